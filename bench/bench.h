@@ -0,0 +1,67 @@
+//! \file bench.h
+//! \brief Shared helpers for the benchmarks
+//!
+//! Every benchmark reports its results through `bench_report`, so the output
+//! has the same format everywhere. Each result is one line of space-separated
+//! `key=value` pairs, starting with `BENCH` and the benchmark's name. Lines
+//! that don't start with `BENCH` are informational and can be ignored by tools
+//! that compare results.
+
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+//! \brief Current monotonic time in nanoseconds
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//! \brief Running mean and variance of a series of samples
+//!
+//! This uses Welford's algorithm, so it doesn't need to store the samples.
+typedef struct bench_stats_t {
+  size_t n;
+  double mean;
+  double m2;
+  double min;
+  double max;
+} bench_stats_t;
+
+//! \brief Add a sample to the statistics
+static inline void bench_stats_add(bench_stats_t *s, double x) {
+  s->n++;
+  double d = x - s->mean;
+  s->mean += d / (double)s->n;
+  s->m2 += d * (x - s->mean);
+  if (s->n == 1u || x < s->min)
+    s->min = x;
+  if (s->n == 1u || x > s->max)
+    s->max = x;
+}
+
+//! \brief Sample standard deviation
+static inline double bench_stats_stddev(const bench_stats_t *s) {
+  return s->n < 2u ? 0.0 : sqrt(s->m2 / (double)(s->n - 1u));
+}
+
+//! \brief Print one result line
+//!
+//! \param[in] name Name of the benchmark, with no spaces
+//! \param[in] params Extra `key=value` pairs describing the configuration, or
+//!                   an empty string
+//! \param[in] ns Per-iteration times in nanoseconds
+static inline void bench_report(const char *name, const char *params,
+                                const bench_stats_t *ns) {
+  double fps = ns->mean > 0.0 ? 1e9 / ns->mean : 0.0;
+  printf("BENCH %s %s%sn=%zu fps=%.2f ns_mean=%.0f ns_stddev=%.0f "
+         "ns_min=%.0f ns_max=%.0f\n",
+         name, params, params[0] != '\0' ? " " : "", ns->n, fps, ns->mean,
+         bench_stats_stddev(ns), ns->min, ns->max);
+  fflush(stdout);
+}
@@ -0,0 +1,175 @@
+//! \file bench_convert.c
+//! \brief Measure colorspace conversion and scaling on their own
+//!
+//! First, this converts a whole 640x480 YUV420P frame with each conversion
+//! kernel this CPU supports. Then, with the best kernel, it converts frames of
+//! several sizes and pixel formats through `scale_rows`, the way
+//! `video_get_frame` does, so each scaling path is timed without any decoding.
+//! Frames are written to ordinary memory.
+
+#include "../convert.h"
+#include "../scale.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+
+//! \brief Number of frames to convert per pass
+#define FRAMES 60u
+
+//! \brief Fill memory with reproducible noise
+static void fill_noise(uint8_t *data, size_t len, uint32_t seed) {
+  for (size_t i = 0u; i < len; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    data[i] = (uint8_t)seed;
+  }
+}
+
+//! \brief Convert a full-size YUV420P frame with one kernel
+//! \return Whether the kernel is supported on this machine
+static bool run_kernel(convert_impl_t impl, uint32_t *framebuffer,
+                       size_t passes) {
+  if (!convert_select(impl))
+    return false;
+
+  static uint8_t y[640u * 480u];
+  static uint8_t u[320u * 240u];
+  static uint8_t v[320u * 240u];
+  fill_noise(y, sizeof(y), 1u);
+  fill_noise(u, sizeof(u), 2u);
+  fill_noise(v, sizeof(v), 3u);
+  const uint8_t *const planes[3] = {y, u, v};
+  const int strides[3] = {640, 320, 320};
+  const convert_matrix_t m = convert_matrix(CONVERT_BT601, false);
+
+  bench_stats_t stats = {0};
+  for (size_t i = 0u; i < passes * FRAMES; i++) {
+    uint64_t start = bench_now_ns();
+    convert_yuv420p(&m, planes, strides, framebuffer, 640u, 640u, 0u, 480u);
+    bench_stats_add(&stats, (double)(bench_now_ns() - start));
+  }
+
+  char params[32];
+  snprintf(params, sizeof(params), "impl=%s", convert_impl_name());
+  bench_report("convert", params, &stats);
+  return true;
+}
+
+//! \brief Convert frames of one size and format into the framebuffer
+//! \return Whether the frame could be laid out
+static bool run_scale(int width, int height, enum AVPixelFormat format,
+                      uint32_t *framebuffer, size_t passes) {
+
+  // Make a frame by hand, with every plane full of noise. Chroma is
+  // subsampled horizontally for every YUV format here, and vertically for all
+  // but YUV422P.
+  AVFrame *frame = av_frame_alloc();
+  if (frame == NULL)
+    return false;
+  frame->width = width;
+  frame->height = height;
+  frame->format = format;
+  frame->sample_aspect_ratio = (AVRational){0, 1};
+  size_t cw = ((size_t)width + 1u) / 2u;
+  size_t ch = format == AV_PIX_FMT_YUV422P ? (size_t)height
+                                           : ((size_t)height + 1u) / 2u;
+  size_t sizes[3] = {(size_t)width * (size_t)height, cw * ch, cw * ch};
+  int planes = 3;
+  if (format == AV_PIX_FMT_RGB24) {
+    planes = 1;
+    sizes[0] *= 3u;
+    frame->linesize[0] = 3 * width;
+  } else if (format == AV_PIX_FMT_NV12) {
+    planes = 2;
+    sizes[1] *= 2u;
+    frame->linesize[0] = width;
+    frame->linesize[1] = 2 * (int)cw;
+  } else {
+    frame->linesize[0] = width;
+    frame->linesize[1] = (int)cw;
+    frame->linesize[2] = (int)cw;
+  }
+  bool ok = true;
+  for (int p = 0; p < planes && ok; p++) {
+    ok = (frame->data[p] = malloc(sizes[p])) != NULL;
+    if (ok)
+      fill_noise(frame->data[p], sizes[p], (uint32_t)p + 7u);
+  }
+
+  scale_layout_t layout;
+  ok = ok && scale_layout_init(&layout, frame);
+  if (ok) {
+    const convert_matrix_t m = convert_matrix(CONVERT_BT601, false);
+    bench_stats_t stats = {0};
+    for (size_t i = 0u; i < passes * FRAMES; i++) {
+      uint64_t start = bench_now_ns();
+      for (size_t row = layout.y; row < layout.y + layout.height; row += 2u)
+        scale_rows(&layout, &m, frame, row,
+                   framebuffer + row * 640u + layout.x,
+                   framebuffer + (row + 1u) * 640u + layout.x);
+      bench_stats_add(&stats, (double)(bench_now_ns() - start));
+    }
+
+    char params[96];
+    snprintf(params, sizeof(params), "impl=%s path=%s format=%s size=%dx%d",
+             convert_impl_name(), scale_path_name(layout.path),
+             av_get_pix_fmt_name(format), width, height);
+    bench_report("scale", params, &stats);
+  }
+
+  for (int p = 0; p < planes; p++)
+    free(frame->data[p]);
+  av_frame_free(&frame);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc > 2) {
+    fputs("Usage: bench-convert [PASSES]\n", stderr);
+    return 1;
+  }
+  size_t passes = argc == 2 ? (size_t)atoi(argv[1]) : 10u;
+  if (passes == 0u)
+    passes = 1u;
+
+  uint32_t *framebuffer = aligned_alloc(64u, 640u * 480u * 4u);
+  if (framebuffer == NULL)
+    return 127;
+  memset(framebuffer, 0, 640u * 480u * 4u);
+
+  // Every kernel this machine has. Unsupported ones are just skipped.
+  static const convert_impl_t IMPLS[] = {
+      CONVERT_IMPL_SCALAR,
+      CONVERT_IMPL_SSE2,
+      CONVERT_IMPL_AVX2,
+      CONVERT_IMPL_NEON,
+  };
+  for (size_t i = 0u; i < sizeof(IMPLS) / sizeof(IMPLS[0]); i++)
+    run_kernel(IMPLS[i], framebuffer, passes);
+
+  // Then every scaling path, with the best kernel. Each size hits a different
+  // path: direct, halving, and the generic scaler both up and down.
+  convert_select(CONVERT_IMPL_AUTO);
+  static const int SIZES[][2] = {
+      {640, 480}, {1280, 960}, {1280, 720}, {1920, 1080}, {320, 240},
+  };
+  static const enum AVPixelFormat FORMATS[] = {
+      AV_PIX_FMT_YUV420P,
+      AV_PIX_FMT_NV12,
+      AV_PIX_FMT_YUV422P,
+      AV_PIX_FMT_RGB24,
+  };
+  bool ok = true;
+  for (size_t s = 0u; s < sizeof(SIZES) / sizeof(SIZES[0]); s++)
+    for (size_t f = 0u; f < sizeof(FORMATS) / sizeof(FORMATS[0]); f++)
+      ok &= run_scale(SIZES[s][0], SIZES[s][1], FORMATS[f], framebuffer,
+                      passes);
+
+  free(framebuffer);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+//! \file bench_decode.c
+//! \brief Measure decoding throughput for each decoder threading setup
+//!
+//! This decodes and converts every frame of a video with `video_get_frame`,
+//! once for each threading mode and thread count, and reports how fast it went.
+//! It doesn't need the HDMI Peripheral - frames are written to ordinary memory.
+//!
+//! It also times opening the video, and splits getting each frame into decoding
+//! and converting, by decoding each frame ahead with `video_preroll` before
+//! converting it with `video_get_frame`.
+//!
+//! Then it measures how long it takes to seek to a keyframe and get the frame
+//! there, and how long the frame that wraps around takes when looping.
+//!
+//! Every result is tagged with the video's file name, so the results for
+//! several videos can be compared in one file.
+
+#include "../video.h"
+#include "bench.h"
+
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//! \brief File name of the video, without the directory
+static const char *video_name;
+
+//! \brief Like `bench_report`, but tagged with the video
+static void report(const char *name, const char *params,
+                   const bench_stats_t *ns) {
+  char tagged[192];
+  snprintf(tagged, sizeof(tagged), "video=%s%s%s", video_name,
+           params[0] != '\0' ? " " : "", params);
+  bench_report(name, tagged, ns);
+}
+
+//! \brief Decode the whole video once with the given configuration
+//! \return Whether the video could be opened and decoded
+static bool run(const char *filename, const video_config_t *config,
+                uint32_t *framebuffer, size_t passes) {
+
+  bench_stats_t stats = {0};
+  size_t delay = 0u;
+  size_t fallbacks = 0u;
+  for (size_t pass = 0u; pass < passes; pass++) {
+    video_t *vid = video_open(filename, config);
+    if (vid == NULL)
+      return false;
+    delay = vid->decode_delay;
+    // Time each frame individually so we can see the variance. This includes
+    // the time spent filling the decoder's pipeline on the first frames.
+    while (true) {
+      uint64_t start = bench_now_ns();
+      int res = video_get_frame(vid, framebuffer);
+      uint64_t end = bench_now_ns();
+      if (res == AVERROR_EOF)
+        break;
+      if (res != 0) {
+        video_close(vid);
+        return false;
+      }
+      bench_stats_add(&stats, (double)(end - start));
+    }
+    fallbacks += frame_pool_stats(vid->pool).fallbacks;
+    video_close(vid);
+  }
+
+  char params[128];
+  snprintf(params, sizeof(params),
+           "threading=%s threads=%zu delay=%zu pool_fallbacks=%zu",
+           video_threading_name(config->decode_threading),
+           config->decode_threads, delay, fallbacks);
+  report("decode", params, &stats);
+  return true;
+}
+
+//! \brief Time opening the video, then decoding and converting separately
+//! \details This uses LibAV's default threading, like the player does
+static bool run_split(const char *filename, uint32_t *framebuffer,
+                      size_t passes) {
+  bench_stats_t open = {0};
+  bench_stats_t decode = {0};
+  bench_stats_t convert = {0};
+  bench_stats_t both = {0};
+  bool ok = true;
+  for (size_t pass = 0u; pass < passes && ok; pass++) {
+    uint64_t start = bench_now_ns();
+    video_t *vid = video_open(filename, NULL);
+    bench_stats_add(&open, (double)(bench_now_ns() - start));
+    if (vid == NULL)
+      return false;
+    // Decoding a frame ahead sets it aside, and then getting the frame only
+    // has to convert it
+    while (ok) {
+      start = bench_now_ns();
+      int res = video_preroll(vid, 1u);
+      uint64_t mid = bench_now_ns();
+      if (res == AVERROR_EOF)
+        break;
+      ok = res == 0 && video_get_frame(vid, framebuffer) == 0;
+      uint64_t end = bench_now_ns();
+      bench_stats_add(&decode, (double)(mid - start));
+      bench_stats_add(&convert, (double)(end - mid));
+      bench_stats_add(&both, (double)(end - start));
+    }
+    video_close(vid);
+  }
+  report("open", "", &open);
+  report("decode-only", "", &decode);
+  report("convert-only", "", &convert);
+  report("decode-convert", "", &both);
+  return ok;
+}
+
+//! \brief Most keyframes to seek to per pass
+#define MAX_SEEKS 64u
+
+//! \brief Seek to keyframes all over the video, timing each seek
+//! \details Each one is timed up to when the frame there is converted
+static bool run_seek(const char *filename, uint32_t *framebuffer,
+                     size_t passes) {
+  video_t *vid = video_open(filename, NULL);
+  if (vid == NULL)
+    return false;
+  bool demuxer_index = vid->indexed;
+  bench_stats_t index = {0};
+  uint64_t start = bench_now_ns();
+  bool ok = video_build_index(vid);
+  bench_stats_add(&index, (double)(bench_now_ns() - start));
+  if (!ok) {
+    video_close(vid);
+    return false;
+  }
+
+  // Alternate between keyframes in the first and second half of the video, so
+  // every seek moves a long way
+  size_t n = vid->keyframe_count;
+  size_t seeks = n < MAX_SEEKS ? n : MAX_SEEKS;
+  bench_stats_t stats = {0};
+  for (size_t pass = 0u; pass < passes && ok; pass++) {
+    for (size_t i = 0u; i < seeks && ok; i++) {
+      size_t j = i % 2u == 0u ? i / 2u : (seeks + 1u) / 2u + i / 2u;
+      size_t k = j * n / seeks;
+      start = bench_now_ns();
+      ok = video_seek(vid, vid->keyframes_ns[k]) == 0 &&
+           video_get_frame(vid, framebuffer) == 0;
+      bench_stats_add(&stats, (double)(bench_now_ns() - start));
+    }
+  }
+  video_close(vid);
+
+  char params[64];
+  snprintf(params, sizeof(params), "keyframes=%zu demuxer_index=%d", n,
+           demuxer_index);
+  report("seek-index", params, &index);
+  report("seek", params, &stats);
+  return ok;
+}
+
+//! \brief Play the video twice over in a loop, timing the frames
+//!
+//! The wrap is reported separately from every other frame. It's the frame
+//! during which the demuxer went back to the start.
+static bool run_loop(const char *filename, uint32_t *framebuffer) {
+  const video_config_t config = {.loop = true};
+  video_t *vid = video_open(filename, &config);
+  if (vid == NULL)
+    return false;
+  bench_stats_t frames = {0};
+  bench_stats_t wraps = {0};
+  bool ok = true;
+  while (ok && vid->loops < 2u) {
+    size_t loops = vid->loops;
+    uint64_t start = bench_now_ns();
+    ok = video_get_frame(vid, framebuffer) == 0;
+    double ns = (double)(bench_now_ns() - start);
+    bench_stats_add(vid->loops != loops ? &wraps : &frames, ns);
+  }
+  video_close(vid);
+  report("loop-frame", "", &frames);
+  report("loop-wrap", "", &wraps);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 2 || argc > 3) {
+    fputs("Usage: bench-decode [VIDEO] [PASSES]\n", stderr);
+    return 1;
+  }
+  size_t passes = argc == 3 ? (size_t)atoi(argv[2]) : 3u;
+  if (passes == 0u)
+    passes = 1u;
+
+  uint32_t *framebuffer = aligned_alloc(64u, 640u * 480u * 4u);
+  if (framebuffer == NULL)
+    return 127;
+  // `basename` may modify its argument, so give it a copy
+  char *path = strdup(argv[1]);
+  if (path == NULL)
+    return 127;
+  video_name = basename(path);
+
+  // Time the parts of getting a frame with the player's setup first
+  bool ok = run_split(argv[1], framebuffer, passes);
+
+  // Try single-threaded decoding, then each threaded mode with every thread
+  // count up to the number of CPUs, then whatever LibAV picks by default
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+  video_config_t config = {.decode_threading = VIDEO_THREADING_NONE};
+  ok &= run(argv[1], &config, framebuffer, passes);
+  for (video_threading_t t = VIDEO_THREADING_SLICE; t <= VIDEO_THREADING_FRAME;
+       t++) {
+    for (long n = 2; n <= cpus; n++) {
+      config.decode_threading = t;
+      config.decode_threads = (size_t)n;
+      ok &= run(argv[1], &config, framebuffer, passes);
+    }
+  }
+  config.decode_threading = VIDEO_THREADING_AUTO;
+  config.decode_threads = 0u;
+  ok &= run(argv[1], &config, framebuffer, passes);
+
+  ok &= run_seek(argv[1], framebuffer, passes);
+  ok &= run_loop(argv[1], framebuffer);
+
+  free(path);
+  free(framebuffer);
+  return ok ? 0 : 1;
+}
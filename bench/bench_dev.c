@@ -0,0 +1,122 @@
+//! \file bench_dev.c
+//! \brief Measure the cost of talking to the HDMI Peripheral
+//!
+//! The presenter works out deadlines with frame id arithmetic, and finds out
+//! where the device is by reading its coordinate register. This times both,
+//! and acknowledging a vsync event, which re-arms the timer when there's no
+//! interrupt.
+//!
+//! On the real device, reading the coordinate is an uncached access over the
+//! AXI bus, which is what's worth knowing. That needs root, and programs the PL
+//! if it doesn't already have the bitstream, but the device isn't started.
+//! With `--sim`, the simulated device is started instead.
+
+#include "../hdmi_dev.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Number of operations timed together in one sample
+//!
+//! Single operations are too quick to time on their own, so every result is
+//! the time for a whole batch, and says how big the batch was
+#define BATCH 1000u
+//! \brief Number of samples per pass
+#define SAMPLES 100u
+
+//! \brief Keeps the compiler from optimizing the arithmetic away
+static volatile int_fast32_t sink;
+
+//! \brief Time the frame id arithmetic `hdmi_dev_wait` and the player do
+static void run_fid(size_t passes) {
+  bench_stats_t stats = {0};
+  hdmi_fid_t fid = 0u;
+  for (size_t i = 0u; i < passes * SAMPLES; i++) {
+    int_fast32_t acc = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t j = 0u; j < BATCH; j++) {
+      hdmi_fid_t due = hdmi_fid_add(fid, (int_fast16_t)(j & 0x3fu));
+      acc += hdmi_fid_delta(due, fid) * HDMI_FRAME_ROWS;
+      fid = hdmi_fid_add(fid, 1);
+    }
+    uint64_t end = bench_now_ns();
+    sink = acc;
+    bench_stats_add(&stats, (double)(end - start));
+  }
+  char params[32];
+  snprintf(params, sizeof(params), "batch=%u", BATCH);
+  bench_report("fid-math", params, &stats);
+}
+
+//! \brief Time reading the coordinate register
+static void run_coordinate(const char *params, size_t passes) {
+  bench_stats_t stats = {0};
+  for (size_t i = 0u; i < passes * SAMPLES; i++) {
+    int_fast32_t acc = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t j = 0u; j < BATCH; j++)
+      acc += (int_fast32_t)hdmi_dev_coordinate().col;
+    uint64_t end = bench_now_ns();
+    sink = acc;
+    bench_stats_add(&stats, (double)(end - start));
+  }
+  bench_report("coordinate", params, &stats);
+}
+
+//! \brief Time acknowledging vsync events
+//! \details There usually aren't any pending, so this is the fixed cost
+static bool run_vsync_ack(const char *params, size_t passes) {
+  if (!hdmi_dev_vsync_open(0u))
+    return false;
+  char vparams[64];
+  snprintf(vparams, sizeof(vparams), "%s vsync=%s", params,
+           hdmi_vsync_mode_name(hdmi_dev_vsync_mode()));
+  bench_stats_t stats = {0};
+  for (size_t i = 0u; i < passes * SAMPLES; i++) {
+    int_fast32_t acc = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t j = 0u; j < BATCH; j++)
+      acc += (int_fast32_t)hdmi_dev_vsync_ack().col;
+    uint64_t end = bench_now_ns();
+    sink = acc;
+    bench_stats_add(&stats, (double)(end - start));
+  }
+  hdmi_dev_vsync_close();
+  bench_report("vsync-ack", vparams, &stats);
+  return true;
+}
+
+int main(int argc, char **argv) {
+
+  bool sim = argc >= 2 && strcmp(argv[1], "--sim") == 0;
+  if (sim) {
+    argc--;
+    argv++;
+  }
+  if (argc > 2) {
+    fputs("Usage: bench-dev [--sim] [PASSES]\n", stderr);
+    return 1;
+  }
+  size_t passes = argc == 2 ? (size_t)atoi(argv[1]) : 10u;
+  if (passes == 0u)
+    passes = 1u;
+
+  run_fid(passes);
+
+  if (!(sim ? hdmi_dev_open_sim() : hdmi_dev_open())) {
+    fputs("Error: failed to open HDMI Peripheral\n", stderr);
+    return 127;
+  }
+  if (sim)
+    hdmi_dev_start();
+  char params[48];
+  snprintf(params, sizeof(params), "device=%s batch=%u", sim ? "sim" : "hw",
+           BATCH);
+  run_coordinate(params, passes);
+  bool ok = run_vsync_ack(params, passes);
+  if (sim)
+    hdmi_dev_stop();
+  hdmi_dev_close();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+//! \file bench_fb.c
+//! \brief Measure the cost of allocating, writing, and flushing framebuffers
+//!
+//! For each ring depth, this allocates that many framebuffers, writes to them,
+//! flushes them, and frees them, first with `hdmi_fb_allocate` and then with
+//! `hdmi_fb_pool_allocate`. Each step is timed separately.
+//!
+//! Then, for each mapping mode, it converts a stream of synthetic frames into a
+//! framebuffer and flushes it, both writing every pixel and only writing the
+//! tiles that changed. That shows whether cached writes plus a flush beat
+//! write-combined writes without one.
+//!
+//! This needs the ZOCL driver unless `--sim` is given, in which case only the
+//! cost of the memory itself is measured, and both mappings are the same.
+
+#include "../convert.h"
+#include "../hdmi_fb.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Timings for one way of allocating framebuffers
+typedef struct fb_stats_t {
+  bench_stats_t alloc;
+  bench_stats_t flush;
+  bench_stats_t free;
+} fb_stats_t;
+
+//! \brief Report every timing for one way of allocating
+static void report(const char *path, size_t depth, const fb_stats_t *st) {
+  char params[64];
+  snprintf(params, sizeof(params), "path=%s depth=%zu", path, depth);
+  bench_report("fb-alloc", params, &st->alloc);
+  bench_report("fb-flush", params, &st->flush);
+  bench_report("fb-free", params, &st->free);
+}
+
+//! \brief Allocate, fill, flush, and free `depth` separate framebuffers
+static bool run_single(hdmi_fb_allocator_t *alloc, size_t depth,
+                       fb_stats_t *st) {
+  hdmi_fb_handle_t *fbs[HDMI_FB_POOL_MAX] = {NULL};
+  bool ok = true;
+
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0u; i < depth && ok; i++)
+    ok = (fbs[i] = hdmi_fb_allocate(alloc)) != NULL;
+  bench_stats_add(&st->alloc, (double)(bench_now_ns() - start));
+
+  // Touch every page, so the flush has something to do
+  for (size_t i = 0u; i < depth && ok; i++)
+    memset(hdmi_fb_data(fbs[i]), (int)i, 640u * 480u * 4u);
+  start = bench_now_ns();
+  for (size_t i = 0u; i < depth && ok; i++)
+    hdmi_fb_flush(alloc, fbs[i]);
+  bench_stats_add(&st->flush, (double)(bench_now_ns() - start));
+
+  start = bench_now_ns();
+  for (size_t i = 0u; i < depth; i++)
+    hdmi_fb_free(alloc, fbs[i]);
+  bench_stats_add(&st->free, (double)(bench_now_ns() - start));
+  return ok;
+}
+
+//! \brief Allocate, fill, flush, and free a pool of `depth` framebuffers
+static bool run_pool(hdmi_fb_allocator_t *alloc, size_t depth,
+                     fb_stats_t *st) {
+  uint64_t start = bench_now_ns();
+  hdmi_fb_pool_t *pool = hdmi_fb_pool_allocate(alloc, depth);
+  bench_stats_add(&st->alloc, (double)(bench_now_ns() - start));
+  if (pool == NULL)
+    return false;
+
+  for (size_t i = 0u; i < depth; i++)
+    memset(hdmi_fb_data(&pool->fbs[i]), (int)i, 640u * 480u * 4u);
+  uint64_t mask = depth == 64u ? ~UINT64_C(0) : (UINT64_C(1) << depth) - 1u;
+  start = bench_now_ns();
+  hdmi_fb_pool_flush(alloc, pool, mask);
+  bench_stats_add(&st->flush, (double)(bench_now_ns() - start));
+
+  start = bench_now_ns();
+  hdmi_fb_pool_free(alloc, pool);
+  bench_stats_add(&st->free, (double)(bench_now_ns() - start));
+  return true;
+}
+
+//! \brief Number of synthetic frames to convert per pass
+#define CONVERT_FRAMES 60u
+
+//! \brief A synthetic YUV420P frame
+typedef struct yuv_frame_t {
+  uint8_t y[640u * 480u];
+  uint8_t u[320u * 240u];
+  uint8_t v[320u * 240u];
+} yuv_frame_t;
+
+//! \brief Draw a frame of a gradient with a square moving across it
+//! \details Only the tiles around the square change from frame to frame
+static void draw_frame(yuv_frame_t *f, size_t n) {
+  for (size_t r = 0u; r < 480u; r++)
+    for (size_t c = 0u; c < 640u; c++)
+      f->y[r * 640u + c] = (uint8_t)(16u + (r + c) / 6u);
+  memset(f->u, 128, sizeof(f->u));
+  memset(f->v, 128, sizeof(f->v));
+  size_t x = n * 8u % (640u - 64u);
+  size_t y = n * 4u % (480u - 64u);
+  for (size_t r = y; r < y + 64u; r++)
+    memset(f->y + r * 640u + x, 235, 64u);
+}
+
+//! \brief Convert and flush a stream of frames with one mapping mode
+static bool run_convert(hdmi_fb_allocator_t *alloc, hdmi_fb_mapping_t mapping,
+                        bool diff, size_t passes, const yuv_frame_t *frames) {
+  alloc->mapping = mapping;
+  hdmi_fb_pool_t *pool = hdmi_fb_pool_allocate(alloc, 1u);
+  if (pool == NULL)
+    return false;
+  hdmi_fb_handle_t *fb = &pool->fbs[0];
+  uint32_t *data = hdmi_fb_data(fb);
+  const convert_matrix_t m = convert_matrix(CONVERT_BT601, false);
+  const int strides[3] = {640, 320, 320};
+  uint32_t scratch[2u * 640u];
+
+  bench_stats_t convert = {0};
+  bench_stats_t flush = {0};
+  for (size_t pass = 0u; pass < passes; pass++) {
+    for (size_t n = 0u; n < CONVERT_FRAMES; n++) {
+      const yuv_frame_t *f = &frames[n];
+      uint64_t start = bench_now_ns();
+      if (!diff) {
+        const uint8_t *const planes[3] = {f->y, f->u, f->v};
+        convert_yuv420p(&m, planes, strides, data, 640u, 640u, 0u, 480u);
+      } else {
+        // The same way `video_get_frame_diff` does it
+        memset(&fb->dirty, 0, sizeof(fb->dirty));
+        for (size_t row = 0u; row < 480u; row += 2u) {
+          const uint8_t *const planes[3] = {
+              f->y + row * 640u,
+              f->u + row / 2u * 320u,
+              f->v + row / 2u * 320u,
+          };
+          convert_yuv420p(&m, planes, strides, scratch, 640u, 640u, 0u, 2u);
+          hdmi_fb_store_row(&fb->dirty, data, row, scratch);
+          hdmi_fb_store_row(&fb->dirty, data, row + 1u, scratch + 640u);
+        }
+      }
+      uint64_t mid = bench_now_ns();
+      hdmi_fb_flush_dirty(alloc, fb);
+      uint64_t end = bench_now_ns();
+      bench_stats_add(&convert, (double)(mid - start));
+      bench_stats_add(&flush, (double)(end - mid));
+    }
+  }
+  hdmi_fb_pool_free(alloc, pool);
+
+  char params[64];
+  snprintf(params, sizeof(params), "mapping=%s path=%s",
+           hdmi_fb_mapping_name(mapping), diff ? "diff" : "full");
+  bench_report("fb-frame-convert", params, &convert);
+  bench_report("fb-frame-flush", params, &flush);
+  return true;
+}
+
+int main(int argc, char **argv) {
+
+  bool sim = argc >= 2 && strcmp(argv[1], "--sim") == 0;
+  if (sim) {
+    argc--;
+    argv++;
+  }
+  if (argc > 2) {
+    fputs("Usage: bench-fb [--sim] [PASSES]\n", stderr);
+    return 1;
+  }
+  size_t passes = argc == 2 ? (size_t)atoi(argv[1]) : 10u;
+  if (passes == 0u)
+    passes = 1u;
+
+  hdmi_fb_allocator_t *alloc =
+      sim ? hdmi_fb_allocator_open_sim() : hdmi_fb_allocator_open();
+  if (alloc == NULL) {
+    fputs("Error: failed to open framebuffer allocator\n", stderr);
+    return 127;
+  }
+
+  // Go up to a deep ring. The interleaving means both paths see CMA in about
+  // the same state.
+  static const size_t DEPTHS[] = {2u, 4u, 8u, 16u};
+  bool ok = true;
+  for (size_t d = 0u; d < sizeof(DEPTHS) / sizeof(DEPTHS[0]); d++) {
+    fb_stats_t single = {0};
+    fb_stats_t pooled = {0};
+    for (size_t pass = 0u; pass < passes; pass++) {
+      ok &= run_single(alloc, DEPTHS[d], &single);
+      ok &= run_pool(alloc, DEPTHS[d], &pooled);
+    }
+    report("single", DEPTHS[d], &single);
+    report("pool", DEPTHS[d], &pooled);
+  }
+
+  // Draw the frames ahead of time, so only converting and flushing is timed
+  convert_select(CONVERT_IMPL_AUTO);
+  yuv_frame_t *frames = malloc(CONVERT_FRAMES * sizeof(yuv_frame_t));
+  if (frames == NULL)
+    return 127;
+  for (size_t n = 0u; n < CONVERT_FRAMES; n++)
+    draw_frame(&frames[n], n);
+  for (hdmi_fb_mapping_t m = HDMI_FB_MAPPING_CACHED;
+       m <= HDMI_FB_MAPPING_WRITE_COMBINED; m++) {
+    ok &= run_convert(alloc, m, false, passes, frames);
+    ok &= run_convert(alloc, m, true, passes, frames);
+  }
+  free(frames);
+
+  hdmi_fb_allocator_close(alloc);
+  return ok ? 0 : 1;
+}
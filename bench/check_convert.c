@@ -0,0 +1,158 @@
+//! \file check_convert.c
+//! \brief Check that every conversion kernel matches the scalar one exactly
+//!
+//! convert.h promises that all the kernels compute exactly the same result.
+//! This holds each kernel this CPU supports to that, against
+//! `convert_kernel_scalar`. Every matrix is tried, on rows of noise of every
+//! width up to a few vectors long, plus some full-size ones. Odd widths
+//! exercise the scalar tails. The buffers are aligned like the frame pool's, so
+//! offset zero exercises the aligned loads, and odd offsets the unaligned
+//! ones. Output rows are followed by guard words, so writing past the end of a
+//! row is caught too.
+//!
+//! It prints one line per mismatch, and exits with a non-zero status if there
+//! were any.
+
+#include "../convert.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Longest row to check
+#define MAX_WIDTH 1920u
+//! \brief Every width up to this is checked
+#define ALL_WIDTHS 130u
+//! \brief Number of words after each output row that must be left alone
+#define GUARD 16u
+//! \brief What the output rows are filled with before each conversion
+#define GUARD_WORD 0xdeadbeefu
+//! \brief Alignment of the input rows, as in the frame pool
+#define FRAME_ALIGN 64
+
+//! \brief Fill memory with reproducible noise
+static void fill_noise(uint8_t *data, size_t len, uint32_t seed) {
+  for (size_t i = 0u; i < len; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    data[i] = (uint8_t)seed;
+  }
+}
+
+//! \brief Buffers for one row pair, with room for an odd offset
+typedef struct rows_t {
+  _Alignas(FRAME_ALIGN) uint8_t y0[MAX_WIDTH + 1u];
+  _Alignas(FRAME_ALIGN) uint8_t y1[MAX_WIDTH + 1u];
+  _Alignas(FRAME_ALIGN) uint8_t u[MAX_WIDTH / 2u + 2u];
+  _Alignas(FRAME_ALIGN) uint8_t v[MAX_WIDTH / 2u + 2u];
+  uint32_t d0[MAX_WIDTH + 1u + GUARD];
+  uint32_t d1[MAX_WIDTH + 1u + GUARD];
+} rows_t;
+
+//! \brief Run a kernel on one row pair
+//!
+//! The inputs and outputs all start `offset` elements into the buffers. With
+//! `single`, both rows are the same, as for an image of odd height.
+static void run(convert_kernel_t kernel, const convert_matrix_t *m,
+                rows_t *r, size_t width, size_t offset, bool single) {
+  for (size_t i = 0u; i < sizeof(r->d0) / sizeof(r->d0[0]); i++)
+    r->d0[i] = r->d1[i] = GUARD_WORD;
+  const uint8_t *y1 = single ? r->y0 : r->y1;
+  uint32_t *d1 = single ? r->d0 : r->d1;
+  kernel(m, r->y0 + offset, y1 + offset, r->u + offset, r->v + offset,
+         r->d0 + offset, d1 + offset, width);
+}
+
+//! \brief Compare one kernel against the scalar one on one row pair
+//! \return Whether they matched
+static bool check(const char *name, convert_kernel_t kernel,
+                  const convert_matrix_t *m, const char *matrix,
+                  rows_t *want, rows_t *got, size_t width, size_t offset,
+                  bool single) {
+  run(convert_kernel_scalar, m, want, width, offset, single);
+  run(kernel, m, got, width, offset, single);
+  for (size_t row = 0u; row < (single ? 1u : 2u); row++) {
+    const uint32_t *w = row == 0u ? want->d0 : want->d1;
+    const uint32_t *g = row == 0u ? got->d0 : got->d1;
+    for (size_t i = 0u; i < sizeof(want->d0) / sizeof(want->d0[0]); i++) {
+      if (w[i] == g[i])
+        continue;
+      ptrdiff_t pixel = (ptrdiff_t)i - (ptrdiff_t)offset;
+      printf("MISMATCH impl=%s matrix=%s width=%zu offset=%zu row=%zu "
+             "pixel=%td want=%08x got=%08x\n",
+             name, matrix, width, offset, row, pixel, (unsigned)w[i],
+             (unsigned)g[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(void) {
+
+  static const struct {
+    convert_impl_t impl;
+    const char *name;
+  } IMPLS[] = {
+      {CONVERT_IMPL_SSE2, "sse2"},
+      {CONVERT_IMPL_AVX2, "avx2"},
+      {CONVERT_IMPL_NEON, "neon"},
+  };
+  static const struct {
+    convert_colorspace_t space;
+    bool full_range;
+    const char *name;
+  } MATRICES[] = {
+      {CONVERT_BT601, false, "bt601-limited"},
+      {CONVERT_BT601, true, "bt601-full"},
+      {CONVERT_BT709, false, "bt709-limited"},
+      {CONVERT_BT709, true, "bt709-full"},
+  };
+  // Every short width, then some long ones
+  static const size_t LONG_WIDTHS[] = {319u, 320u, 639u, 640u, 1279u, 1920u};
+  const size_t widths =
+      ALL_WIDTHS + sizeof(LONG_WIDTHS) / sizeof(LONG_WIDTHS[0]);
+
+  // Both sets of buffers get the same input
+  static rows_t want;
+  static rows_t got;
+  fill_noise(want.y0, sizeof(want.y0), 1u);
+  fill_noise(want.y1, sizeof(want.y1), 2u);
+  fill_noise(want.u, sizeof(want.u), 3u);
+  fill_noise(want.v, sizeof(want.v), 4u);
+  memcpy(&got, &want, sizeof(got));
+
+  size_t checked = 0u;
+  size_t failed = 0u;
+  for (size_t k = 0u; k < sizeof(IMPLS) / sizeof(IMPLS[0]); k++) {
+    convert_kernel_t kernel = convert_kernel(IMPLS[k].impl);
+    if (kernel == NULL) {
+      printf("Skipping %s, which this machine doesn't support\n",
+             IMPLS[k].name);
+      continue;
+    }
+    size_t before = failed;
+    for (size_t mi = 0u; mi < sizeof(MATRICES) / sizeof(MATRICES[0]); mi++) {
+      const convert_matrix_t m =
+          convert_matrix(MATRICES[mi].space, MATRICES[mi].full_range);
+      const char *matrix = MATRICES[mi].name;
+      for (size_t w = 0u; w < widths; w++) {
+        size_t width = w < ALL_WIDTHS ? w + 1u : LONG_WIDTHS[w - ALL_WIDTHS];
+        for (size_t offset = 0u; offset < 2u; offset++)
+          for (int single = 0; single < 2; single++) {
+            checked++;
+            if (!check(IMPLS[k].name, kernel, &m, matrix, &want, &got, width,
+                       offset, single != 0))
+              failed++;
+          }
+      }
+    }
+    printf("Checked %s: %s\n", IMPLS[k].name,
+           failed == before ? "bit-exact" : "MISMATCHED");
+  }
+
+  printf("%zu of %zu row pairs mismatched\n", failed, checked);
+  return failed == 0u ? 0 : 1;
+}
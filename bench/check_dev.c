@@ -0,0 +1,91 @@
+//! \file check_dev.c
+//! \brief Check that the simulated device latches framebuffers when expected
+//!
+//! The player relies on a framebuffer given to `hdmi_dev_set_fb` being scanned
+//! out from the start of the next frame, and not before. Only then can the
+//! framebuffer it replaced be recycled. This presents framebuffers at rows all
+//! over the frame, up to the very last one, and checks with
+//! `hdmi_dev_sim_scanout` that the old framebuffer is scanned out for the rest
+//! of the frame, and the new one from the next frame on.
+//!
+//! The device moves on in real time, so if it started a new frame while we
+//! were presenting, there's no telling which framebuffer it should be on. Those
+//! presentations are counted, but not checked.
+//!
+//! It prints one line per failure, and exits with a non-zero status if there
+//! were any.
+
+#include "../hdmi_dev.h"
+#include "../hdmi_fb.h"
+
+#include <stdio.h>
+
+//! \brief Number of times to present at each row
+#define REPEATS 4u
+
+int main(void) {
+
+  hdmi_fb_allocator_t *alloc = hdmi_fb_allocator_open_sim();
+  hdmi_fb_pool_t *pool =
+      alloc != NULL ? hdmi_fb_pool_allocate(alloc, 2u) : NULL;
+  if (pool == NULL || !hdmi_dev_open_sim()) {
+    fputs("Error: failed to set up the simulated device\n", stderr);
+    return 127;
+  }
+
+  // The first framebuffer is scanned out as soon as the device starts
+  size_t failed = 0u;
+  size_t checked = 0u;
+  size_t raced = 0u;
+  size_t shown = 0u;
+  hdmi_dev_set_fb(&pool->fbs[shown]);
+  hdmi_dev_start();
+  if (hdmi_dev_sim_scanout() != (uint32_t)pool->fbs[shown].physical_address) {
+    puts("FAIL started on the wrong framebuffer");
+    failed++;
+  }
+
+  static const uint_fast16_t ROWS[] = {
+      0u, 1u, 100u, 240u, 479u, 480u, HDMI_FRAME_ROWS - 2u,
+      HDMI_FRAME_ROWS - 1u,
+  };
+  for (size_t i = 0u; i < sizeof(ROWS) / sizeof(ROWS[0]); i++) {
+    for (size_t rep = 0u; rep < REPEATS; rep++) {
+      const uint32_t old_fb = (uint32_t)pool->fbs[shown].physical_address;
+      const uint32_t new_fb = (uint32_t)pool->fbs[1u - shown].physical_address;
+
+      // Present at the row on the next frame
+      hdmi_fid_t next = hdmi_fid_add(hdmi_dev_coordinate().fid, 1);
+      hdmi_fid_t before = hdmi_dev_wait(next, ROWS[i]).fid;
+      hdmi_dev_set_fb(&pool->fbs[1u - shown]);
+      uint32_t during = hdmi_dev_sim_scanout();
+      hdmi_fid_t after = hdmi_dev_coordinate().fid;
+
+      // If the frame didn't change, the old framebuffer is still up
+      checked++;
+      if (before != after) {
+        raced++;
+      } else if (during != old_fb) {
+        printf("FAIL row=%u switched before the frame ended\n",
+               (unsigned)ROWS[i]);
+        failed++;
+      }
+      // Either way, it's switched by the frame after we last looked
+      hdmi_dev_wait(hdmi_fid_add(after, 1), 0u);
+      if (hdmi_dev_sim_scanout() != new_fb) {
+        printf("FAIL row=%u didn't switch on the next frame\n",
+               (unsigned)ROWS[i]);
+        failed++;
+      }
+      shown = 1u - shown;
+    }
+  }
+
+  hdmi_dev_stop();
+  hdmi_dev_close();
+  hdmi_fb_pool_free(alloc, pool);
+  hdmi_fb_allocator_close(alloc);
+  printf("%zu failures in %zu presentations, %zu raced the frame\n", failed,
+         checked, raced);
+  return failed == 0u ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+//! \file gen_video.c
+//! \brief Generate synthetic videos for the benchmarks
+//!
+//! The benchmarks need videos to decode, but we don't want to check any into
+//! the repository or download them. Instead, this encodes a synthetic clip with
+//! LibAV's own MPEG-4 Part 2 encoder, which every build of LibAV has. The same
+//! arguments always give the same video, so results can be compared across
+//! machines and commits.
+//!
+//! The picture is a diagonal gradient that scrolls every frame, with a bright
+//! box moving across it and a band of noise, so the encoder has motion and
+//! detail to spend the bitrate on everywhere.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+
+//! \brief Frame rate of the generated videos
+static const int FRAME_RATE = 30;
+//! \brief Size of the moving box, in pixels
+static const int BOX_SIZE = 64;
+
+//! \brief Draw frame number `n` of the clip
+static void draw(AVFrame *frame, int n) {
+  const int w = frame->width;
+  const int h = frame->height;
+
+  // Luma is a scrolling gradient with a band of noise across the middle. The
+  // noise is seeded by the frame number, so it's different every frame but
+  // the same every run.
+  uint32_t seed = 2463534242u + (uint32_t)n;
+  for (int y = 0; y < h; y++) {
+    uint8_t *row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+    bool noisy = y >= h * 3 / 8 && y < h * 5 / 8;
+    for (int x = 0; x < w; x++) {
+      uint8_t v = (uint8_t)(x + y + 3 * n);
+      if (noisy) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        v = (uint8_t)(v / 2u + (seed & 0x7fu));
+      }
+      row[x] = v;
+    }
+  }
+  // Chroma drifts in opposite directions, so the colours keep changing
+  for (int y = 0; y < (h + 1) / 2; y++) {
+    uint8_t *u = frame->data[1] + (ptrdiff_t)y * frame->linesize[1];
+    uint8_t *v = frame->data[2] + (ptrdiff_t)y * frame->linesize[2];
+    for (int x = 0; x < (w + 1) / 2; x++) {
+      u[x] = (uint8_t)(128 + (x + n) % 64 - 32);
+      v[x] = (uint8_t)(128 + (y - n) % 64 - 32);
+    }
+  }
+
+  // The box moves diagonally, bouncing off the edges
+  int span_x = w > BOX_SIZE ? w - BOX_SIZE : 1;
+  int span_y = h > BOX_SIZE ? h - BOX_SIZE : 1;
+  int bx = (n * 8) % (2 * span_x);
+  int by = (n * 5) % (2 * span_y);
+  bx = bx < span_x ? bx : 2 * span_x - bx;
+  by = by < span_y ? by : 2 * span_y - by;
+  for (int y = by; y < by + BOX_SIZE && y < h; y++)
+    for (int x = bx; x < bx + BOX_SIZE && x < w; x++)
+      frame->data[0][(ptrdiff_t)y * frame->linesize[0] + x] = 235u;
+}
+
+//! \brief Send a frame to the encoder, and write out any packets it returns
+//! \param[in] frame The frame to encode, or `NULL` to drain the encoder
+//! \return Whether everything succeeded
+static bool encode(AVCodecContext *enc, const AVFrame *frame,
+                   AVFormatContext *fmt, AVStream *st, AVPacket *pkt) {
+  if (avcodec_send_frame(enc, frame) < 0)
+    return false;
+  while (true) {
+    int res = avcodec_receive_packet(enc, pkt);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF)
+      return true;
+    if (res < 0)
+      return false;
+    av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+    pkt->stream_index = st->index;
+    // This takes ownership of the packet's data, and resets it
+    if (av_interleaved_write_frame(fmt, pkt) < 0)
+      return false;
+  }
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 2 || argc > 7) {
+    fputs("Usage: gen-video [OUTPUT] [WIDTHxHEIGHT] [KBPS] [GOP] [BFRAMES] "
+          "[FRAMES]\n"
+          "Encodes a synthetic MPEG-4 clip at 30fps. The container is\n"
+          "picked from the extension of [OUTPUT]. The defaults are 640x480,\n"
+          "2000kbps, a keyframe every 30 frames, no B-frames, and 300\n"
+          "frames.\n",
+          stderr);
+    return 1;
+  }
+  int width = 640;
+  int height = 480;
+  if (argc > 2 && sscanf(argv[2], "%dx%d", &width, &height) != 2)
+    width = 0;
+  long kbps = argc > 3 ? atol(argv[3]) : 2000;
+  int gop = argc > 4 ? atoi(argv[4]) : 30;
+  int bframes = argc > 5 ? atoi(argv[5]) : 0;
+  int frames = argc > 6 ? atoi(argv[6]) : 300;
+  if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0 ||
+      kbps <= 0 || gop <= 0 || bframes < 0 || frames <= 0) {
+    fputs("Usage: invalid parameters\n", stderr);
+    return 1;
+  }
+
+  bool ok = false;
+  bool header_written = false;
+  AVFormatContext *fmt = NULL;
+  AVCodecContext *enc = NULL;
+  AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+
+  // Set up the encoder
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+  if (codec == NULL)
+    goto done;
+  if (avformat_alloc_output_context2(&fmt, NULL, NULL, argv[1]) < 0)
+    goto done;
+  AVStream *st = avformat_new_stream(fmt, NULL);
+  enc = avcodec_alloc_context3(codec);
+  if (st == NULL || enc == NULL)
+    goto done;
+  enc->width = width;
+  enc->height = height;
+  enc->pix_fmt = AV_PIX_FMT_YUV420P;
+  enc->time_base = (AVRational){1, FRAME_RATE};
+  enc->framerate = (AVRational){FRAME_RATE, 1};
+  enc->bit_rate = kbps * 1000;
+  enc->gop_size = gop;
+  enc->max_b_frames = bframes;
+  if ((fmt->oformat->flags & AVFMT_GLOBALHEADER) != 0)
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  if (avcodec_open2(enc, codec, NULL) < 0)
+    goto done;
+  if (avcodec_parameters_from_context(st->codecpar, enc) < 0)
+    goto done;
+  st->time_base = enc->time_base;
+
+  // Open the output
+  if ((fmt->oformat->flags & AVFMT_NOFILE) == 0 &&
+      avio_open(&fmt->pb, argv[1], AVIO_FLAG_WRITE) < 0)
+    goto done;
+  if (avformat_write_header(fmt, NULL) < 0)
+    goto done;
+  header_written = true;
+
+  // Encode every frame, then drain the encoder
+  frame = av_frame_alloc();
+  pkt = av_packet_alloc();
+  if (frame == NULL || pkt == NULL)
+    goto done;
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  if (av_frame_get_buffer(frame, 0) < 0)
+    goto done;
+  for (int n = 0; n < frames; n++) {
+    if (av_frame_make_writable(frame) < 0)
+      goto done;
+    draw(frame, n);
+    frame->pts = n;
+    if (!encode(enc, frame, fmt, st, pkt))
+      goto done;
+  }
+  ok = encode(enc, NULL, fmt, st, pkt);
+
+done:
+  if (header_written && av_write_trailer(fmt) < 0)
+    ok = false;
+  if (fmt != NULL && (fmt->oformat->flags & AVFMT_NOFILE) == 0)
+    avio_closep(&fmt->pb);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&enc);
+  avformat_free_context(fmt);
+  if (!ok) {
+    fprintf(stderr, "Error: failed to generate %s\n", argv[1]);
+    return 127;
+  }
+  fprintf(stderr, "Generated %s: %dx%d, %ldkbps, GOP %d, %d B-frames, %d "
+          "frames\n",
+          argv[1], width, height, kbps, gop, bframes, frames);
+  return 0;
+}
@@ -0,0 +1,174 @@
+#include "convert.h"
+
+#include <math.h>
+
+//! \brief The kernel used by `convert_yuv420p`
+//! \see convert_select
+static convert_kernel_t selected_kernel = convert_kernel_scalar;
+//! \brief The implementation `selected_kernel` came from
+static convert_impl_t selected_impl = CONVERT_IMPL_SCALAR;
+
+convert_matrix_t convert_matrix(convert_colorspace_t space, bool full_range) {
+
+  // Luma and blue-difference weights for each standard. The green weight is
+  // whatever is left over.
+  double kr = 0.299, kb = 0.114;
+  if (space == CONVERT_BT709) {
+    kr = 0.2126;
+    kb = 0.0722;
+  }
+  double kg = 1.0 - kr - kb;
+
+  // Scale factors to expand limited-range data to the full [0, 255]
+  double ys = full_range ? 1.0 : 255.0 / 219.0;
+  double cs = full_range ? 1.0 : 255.0 / 224.0;
+
+  // Invert the encoding equations. Remember that we have six fractional bits.
+  convert_matrix_t ret = {
+      .y_offset = full_range ? 0 : 16,
+      .y_coef = (int16_t)lrint(64.0 * ys),
+      .v_r = (int16_t)lrint(64.0 * cs * 2.0 * (1.0 - kr)),
+      .u_g = (int16_t)lrint(64.0 * cs * 2.0 * kb * (1.0 - kb) / kg),
+      .v_g = (int16_t)lrint(64.0 * cs * 2.0 * kr * (1.0 - kr) / kg),
+      .u_b = (int16_t)lrint(64.0 * cs * 2.0 * (1.0 - kb)),
+  };
+  return ret;
+}
+
+convert_kernel_t convert_kernel(convert_impl_t impl) {
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  bool has_sse2 = __builtin_cpu_supports("sse2");
+  bool has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  switch (impl) {
+  case CONVERT_IMPL_AUTO:
+    // Try the implementations from fastest to slowest
+#if defined(__ARM_NEON)
+    return convert_kernel_neon;
+#elif defined(__x86_64__) || defined(__i386__)
+    if (has_avx2)
+      return convert_kernel_avx2;
+    if (has_sse2)
+      return convert_kernel_sse2;
+#endif
+    return convert_kernel_scalar;
+
+  case CONVERT_IMPL_SCALAR:
+    return convert_kernel_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+  case CONVERT_IMPL_SSE2:
+    return has_sse2 ? convert_kernel_sse2 : NULL;
+  case CONVERT_IMPL_AVX2:
+    return has_avx2 ? convert_kernel_avx2 : NULL;
+#endif
+
+#if defined(__ARM_NEON)
+  case CONVERT_IMPL_NEON:
+    return convert_kernel_neon;
+#endif
+
+  default:
+    return NULL;
+  }
+}
+
+bool convert_select(convert_impl_t impl) {
+  convert_kernel_t kernel = convert_kernel(impl);
+  if (kernel == NULL)
+    return false;
+  selected_kernel = kernel;
+  // Resolve `CONVERT_IMPL_AUTO` to what was actually picked, so we can report
+  // it later
+  if (kernel == convert_kernel_scalar)
+    selected_impl = CONVERT_IMPL_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+  else if (kernel == convert_kernel_sse2)
+    selected_impl = CONVERT_IMPL_SSE2;
+  else if (kernel == convert_kernel_avx2)
+    selected_impl = CONVERT_IMPL_AVX2;
+#endif
+#if defined(__ARM_NEON)
+  else if (kernel == convert_kernel_neon)
+    selected_impl = CONVERT_IMPL_NEON;
+#endif
+  return true;
+}
+
+const char *convert_impl_name(void) {
+  switch (selected_impl) {
+  case CONVERT_IMPL_SSE2:
+    return "sse2";
+  case CONVERT_IMPL_AVX2:
+    return "avx2";
+  case CONVERT_IMPL_NEON:
+    return "neon";
+  default:
+    return "scalar";
+  }
+}
+
+void convert_yuv420p(const convert_matrix_t *m, const uint8_t *const planes[3],
+                     const int strides[3], uint32_t *dst, size_t dst_stride,
+                     size_t width, size_t row_begin, size_t row_end) {
+  // Do two rows at a time, since they share chroma. If there's an odd row at
+  // the end, it's converted twice into the same place.
+  for (size_t row = row_begin; row < row_end; row += 2u) {
+    size_t row1 = row + 1u < row_end ? row + 1u : row;
+    selected_kernel(m, planes[0] + row * strides[0],
+                    planes[0] + row1 * strides[0],
+                    planes[1] + (row / 2u) * strides[1],
+                    planes[2] + (row / 2u) * strides[2], dst + row * dst_stride,
+                    dst + row1 * dst_stride, width);
+  }
+}
+
+void convert_row_pair(const convert_matrix_t *m, const uint8_t *y0,
+                      const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                      uint32_t *d0, uint32_t *d1, size_t width) {
+  selected_kernel(m, y0, y1, u, v, d0, d1, width);
+}
+
+//! \brief Saturate a value to the range of a signed 16-bit integer
+static inline int32_t sat16(int32_t x) {
+  return x < INT16_MIN ? INT16_MIN : x > INT16_MAX ? INT16_MAX : x;
+}
+
+//! \brief Round off the fractional bits and clamp to a byte
+static inline uint32_t descale(int32_t x) {
+  x = (x + 32) >> 6;
+  return x < 0 ? 0u : x > 255 ? 255u : (uint32_t)x;
+}
+
+//! \brief Convert a single pixel given its precomputed chroma terms
+static inline uint32_t pixel(const convert_matrix_t *m, uint8_t y, int32_t r_v,
+                             int32_t g_uv, int32_t b_u) {
+  int32_t yy = ((int32_t)y - m->y_offset) * m->y_coef;
+  uint32_t r = descale(sat16(yy + r_v));
+  uint32_t g = descale(sat16(yy - g_uv));
+  uint32_t b = descale(sat16(yy + b_u));
+  return 0xff000000u | (r << 16) | (g << 8) | b;
+}
+
+void convert_kernel_scalar(const convert_matrix_t *m, const uint8_t *y0,
+                           const uint8_t *y1, const uint8_t *u,
+                           const uint8_t *v, uint32_t *d0, uint32_t *d1,
+                           size_t width) {
+  for (size_t x = 0u; x < width; x += 2u) {
+    // Compute the chroma terms once for the four pixels that share them
+    int32_t uu = (int32_t)u[x / 2u] - 128;
+    int32_t vv = (int32_t)v[x / 2u] - 128;
+    int32_t r_v = m->v_r * vv;
+    int32_t g_uv = m->u_g * uu + m->v_g * vv;
+    int32_t b_u = m->u_b * uu;
+    // Handle the last column of odd-width images
+    size_t n = x + 1u < width ? 2u : 1u;
+    for (size_t i = 0u; i < n; i++) {
+      d0[x + i] = pixel(m, y0[x + i], r_v, g_uv, b_u);
+      d1[x + i] = pixel(m, y1[x + i], r_v, g_uv, b_u);
+    }
+  }
+}
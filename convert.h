@@ -0,0 +1,148 @@
+//! \file convert.h
+//! \brief Colorspace conversion from YUV to the framebuffer's BGRA format
+//!
+//! This replaces a generic `sws_scale` call with kernels specialized for the
+//! one conversion we actually do. There's a scalar reference implementation, as
+//! well as vectorized ones for NEON on the Zynq's Cortex-A9 and for SSE2 and
+//! AVX2 on x86. The best one available is picked at runtime.
+//!
+//! All the implementations compute exactly the same result. They do the
+//! arithmetic in 16-bit fixed point with six fractional bits, and every step is
+//! defined so that it maps onto a single vector instruction. With `Y`, `U`, and
+//! `V` being the input samples, and `m` the matrix:
+//!
+//!     y' = (Y - m.y_offset) * m.y_coef
+//!     u' = U - 128
+//!     v' = V - 128
+//!     R  = clamp((sat16(y' + m.v_r * v') + 32) >> 6)
+//!     G  = clamp((sat16(y' - (m.u_g * u' + m.v_g * v')) + 32) >> 6)
+//!     B  = clamp((sat16(y' + m.u_b * u') + 32) >> 6)
+//!
+//! where `sat16` saturates to a signed 16-bit integer, and `clamp` clamps to
+//! [0, 255]. The coefficients are small enough that everything else fits in 16
+//! bits, and saturation only happens for values that would be clamped to 255
+//! anyway. Chroma is upsampled by repeating each sample.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Which standard the YUV data was encoded with
+typedef enum convert_colorspace_t {
+  CONVERT_BT601,
+  CONVERT_BT709,
+} convert_colorspace_t;
+
+//! \brief Fixed-point coefficients for YUV to RGB conversion
+//! \details All the coefficients have six fractional bits
+//! \see convert_matrix
+typedef struct convert_matrix_t {
+  int16_t y_offset;
+  int16_t y_coef;
+  int16_t v_r;
+  int16_t u_g;
+  int16_t v_g;
+  int16_t u_b;
+} convert_matrix_t;
+
+//! \brief Compute the conversion matrix for a colorspace
+//!
+//! \param[in] space The standard the data was encoded with
+//! \param[in] full_range Whether luma spans [0, 255] instead of [16, 235], and
+//!                       chroma [0, 255] instead of [16, 240]
+convert_matrix_t convert_matrix(convert_colorspace_t space, bool full_range);
+
+//! \brief Signature of a conversion kernel
+//!
+//! Kernels convert two rows of luma that share one row of chroma. This way, the
+//! chroma terms are only computed once. To convert a single row, pass the same
+//! pointers for both rows.
+//!
+//! \param[in] m The conversion matrix to use
+//! \param[in] y0,y1 The luma rows
+//! \param[in] u,v The chroma rows, each `(width + 1) / 2` samples long
+//! \param[out] d0,d1 The output rows, corresponding to `y0` and `y1`
+//! \param[in] width The number of pixels in each row
+typedef void (*convert_kernel_t)(const convert_matrix_t *m, const uint8_t *y0,
+                                 const uint8_t *y1, const uint8_t *u,
+                                 const uint8_t *v, uint32_t *d0, uint32_t *d1,
+                                 size_t width);
+
+//! \brief The kernel implementations we have
+//! \details `CONVERT_IMPL_AUTO` selects the best one the CPU supports
+typedef enum convert_impl_t {
+  CONVERT_IMPL_AUTO,
+  CONVERT_IMPL_SCALAR,
+  CONVERT_IMPL_SSE2,
+  CONVERT_IMPL_AVX2,
+  CONVERT_IMPL_NEON,
+} convert_impl_t;
+
+//! \brief Choose which kernel implementation to use
+//!
+//! This must be called before any conversions are done, and it must not be
+//! called concurrently with them. If it's never called, the scalar
+//! implementation is used.
+//!
+//! \return Whether the implementation is supported on this machine. On failure,
+//!         the previous selection is kept.
+bool convert_select(convert_impl_t impl);
+//! \brief Get the kernel for an implementation
+//! \return The kernel, or `NULL` if it's not supported on this machine
+convert_kernel_t convert_kernel(convert_impl_t impl);
+//! \brief Human-readable name of the selected implementation
+const char *convert_impl_name(void);
+
+//! \brief Convert rows of a YUV420P image into BGRA
+//!
+//! This converts rows [`row_begin`, `row_end`) of the image using the selected
+//! kernel. The output is written to the same rows of `dst`. For the chroma to
+//! line up, `row_begin` must be even.
+//!
+//! \param[in] m The conversion matrix to use
+//! \param[in] planes Pointers to the Y, U, and V planes
+//! \param[in] strides Length of a row of each plane in bytes
+//! \param[out] dst The output image
+//! \param[in] dst_stride Length of a row of the output in pixels
+//! \param[in] width Width of the image in pixels
+//! \param[in] row_begin First row to convert
+//! \param[in] row_end One past the last row to convert
+void convert_yuv420p(const convert_matrix_t *m, const uint8_t *const planes[3],
+                     const int strides[3], uint32_t *dst, size_t dst_stride,
+                     size_t width, size_t row_begin, size_t row_end);
+
+//! \brief Convert two rows that share chroma with the selected kernel
+//! \details The arguments are as for `convert_kernel_t`
+void convert_row_pair(const convert_matrix_t *m, const uint8_t *y0,
+                      const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                      uint32_t *d0, uint32_t *d1, size_t width);
+
+//! \brief Kernel implementations
+//!
+//! These are exposed so they can be compared against each other. The vector
+//! implementations fall back to `convert_kernel_scalar` for the pixels at the
+//! end of the row that don't fill a whole vector. They take any alignment, but
+//! use aligned loads when the rows are aligned to a vector, as they are in the
+//! frame pool.
+//!
+//! @{
+void convert_kernel_scalar(const convert_matrix_t *m, const uint8_t *y0,
+                           const uint8_t *y1, const uint8_t *u,
+                           const uint8_t *v, uint32_t *d0, uint32_t *d1,
+                           size_t width);
+#if defined(__x86_64__) || defined(__i386__)
+void convert_kernel_sse2(const convert_matrix_t *m, const uint8_t *y0,
+                         const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                         uint32_t *d0, uint32_t *d1, size_t width);
+void convert_kernel_avx2(const convert_matrix_t *m, const uint8_t *y0,
+                         const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                         uint32_t *d0, uint32_t *d1, size_t width);
+#endif
+#if defined(__ARM_NEON)
+void convert_kernel_neon(const convert_matrix_t *m, const uint8_t *y0,
+                         const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                         uint32_t *d0, uint32_t *d1, size_t width);
+#endif
+//! @}
@@ -0,0 +1,219 @@
+//! \file convert_x86.c
+//! \brief SSE2 and AVX2 conversion kernels
+//!
+//! These are mostly useful for testing off-board. They're compiled with target
+//! attributes so that the rest of the program doesn't need to be built for
+//! AVX2, and `convert_kernel` checks the CPU before handing them out.
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+//! \brief Convert as many pixels as fill whole vectors
+//! \details With `aligned`, the luma rows must be 16-byte aligned
+//! \return The number of pixels converted
+static inline __attribute__((target("sse2"), always_inline)) size_t
+sse2_vectors(const convert_matrix_t *m, const uint8_t *y0, const uint8_t *y1,
+             const uint8_t *u, const uint8_t *v, uint32_t *d0, uint32_t *d1,
+             size_t width, bool aligned) {
+
+  // Broadcast the coefficients
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi8((char)0xff);
+  const __m128i c128 = _mm_set1_epi16(128);
+  const __m128i round = _mm_set1_epi16(32);
+  const __m128i y_offset = _mm_set1_epi16(m->y_offset);
+  const __m128i y_coef = _mm_set1_epi16(m->y_coef);
+  const __m128i v_r = _mm_set1_epi16(m->v_r);
+  const __m128i u_g = _mm_set1_epi16(m->u_g);
+  const __m128i v_g = _mm_set1_epi16(m->v_g);
+  const __m128i u_b = _mm_set1_epi16(m->u_b);
+
+  // Do 16 pixels at a time
+  size_t x = 0u;
+  for (; x + 16u <= width; x += 16u) {
+
+    // Load eight chroma samples and compute their terms
+    __m128i uu = _mm_loadl_epi64((const __m128i *)(u + x / 2u));
+    __m128i vv = _mm_loadl_epi64((const __m128i *)(v + x / 2u));
+    uu = _mm_sub_epi16(_mm_unpacklo_epi8(uu, zero), c128);
+    vv = _mm_sub_epi16(_mm_unpacklo_epi8(vv, zero), c128);
+    __m128i r_v = _mm_mullo_epi16(vv, v_r);
+    __m128i g_uv =
+        _mm_add_epi16(_mm_mullo_epi16(uu, u_g), _mm_mullo_epi16(vv, v_g));
+    __m128i b_u = _mm_mullo_epi16(uu, u_b);
+    // Each chroma sample covers two pixels, so duplicate them
+    __m128i r_v_lo = _mm_unpacklo_epi16(r_v, r_v);
+    __m128i r_v_hi = _mm_unpackhi_epi16(r_v, r_v);
+    __m128i g_uv_lo = _mm_unpacklo_epi16(g_uv, g_uv);
+    __m128i g_uv_hi = _mm_unpackhi_epi16(g_uv, g_uv);
+    __m128i b_u_lo = _mm_unpacklo_epi16(b_u, b_u);
+    __m128i b_u_hi = _mm_unpackhi_epi16(b_u, b_u);
+
+    // Apply them to both rows
+    for (size_t row = 0u; row < 2u; row++) {
+      const uint8_t *yp = row == 0u ? y0 : y1;
+      uint32_t *dp = row == 0u ? d0 : d1;
+
+      // Load the luma and scale it
+      const __m128i *yv = (const __m128i *)(yp + x);
+      __m128i yy = aligned ? _mm_load_si128(yv) : _mm_loadu_si128(yv);
+      __m128i yy_lo = _mm_unpacklo_epi8(yy, zero);
+      __m128i yy_hi = _mm_unpackhi_epi8(yy, zero);
+      yy_lo = _mm_mullo_epi16(_mm_sub_epi16(yy_lo, y_offset), y_coef);
+      yy_hi = _mm_mullo_epi16(_mm_sub_epi16(yy_hi, y_offset), y_coef);
+
+      // Compute each channel. The packing does the clamping for us.
+#define CHANNEL(op, lo, hi)                                                    \
+  _mm_packus_epi16(                                                            \
+      _mm_srai_epi16(_mm_adds_epi16(op(yy_lo, lo), round), 6),                 \
+      _mm_srai_epi16(_mm_adds_epi16(op(yy_hi, hi), round), 6))
+      __m128i r = CHANNEL(_mm_adds_epi16, r_v_lo, r_v_hi);
+      __m128i g = CHANNEL(_mm_subs_epi16, g_uv_lo, g_uv_hi);
+      __m128i b = CHANNEL(_mm_adds_epi16, b_u_lo, b_u_hi);
+#undef CHANNEL
+
+      // Interleave into BGRA and store
+      __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+      __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+      __m128i ra_lo = _mm_unpacklo_epi8(r, alpha);
+      __m128i ra_hi = _mm_unpackhi_epi8(r, alpha);
+      __m128i *out = (__m128i *)(dp + x);
+      _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(bg_lo, ra_lo));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+    }
+  }
+  return x;
+}
+
+__attribute__((target("sse2"))) void
+convert_kernel_sse2(const convert_matrix_t *m, const uint8_t *y0,
+                    const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                    uint32_t *d0, uint32_t *d1, size_t width) {
+
+  // Rows from the frame pool are aligned, so they can take aligned loads
+  size_t x = ((uintptr_t)y0 | (uintptr_t)y1) % 16u == 0u
+                 ? sse2_vectors(m, y0, y1, u, v, d0, d1, width, true)
+                 : sse2_vectors(m, y0, y1, u, v, d0, d1, width, false);
+
+  // Finish off whatever doesn't fill a vector
+  if (x < width)
+    convert_kernel_scalar(m, y0 + x, y1 + x, u + x / 2u, v + x / 2u, d0 + x,
+                          d1 + x, width - x);
+}
+
+//! \brief Convert as many pixels as fill whole vectors
+//! \details With `aligned`, the luma rows must be 32-byte aligned, and the
+//! chroma rows 16-byte aligned
+//! \return The number of pixels converted
+static inline __attribute__((target("avx2"), always_inline)) size_t
+avx2_vectors(const convert_matrix_t *m, const uint8_t *y0, const uint8_t *y1,
+             const uint8_t *u, const uint8_t *v, uint32_t *d0, uint32_t *d1,
+             size_t width, bool aligned) {
+
+  // Broadcast the coefficients
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha = _mm256_set1_epi8((char)0xff);
+  const __m256i c128 = _mm256_set1_epi16(128);
+  const __m256i round = _mm256_set1_epi16(32);
+  const __m256i y_offset = _mm256_set1_epi16(m->y_offset);
+  const __m256i y_coef = _mm256_set1_epi16(m->y_coef);
+  const __m256i v_r = _mm256_set1_epi16(m->v_r);
+  const __m256i u_g = _mm256_set1_epi16(m->u_g);
+  const __m256i v_g = _mm256_set1_epi16(m->v_g);
+  const __m256i u_b = _mm256_set1_epi16(m->u_b);
+
+  // Do 32 pixels at a time. Most AVX2 shuffles work within 128-bit lanes, so
+  // the intermediate vectors are out of order. The `_lo` vectors hold pixels
+  // [0, 8) and [16, 24), while the `_hi` vectors hold [8, 16) and [24, 32).
+  // The luma unpacks produce the same order, and the final permutes fix it.
+  size_t x = 0u;
+  for (; x + 32u <= width; x += 32u) {
+
+    // Load 16 chroma samples and compute their terms
+    const __m128i *u_in = (const __m128i *)(u + x / 2u);
+    const __m128i *v_in = (const __m128i *)(v + x / 2u);
+    __m256i uu = _mm256_cvtepu8_epi16(aligned ? _mm_load_si128(u_in)
+                                              : _mm_loadu_si128(u_in));
+    __m256i vv = _mm256_cvtepu8_epi16(aligned ? _mm_load_si128(v_in)
+                                              : _mm_loadu_si128(v_in));
+    uu = _mm256_sub_epi16(uu, c128);
+    vv = _mm256_sub_epi16(vv, c128);
+    __m256i r_v = _mm256_mullo_epi16(vv, v_r);
+    __m256i g_uv = _mm256_add_epi16(_mm256_mullo_epi16(uu, u_g),
+                                    _mm256_mullo_epi16(vv, v_g));
+    __m256i b_u = _mm256_mullo_epi16(uu, u_b);
+    // Duplicate them for the two pixels each covers
+    __m256i r_v_lo = _mm256_unpacklo_epi16(r_v, r_v);
+    __m256i r_v_hi = _mm256_unpackhi_epi16(r_v, r_v);
+    __m256i g_uv_lo = _mm256_unpacklo_epi16(g_uv, g_uv);
+    __m256i g_uv_hi = _mm256_unpackhi_epi16(g_uv, g_uv);
+    __m256i b_u_lo = _mm256_unpacklo_epi16(b_u, b_u);
+    __m256i b_u_hi = _mm256_unpackhi_epi16(b_u, b_u);
+
+    // Apply them to both rows
+    for (size_t row = 0u; row < 2u; row++) {
+      const uint8_t *yp = row == 0u ? y0 : y1;
+      uint32_t *dp = row == 0u ? d0 : d1;
+
+      // Load the luma and scale it
+      const __m256i *yv = (const __m256i *)(yp + x);
+      __m256i yy = aligned ? _mm256_load_si256(yv) : _mm256_loadu_si256(yv);
+      __m256i yy_lo = _mm256_unpacklo_epi8(yy, zero);
+      __m256i yy_hi = _mm256_unpackhi_epi8(yy, zero);
+      yy_lo = _mm256_mullo_epi16(_mm256_sub_epi16(yy_lo, y_offset), y_coef);
+      yy_hi = _mm256_mullo_epi16(_mm256_sub_epi16(yy_hi, y_offset), y_coef);
+
+      // Compute each channel. The packing puts the pixels back in order.
+#define CHANNEL(op, lo, hi)                                                    \
+  _mm256_packus_epi16(                                                         \
+      _mm256_srai_epi16(_mm256_adds_epi16(op(yy_lo, lo), round), 6),           \
+      _mm256_srai_epi16(_mm256_adds_epi16(op(yy_hi, hi), round), 6))
+      __m256i r = CHANNEL(_mm256_adds_epi16, r_v_lo, r_v_hi);
+      __m256i g = CHANNEL(_mm256_subs_epi16, g_uv_lo, g_uv_hi);
+      __m256i b = CHANNEL(_mm256_adds_epi16, b_u_lo, b_u_hi);
+#undef CHANNEL
+
+      // Interleave into BGRA. Again, this is out of order within each vector.
+      __m256i bg_lo = _mm256_unpacklo_epi8(b, g);
+      __m256i bg_hi = _mm256_unpackhi_epi8(b, g);
+      __m256i ra_lo = _mm256_unpacklo_epi8(r, alpha);
+      __m256i ra_hi = _mm256_unpackhi_epi8(r, alpha);
+      __m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo); // [0, 4), [16, 20)
+      __m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo); // [4, 8), [20, 24)
+      __m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi); // [8, 12), [24, 28)
+      __m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi); // [12, 16), [28, 32)
+
+      // Fix the order and store
+      __m256i *out = (__m256i *)(dp + x);
+      _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+      _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+      _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+      _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+  }
+  return x;
+}
+
+__attribute__((target("avx2"))) void
+convert_kernel_avx2(const convert_matrix_t *m, const uint8_t *y0,
+                    const uint8_t *y1, const uint8_t *u, const uint8_t *v,
+                    uint32_t *d0, uint32_t *d1, size_t width) {
+
+  // Rows from the frame pool are aligned, so they can take aligned loads
+  bool aligned = ((uintptr_t)y0 | (uintptr_t)y1) % 32u == 0u &&
+                 ((uintptr_t)u | (uintptr_t)v) % 16u == 0u;
+  size_t x = aligned ? avx2_vectors(m, y0, y1, u, v, d0, d1, width, true)
+                     : avx2_vectors(m, y0, y1, u, v, d0, d1, width, false);
+
+  // Finish off whatever doesn't fill a vector
+  if (x < width)
+    convert_kernel_scalar(m, y0 + x, y1 + x, u + x / 2u, v + x / 2u, d0 + x,
+                          d1 + x, width - x);
+}
+
+#endif
@@ -0,0 +1,169 @@
+#include "frame_pool.h"
+
+#include <stdlib.h>
+
+//! \brief Round `x` up to a multiple of `a`, which must be a power of two
+static inline size_t align_up(size_t x, size_t a) {
+  return (x + a - 1u) & ~(a - 1u);
+}
+
+frame_pool_t *frame_pool_open(size_t count) {
+  // Edge case handling
+  if (count == 0u || count > FRAME_POOL_MAX)
+    return NULL;
+  // Allocate space for the return value. Everything else is initialized on the
+  // first request.
+  frame_pool_t *ret = calloc(1u, sizeof(frame_pool_t));
+  if (ret == NULL)
+    return NULL;
+  if (pthread_mutex_init(&ret->lock, NULL) != 0) {
+    free(ret);
+    return NULL;
+  }
+  ret->count = count;
+  ret->stats.buffers = count;
+  return ret;
+}
+
+//! \brief Actually free the pool
+//! \details Must only be called once no buffers are in use
+static void destroy(frame_pool_t *pool) {
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->memory);
+  free(pool);
+}
+
+void frame_pool_close(frame_pool_t *pool) {
+  // Edge case handling
+  if (pool == NULL)
+    return;
+  // If any buffers are still out, defer to the last release
+  pthread_mutex_lock(&pool->lock);
+  bool in_use = pool->memory != NULL && pool->free_count != pool->count;
+  pool->closing = in_use;
+  pthread_mutex_unlock(&pool->lock);
+  if (!in_use)
+    destroy(pool);
+}
+
+//! \brief Compute the layout and allocate the buffers
+//! \details Must be called with the lock held
+//! \return Whether the allocation succeeded
+static bool init_memory(frame_pool_t *pool, AVCodecContext *ctx, int width,
+                        int height) {
+
+  // The codec may need the buffer to be bigger than the frame, and it may need
+  // rows to be aligned to more than we'd otherwise choose
+  int padded_width = width;
+  int padded_height = height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(ctx, &padded_width, &padded_height,
+                            linesize_align);
+  size_t align = FRAME_POOL_ALIGN;
+  for (size_t i = 0u; i < 3u; i++)
+    if ((size_t)linesize_align[i] > align)
+      align = (size_t)linesize_align[i];
+
+  // Lay out the three planes one after the other. Each one is padded at the end
+  // so vector code can read a little past the last row.
+  size_t offset = 0u;
+  for (size_t i = 0u; i < 3u; i++) {
+    size_t w = (size_t)padded_width;
+    size_t h = (size_t)padded_height;
+    if (i != 0u) {
+      w = (w + 1u) / 2u;
+      h = (h + 1u) / 2u;
+    }
+    size_t linesize = align_up(w, align);
+    pool->linesize[i] = (int)linesize;
+    pool->plane_offset[i] = offset;
+    offset = align_up(offset + linesize * h + FRAME_POOL_ALIGN, align);
+  }
+  pool->buffer_size = offset;
+  pool->width = width;
+  pool->height = height;
+
+  // Allocate all the buffers at once
+  if (posix_memalign((void **)&pool->memory, align,
+                     pool->buffer_size * pool->count) != 0) {
+    pool->memory = NULL;
+    return false;
+  }
+  for (size_t i = 0u; i < pool->count; i++)
+    pool->free_list[i] = i;
+  pool->free_count = pool->count;
+  return true;
+}
+
+//! \brief Called by LibAV when the last reference to a buffer goes away
+static void release(void *opaque, uint8_t *data) {
+  frame_pool_t *pool = opaque;
+  pthread_mutex_lock(&pool->lock);
+  size_t idx = (size_t)(data - pool->memory) / pool->buffer_size;
+  pool->free_list[pool->free_count++] = idx;
+  bool last = pool->closing && pool->free_count == pool->count;
+  pthread_mutex_unlock(&pool->lock);
+  // If the pool was closed while we were out, we're responsible for freeing it
+  if (last)
+    destroy(pool);
+}
+
+int frame_pool_get_buffer(frame_pool_t *pool, AVCodecContext *ctx,
+                          AVFrame *frame, int flags) {
+
+  // We only know how to lay out YUV420P
+  if (pool == NULL || frame->format != AV_PIX_FMT_YUV420P)
+    goto fallback;
+
+  // Take a buffer, setting up the pool if this is the first request
+  pthread_mutex_lock(&pool->lock);
+  if (pool->memory == NULL &&
+      !init_memory(pool, ctx, frame->width, frame->height)) {
+    pthread_mutex_unlock(&pool->lock);
+    goto fallback;
+  }
+  if (frame->width != pool->width || frame->height != pool->height ||
+      pool->free_count == 0u) {
+    pthread_mutex_unlock(&pool->lock);
+    goto fallback;
+  }
+  size_t idx = pool->free_list[--pool->free_count];
+  size_t in_use = pool->count - pool->free_count;
+  if (in_use > pool->stats.peak_in_use)
+    pool->stats.peak_in_use = in_use;
+  pool->stats.hits++;
+  uint8_t *base = pool->memory + idx * pool->buffer_size;
+  pthread_mutex_unlock(&pool->lock);
+
+  // Wrap it so LibAV can reference count it. This allocates a small
+  // bookkeeping structure, but not the frame data itself.
+  frame->buf[0] = av_buffer_create(base, pool->buffer_size, release, pool, 0);
+  if (frame->buf[0] == NULL) {
+    release(pool, base);
+    return AVERROR(ENOMEM);
+  }
+  for (size_t i = 0u; i < 3u; i++) {
+    frame->data[i] = base + pool->plane_offset[i];
+    frame->linesize[i] = pool->linesize[i];
+  }
+  frame->extended_data = frame->data;
+  return 0;
+
+fallback:
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.fallbacks++;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return avcodec_default_get_buffer2(ctx, frame, flags);
+}
+
+frame_pool_stats_t frame_pool_stats(frame_pool_t *pool) {
+  frame_pool_stats_t ret = {0};
+  if (pool == NULL)
+    return ret;
+  pthread_mutex_lock(&pool->lock);
+  ret = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+  return ret;
+}
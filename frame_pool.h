@@ -0,0 +1,106 @@
+//! \file frame_pool.h
+//! \brief Preallocated buffers for decoded frames
+//!
+//! By default, LibAV allocates buffers for decoded frames as it needs them, and
+//! it frees them when we unreference the frame. This module instead carves a
+//! fixed number of YUV420P frame buffers out of one allocation made up front,
+//! and hands them to the decoder through a custom `get_buffer2` callback. Once
+//! the pool is warm, decoding doesn't allocate any frame buffers.
+//!
+//! Every plane and every row starts on a `FRAME_POOL_ALIGN`-byte boundary. The
+//! vector conversion kernels check for this, and take aligned loads when they
+//! convert straight from a frame. That's when the frame is the same size as
+//! the output, and its chroma doesn't need to be resampled first.
+//!
+//! The pool is thread-safe, since frame-threaded decoders request and release
+//! buffers from their own threads.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+//! \brief Alignment of every plane and row in the pool, in bytes
+#define FRAME_POOL_ALIGN 64u
+//! \brief Maximum number of buffers in a pool
+#define FRAME_POOL_MAX 64u
+
+//! \brief Counters describing how the pool has been used
+typedef struct frame_pool_stats_t {
+  //! \brief Number of buffers in the pool
+  size_t buffers;
+  //! \brief Most buffers that were ever handed out at once
+  size_t peak_in_use;
+  //! \brief Number of buffers handed out from the pool
+  size_t hits;
+  //! \brief Number of times LibAV's allocator had to be used instead
+  //! \details This is zero if no frame buffers were allocated while decoding
+  size_t fallbacks;
+} frame_pool_stats_t;
+
+//! \brief A pool of frame buffers
+//!
+//! The memory for the buffers is allocated when the first frame is requested,
+//! since that's when we know its dimensions and the codec's alignment needs.
+//! All buffers have the same layout, which is recorded here. Requests for
+//! frames with a different format or size fall back to LibAV's allocator.
+typedef struct frame_pool_t {
+  //! \brief Protects every field below
+  pthread_mutex_t lock;
+
+  //! \brief Number of buffers to allocate
+  size_t count;
+  //! \brief Backing memory for all the buffers, or `NULL` before first use
+  uint8_t *memory;
+
+  //! \brief Layout of each buffer
+  //! @{
+  int width;
+  int height;
+  int linesize[3];
+  size_t plane_offset[3];
+  size_t buffer_size;
+  //! @}
+
+  //! \brief Indices of the buffers not currently handed out
+  //! @{
+  size_t free_list[FRAME_POOL_MAX];
+  size_t free_count;
+  //! @}
+
+  //! \brief Set by `frame_pool_close` if buffers were still in use
+  //! \details The pool is freed when the last one is released
+  bool closing;
+
+  //! \brief Usage counters
+  frame_pool_stats_t stats;
+} frame_pool_t;
+
+//! \brief Create a pool
+//!
+//! No memory for the buffers is allocated yet. That happens when the first
+//! frame is requested.
+//!
+//! \param[in] count The number of buffers, at most `FRAME_POOL_MAX`
+//! \return A pointer to the pool on the heap, or `NULL` on failure
+frame_pool_t *frame_pool_open(size_t count);
+//! \brief Inverse of `frame_pool_open`
+//!
+//! Frames that still reference buffers in the pool stay valid. The pool is
+//! freed once all of them are unreferenced. It is legal to close a `NULL` pool.
+void frame_pool_close(frame_pool_t *pool);
+
+//! \brief Implementation of `AVCodecContext.get_buffer2`
+//!
+//! The context's callback should forward to this function with the pool it's
+//! using. If the pool can't satisfy the request, this forwards to
+//! `avcodec_default_get_buffer2` and counts a fallback.
+int frame_pool_get_buffer(frame_pool_t *pool, AVCodecContext *ctx,
+                          AVFrame *frame, int flags);
+
+//! \brief Get a snapshot of the pool's counters
+frame_pool_stats_t frame_pool_stats(frame_pool_t *pool);
@@ -1,9 +1,14 @@
 #include "hdmi_dev.h"
 
+#include "hdmi_sim.h"
+
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -24,6 +29,25 @@ static const char *const FIRMWARE_NAME = "hdmi_dev.bin";
 //! @{
 static const char *const FLAG_FILE = "/sys/class/fpga_manager/fpga0/flags";
 static const char *const PROG_FILE = "/sys/class/fpga_manager/fpga0/firmware";
+static const char *const STATE_FILE = "/sys/class/fpga_manager/fpga0/state";
+//! @}
+
+//! \brief Where the firmware named by `FIRMWARE_NAME` is found
+static const char *const FIRMWARE_PATH = "/lib/firmware/hdmi_dev.bin";
+//! \brief Where to record the checksum of the bitstream we programmed
+//!
+//! This is on a tmpfs, so it's gone after a reboot, just like the bitstream
+//! itself. If it matches the firmware, and the FPGA manager says the PL is
+//! operating, the PL still has our bitstream and doesn't need programming.
+static const char *const STAMP_FILE = "/run/hdmi_dev.stamp";
+
+//! \brief Name the UIO driver gives the HDMI Peripheral's interrupt
+//!
+//! The device tree binds the interrupt to `generic-uio` under this name. It's
+//! looked for among the first `UIO_MAX_DEVICES` devices in `/sys/class/uio`.
+//! @{
+static const char *const UIO_NAME = "hdmi_dev";
+static const int UIO_MAX_DEVICES = 16;
 //! @}
 
 //! \brief Physical address of the HDMI Peripheral's registers
@@ -49,6 +73,28 @@ typedef struct hdmi_dev_handle_t {
   //! \see REGISTERS_LEN
   volatile uint32_t *registers;
 
+  //! \brief Model of the device, if we're simulating it
+  //! \details The default value must be `NULL`
+  hdmi_sim_t *sim;
+
+  //! \brief How long before a target `hdmi_dev_wait` stops sleeping
+  uint32_t wait_margin_ns;
+  //! \brief Counters for `hdmi_dev_wait`
+  hdmi_wait_stats_t wait_stats;
+
+  //! \brief Source of vsync events, if one is open
+  //! \details The default value of `vsync_fd` must be `-1`
+  //! @{
+  int vsync_fd;
+  hdmi_vsync_mode_t vsync_mode;
+  uint_fast16_t vsync_row;
+  //! @}
+
+  //! \brief Whether to program the PL even if it already has the bitstream
+  bool force_program;
+  //! \brief How the last `hdmi_dev_open` went
+  hdmi_open_stats_t open_stats;
+
 } hdmi_dev_handle_t;
 
 //! \brief Handle to the singleton HDMI Peripheral
@@ -57,8 +103,100 @@ static hdmi_dev_handle_t hdmi_dev = {
     .initialized = false,
     .mem_fd = -1,
     .registers = MAP_FAILED,
+    .sim = NULL,
+    .vsync_fd = -1,
+    .wait_margin_ns = HDMI_DEFAULT_WAIT_MARGIN_NS,
 };
 
+//! \brief Whether we have a device to talk to, real or simulated
+static inline bool have_regs(void) {
+  return hdmi_dev.registers != MAP_FAILED || hdmi_dev.sim != NULL;
+}
+
+//! \brief Read one of the peripheral's registers
+//! \param[in] offset Byte offset of the register
+static inline uint32_t reg_read(size_t offset) {
+  if (hdmi_dev.sim != NULL)
+    return hdmi_sim_read(hdmi_dev.sim, offset);
+  return hdmi_dev.registers[offset / 4u];
+}
+
+//! \brief Write one of the peripheral's registers
+//! \param[in] offset Byte offset of the register
+static inline void reg_write(size_t offset, uint32_t value) {
+  if (hdmi_dev.sim != NULL)
+    hdmi_sim_write(hdmi_dev.sim, offset, value);
+  else
+    hdmi_dev.registers[offset / 4u] = value;
+}
+
+//! \brief Current time on the monotonic clock, in nanoseconds
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+//! \brief Compute a checksum of the firmware file
+//! \details This is 64-bit FNV-1a, which is plenty to tell bitstreams apart
+static bool firmware_checksum(uint64_t *checksum) {
+  int fd = open(FIRMWARE_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  uint64_t hash = 0xcbf29ce484222325u;
+  uint8_t buf[64u * 1024u];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    for (ssize_t i = 0; i < n; i++)
+      hash = (hash ^ buf[i]) * 0x100000001b3u;
+  close(fd);
+  *checksum = hash;
+  return n == 0;
+}
+
+//! \brief Whether the PL already has the bitstream with this checksum
+//!
+//! This trusts the stamp we wrote when we last programmed it, and checks that
+//! the FPGA manager agrees the PL is operating. Something else programming
+//! the PL without updating the stamp would fool this, which is what
+//! `hdmi_dev_set_force_program` is for.
+static bool pl_is_current(uint64_t checksum) {
+  char state[32] = {0};
+  int fd = open(STATE_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  ssize_t n = read(fd, state, sizeof(state) - 1u);
+  close(fd);
+  if (n <= 0 || strncmp(state, "operating", 9u) != 0)
+    return false;
+
+  char stamp[32] = {0};
+  fd = open(STAMP_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  n = read(fd, stamp, sizeof(stamp) - 1u);
+  close(fd);
+  char expected[32];
+  snprintf(expected, sizeof(expected), "%016" PRIx64 "\n", checksum);
+  return n > 0 && strcmp(stamp, expected) == 0;
+}
+
+//! \brief Record that the PL has the bitstream with this checksum
+//! \details Failing to is harmless, since we'll just program it next time
+static void write_stamp(uint64_t checksum) {
+  int fd = open(STAMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return;
+  char stamp[32];
+  int len = snprintf(stamp, sizeof(stamp), "%016" PRIx64 "\n", checksum);
+  if (write(fd, stamp, (size_t)len) != len) {
+    close(fd);
+    unlink(STAMP_FILE);
+    return;
+  }
+  close(fd);
+}
+
 //! \brief Initialize the PL with the HDMI Peripheral
 //! \see hdmi_dev_open
 static bool init_pl(void) {
@@ -179,12 +317,31 @@ bool hdmi_dev_open(void) {
   // Perform all of the initialization tasks. These functions will clean up
   // their own resources, but they may leave some in the `hdmi_dev` variable for
   // us to clean up. That's why we call `hdmi_dev_close` on failure.
-  if (!init_pl())
-    goto failure;
+  //
+  // Programming the PL is by far the slowest step, so skip it if the PL
+  // already has our bitstream. Remove the stamp while programming, so a
+  // failure partway through doesn't leave it claiming otherwise.
+  hdmi_open_stats_t *st = &hdmi_dev.open_stats;
+  *st = (hdmi_open_stats_t){0};
+  uint64_t start = now_ns();
+  uint64_t checksum = 0u;
+  bool have_checksum = firmware_checksum(&checksum);
+  st->programmed =
+      hdmi_dev.force_program || !have_checksum || !pl_is_current(checksum);
+  if (st->programmed) {
+    unlink(STAMP_FILE);
+    if (!init_pl())
+      goto failure;
+    if (have_checksum)
+      write_stamp(checksum);
+  }
+  uint64_t pl_done = now_ns();
+  st->pl_ns = pl_done - start;
   if (!init_regs())
     goto failure;
   if (!init_clocks())
     goto failure;
+  st->clocks_ns = now_ns() - pl_done;
 
   // Mark as initialized and return
   hdmi_dev.initialized = true;
@@ -197,6 +354,21 @@ failure:
   return false;
 }
 
+bool hdmi_dev_open_sim(void) {
+
+  // Same as above, except there's only one resource to acquire
+  if (hdmi_dev.initialized)
+    return true;
+  if (have_regs())
+    return false;
+  hdmi_dev.sim = hdmi_sim_open();
+  if (hdmi_dev.sim == NULL)
+    return false;
+
+  hdmi_dev.initialized = true;
+  return true;
+}
+
 void hdmi_dev_close(void) {
   // This function is responsible for resetting the HDMI Peripheral to a known
   // state. It's used by the `hdmi_dev_open` function.
@@ -214,6 +386,12 @@ void hdmi_dev_close(void) {
     close(hdmi_dev.mem_fd);
     hdmi_dev.mem_fd = -1;
   }
+  // Free the model, if we were simulating
+  hdmi_sim_close(hdmi_dev.sim);
+  hdmi_dev.sim = NULL;
+
+  // Stop generating vsync events
+  hdmi_dev_vsync_close();
 
   // Mark as uninitialized
   hdmi_dev.initialized = false;
@@ -221,14 +399,14 @@ void hdmi_dev_close(void) {
 
 void hdmi_dev_start(void) {
   // Check to make sure we have registers. If we don't, bail.
-  if (hdmi_dev.registers == MAP_FAILED)
+  if (!have_regs())
     return;
   // Otherwise, set it running in continuous mode. Wait until the current
   // coordinate goes valid to know that we're running. Remember to clear the
   // coordinate valid bit first.
-  (void)hdmi_dev.registers[0x1cu / 4u];
-  hdmi_dev.registers[0x0u / 4u] = 0x81u;
-  while ((hdmi_dev.registers[0x1cu / 4u] & 1u) == 0u) {
+  (void)reg_read(0x1cu);
+  reg_write(0x0u, 0x81u);
+  while ((reg_read(0x1cu) & 1u) == 0u) {
     // We won't be waiting here for long. The latency from startup is 19 cycles
     // at 100MHz, so just 190ns. It's not worth sleeping.
   }
@@ -236,11 +414,11 @@ void hdmi_dev_start(void) {
 
 void hdmi_dev_stop(void) {
   // Check to make sure we have registers. If we don't, bail.
-  if (hdmi_dev.registers == MAP_FAILED)
+  if (!have_regs())
     return;
   // Otherwise, stop it, then wait until the device signals idle.
   hdmi_dev_stopnow();
-  while ((hdmi_dev.registers[0x0u / 4u] & 0x04u) == 0u) {
+  while ((reg_read(0x0u) & 0x04u) == 0u) {
     // We could be waiting here for some time - up to 17ms. Thus, we sleep for a
     // good portion of the duration. It can be interrupted, but that's fine
     // since it's in a loop.
@@ -251,10 +429,10 @@ void hdmi_dev_stop(void) {
 
 void hdmi_dev_stopnow(void) {
   // Check to make sure we have registers. If we don't, bail.
-  if (hdmi_dev.registers == MAP_FAILED)
+  if (!have_regs())
     return;
   // Otherwise, stop it
-  hdmi_dev.registers[0x0u / 4u] = 0x00u;
+  reg_write(0x0u, 0x00u);
 }
 
 hdmi_coordinate_t hdmi_dev_coordinate(void) {
@@ -265,10 +443,10 @@ hdmi_coordinate_t hdmi_dev_coordinate(void) {
       .col = 0u,
   };
   // If we don't have the registers mapped, bail
-  if (hdmi_dev.registers == MAP_FAILED)
+  if (!have_regs())
     return ret;
   // Otherwise, read the raw coordinate and populate the fields
-  uint32_t raw_coord = hdmi_dev.registers[0x18u / 4u];
+  uint32_t raw_coord = reg_read(0x18u);
   ret.fid = (raw_coord >> 20) & 0xfffu;
   ret.row = (raw_coord >> 10) & 0x3ffu;
   ret.col = (raw_coord >> 0) & 0x3ffu;
@@ -280,8 +458,199 @@ void hdmi_dev_set_fb(hdmi_fb_handle_t *fb) {
   // registers mapped.
   if (fb == NULL)
     return;
-  if (hdmi_dev.registers == MAP_FAILED)
+  if (!have_regs())
     return;
   // Tell the peripheral
-  hdmi_dev.registers[0x10u / 4u] = fb->physical_address;
+  reg_write(0x10u, fb->physical_address);
+}
+
+uint32_t hdmi_dev_sim_scanout(void) {
+  if (hdmi_dev.sim == NULL)
+    return 0u;
+  return hdmi_sim_scanout(hdmi_dev.sim);
+}
+
+void hdmi_dev_set_wait_margin(uint32_t margin_ns) {
+  hdmi_dev.wait_margin_ns = margin_ns;
+}
+
+//! \brief How many pixels the device has to serialize to get from `cur` to the
+//!        start of row `row` on frame `fid`
+//! \return The distance, which is negative if the target has already passed
+static int64_t pixels_until(hdmi_coordinate_t cur, hdmi_fid_t fid,
+                            uint_fast16_t row) {
+  int64_t frames = hdmi_fid_delta(fid, cur.fid);
+  int64_t rows = (int64_t)row - (int64_t)cur.row;
+  return (frames * HDMI_FRAME_ROWS + rows) * HDMI_FRAME_COLS -
+         (int64_t)cur.col;
+}
+
+hdmi_coordinate_t hdmi_dev_wait(hdmi_fid_t fid, uint_fast16_t row) {
+  hdmi_dev.wait_stats.waits++;
+
+  // Sleep until we're within the margin. This is a loop in case the sleep is
+  // interrupted, but normally it runs only once.
+  hdmi_coordinate_t cur = hdmi_dev_coordinate();
+  bool slept = false;
+  while (true) {
+    int64_t pixels = pixels_until(cur, fid, row);
+    if (pixels <= 0) {
+      // If we got here right after sleeping, we woke up too late
+      if (slept)
+        hdmi_dev.wait_stats.overslept++;
+      return cur;
+    }
+    uint64_t ns = (uint64_t)pixels * 1000000000u / HDMI_PIXEL_CLOCK_HZ;
+    if (ns <= hdmi_dev.wait_margin_ns)
+      break;
+
+    // Sleep until the margin before the target, and record how late we woke
+    uint64_t target = now_ns() + (ns - hdmi_dev.wait_margin_ns);
+    struct timespec req = {
+        .tv_sec = (time_t)(target / 1000000000u),
+        .tv_nsec = (long)(target % 1000000000u),
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL);
+    uint64_t woke = now_ns();
+    if (woke > target) {
+      uint64_t late = woke - target;
+      hdmi_dev.wait_stats.wake_late_ns_total += late;
+      if (late > hdmi_dev.wait_stats.wake_late_ns_max)
+        hdmi_dev.wait_stats.wake_late_ns_max = late;
+    }
+    hdmi_dev.wait_stats.sleeps++;
+    slept = true;
+    cur = hdmi_dev_coordinate();
+  }
+
+  // Spin for the last few lines
+  uint64_t spin_start = now_ns();
+  while (pixels_until(cur, fid, row) > 0)
+    cur = hdmi_dev_coordinate();
+  hdmi_dev.wait_stats.spin_ns_total += now_ns() - spin_start;
+  return cur;
+}
+
+hdmi_wait_stats_t hdmi_dev_wait_stats(void) { return hdmi_dev.wait_stats; }
+
+void hdmi_dev_set_force_program(bool force) { hdmi_dev.force_program = force; }
+
+hdmi_open_stats_t hdmi_dev_open_stats(void) { return hdmi_dev.open_stats; }
+
+//! \brief Find the UIO device for the HDMI Peripheral's interrupt, and open it
+//! \return The file descriptor, or `-1` if there isn't one
+static int open_uio(void) {
+  for (int i = 0; i < UIO_MAX_DEVICES; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/uio/uio%d/name", i);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    char name[32] = {0};
+    ssize_t n = read(fd, name, sizeof(name) - 1u);
+    close(fd);
+    if (n <= 0 || strncmp(name, UIO_NAME, strlen(UIO_NAME)) != 0 ||
+        (name[strlen(UIO_NAME)] != '\n' && name[strlen(UIO_NAME)] != '\0'))
+      continue;
+
+    // Found it. Interrupts start out masked, so unmask them.
+    snprintf(path, sizeof(path), "/dev/uio%d", i);
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+      return -1;
+    uint32_t enable = 1u;
+    if (write(fd, &enable, sizeof(enable)) != sizeof(enable)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  return -1;
+}
+
+//! \brief Set the timer to expire when the device next reaches the vsync row
+//! \param[in] cur Where the device is now. The row is reached after this.
+static void arm_timer(hdmi_coordinate_t cur) {
+  hdmi_fid_t fid = cur.row < hdmi_dev.vsync_row ? cur.fid
+                                                 : hdmi_fid_add(cur.fid, 1);
+  int64_t pixels = pixels_until(cur, fid, hdmi_dev.vsync_row);
+  uint64_t target =
+      now_ns() + (uint64_t)pixels * 1000000000u / HDMI_PIXEL_CLOCK_HZ;
+  struct itimerspec its = {
+      .it_value =
+          {
+              .tv_sec = (time_t)(target / 1000000000u),
+              .tv_nsec = (long)(target % 1000000000u),
+          },
+  };
+  timerfd_settime(hdmi_dev.vsync_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+bool hdmi_dev_vsync_open(uint_fast16_t row) {
+  // Edge case handling
+  if (!have_regs() || row >= HDMI_FRAME_ROWS)
+    return false;
+  hdmi_dev_vsync_close();
+  hdmi_dev.vsync_row = row;
+
+  // The interrupt fires at the start of each frame, so it's only useful for
+  // row zero. Everything else, including the simulated device, uses a timer.
+  if (hdmi_dev.sim == NULL && row == 0u) {
+    hdmi_dev.vsync_fd = open_uio();
+    if (hdmi_dev.vsync_fd != -1) {
+      hdmi_dev.vsync_mode = HDMI_VSYNC_UIO;
+      return true;
+    }
+  }
+  hdmi_dev.vsync_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (hdmi_dev.vsync_fd == -1)
+    return false;
+  hdmi_dev.vsync_mode = HDMI_VSYNC_TIMER;
+  arm_timer(hdmi_dev_coordinate());
+  return true;
+}
+
+void hdmi_dev_vsync_close(void) {
+  if (hdmi_dev.vsync_fd == -1)
+    return;
+  close(hdmi_dev.vsync_fd);
+  hdmi_dev.vsync_fd = -1;
+}
+
+int hdmi_dev_vsync_fd(void) { return hdmi_dev.vsync_fd; }
+
+hdmi_vsync_mode_t hdmi_dev_vsync_mode(void) { return hdmi_dev.vsync_mode; }
+
+hdmi_coordinate_t hdmi_dev_vsync_ack(void) {
+  // Consume whatever events are pending. The file descriptors are
+  // non-blocking, so this is fine even if there aren't any.
+  if (hdmi_dev.vsync_mode == HDMI_VSYNC_UIO) {
+    // UIO masks the interrupt each time it fires, so unmask it again
+    uint32_t count;
+    uint32_t enable = 1u;
+    ssize_t res = read(hdmi_dev.vsync_fd, &count, sizeof(count));
+    if (res == sizeof(count))
+      res = write(hdmi_dev.vsync_fd, &enable, sizeof(enable));
+    (void)res;
+    return hdmi_dev_coordinate();
+  }
+  uint64_t expirations;
+  ssize_t res = read(hdmi_dev.vsync_fd, &expirations, sizeof(expirations));
+  (void)res;
+
+  // The timer is re-armed from where the device actually is, so it can't drift
+  // away from the device's clock
+  hdmi_coordinate_t cur = hdmi_dev_coordinate();
+  arm_timer(cur);
+  return cur;
+}
+
+const char *hdmi_vsync_mode_name(hdmi_vsync_mode_t mode) {
+  switch (mode) {
+  case HDMI_VSYNC_UIO:
+    return "uio";
+  default:
+    return "timer";
+  }
 }
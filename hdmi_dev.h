@@ -20,8 +20,27 @@
 //! PL and the clocks will be in an undefined state, but no resources will be
 //! leaked.
 //!
+//! Flashing is skipped if the PL already has the same bitstream, as recorded
+//! by a checksum stamp written the last time it was flashed. The stamp lives in
+//! `/run`, so it doesn't survive a reboot. Use `hdmi_dev_set_force_program`
+//! to always flash. Either way, the clocks are configured and the peripheral
+//! is reset.
+//!
+//! This doesn't touch anything but the device, so it's safe to call while
+//! other threads set up the rest of the program.
+//!
 //! \return Whether initialization was successful
 bool hdmi_dev_open(void);
+//! \brief Initialize a simulated HDMI Peripheral instead of the real one
+//!
+//! This doesn't touch the PL, the clocks, or `/dev/mem`. Instead, register
+//! accesses go to a software model of the device that advances in real time.
+//! Everything else in this module behaves the same way, so the rest of the
+//! program can run on a machine without the hardware.
+//!
+//! \see hdmi_sim.h
+//! \return Whether initialization was successful
+bool hdmi_dev_open_sim(void);
 //! \brief Inverse of `hdmi_dev_open`
 //!
 //! This method frees all the host-side resources currently in use by the
@@ -49,6 +68,20 @@ void hdmi_dev_stop(void);
 //!        idle
 void hdmi_dev_stopnow(void);
 
+//! \brief Timing of the video signal generated by the HDMI Peripheral
+//!
+//! The device always outputs 640x480 at 60Hz. Including blanking, each frame is
+//! 800 columns by 525 rows, and one pixel is serialized per pixel clock.
+//!
+//! @{
+#define HDMI_FRAME_COLS 800u
+#define HDMI_FRAME_ROWS 525u
+#define HDMI_PIXEL_CLOCK_HZ 25200000u
+//! @}
+//! \brief Number of frames the device refreshes per second
+#define HDMI_REFRESH_HZ                                                        \
+  (HDMI_PIXEL_CLOCK_HZ / (HDMI_FRAME_COLS * HDMI_FRAME_ROWS))
+
 //! \brief Type for frame ids reported by the HDMI Peripheral
 //!
 //! These values are represented as `size_t`s, but they play by special rules.
@@ -74,6 +107,11 @@ static inline int_fast16_t hdmi_fid_delta(hdmi_fid_t final,
   return (d ^ m) - m;
 }
 
+//! \brief Computes the frame id `delta` frames after `fid`
+static inline hdmi_fid_t hdmi_fid_add(hdmi_fid_t fid, int_fast16_t delta) {
+  return (fid + (hdmi_fid_t)delta) & 0xfffu;
+}
+
 //! \brief Coordinates for pixels serialized by the HDMI Peripheral
 //!
 //! The device returns these coordinates to tell us where it is on the current
@@ -99,3 +137,127 @@ hdmi_coordinate_t hdmi_dev_coordinate(void);
 //! next frame. This will not flush the framebuffer from the cache, so make sure
 //! to do that first.
 void hdmi_dev_set_fb(hdmi_fb_handle_t *fb);
+
+//! \brief Get which framebuffer the simulated device is scanning out of
+//!
+//! The real device doesn't expose this, so it's only available when simulated.
+//! It's for checking that framebuffers are latched when we expect.
+//!
+//! \return The framebuffer's physical address, or zero if the device isn't
+//!         simulated
+//! \see hdmi_sim_scanout
+uint32_t hdmi_dev_sim_scanout(void);
+
+//! \brief Default safety margin for `hdmi_dev_wait`, in nanoseconds
+//!
+//! This is how long before the target we aim to wake up, leaving the rest to
+//! spinning. It has to cover the scheduler's wakeup latency. It's about six
+//! lines.
+#define HDMI_DEFAULT_WAIT_MARGIN_NS 200000u
+
+//! \brief Counters describing how well `hdmi_dev_wait` slept
+typedef struct hdmi_wait_stats_t {
+  //! \brief Number of calls to `hdmi_dev_wait`
+  size_t waits;
+  //! \brief Number of times it slept instead of just spinning
+  size_t sleeps;
+  //! \brief Number of times it woke up after the target had already passed
+  //! \details If this isn't zero, the margin is too small
+  size_t overslept;
+  //! \brief How much later than requested the sleeps ended, in nanoseconds
+  //! @{
+  uint64_t wake_late_ns_total;
+  uint64_t wake_late_ns_max;
+  //! @}
+  //! \brief Total time spent spinning on the coordinate, in nanoseconds
+  uint64_t spin_ns_total;
+} hdmi_wait_stats_t;
+
+//! \brief Set the safety margin used by `hdmi_dev_wait`
+//! \param[in] margin_ns How long before the target to stop sleeping
+void hdmi_dev_set_wait_margin(uint32_t margin_ns);
+
+//! \brief Wait until the HDMI Peripheral reaches a coordinate
+//!
+//! This returns once the device is serializing row `row` of frame `fid`, or
+//! anything after it. Since the device's timing is fixed, the time until then
+//! can be computed from the current coordinate. This sleeps until the safety
+//! margin before the target, then spins on the coordinate for the rest. That
+//! way, the CPU is free for nearly all of the wait, but we still return within
+//! a few microseconds of the target.
+//!
+//! The target must be less than 2048 frames away, as with `hdmi_fid_delta`. The
+//! device must be running.
+//!
+//! \return The first coordinate observed at or after the target
+hdmi_coordinate_t hdmi_dev_wait(hdmi_fid_t fid, uint_fast16_t row);
+
+//! \brief Get a snapshot of `hdmi_dev_wait`'s counters
+hdmi_wait_stats_t hdmi_dev_wait_stats(void);
+
+//! \brief Where vsync events come from
+typedef enum hdmi_vsync_mode_t {
+  //! \brief The HDMI Peripheral's frame start interrupt, through UIO
+  HDMI_VSYNC_UIO,
+  //! \brief A timer set from the device's coordinate
+  HDMI_VSYNC_TIMER,
+} hdmi_vsync_mode_t;
+
+//! \brief Start generating vsync events on a file descriptor
+//!
+//! The file descriptor becomes readable whenever the device reaches row `row`
+//! of a frame. It can be used with `poll`, `epoll`, or `select` alongside any
+//! other file descriptors, so a thread can sleep in the kernel until the next
+//! frame instead of reading the coordinate over and over.
+//!
+//! For row zero on the real device, the events come from the HDMI
+//! Peripheral's frame start interrupt, if the device tree exposes it through
+//! UIO. Otherwise, including with the simulated device, they're emulated with
+//! a timer. The timer is set from the coordinate, so the events follow the
+//! device, but they're subject to the scheduler's wakeup latency.
+//!
+//! The events are hints. Once the file descriptor is readable, call
+//! `hdmi_dev_vsync_ack`, and check the coordinate it returns. The device
+//! should be running, since the timer is only set correctly once it is. Any
+//! source already open is closed first.
+//!
+//! \param[in] row The row to signal on, in [0, `HDMI_FRAME_ROWS`)
+//! \return Whether the events could be set up
+bool hdmi_dev_vsync_open(uint_fast16_t row);
+//! \brief Inverse of `hdmi_dev_vsync_open`
+//! \details This is a no-op if there's no source open. `hdmi_dev_close` also
+//!          calls it.
+void hdmi_dev_vsync_close(void);
+
+//! \brief The file descriptor to wait on for vsync events, or `-1`
+//! \details Wait for it to be readable, but don't read it directly
+int hdmi_dev_vsync_fd(void);
+//! \brief Where the vsync events come from, if a source is open
+hdmi_vsync_mode_t hdmi_dev_vsync_mode(void);
+
+//! \brief Acknowledge any pending vsync events, and get ready for the next
+//!
+//! This never blocks, and is fine to call even if there weren't any events.
+//!
+//! \return The coordinate the device is at now
+hdmi_coordinate_t hdmi_dev_vsync_ack(void);
+
+//! \brief Human-readable name of a vsync mode
+const char *hdmi_vsync_mode_name(hdmi_vsync_mode_t mode);
+
+//! \brief How the last call to `hdmi_dev_open` went
+typedef struct hdmi_open_stats_t {
+  //! \brief Whether the PL was flashed, or it already had the bitstream
+  bool programmed;
+  //! \brief Time spent checking for and flashing the bitstream, in nanoseconds
+  uint64_t pl_ns;
+  //! \brief Time spent mapping the registers and configuring the clocks
+  uint64_t clocks_ns;
+} hdmi_open_stats_t;
+
+//! \brief Set whether `hdmi_dev_open` always flashes the PL
+//! \details This must be called before the device is opened
+void hdmi_dev_set_force_program(bool force);
+
+//! \brief Get how the last call to `hdmi_dev_open` went
+hdmi_open_stats_t hdmi_dev_open_stats(void);
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include "hdmi_fb.h"
 
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <libdrm/drm.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -16,6 +19,20 @@ static const char *const DEV_FILE =
 //! \brief Length of the buffer we allocate in bytes
 static const size_t BUF_SIZE = 640u * 480u * 4u;
 
+//! \brief Length of a row of the framebuffer in bytes
+static const size_t ROW_SIZE = 640u * 4u;
+
+//! \brief Largest gap between dirty ranges that we flush anyway
+//!
+//! Every sync ioctl costs a system call and a walk over the buffer. Syncing a
+//! few clean cache lines is cheaper than issuing another ioctl, so ranges that
+//! are this close are merged. This is one row of tiles.
+static const size_t FLUSH_MERGE_GAP = HDMI_FB_TILE_HEIGHT * 640u * 4u;
+
+//! \brief Where the fake physical addresses of simulated framebuffers start
+//! \details This is the start of DDR on the Zynq, just for realism
+static const intptr_t SIM_BASE_ADDRESS = 0x00100000;
+
 hdmi_fb_allocator_t *hdmi_fb_allocator_open(void) {
   // Try to allocate the return value
   hdmi_fb_allocator_t *ret = calloc(1u, sizeof(hdmi_fb_allocator_t));
@@ -31,6 +48,27 @@ hdmi_fb_allocator_t *hdmi_fb_allocator_open(void) {
   return ret;
 }
 
+hdmi_fb_allocator_t *hdmi_fb_allocator_open_sim(void) {
+  // There's no device file to open, so this can only fail on allocation
+  hdmi_fb_allocator_t *ret = calloc(1u, sizeof(hdmi_fb_allocator_t));
+  if (ret == NULL)
+    return NULL;
+  ret->fd = -1;
+  ret->sim = true;
+  ret->sim_next_address = SIM_BASE_ADDRESS;
+  return ret;
+}
+
+const char *hdmi_fb_mapping_name(hdmi_fb_mapping_t mapping) {
+  switch (mapping) {
+  case HDMI_FB_MAPPING_CACHED:
+    return "cached";
+  case HDMI_FB_MAPPING_WRITE_COMBINED:
+    return "wc";
+  }
+  return "unknown";
+}
+
 void hdmi_fb_allocator_close(hdmi_fb_allocator_t *alloc) {
   // Make sure this works even if `alloc` is only partially initialized
   if (alloc != NULL) {
@@ -40,71 +78,143 @@ void hdmi_fb_allocator_close(hdmi_fb_allocator_t *alloc) {
   }
 }
 
-hdmi_fb_handle_t *hdmi_fb_allocate(hdmi_fb_allocator_t *alloc) {
+//! \brief Round `x` up to a multiple of the page size
+static inline size_t page_align(size_t x) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (x + page - 1u) & ~(page - 1u);
+}
 
-  // Edge case handling
-  if (alloc == NULL)
-    return NULL;
+//! \brief Allocate and map a physically contiguous buffer object
+//!
+//! This is the common part of allocating single framebuffers and pools. On
+//! failure, whatever was acquired is still written to the outputs, so the
+//! caller can release it with `bo_release`.
+//!
+//! \param[in] size How many bytes to allocate
+//! \param[out] handle The GEM handle, or zero for simulated allocators
+//! \param[out] sim_fd The memory file, or `-1` for real allocators
+//! \param[out] physical_address Where the buffer is in physical memory
+//! \param[out] data The mapping of the buffer, or `MAP_FAILED`
+//! \return Whether everything succeeded
+static bool bo_create(hdmi_fb_allocator_t *alloc, size_t size,
+                      uint32_t *handle, int *sim_fd,
+                      intptr_t *physical_address, void **data) {
 
-  // Allocate space for the return value
-  hdmi_fb_handle_t *ret = calloc(1u, sizeof(hdmi_fb_handle_t));
-  if (ret == NULL)
-    return NULL;
-  // Initialize everything to a known state
-  ret->handle = 0;
-  ret->physical_address = ~0u;
-  ret->data = MAP_FAILED;
+  // Simulated allocators don't use DRM at all
+  if (alloc->sim) {
+    *sim_fd = memfd_create("hdmi_fb", MFD_CLOEXEC);
+    if (*sim_fd == -1)
+      return false;
+    if (ftruncate(*sim_fd, (off_t)size) == -1)
+      return false;
+    *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *sim_fd, 0);
+    if (*data == MAP_FAILED)
+      return false;
+    *physical_address = alloc->sim_next_address;
+    alloc->sim_next_address += (intptr_t)size;
+    return true;
+  }
 
   // Try to allocate the buffer object
   {
     // Arguments
+    // Without the cacheable flag, ZOCL maps CMA buffers write-combined. That's
+    // what we always used to ask for, but cached is the default now.
+    uint32_t flags = DRM_ZOCL_BO_FLAGS_CMA;
+    if (alloc->mapping == HDMI_FB_MAPPING_CACHED)
+      flags |= DRM_ZOCL_BO_FLAGS_CACHEABLE;
     struct drm_zocl_create_bo args = {
-        .size = BUF_SIZE,
-        .flags = DRM_ZOCL_BO_FLAGS_CMA,
+        .size = size,
+        .flags = flags,
     };
     // IOCTL call
     int res = ioctl(alloc->fd, DRM_IOCTL_ZOCL_CREATE_BO, &args);
     if (res == -1)
-      goto failure;
+      return false;
     // Exfiltrate data
-    ret->handle = args.handle;
+    *handle = args.handle;
   }
 
   // Try to get the physical address of the buffer object
   {
     // Arguments
     struct drm_zocl_info_bo args = {
-        .handle = ret->handle,
+        .handle = *handle,
     };
     // IOCTL call
     int res = ioctl(alloc->fd, DRM_IOCTL_ZOCL_INFO_BO, &args);
     if (res == -1)
-      goto failure;
+      return false;
     // Exfiltrate data. We only have 32-bit addresses, so we can ignore the
     // higher bits. Also take this opportunity to do sanity checking - we
     // should've gotten the size we asked for.
-    if (args.size != BUF_SIZE)
-      goto failure;
-    ret->physical_address = (intptr_t)args.paddr;
+    if (args.size != size)
+      return false;
+    *physical_address = (intptr_t)args.paddr;
   }
 
   // Finally, try to map the buffer into our address space
   {
     // Arguments
     struct drm_zocl_map_bo args = {
-        .handle = ret->handle,
+        .handle = *handle,
     };
     // IOCTL call
     int res = ioctl(alloc->fd, DRM_IOCTL_ZOCL_MAP_BO, &args);
     if (res == -1)
-      goto failure;
+      return false;
     // MMAP call
-    ret->data = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     alloc->fd, args.offset);
-    if (ret->data == MAP_FAILED)
-      goto failure;
+    *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, alloc->fd,
+                 args.offset);
+    if (*data == MAP_FAILED)
+      return false;
   }
 
+  return true;
+}
+
+//! \brief Inverse of `bo_create`
+//! \details This is tolerant of partially created buffer objects
+static void bo_release(hdmi_fb_allocator_t *alloc, uint32_t handle, int sim_fd,
+                       void *data, size_t size) {
+  // If we have data mapped, unmap it
+  if (data != MAP_FAILED)
+    munmap(data, size);
+  // Free the handle. It's a GEM object, so we just use the IOCTL to free those.
+  if (handle != 0) {
+    struct drm_gem_close args = {.handle = handle};
+    ioctl(alloc->fd, DRM_IOCTL_GEM_CLOSE, &args);
+  }
+  // Simulated framebuffers have a memory file instead
+  if (sim_fd != -1)
+    close(sim_fd);
+}
+
+hdmi_fb_handle_t *hdmi_fb_allocate(hdmi_fb_allocator_t *alloc) {
+
+  // Edge case handling
+  if (alloc == NULL)
+    return NULL;
+
+  // Allocate space for the return value
+  hdmi_fb_handle_t *ret = calloc(1u, sizeof(hdmi_fb_handle_t));
+  if (ret == NULL)
+    return NULL;
+  // Initialize everything to a known state
+  ret->handle = 0;
+  ret->sim_fd = -1;
+  ret->physical_address = ~0u;
+  ret->data = MAP_FAILED;
+  ret->mapping = alloc->mapping;
+
+  // Get a buffer object of our own
+  void *data = MAP_FAILED;
+  bool ok = bo_create(alloc, BUF_SIZE, &ret->handle, &ret->sim_fd,
+                      &ret->physical_address, &data);
+  ret->data = data;
+  if (!ok)
+    goto failure;
+
   // Done
   return ret;
 
@@ -121,43 +231,287 @@ void hdmi_fb_free(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb) {
   // Edge case handling
   if (alloc == NULL || fb == NULL)
     return;
+  // Framebuffers in a pool are freed along with it
+  if (fb->pooled)
+    return;
 
-  // If we have data mapped, unmap it. Again, we're casting away volatile, but
-  // that's fine since we're freeing the buffer.
-  if (fb->data != MAP_FAILED)
-    munmap((void *)fb->data, BUF_SIZE);
+  // Release the buffer object. Again, we're casting away volatile, but that's
+  // fine since we're freeing the buffer. The physical address is only for our
+  // bookkeeping and doesn't have any resources attached to it.
+  bo_release(alloc, fb->handle, fb->sim_fd, (void *)fb->data, BUF_SIZE);
 
-  // The physical address is only for our bookkeeping and doesn't have any
-  // resources attached to it.
+  // The pointer itself is allocated on the heap, so free it
+  free(fb);
+}
 
-  // Free the handle. It's a GEM object, so we just use the IOCTL to free those.
-  if (fb->handle != 0) {
-    struct drm_gem_close args = {.handle = fb->handle};
-    ioctl(alloc->fd, DRM_IOCTL_GEM_CLOSE, &args);
+hdmi_fb_pool_t *hdmi_fb_pool_allocate(hdmi_fb_allocator_t *alloc,
+                                      size_t count) {
+
+  // Edge case handling
+  if (alloc == NULL || count == 0u || count > HDMI_FB_POOL_MAX)
+    return NULL;
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  hdmi_fb_pool_t *ret = calloc(1u, sizeof(hdmi_fb_pool_t));
+  if (ret == NULL)
+    return NULL;
+  ret->sim_fd = -1;
+  ret->physical_address = ~0u;
+  ret->data = MAP_FAILED;
+  ret->mapping = alloc->mapping;
+  ret->count = count;
+  ret->stride = page_align(BUF_SIZE);
+  ret->size = ret->stride * count;
+
+  // Get one buffer object for all the framebuffers
+  void *data = MAP_FAILED;
+  bool ok = bo_create(alloc, ret->size, &ret->handle, &ret->sim_fd,
+                      &ret->physical_address, &data);
+  ret->data = data;
+  if (!ok)
+    goto failure;
+
+  // Carve it up. Each framebuffer shares the buffer object's handle, so the
+  // usual flushing functions work on them, but they sync at their own offset.
+  for (size_t i = 0u; i < count; i++) {
+    hdmi_fb_handle_t *fb = &ret->fbs[i];
+    size_t offset = i * ret->stride;
+    fb->handle = ret->handle;
+    fb->sim_fd = ret->sim_fd;
+    fb->physical_address = ret->physical_address + (intptr_t)offset;
+    fb->data = (volatile uint32_t *)((uint8_t *)data + offset);
+    fb->offset = offset;
+    fb->pooled = true;
+    fb->mapping = ret->mapping;
   }
 
-  // The pointer itself is allocated on the heap, so free it
-  free(fb);
+  return ret;
+
+failure:
+  hdmi_fb_pool_free(alloc, ret);
+  return NULL;
 }
 
-void hdmi_fb_flush(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb) {
+void hdmi_fb_pool_free(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool) {
+  // Edge case handling
+  if (alloc == NULL || pool == NULL)
+    return;
+  bo_release(alloc, pool->handle, pool->sim_fd, (void *)pool->data,
+             pool->size);
+  free(pool);
+}
+
+//! \brief Export a buffer object as a file descriptor
+//! \details See `hdmi_fb_export`
+static int bo_export(hdmi_fb_allocator_t *alloc, uint32_t handle, int sim_fd) {
+  // Simulated buffer objects are already files, so just hand out another
+  // reference to the same memory
+  if (alloc->sim)
+    return sim_fd == -1 ? -1 : fcntl(sim_fd, F_DUPFD_CLOEXEC, 0);
+  if (alloc->fd == -1 || handle == 0)
+    return -1;
+  // Arguments
+  struct drm_prime_handle args = {
+      .handle = handle,
+      .flags = DRM_CLOEXEC | DRM_RDWR,
+      .fd = -1,
+  };
+  // IOCTL call
+  int res = ioctl(alloc->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args);
+  if (res == -1)
+    return -1;
+  return args.fd;
+}
 
+int hdmi_fb_export(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb) {
   // Edge case handling
   if (alloc == NULL || fb == NULL)
-    return;
-  // Check to make sure we have a valid file descriptor and a valid handle.
-  // There shouldn't be a way to get here without that, but better safe than
-  // sorry.
-  if (alloc->fd == -1 || fb->handle == 0)
-    return;
+    return -1;
+  return bo_export(alloc, fb->handle, fb->sim_fd);
+}
 
+int hdmi_fb_pool_export(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool) {
+  // Edge case handling
+  if (alloc == NULL || pool == NULL)
+    return -1;
+  return bo_export(alloc, pool->handle, pool->sim_fd);
+}
+
+//! \brief Sync one byte range of a framebuffer to the device
+//! \details This also updates the allocator's statistics
+static void sync_range(hdmi_fb_allocator_t *alloc, uint32_t handle,
+                       size_t offset, size_t size) {
+  atomic_fetch_add_explicit(&alloc->stats.ioctls, 1u, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc->stats.bytes, size, memory_order_relaxed);
+  // Simulated framebuffers are in ordinary memory, so there's nothing to do
+  if (alloc->sim)
+    return;
   // Arguments
   struct drm_zocl_sync_bo args = {
-      .handle = fb->handle,
+      .handle = handle,
       .dir = DRM_ZOCL_SYNC_BO_TO_DEVICE,
-      .offset = 0u,
-      .size = BUF_SIZE,
+      .offset = offset,
+      .size = size,
   };
   // IOCTL call
   ioctl(alloc->fd, DRM_IOCTL_ZOCL_SYNC_BO, &args);
 }
+
+//! \brief Wait for writes to write-combined memory to reach it
+//!
+//! There's nothing in the cache to flush, but writes can still be sitting in
+//! the write buffer. The sync ioctl would have waited for them, so we have to
+//! do it ourselves before the device is told to read the framebuffer.
+static void drain_writes(void) {
+#if defined(__arm__) || defined(__aarch64__)
+  __asm__ volatile("dsb st" ::: "memory");
+#else
+  atomic_thread_fence(memory_order_seq_cst);
+#endif
+}
+
+void hdmi_fb_flush(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb) {
+
+  // Edge case handling
+  if (alloc == NULL || fb == NULL)
+    return;
+  // Check to make sure we have a valid file descriptor and a valid handle.
+  // There shouldn't be a way to get here without that, but better safe than
+  // sorry.
+  if (!alloc->sim && (alloc->fd == -1 || fb->handle == 0))
+    return;
+
+  atomic_fetch_add_explicit(&alloc->stats.flushes, 1u, memory_order_relaxed);
+  if (fb->mapping == HDMI_FB_MAPPING_WRITE_COMBINED)
+    drain_writes();
+  else
+    sync_range(alloc, fb->handle, fb->offset, BUF_SIZE);
+  memset(&fb->dirty, 0, sizeof(fb->dirty));
+  fb->synced = true;
+}
+
+//! \brief Sync the dirty tiles in tile rows [`tile_begin`, `tile_end`)
+//!
+//! Each row of tiles becomes one range, from the first dirty tile on its top
+//! row to the last dirty tile on its bottom row. That covers some clean tiles
+//! in between, but it's only one ioctl. Neighbouring ranges are merged if the
+//! gap between them is small. The dirty bits of those rows are cleared.
+static void sync_dirty_rows(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb,
+                            size_t tile_begin, size_t tile_end) {
+  bool pending = false;
+  size_t begin = 0u;
+  size_t end = 0u;
+  for (size_t tr = tile_begin; tr < tile_end; tr++) {
+    uint32_t mask = fb->dirty.rows[tr];
+    if (mask == 0u)
+      continue;
+    fb->dirty.rows[tr] = 0u;
+    size_t first = (size_t)__builtin_ctz(mask);
+    size_t last = 31u - (size_t)__builtin_clz(mask);
+    size_t top = tr * HDMI_FB_TILE_HEIGHT;
+    size_t bottom = top + HDMI_FB_TILE_HEIGHT - 1u;
+    size_t b = top * ROW_SIZE + first * HDMI_FB_TILE_WIDTH * 4u;
+    size_t e = bottom * ROW_SIZE + (last + 1u) * HDMI_FB_TILE_WIDTH * 4u;
+    if (pending && b - end <= FLUSH_MERGE_GAP) {
+      end = e;
+      continue;
+    }
+    if (pending)
+      sync_range(alloc, fb->handle, fb->offset + begin, end - begin);
+    pending = true;
+    begin = b;
+    end = e;
+  }
+  if (pending)
+    sync_range(alloc, fb->handle, fb->offset + begin, end - begin);
+}
+
+void hdmi_fb_flush_dirty(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb) {
+
+  // Edge case handling
+  if (alloc == NULL || fb == NULL)
+    return;
+  if (!alloc->sim && (alloc->fd == -1 || fb->handle == 0))
+    return;
+  // We can't trust the bitmap until the device has seen the whole buffer.
+  // Write-combined buffers don't need the bitmap at all.
+  if (!fb->synced || fb->mapping == HDMI_FB_MAPPING_WRITE_COMBINED) {
+    hdmi_fb_flush(alloc, fb);
+    return;
+  }
+
+  atomic_fetch_add_explicit(&alloc->stats.flushes, 1u, memory_order_relaxed);
+  sync_dirty_rows(alloc, fb, 0u, HDMI_FB_TILE_ROWS);
+}
+
+void hdmi_fb_flush_band(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb,
+                        size_t tile_begin, size_t tile_end) {
+
+  // Edge case handling
+  if (alloc == NULL || fb == NULL)
+    return;
+  if (!alloc->sim && (alloc->fd == -1 || fb->handle == 0))
+    return;
+  if (tile_end > HDMI_FB_TILE_ROWS)
+    tile_end = HDMI_FB_TILE_ROWS;
+  // Write-combined buffers only have to wait for the band's writes. Their
+  // dirty tiles are left for `hdmi_fb_flush_dirty`, which ignores them.
+  if (fb->mapping == HDMI_FB_MAPPING_WRITE_COMBINED) {
+    drain_writes();
+    return;
+  }
+  sync_dirty_rows(alloc, fb, tile_begin, tile_end);
+}
+
+void hdmi_fb_pool_flush(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool,
+                        uint64_t mask) {
+
+  // Edge case handling
+  if (alloc == NULL || pool == NULL)
+    return;
+  if (!alloc->sim && (alloc->fd == -1 || pool->handle == 0))
+    return;
+
+  // Framebuffers next to each other in the buffer object are synced with one
+  // ioctl, so look for runs of them. Write-combined pools don't need any.
+  atomic_fetch_add_explicit(&alloc->stats.flushes, 1u, memory_order_relaxed);
+  if (pool->mapping == HDMI_FB_MAPPING_WRITE_COMBINED)
+    drain_writes();
+  size_t i = 0u;
+  while (i < pool->count) {
+    if ((mask >> i & 1u) == 0u) {
+      i++;
+      continue;
+    }
+    size_t first = i;
+    for (; i < pool->count && (mask >> i & 1u) != 0u; i++) {
+      memset(&pool->fbs[i].dirty, 0, sizeof(pool->fbs[i].dirty));
+      pool->fbs[i].synced = true;
+    }
+    size_t begin = first * pool->stride;
+    size_t end = (i - 1u) * pool->stride + BUF_SIZE;
+    if (pool->mapping != HDMI_FB_MAPPING_WRITE_COMBINED)
+      sync_range(alloc, pool->handle, begin, end - begin);
+  }
+}
+
+void hdmi_fb_dirty_all(hdmi_fb_dirty_t *dirty) {
+  for (size_t tr = 0u; tr < HDMI_FB_TILE_ROWS; tr++)
+    dirty->rows[tr] = (UINT32_C(1) << HDMI_FB_TILE_COLS) - 1u;
+}
+
+void hdmi_fb_store_row(hdmi_fb_dirty_t *dirty, uint32_t *data, size_t row,
+                       const uint32_t *src) {
+  uint32_t *dst = data + row * 640u;
+  uint32_t mask = 0u;
+  for (size_t t = 0u; t < HDMI_FB_TILE_COLS; t++) {
+    size_t x = t * HDMI_FB_TILE_WIDTH;
+    size_t n = HDMI_FB_TILE_WIDTH * sizeof(uint32_t);
+    if (memcmp(dst + x, src + x, n) != 0) {
+      memcpy(dst + x, src + x, n);
+      mask |= UINT32_C(1) << t;
+    }
+  }
+  dirty->rows[row / HDMI_FB_TILE_HEIGHT] |= mask;
+}
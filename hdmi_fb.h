@@ -8,23 +8,105 @@
 
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+//! \brief Dimensions of the tiles used to track which parts of a framebuffer
+//!        changed
+//!
+//! A tile is 32 pixels wide, which is four cache lines on the Cortex-A9, and
+//! 16 rows tall. There are 20 tiles across a framebuffer and 30 down.
+//! @{
+#define HDMI_FB_TILE_WIDTH 32u
+#define HDMI_FB_TILE_HEIGHT 16u
+#define HDMI_FB_TILE_COLS (640u / HDMI_FB_TILE_WIDTH)
+#define HDMI_FB_TILE_ROWS (480u / HDMI_FB_TILE_HEIGHT)
+//! @}
+
+//! \brief Which tiles of a framebuffer changed since it was last flushed
+//!
+//! There's one word per row of tiles, and bit `i` of that word is set if the
+//! `i`-th tile from the left is dirty. Each row of tiles can be updated by a
+//! different thread.
+typedef struct hdmi_fb_dirty_t {
+  uint32_t rows[HDMI_FB_TILE_ROWS];
+} hdmi_fb_dirty_t;
+
+//! \brief How framebuffers are mapped into our address space
+//!
+//! Which one is faster depends on the board and on the access pattern, so it
+//! can be chosen at runtime. `bench/bench-fb` measures both.
+typedef enum hdmi_fb_mapping_t {
+  //! \brief Cached, so writes are fast but have to be flushed
+  HDMI_FB_MAPPING_CACHED,
+  //! \brief Write-combined, so flushing is a no-op
+  //!
+  //! Writes bypass the cache, and are merged in a small buffer on their way to
+  //! memory. Sequential writes are nearly as fast as cached ones, but reads are
+  //! very slow, so framebuffers mapped like this shouldn't be compared against
+  //! with `hdmi_fb_store_row`.
+  HDMI_FB_MAPPING_WRITE_COMBINED,
+} hdmi_fb_mapping_t;
+
+//! \brief Counters for how much of the framebuffers have been flushed
+//! \details These are atomic, since bands can be flushed from any thread
+typedef struct hdmi_fb_flush_stats_t {
+  //! \brief Number of calls to flush a framebuffer
+  //! \details Flushing a band doesn't count, only a whole framebuffer
+  atomic_size_t flushes;
+  //! \brief Number of sync ioctls issued
+  atomic_size_t ioctls;
+  //! \brief Total number of bytes synced
+  atomic_uint_fast64_t bytes;
+} hdmi_fb_flush_stats_t;
+
 //! \brief An object that can be used to allocate framebuffers
 //!
 //! In order to allocate a framebuffer, we first open the device file, then do
 //! ioctls on it to do the allocation. This structure saves the file descriptor
 //! from the call to `open`. That file descriptor is used during the actual
 //! allocations.
+//!
+//! An allocator can also be simulated, in which case it doesn't have a device
+//! file at all. Framebuffers are then backed by anonymous shared memory, which
+//! lets the program run on machines without the ZOCL driver.
 typedef struct hdmi_fb_allocator_t {
   int fd;
+  //! \brief Whether framebuffers come from `memfd_create` instead of DRM
+  bool sim;
+  //! \brief Fake physical address to give the next simulated framebuffer
+  intptr_t sim_next_address;
+  //! \brief How framebuffers allocated from now on are mapped
+  //!
+  //! This defaults to `HDMI_FB_MAPPING_CACHED`. Before there was a choice,
+  //! framebuffers were always plain CMA buffer objects, which ZOCL maps
+  //! write-combined. Flushing only what changed and comparing against what's
+  //! already in the framebuffer only pay off when it's cached, so that's the
+  //! default now.
+  hdmi_fb_mapping_t mapping;
+  //! \brief How much has been flushed through this allocator
+  //!
+  //! Simulated framebuffers count as well, even though flushing them does
+  //! nothing, so the savings from partial flushes can be measured anywhere.
+  hdmi_fb_flush_stats_t stats;
 } hdmi_fb_allocator_t;
 
 //! \brief Create an `hdmi_fb_allocator_t`
 //! \return A pointer to the allocator on the heap, or `NULL` on failure
 hdmi_fb_allocator_t *hdmi_fb_allocator_open(void);
+//! \brief Create a simulated `hdmi_fb_allocator_t`
+//!
+//! Framebuffers from this allocator live in ordinary memory, and flushing them
+//! is a no-op. Their physical addresses are made up, but they are distinct, so
+//! they can be used to tell framebuffers apart in a simulated HDMI Peripheral.
+//!
+//! \see hdmi_dev_open_sim
+//! \return A pointer to the allocator on the heap, or `NULL` on failure
+hdmi_fb_allocator_t *hdmi_fb_allocator_open_sim(void);
+//! \brief Get the name of a mapping mode, as accepted on the command line
+const char *hdmi_fb_mapping_name(hdmi_fb_mapping_t mapping);
 //! \brief Close an `hdmi_fb_allocator_t`
 //!
 //! This is a `free` operation - don't use `alloc` after this. However, it is
@@ -38,13 +120,68 @@ void hdmi_fb_allocator_close(hdmi_fb_allocator_t *alloc);
 //! the buffer. These framebuffers should be freed with the same allocator used
 //! to create them.
 //!
+//! Simulated framebuffers don't have a GEM handle. Instead, they hold the file
+//! descriptor of the memory backing them. That field is `-1` for real ones.
+//!
+//! Framebuffers also track which of their tiles were written since they were
+//! last flushed, so only those have to be synced to the device.
+//!
+//! Framebuffers carved from a pool share the pool's GEM handle or memory file,
+//! and sit at `offset` bytes into its buffer object. They're freed with the
+//! pool.
+//!
 //! \see hdmi_fb_ptr
+//! \see hdmi_fb_pool_t
 typedef struct hdmi_fb_handle_t {
   uint32_t handle;
+  int sim_fd;
   intptr_t physical_address;
   volatile uint32_t *volatile data;
+  //! \brief Tiles written since the last flush
+  hdmi_fb_dirty_t dirty;
+  //! \brief Whether the framebuffer has been flushed in full at least once
+  //! \details Until then, we don't know what the device would see
+  bool synced;
+  //! \brief Offset of the framebuffer in its buffer object, in bytes
+  size_t offset;
+  //! \brief Whether the framebuffer belongs to an `hdmi_fb_pool_t`
+  bool pooled;
+  //! \brief How the framebuffer is mapped
+  hdmi_fb_mapping_t mapping;
 } hdmi_fb_handle_t;
 
+//! \brief Maximum number of framebuffers in a pool
+#define HDMI_FB_POOL_MAX 64u
+
+//! \brief Several framebuffers in one buffer object
+//!
+//! Allocating a framebuffer on its own takes three ioctls and a mapping, and
+//! each one is a separate CMA allocation. With a deep ring, that fragments CMA
+//! and slows down startup. A pool instead allocates a single buffer object
+//! holding every framebuffer, and maps it once. The framebuffers are laid out
+//! one after the other on page boundaries, each with its own physical address.
+//!
+//! The framebuffers in `fbs` work with every other function in this module,
+//! except that `hdmi_fb_free` is a no-op on them.
+typedef struct hdmi_fb_pool_t {
+  //! \brief The buffer object, as for `hdmi_fb_handle_t`
+  //! @{
+  uint32_t handle;
+  int sim_fd;
+  intptr_t physical_address;
+  volatile uint8_t *volatile data;
+  hdmi_fb_mapping_t mapping;
+  //! @}
+  //! \brief Size of the whole buffer object in bytes
+  size_t size;
+  //! \brief Distance between the starts of consecutive framebuffers in bytes
+  size_t stride;
+  //! \brief Number of framebuffers in the pool
+  size_t count;
+  //! \brief The framebuffers, of which the first `count` are valid
+  hdmi_fb_handle_t fbs[HDMI_FB_POOL_MAX];
+} hdmi_fb_pool_t;
+
 //! \brief Get a pointer to the framebuffer's data
 static inline uint32_t *hdmi_fb_data(hdmi_fb_handle_t *fb) {
   if (fb == NULL)
@@ -70,10 +207,99 @@ hdmi_fb_handle_t *hdmi_fb_allocate(hdmi_fb_allocator_t *alloc);
 //! a no-op.
 void hdmi_fb_free(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb);
 
+//! \brief Allocate a pool of framebuffers with an allocator
+//!
+//! It is legal for the `alloc` parameter to be `NULL`. In that case, allocation
+//! always fails and returns `NULL`.
+//!
+//! \param[in] alloc The allocator to use
+//! \param[in] count How many framebuffers to allocate, at most
+//!                  `HDMI_FB_POOL_MAX`
+//! \return An `hdmi_fb_pool_t` on the heap, or `NULL` on failure
+hdmi_fb_pool_t *hdmi_fb_pool_allocate(hdmi_fb_allocator_t *alloc,
+                                      size_t count);
+//! \brief Free a pool, along with all of its framebuffers
+//!
+//! As with `hdmi_fb_free`, the pool should not be used after this, and this is
+//! a no-op if either parameter is `NULL`.
+void hdmi_fb_pool_free(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool);
+
+//! \brief Export a framebuffer's memory, so other processes can map it
+//!
+//! For real framebuffers, this is a dma-buf, from
+//! `DRM_IOCTL_PRIME_HANDLE_TO_FD`. Simulated ones get another descriptor for
+//! their memory file. Either way, mapping it with `MAP_SHARED` gives the very
+//! memory the device reads. The descriptor covers the framebuffer's whole
+//! buffer object, so for pooled framebuffers, the pixels start `fb->offset`
+//! bytes into it.
+//!
+//! Writes through other mappings still have to be flushed from the cache with
+//! this process's flushing functions before the framebuffer is shown.
+//!
+//! \return A new close-on-exec file descriptor owned by the caller, or `-1` on
+//!         failure, including if either parameter is `NULL`
+int hdmi_fb_export(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb);
+//! \brief Export a whole pool's buffer object, as for `hdmi_fb_export`
+//! \details Framebuffer `i` starts `i * pool->stride` bytes into it
+int hdmi_fb_pool_export(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool);
+
 //! \brief Flush a framebuffer's contents from the cache
 //!
 //! This must be called before giving the framebuffer to the HDMI Peripheral.
-//! Otherwise, the device will read stale data.
+//! Otherwise, the device will read stale data. The whole framebuffer is
+//! flushed, and its dirty tiles are cleared. For write-combined framebuffers,
+//! this only waits for outstanding writes to reach memory.
 //!
 //! This function is a no-op if `fb` or `alloc` is `NULL`.
 void hdmi_fb_flush(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb);
+//! \brief Flush only the dirty tiles of a framebuffer from the cache
+//!
+//! This is like `hdmi_fb_flush`, but it only syncs the parts of the
+//! framebuffer covering the tiles in `fb->dirty`. Dirty tiles are merged into
+//! contiguous byte ranges, and ranges separated by small gaps are merged too,
+//! since each ioctl has a fixed cost. The first flush of a framebuffer is
+//! always a full one.
+//!
+//! This function is a no-op if `fb` or `alloc` is `NULL`.
+void hdmi_fb_flush_dirty(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb);
+//! \brief Flush the dirty tiles in some rows of tiles from the cache
+//!
+//! This is like `hdmi_fb_flush_dirty`, but only for tile rows [`tile_begin`,
+//! `tile_end`), so a band of the framebuffer can be flushed as soon as it's
+//! written, while the rest is still being written. Only the dirty bits of
+//! those rows are touched, so different threads can flush different bands of
+//! the same framebuffer at once. For write-combined framebuffers, this only
+//! waits for outstanding writes to reach memory.
+//!
+//! The framebuffer still has to go through `hdmi_fb_flush_dirty` before it's
+//! shown. If every band was flushed, that only counts the flush, except for
+//! the first flush of a framebuffer, which is always a full one.
+//!
+//! This function is a no-op if `fb` or `alloc` is `NULL`.
+void hdmi_fb_flush_band(hdmi_fb_allocator_t *alloc, hdmi_fb_handle_t *fb,
+                        size_t tile_begin, size_t tile_end);
+
+//! \brief Flush several framebuffers in a pool from the cache
+//!
+//! Bit `i` of `mask` selects `pool->fbs[i]`. Each selected framebuffer is
+//! flushed in full, as with `hdmi_fb_flush`, but neighbouring framebuffers are
+//! synced with a single ioctl.
+//!
+//! This function is a no-op if `pool` or `alloc` is `NULL`.
+void hdmi_fb_pool_flush(hdmi_fb_allocator_t *alloc, hdmi_fb_pool_t *pool,
+                        uint64_t mask);
+
+//! \brief Mark every tile in the bitmap as dirty
+void hdmi_fb_dirty_all(hdmi_fb_dirty_t *dirty);
+//! \brief Write one row of pixels, only touching the tiles that changed
+//!
+//! Each tile-wide segment of `src` is compared against what the framebuffer
+//! holds. Only the segments that differ are written, and their tiles are marked
+//! in `dirty`. Writing a row never clears any bits.
+//!
+//! \param[inout] dirty The bitmap to mark changed tiles in
+//! \param[inout] data The framebuffer's pixels
+//! \param[in] row Which row to write
+//! \param[in] src The new contents of the row, 640 pixels
+void hdmi_fb_store_row(hdmi_fb_dirty_t *dirty, uint32_t *data, size_t row,
+                       const uint32_t *src);
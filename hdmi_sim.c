@@ -0,0 +1,120 @@
+#include "hdmi_sim.h"
+
+#include "hdmi_dev.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+//! \brief Number of pixels serialized per frame, including blanking
+static const uint64_t FRAME_PIXELS =
+    (uint64_t)HDMI_FRAME_COLS * HDMI_FRAME_ROWS;
+
+//! \brief Current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//! \brief Pack a pixel index into the coordinate register's format
+static uint32_t pack_coord(uint64_t pixel) {
+  uint64_t frame = pixel / FRAME_PIXELS;
+  uint64_t within = pixel % FRAME_PIXELS;
+  uint32_t fid = (uint32_t)(frame & 0xfffu);
+  uint32_t row = (uint32_t)(within / HDMI_FRAME_COLS);
+  uint32_t col = (uint32_t)(within % HDMI_FRAME_COLS);
+  return (fid << 20) | (row << 10) | col;
+}
+
+//! \brief Advance the model to the current time
+//!
+//! This handles the transition to idle after a stop was requested.
+//!
+//! \return The index of the pixel currently being serialized, counting from
+//!         when the device was started
+static uint64_t update(hdmi_sim_t *sim) {
+  if (!sim->running)
+    return 0u;
+  // Split the elapsed time into seconds and nanoseconds so the multiplication
+  // doesn't overflow for long-running playback
+  uint64_t elapsed = now_ns() - sim->start_ns;
+  uint64_t pixel = (elapsed / 1000000000ull) * HDMI_PIXEL_CLOCK_HZ +
+                   (elapsed % 1000000000ull) * HDMI_PIXEL_CLOCK_HZ /
+                       1000000000ull;
+  if (sim->stopping && pixel >= sim->stop_pixel) {
+    // The frame in progress when we were stopped has finished. Freeze the
+    // coordinate on the last pixel of that frame.
+    sim->running = false;
+    sim->stopping = false;
+    sim->idle_coord = pack_coord(sim->stop_pixel - 1u);
+    return sim->stop_pixel - 1u;
+  }
+  return pixel;
+}
+
+hdmi_sim_t *hdmi_sim_open(void) {
+  // Everything starts zeroed, which is the idle state
+  return calloc(1u, sizeof(hdmi_sim_t));
+}
+
+void hdmi_sim_close(hdmi_sim_t *sim) { free(sim); }
+
+uint32_t hdmi_sim_read(hdmi_sim_t *sim, size_t offset) {
+  uint64_t pixel = update(sim);
+  switch (offset) {
+  case 0x00u:
+    // Report the idle bit. We don't model any of the other status bits.
+    return sim->running ? (sim->stopping ? 0x00u : 0x81u) : 0x04u;
+  case 0x10u:
+    return sim->fb_pending;
+  case 0x18u:
+    return sim->running ? pack_coord(pixel) : sim->idle_coord;
+  case 0x1cu: {
+    // Clear on read. The coordinate is valid if it moved since we last looked.
+    bool valid = sim->running && pixel != sim->valid_pixel;
+    sim->valid_pixel = pixel;
+    return valid ? 1u : 0u;
+  }
+  default:
+    return 0u;
+  }
+}
+
+void hdmi_sim_write(hdmi_sim_t *sim, size_t offset, uint32_t value) {
+  uint64_t pixel = update(sim);
+  switch (offset) {
+  case 0x00u:
+    if ((value & 0x01u) != 0u && !sim->running) {
+      // Start scanning from the top-left. Make sure the next read of the valid
+      // register reports that we're running.
+      sim->running = true;
+      sim->stopping = false;
+      sim->start_ns = now_ns();
+      sim->valid_pixel = ~0ull;
+      sim->fb_active = sim->fb_pending;
+      sim->fb_pending_frame = 0u;
+    } else if ((value & 0x01u) == 0u && sim->running && !sim->stopping) {
+      // Finish the current frame, then go idle
+      sim->stopping = true;
+      sim->stop_pixel = (pixel / FRAME_PIXELS + 1u) * FRAME_PIXELS;
+    }
+    break;
+  case 0x10u: {
+    // If the previous value has been latched by now, it becomes the active
+    // framebuffer. The new value gets latched at the start of the next frame.
+    uint64_t frame = pixel / FRAME_PIXELS;
+    if (frame > sim->fb_pending_frame)
+      sim->fb_active = sim->fb_pending;
+    sim->fb_pending = value;
+    sim->fb_pending_frame = frame;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+uint32_t hdmi_sim_scanout(hdmi_sim_t *sim) {
+  uint64_t frame = update(sim) / FRAME_PIXELS;
+  return frame > sim->fb_pending_frame ? sim->fb_pending : sim->fb_active;
+}
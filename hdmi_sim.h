@@ -0,0 +1,68 @@
+//! \file hdmi_sim.h
+//! \brief Software model of the HDMI Peripheral's registers
+//!
+//! This lets the rest of the program run without a Zynq. Instead of reading and
+//! writing device memory, `hdmi_dev` forwards register accesses here, and this
+//! module computes what the hardware would have returned. The scan position is
+//! derived from the monotonic clock, so the model advances in real time just
+//! like the device would.
+//!
+//! Only the registers we actually use are modeled:
+//! * `0x00`: control. Writing `0x81` starts continuous mode, and writing `0x00`
+//!   stops the device at the end of the current frame. Bit 2 reads as one when
+//!   the device is idle.
+//! * `0x10`: framebuffer address. The value is latched at the start of each
+//!   frame.
+//! * `0x18`: current coordinate, packed as `fid[31:20] row[19:10] col[9:0]`.
+//! * `0x1c`: coordinate valid. Bit 0 is set once the coordinate has advanced,
+//!   and it is cleared on read.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief State of the simulated peripheral
+typedef struct hdmi_sim_t {
+  //! \brief Whether the device has been started and hasn't gone idle since
+  bool running;
+  //! \brief Whether a stop was requested while running
+  bool stopping;
+  //! \brief Monotonic time the device was started at, in nanoseconds
+  uint64_t start_ns;
+  //! \brief Pixel index at which the device goes idle, if `stopping`
+  uint64_t stop_pixel;
+  //! \brief Pixel index observed by the last read of the valid register
+  uint64_t valid_pixel;
+  //! \brief Coordinate to report while idle
+  uint32_t idle_coord;
+
+  //! \brief Last value written to the framebuffer address register
+  uint32_t fb_pending;
+  //! \brief Frame during which `fb_pending` was written
+  uint64_t fb_pending_frame;
+  //! \brief Framebuffer address latched for the previous frame
+  uint32_t fb_active;
+} hdmi_sim_t;
+
+//! \brief Create a simulated peripheral in the idle state
+//! \return A pointer to the model on the heap, or `NULL` on failure
+hdmi_sim_t *hdmi_sim_open(void);
+//! \brief Inverse of `hdmi_sim_open`
+//! \details It is legal to close a `NULL` model
+void hdmi_sim_close(hdmi_sim_t *sim);
+
+//! \brief Read a register from the model
+//! \param[in] offset Byte offset of the register, which must be word-aligned
+uint32_t hdmi_sim_read(hdmi_sim_t *sim, size_t offset);
+//! \brief Write a register in the model
+//! \param[in] offset Byte offset of the register, which must be word-aligned
+void hdmi_sim_write(hdmi_sim_t *sim, size_t offset, uint32_t value);
+
+//! \brief Framebuffer address the model is currently scanning out of
+//!
+//! This is the hardware's internal state, which isn't visible through the
+//! registers. It's useful for checking that frames were presented when we
+//! expected.
+uint32_t hdmi_sim_scanout(hdmi_sim_t *sim);
@@ -1,27 +1,149 @@
+#include "convert.h"
 #include "hdmi_dev.h"
 #include "hdmi_fb.h"
+#include "pack.h"
+#include "player.h"
+#include "playlist.h"
+#include "racer.h"
+#include "raw.h"
+#include "reader.h"
+#include "share.h"
+#include "telemetry.h"
 #include "video.h"
 
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+//! \brief Default number of framebuffers in the ring
+static const size_t DEFAULT_DEPTH = 4u;
+
 //! \brief Print the usage and exit
 //! \details Exits with code 1
 __attribute__((noreturn)) void usage(void) {
   const char *const USAGE =
-      "Usage: hdmi-dev-video-player [VIDEO] [FDIV]\n"
-      "Plays the video file specified by [VIDEO] using the HDMI Peripheral\n"
-      "with the frame-rate divider [FDIV]\n"
+      "Usage: hdmi-dev-video-player [OPTIONS] [VIDEO] [FDIV]\n"
+      "Plays the video file specified by [VIDEO] using the HDMI Peripheral,\n"
+      "optionally with the frame-rate divider [FDIV]\n"
+      "\n"
+      "Options:\n"
+      "  -d, --depth=N  Decode up to N frames ahead of the one on screen,\n"
+      "                 using N framebuffers. Must be between 2 and 64. The\n"
+      "                 default is 4.\n"
+      "  --convert=IMPL Use the given colorspace conversion kernel. One of\n"
+      "                 auto, scalar, sse2, avx2, or neon. The default is\n"
+      "                 auto, which picks the fastest one this CPU supports.\n"
+      "  --convert-threads=N\n"
+      "                 Split colorspace conversion across N threads. The\n"
+      "                 default is one per CPU.\n"
+      "  --decode-threading=MODE\n"
+      "                 How the decoder should use threads. One of auto,\n"
+      "                 none, slice, or frame. Frame threading is the fastest\n"
+      "                 but adds a frame of delay per extra thread. The\n"
+      "                 default is auto, which lets LibAV decide.\n"
+      "  --decode-threads=N\n"
+      "                 Use N threads for decoding. The default lets LibAV\n"
+      "                 decide, which is usually one per CPU.\n"
+      "  --io=MODE      How the video file is read. One of libav, mmap, or\n"
+      "                 thread. With libav, the demuxer blocks on every\n"
+      "                 read, so slow storage delays frames. With mmap, the\n"
+      "                 file is mapped and the kernel is asked to read ahead.\n"
+      "                 With thread, a separate thread reads ahead into a\n"
+      "                 buffer. The default is libav.\n"
+      "  --readahead=MB\n"
+      "                 Read MB megabytes ahead of the demuxer with mmap or\n"
+      "                 thread. The default is 8.\n"
+      "  --loop         Play [VIDEO] over and over until interrupted. The\n"
+      "                 decoder isn't restarted between loops, so there's\n"
+      "                 no gap when the video starts over.\n"
+      "  --pack         Treat [VIDEO] as a frame pack written by\n"
+      "                 hdmi-dev-video-pack. Frames are copied straight into\n"
+      "                 the framebuffers without decoding, so even [FDIV] = 1\n"
+      "                 is sustainable.\n"
+      "  --playlist     Treat [VIDEO] as a playlist: a text file listing one\n"
+      "                 video per line. The videos are played back to back,\n"
+      "                 each starting on the refresh after the last one\n"
+      "                 ends. With --loop, the whole list loops.\n"
+      "  --raw=FORMAT   Treat [VIDEO] as a stream of raw 640x480 frames, one\n"
+      "                 after another, in FORMAT. That's one of bgra or\n"
+      "                 yuv420p. [VIDEO] can be a named pipe, or - for\n"
+      "                 standard input. BGRA frames are read straight into\n"
+      "                 the framebuffers. The ring defaults to 2 frames, to\n"
+      "                 keep the latency down.\n"
+      "  --serve        Treat [VIDEO] as the path of a Unix socket to listen\n"
+      "                 on. Another process connects, and draws frames\n"
+      "                 straight into the framebuffers, which are shared\n"
+      "                 with it. See share.h for the protocol. Frames are\n"
+      "                 shown on the refreshes the client asks for.\n"
+      "  --full-flush   Write and flush every framebuffer in full. By\n"
+      "                 default, each frame is compared with what the\n"
+      "                 framebuffer held, and only the tiles that changed\n"
+      "                 are written and flushed from the cache.\n"
+      "  --flush-after-convert\n"
+      "                 Flush each frame from the cache once it's fully\n"
+      "                 converted. By default, videos are flushed in bands\n"
+      "                 of 32 lines while the rest of the frame is still\n"
+      "                 being converted.\n"
+      "  --fb-mapping=MODE\n"
+      "                 How framebuffers are mapped. One of cached or wc.\n"
+      "                 Cached framebuffers are flushed from the cache\n"
+      "                 before they're shown. Write-combined (wc) ones\n"
+      "                 never need flushing, but reading them back is slow,\n"
+      "                 so they're always written in full. The default is\n"
+      "                 cached, so only what changed is written and\n"
+      "                 flushed. Older versions always used wc.\n"
+      "  --wait-margin=US\n"
+      "                 While waiting for the next frame, sleep until US\n"
+      "                 microseconds before it, then spin. Raise this if\n"
+      "                 the wait statistics show late wakeups. The default\n"
+      "                 is 200.\n"
+      "  --vsync        Sleep on vsync events while waiting for each frame,\n"
+      "                 instead of timing the sleep from the device's\n"
+      "                 position. The events come from the device's frame\n"
+      "                 start interrupt if it's exposed through UIO, and\n"
+      "                 from a timer otherwise.\n"
+      "  --beam-race    Write each frame straight into the framebuffer the\n"
+      "                 device is showing, a band at a time, staying just\n"
+      "                 behind the beam. That saves a frame of latency and\n"
+      "                 all but one framebuffer, but nothing absorbs a slow\n"
+      "                 frame. Only single videos can be raced, and\n"
+      "                 --depth is ignored.\n"
+      "  --race-margin=ROWS\n"
+      "                 With --beam-race, how many lines ahead of the beam\n"
+      "                 each band has to be flushed. The default is 16.\n"
+      "  --telemetry=FILE\n"
+      "                 Write how long each stage of the pipeline took to\n"
+      "                 FILE at exit. It's CSV if FILE ends in .csv, and\n"
+      "                 JSON otherwise. A summary is printed to stderr on\n"
+      "                 exit, and whenever SIGUSR1 is received.\n"
+      "  --force-program\n"
+      "                 Program the PL even if it already has the HDMI\n"
+      "                 Peripheral's bitstream. By default, that step is\n"
+      "                 skipped if the bitstream hasn't changed since it\n"
+      "                 was last programmed.\n"
+      "  --sim          Use a simulated HDMI Peripheral and framebuffers in\n"
+      "                 ordinary memory. This doesn't need root or a Zynq, so\n"
+      "                 it can be used to measure decoding performance.\n"
       "\n"
-      "The input video must be 640x480, and it must have frames encoded as\n"
-      "YUV420P. It also cannot have any audio associated with it - it must be\n"
-      "a single stream.\n"
+      "The input video can be any size. It's scaled to fit 640x480, keeping\n"
+      "its aspect ratio, with black bars filling the rest. Its frames must be\n"
+      "encoded as YUV420P, YUVJ420P, YUV422P, NV12, or RGB24. It also cannot\n"
+      "have any audio associated with it - it must be a single stream.\n"
       "\n"
-      "The frame-rate divider is applied to a 60Hz refresh rate. In other\n"
-      "words, the frame rate is (60Hz / [FDIV]). Setting the divider too low\n"
-      "will cause frames to miss their deadline and for the video to be\n"
-      "played back slower. A stable value is [FDIV] = 3.\n"
+      "By default, each frame is shown on the 60Hz refresh nearest its\n"
+      "timestamp, so the video plays at its own frame rate. 24fps content\n"
+      "alternates between two and three refreshes per frame.\n"
+      "\n"
+      "Giving [FDIV] overrides that. The divider is applied to the 60Hz\n"
+      "refresh rate. In other words, the frame rate is (60Hz / [FDIV]).\n"
+      "Setting the divider too low will cause frames to miss their deadline\n"
+      "and to be dropped. A stable value is [FDIV] = 3.\n"
       "\n"
       "Finally, this program must be used with the HDMI Peripheral. It must\n"
       "be run as root to interact with the device.\n";
@@ -42,50 +164,586 @@ __attribute__((noreturn)) void signal_handler(int signum) {
   _exit(2);
 }
 
+//! \brief Ask the presenter to print the telemetry
+//! \details It is intended to be installed for SIGUSR1 with `sigaction`
+void dump_handler(int signum) {
+  (void)signum;
+  telemetry_request_dump();
+}
+
+//! \brief Frame sources for videos and packs
+//!
+//! The `_diff` variants only write the tiles that changed, so only those get
+//! flushed. The others overwrite the whole framebuffer, leaving it all dirty.
+//! Videos and playlists flush what they write as they go, unless that's off.
+//! Videos and playlists report each frame's number and timestamp, since the
+//! decoder can skip frames to catch up. Packs are always played frame by frame,
+//! and their frames are timed by the frame rate they were recorded at. Raw
+//! streams have no timestamps, so their frames are live: each is shown a
+//! refresh after the last, or as soon as it arrives if that's later. Shared
+//! framebuffers are drawn by another process, which says what it wrote and
+//! when to show it.
+//! @{
+static int video_source(void *ctx, hdmi_fb_handle_t *fb,
+                        player_frame_t *frame) {
+  video_t *vid = ctx;
+  int res = video_get_frame_fb(vid, fb, false);
+  frame->index = vid->frame_index;
+  frame->time_ns = vid->frame_time_ns;
+  return res;
+}
+static int video_source_diff(void *ctx, hdmi_fb_handle_t *fb,
+                             player_frame_t *frame) {
+  video_t *vid = ctx;
+  int res = video_get_frame_fb(vid, fb, true);
+  frame->index = vid->frame_index;
+  frame->time_ns = vid->frame_time_ns;
+  return res;
+}
+static enum AVDiscard catchup_discard(player_catchup_t catchup) {
+  static const enum AVDiscard DISCARDS[] = {
+      [PLAYER_CATCHUP_NONE] = AVDISCARD_DEFAULT,
+      [PLAYER_CATCHUP_NONREF] = AVDISCARD_NONREF,
+      [PLAYER_CATCHUP_NONKEY] = AVDISCARD_NONKEY,
+  };
+  static const char *const NAMES[] = {
+      [PLAYER_CATCHUP_NONE] = "no",
+      [PLAYER_CATCHUP_NONREF] = "non-reference",
+      [PLAYER_CATCHUP_NONKEY] = "non-key",
+  };
+  fprintf(stderr, "TRACE: Decoder now skipping %s frames\n", NAMES[catchup]);
+  return DISCARDS[catchup];
+}
+static void video_catchup(void *ctx, player_catchup_t catchup) {
+  video_set_discard(ctx, catchup_discard(catchup));
+}
+static void playlist_catchup(void *ctx, player_catchup_t catchup) {
+  playlist_set_discard(ctx, catchup_discard(catchup));
+}
+static int playlist_source(void *ctx, hdmi_fb_handle_t *fb,
+                           player_frame_t *frame) {
+  playlist_t *list = ctx;
+  int res = playlist_get_frame_fb(list, fb, false);
+  frame->index = list->frame_index;
+  frame->time_ns = list->frame_time_ns;
+  return res;
+}
+static int playlist_source_diff(void *ctx, hdmi_fb_handle_t *fb,
+                                player_frame_t *frame) {
+  playlist_t *list = ctx;
+  int res = playlist_get_frame_fb(list, fb, true);
+  frame->index = list->frame_index;
+  frame->time_ns = list->frame_time_ns;
+  return res;
+}
+static void pack_time(const pack_t *pack, player_frame_t *frame) {
+  const pack_header_t *h = &pack->header;
+  if (h->rate_num != 0u && h->rate_den != 0u)
+    frame->time_ns = av_rescale(frame->index, 1000000000ll * h->rate_den,
+                                h->rate_num);
+}
+static int pack_source(void *ctx, hdmi_fb_handle_t *fb,
+                       player_frame_t *frame) {
+  pack_time(ctx, frame);
+  return pack_get_frame(ctx, hdmi_fb_data(fb));
+}
+static int pack_source_diff(void *ctx, hdmi_fb_handle_t *fb,
+                            player_frame_t *frame) {
+  pack_time(ctx, frame);
+  return pack_get_frame_diff(ctx, hdmi_fb_data(fb), &fb->dirty);
+}
+static int raw_source(void *ctx, hdmi_fb_handle_t *fb,
+                      player_frame_t *frame) {
+  frame->live = true;
+  return raw_get_frame(ctx, fb);
+}
+static int share_source(void *ctx, hdmi_fb_handle_t *fb,
+                        player_frame_t *frame) {
+  return share_get_frame(ctx, fb, frame);
+}
+//! @}
+
+//! \brief Sources for racing the beam with a video
+//!
+//! Frames are decoded first, then converted a band at a time. As with the
+//! player's sources, the `_diff` variant only writes the tiles that changed.
+//! @{
+static int video_race_decode(void *ctx, player_frame_t *frame) {
+  video_t *vid = ctx;
+  int res = video_decode(vid);
+  frame->index = vid->frame_index;
+  frame->time_ns = vid->frame_time_ns;
+  return res;
+}
+static void video_race_convert(void *ctx, hdmi_fb_handle_t *fb,
+                               size_t tile_begin, size_t tile_end) {
+  video_convert(ctx, hdmi_fb_data(fb), NULL, tile_begin, tile_end);
+}
+static void video_race_convert_diff(void *ctx, hdmi_fb_handle_t *fb,
+                                    size_t tile_begin, size_t tile_end) {
+  video_convert(ctx, hdmi_fb_data(fb), &fb->dirty, tile_begin, tile_end);
+}
+//! @}
+
+//! \brief Arguments and results for opening the device on its own thread
+//!
+//! Programming the PL is by far the slowest part of starting up, and it
+//! doesn't depend on anything else. So, it runs while the video is opened and
+//! the first frames are decoded.
+typedef struct device_open_t {
+  bool sim;
+  bool ok;
+  //! \brief How long opening took, in nanoseconds
+  uint64_t ns;
+} device_open_t;
+static void *device_open_main(void *arg) {
+  device_open_t *dev = arg;
+  uint64_t start = telemetry_now_ns();
+  dev->ok = dev->sim ? hdmi_dev_open_sim() : hdmi_dev_open();
+  dev->ns = telemetry_now_ns() - start;
+  return NULL;
+}
+
 int main(int argc, char **argv) {
 
+  // Time to first frame is measured from here
+  const uint64_t start_ns = telemetry_now_ns();
+
   // Check if the user is asking for help
   if (argc == 2 && strcmp("help", argv[1]) == 0)
     usage();
   else if (argc == 2 && strcmp("--help", argv[1]) == 0)
     usage();
+
+  // Parse options
+  size_t depth = 0u;
+  int sim = 0;
+  int use_pack = 0;
+  int use_playlist = 0;
+  int use_share = 0;
+  int use_raw = 0;
+  raw_format_t raw_format = RAW_FORMAT_BGRA;
+  int full_flush = 0;
+  int late_flush = 0;
+  int use_vsync = 0;
+  int beam_race = 0;
+  size_t race_margin = RACER_DEFAULT_MARGIN_ROWS;
+  hdmi_fb_mapping_t fb_mapping = HDMI_FB_MAPPING_CACHED;
+  const char *telemetry_path = NULL;
+  long wait_margin_us = HDMI_DEFAULT_WAIT_MARGIN_NS / 1000u;
+  convert_impl_t convert_impl = CONVERT_IMPL_AUTO;
+  video_config_t video_cfg = {0};
+  {
+    static const struct option LONG_OPTS[] = {
+        {"depth", required_argument, NULL, 'd'},
+        {"convert", required_argument, NULL, 'C'},
+        {"convert-threads", required_argument, NULL, 'T'},
+        {"decode-threading", required_argument, NULL, 'M'},
+        {"decode-threads", required_argument, NULL, 'D'},
+        {"io", required_argument, NULL, 'I'},
+        {"readahead", required_argument, NULL, 'A'},
+        {"loop", no_argument, NULL, 'L'},
+        {"pack", no_argument, NULL, 'P'},
+        {"playlist", no_argument, NULL, 'Y'},
+        {"raw", required_argument, NULL, 'X'},
+        {"serve", no_argument, NULL, 'O'},
+        {"full-flush", no_argument, NULL, 'F'},
+        {"flush-after-convert", no_argument, NULL, 'K'},
+        {"fb-mapping", required_argument, NULL, 'B'},
+        {"wait-margin", required_argument, NULL, 'W'},
+        {"vsync", no_argument, NULL, 'V'},
+        {"beam-race", no_argument, NULL, 'N'},
+        {"race-margin", required_argument, NULL, 'H'},
+        {"telemetry", required_argument, NULL, 'R'},
+        {"force-program", no_argument, NULL, 'G'},
+        {"sim", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:", LONG_OPTS, NULL)) != -1) {
+      switch (opt) {
+      case 'd': {
+        int d = atoi(optarg);
+        if (d < (int)PLAYER_MIN_DEPTH || d > (int)PLAYER_MAX_DEPTH) {
+          fputs("Usage: invalid ring depth\n", stderr);
+          usage();
+        }
+        depth = (size_t)d;
+        break;
+      }
+      case 'C': {
+        static const char *const NAMES[] = {
+            [CONVERT_IMPL_AUTO] = "auto", [CONVERT_IMPL_SCALAR] = "scalar",
+            [CONVERT_IMPL_SSE2] = "sse2", [CONVERT_IMPL_AVX2] = "avx2",
+            [CONVERT_IMPL_NEON] = "neon",
+        };
+        const size_t N_NAMES = sizeof(NAMES) / sizeof(NAMES[0]);
+        size_t i = 0u;
+        while (i < N_NAMES && strcmp(NAMES[i], optarg) != 0)
+          i++;
+        if (i == N_NAMES) {
+          fputs("Usage: unknown conversion kernel\n", stderr);
+          usage();
+        }
+        convert_impl = (convert_impl_t)i;
+        break;
+      }
+      case 'T': {
+        int t = atoi(optarg);
+        if (t <= 0 || t > (int)WORKERS_MAX) {
+          fputs("Usage: invalid number of conversion threads\n", stderr);
+          usage();
+        }
+        video_cfg.convert_threads = (size_t)t;
+        break;
+      }
+      case 'M': {
+        video_threading_t t = VIDEO_THREADING_AUTO;
+        while (t <= VIDEO_THREADING_FRAME &&
+               strcmp(video_threading_name(t), optarg) != 0)
+          t++;
+        if (t > VIDEO_THREADING_FRAME) {
+          fputs("Usage: unknown decoder threading mode\n", stderr);
+          usage();
+        }
+        video_cfg.decode_threading = t;
+        break;
+      }
+      case 'D': {
+        int t = atoi(optarg);
+        if (t <= 0) {
+          fputs("Usage: invalid number of decoder threads\n", stderr);
+          usage();
+        }
+        video_cfg.decode_threads = (size_t)t;
+        break;
+      }
+      case 'I': {
+        video_io_t io = VIDEO_IO_LIBAV;
+        while (io <= VIDEO_IO_THREAD && strcmp(video_io_name(io), optarg) != 0)
+          io++;
+        if (io > VIDEO_IO_THREAD) {
+          fputs("Usage: unknown I/O mode\n", stderr);
+          usage();
+        }
+        video_cfg.io = io;
+        break;
+      }
+      case 'A': {
+        int mb = atoi(optarg);
+        if (mb <= 0 || mb > 1024) {
+          fputs("Usage: invalid read-ahead size\n", stderr);
+          usage();
+        }
+        video_cfg.readahead = (size_t)mb * 1024u * 1024u;
+        break;
+      }
+      case 'L':
+        video_cfg.loop = true;
+        break;
+      case 'P':
+        use_pack = 1;
+        break;
+      case 'Y':
+        use_playlist = 1;
+        break;
+      case 'X': {
+        raw_format_t f = RAW_FORMAT_BGRA;
+        while (f <= RAW_FORMAT_YUV420P &&
+               strcmp(raw_format_name(f), optarg) != 0)
+          f++;
+        if (f > RAW_FORMAT_YUV420P) {
+          fputs("Usage: unknown raw frame format\n", stderr);
+          usage();
+        }
+        use_raw = 1;
+        raw_format = f;
+        break;
+      }
+      case 'O':
+        use_share = 1;
+        break;
+      case 'F':
+        full_flush = 1;
+        break;
+      case 'K':
+        late_flush = 1;
+        break;
+      case 'B': {
+        hdmi_fb_mapping_t m = HDMI_FB_MAPPING_CACHED;
+        while (m <= HDMI_FB_MAPPING_WRITE_COMBINED &&
+               strcmp(hdmi_fb_mapping_name(m), optarg) != 0)
+          m++;
+        if (m > HDMI_FB_MAPPING_WRITE_COMBINED) {
+          fputs("Usage: unknown framebuffer mapping\n", stderr);
+          usage();
+        }
+        fb_mapping = m;
+        break;
+      }
+      case 'W':
+        wait_margin_us = atol(optarg);
+        if (wait_margin_us < 0 || wait_margin_us > 1000000) {
+          fputs("Usage: invalid wait margin\n", stderr);
+          usage();
+        }
+        break;
+      case 'V':
+        use_vsync = 1;
+        break;
+      case 'N':
+        beam_race = 1;
+        break;
+      case 'H': {
+        int rows = atoi(optarg);
+        int max = (int)(HDMI_FB_TILE_ROWS * HDMI_FB_TILE_HEIGHT);
+        if (rows <= 0 || rows >= max) {
+          fputs("Usage: invalid race margin\n", stderr);
+          usage();
+        }
+        race_margin = (size_t)rows;
+        break;
+      }
+      case 'R':
+        telemetry_path = optarg;
+        break;
+      case 'G':
+        hdmi_dev_set_force_program(true);
+        break;
+      case 'S':
+        sim = 1;
+        break;
+      default:
+        usage();
+      }
+    }
+    // Only leave the positional arguments
+    argc -= optind - 1;
+    argv += optind - 1;
+  }
+
   // Check for correct usage
-  if (argc != 3) {
+  if (argc != 2 && argc != 3) {
     fputs("Usage: wrong number of arguments\n", stderr);
     usage();
-  } else if (geteuid() != 0) {
+  } else if (use_pack + use_playlist + use_share + use_raw > 1) {
+    fputs("Usage: only one of --pack, --playlist, --raw, and --serve can be "
+          "used\n",
+          stderr);
+    usage();
+  } else if (beam_race && (use_pack || use_playlist || use_share || use_raw ||
+                           use_vsync)) {
+    fputs("Usage: --beam-race only works on its own with a single video\n",
+          stderr);
+    usage();
+  } else if (!sim && geteuid() != 0) {
     fputs("Usage: must be run as root\n", stderr);
     usage();
   }
 
-  // Parse the frame-rate divider
-  const int FDIV = atoi(argv[2]);
-  if (FDIV <= 0) {
+  // Live streams want as little as possible queued up in front of them
+  if (depth == 0u)
+    depth = use_raw ? PLAYER_MIN_DEPTH : DEFAULT_DEPTH;
+
+  // Parse the frame-rate divider, if we were given one. Otherwise, frames
+  // are scheduled by their timestamps.
+  const int FDIV = argc == 3 ? atoi(argv[2]) : 0;
+  if (argc == 3 && FDIV <= 0) {
     fputs("Usage: invalid frame-rate divider\n", stderr);
     usage();
   }
 
-  // Open the video to play
-  video_t *vid = video_open(argv[1]);
-  if (vid == NULL) {
-    fputs("Usage: failed to open video\n", stderr);
-    usage();
+  // Comparing against write-combined framebuffers would read them back, which
+  // costs far more than just writing the whole frame
+  if (fb_mapping == HDMI_FB_MAPPING_WRITE_COMBINED && !full_flush) {
+    fputs("TRACE: Writing whole frames into write-combined framebuffers\n",
+          stderr);
+    full_flush = 1;
+  }
+
+  // Create the histograms every stage records its timing into
+  telemetry_t *tel = telemetry_open();
+  if (tel == NULL) {
+    fputs("Error: failed to allocate telemetry\n", stderr);
+    exit(127);
+  }
+  video_cfg.telemetry = tel;
+
+  // Start setting up the device. Everything up to `player_start` happens in
+  // the meantime.
+  device_open_t dev = {.sim = sim != 0};
+  pthread_t dev_thread;
+  if (pthread_create(&dev_thread, NULL, device_open_main, &dev) != 0) {
+    fputs("Error: failed to start opening HDMI Peripheral\n", stderr);
+    exit(127);
   }
 
-  // Create the framebuffer allocator ...
-  hdmi_fb_allocator_t *alloc_fb = hdmi_fb_allocator_open();
+  // Create the framebuffer allocator. Videos flush what they convert as they
+  // go, so they need it to open. Write-combined framebuffers don't need
+  // flushing, so they're left alone until the frame is done.
+  hdmi_fb_allocator_t *alloc_fb =
+      sim ? hdmi_fb_allocator_open_sim() : hdmi_fb_allocator_open();
   if (alloc_fb == NULL) {
     fputs("Error: failed to open framebuffer allocator\n", stderr);
     exit(127);
   }
-  // ... so we can allocate two framebuffers to double-buffer with
-  hdmi_fb_handle_t *fbs[2];
-  for (size_t i = 0u; i < 2u; i++) {
-    fbs[i] = hdmi_fb_allocate(alloc_fb);
-    if (fbs[i] == NULL) {
-      fputs("Error: failed to allocate framebuffer\n", stderr);
-      exit(127);
+  alloc_fb->mapping = fb_mapping;
+  if (!late_flush && fb_mapping == HDMI_FB_MAPPING_CACHED && !use_pack &&
+      !use_raw && !use_share && !beam_race) {
+    fputs("TRACE: Flushing frames in bands as they're converted\n", stderr);
+    video_cfg.flush_alloc = alloc_fb;
+  }
+
+  // Open the frames to play. A pack doesn't need any decoding, so it skips
+  // all of the setup for that.
+  uint64_t step_ns = telemetry_now_ns();
+  video_t *vid = NULL;
+  playlist_t *list = NULL;
+  pack_t *pack = NULL;
+  share_t *share = NULL;
+  raw_t *raw = NULL;
+  player_source_t source;
+  if (use_raw) {
+    if (raw_format != RAW_FORMAT_BGRA) {
+      if (!convert_select(convert_impl)) {
+        fputs("Usage: conversion kernel not supported on this CPU\n",
+              stderr);
+        usage();
+      }
+      fprintf(stderr, "TRACE: Using %s colorspace conversion\n",
+              convert_impl_name());
+    }
+    raw = raw_open(argv[1], raw_format, video_cfg.convert_threads);
+    if (raw == NULL) {
+      fputs("Usage: failed to open raw frame stream\n", stderr);
+      usage();
+    }
+    raw->telemetry = tel;
+    fprintf(stderr, "TRACE: Reading raw %s frames of %zu bytes\n",
+            raw_format_name(raw_format), raw->frame_size);
+    source = (player_source_t){.get_frame = raw_source, .ctx = raw};
+  } else if (use_share) {
+    share = share_open(argv[1]);
+    if (share == NULL) {
+      fputs("Usage: failed to listen on socket\n", stderr);
+      usage();
     }
+    source = (player_source_t){.get_frame = share_source, .ctx = share};
+  } else if (use_pack) {
+    pack = pack_open(argv[1]);
+    if (pack == NULL) {
+      fputs("Usage: failed to open frame pack\n", stderr);
+      usage();
+    }
+    pack->telemetry = tel;
+    pack->loop = video_cfg.loop;
+    fprintf(stderr,
+            "TRACE: Playing %u pre-converted frames recorded at %u/%u fps\n",
+            pack->header.frame_count, pack->header.rate_num,
+            pack->header.rate_den);
+    if (FDIV == 0 && pack->header.rate_num == 0u) {
+      fputs("Usage: frame pack has no frame rate, so [FDIV] is needed\n",
+            stderr);
+      usage();
+    }
+    source = (player_source_t){
+        .get_frame = full_flush ? pack_source : pack_source_diff,
+        .ctx = pack,
+    };
+  } else {
+    // Pick the colorspace conversion kernel
+    if (!convert_select(convert_impl)) {
+      fputs("Usage: conversion kernel not supported on this CPU\n", stderr);
+      usage();
+    }
+    fprintf(stderr, "TRACE: Using %s colorspace conversion\n",
+            convert_impl_name());
+
+    // Open the video to play, or the first one in the playlist
+    video_t *first = NULL;
+    if (use_playlist) {
+      list = playlist_open(argv[1], &video_cfg);
+      if (list == NULL) {
+        fputs("Usage: failed to open playlist\n", stderr);
+        usage();
+      }
+      first = playlist_video(list);
+      fprintf(stderr, "TRACE: Playing %zu videos back to back\n", list->count);
+    } else {
+      vid = first = video_open(argv[1], &video_cfg);
+      if (vid == NULL) {
+        fputs("Usage: failed to open video\n", stderr);
+        usage();
+      }
+    }
+    // Report how the decoder ended up being configured. The player fills the
+    // whole ring before it starts presenting, so the decoder's delay just
+    // pushes back when presentation starts.
+    {
+      int active = first->codec_ctx->active_thread_type;
+      const char *mode = (active & FF_THREAD_FRAME) != 0   ? "frame"
+                         : (active & FF_THREAD_SLICE) != 0 ? "slice"
+                                                           : "none";
+      fprintf(stderr,
+              "TRACE: Decoding with %d threads (%s), adding %zu frames of "
+              "delay\n",
+              first->codec_ctx->thread_count, mode, first->decode_delay);
+      fprintf(stderr, "TRACE: Presentation starts after %zu packets\n",
+              first->decode_delay + (beam_race ? 1u : depth));
+    }
+    if (first->reader != NULL)
+      fprintf(stderr, "TRACE: Reading %zu bytes ahead of the demuxer (%s)\n",
+              first->reader->readahead, reader_mode_name(first->reader->mode));
+    if (FDIV == 0)
+      fprintf(stderr, "TRACE: Scheduling frames by timestamp, at %d/%d fps\n",
+              first->frame_rate.num, first->frame_rate.den);
+    if (list != NULL)
+      source = (player_source_t){
+          .get_frame = full_flush ? playlist_source : playlist_source_diff,
+          .set_catchup = playlist_catchup,
+          .ctx = list,
+      };
+    else
+      source = (player_source_t){
+          .get_frame = full_flush ? video_source : video_source_diff,
+          .set_catchup = video_catchup,
+          .ctx = vid,
+      };
+  }
+
+  const uint64_t source_ns = telemetry_now_ns() - step_ns;
+
+  // Allocate the ring of framebuffers for the player, or the one framebuffer
+  // to race the beam in
+  step_ns = telemetry_now_ns();
+  player_t *player = NULL;
+  racer_t *racer = NULL;
+  if (beam_race) {
+    const racer_source_t race_source = {
+        .decode = video_race_decode,
+        .convert = full_flush ? video_race_convert : video_race_convert_diff,
+        .ctx = vid,
+    };
+    const racer_config_t racer_cfg = {
+        .fdiv = FDIV,
+        .margin_rows = race_margin,
+        .telemetry = tel,
+    };
+    racer = racer_open(&race_source, alloc_fb, &racer_cfg);
+    fprintf(stderr, "TRACE: Racing the beam, %zu lines ahead of it\n",
+            race_margin);
+  } else {
+    const player_config_t player_cfg = {
+        .depth = depth,
+        .fdiv = FDIV,
+        .vsync = use_vsync != 0,
+        .telemetry = tel,
+    };
+    player = player_open(&source, alloc_fb, &player_cfg);
+  }
+  if (player == NULL && racer == NULL) {
+    fputs("Error: failed to allocate framebuffers\n", stderr);
+    exit(127);
   }
 
   // Setup the SIGINT and SIGTERM handlers
@@ -93,100 +751,205 @@ int main(int argc, char **argv) {
     const struct sigaction args = {.sa_handler = signal_handler};
     int res_int = sigaction(SIGINT, &args, NULL);
     int res_term = sigaction(SIGTERM, &args, NULL);
-    if (res_int != 0 || res_term != 0) {
+    // SIGUSR1 just asks for the telemetry. Restart whatever it interrupted.
+    const struct sigaction dump_args = {.sa_handler = dump_handler,
+                                        .sa_flags = SA_RESTART};
+    int res_usr1 = sigaction(SIGUSR1, &dump_args, NULL);
+    if (res_int != 0 || res_term != 0 || res_usr1 != 0) {
       fputs("Error: couldn't setup signal handler\n", stderr);
       exit(127);
     }
   }
 
-  // Setup the device
-  if (!hdmi_dev_open()) {
+  // Shared framebuffers are drawn by the client, so there's nothing to do
+  // until one connects. Don't count the time spent waiting for it.
+  if (share != NULL) {
+    fprintf(stderr, "TRACE: Waiting for a client on %s\n", argv[1]);
+    uint64_t accept_ns = telemetry_now_ns();
+    if (!share_accept(share, alloc_fb, player->pool)) {
+      fputs("Error: failed to share framebuffers with client\n", stderr);
+      exit(127);
+    }
+    step_ns += telemetry_now_ns() - accept_ns;
+    fprintf(stderr, "TRACE: Sharing %zu framebuffers with the client\n",
+            player->pool->count);
+  }
+
+  // Start decoding the first frames, so they're ready by the time the device
+  // is. The player only starts the device once the ring is full. The racer
+  // decodes on the presenting thread, so it doesn't start until then.
+  if (player != NULL && !player_start(player)) {
+    fputs("Error: failed to start decoding\n", stderr);
+    exit(127);
+  }
+  const uint64_t ring_ns = telemetry_now_ns() - step_ns;
+
+  // Wait for the device
+  pthread_join(dev_thread, NULL);
+  if (!dev.ok) {
     fputs("Error: failed to open HDMI Peripheral\n", stderr);
     exit(127);
   }
+  hdmi_dev_set_wait_margin((uint32_t)wait_margin_us * 1000u);
+  if (use_vsync) {
+    if (!hdmi_dev_vsync_open(0u)) {
+      fputs("Error: failed to set up vsync events\n", stderr);
+      exit(127);
+    }
+    fprintf(stderr, "TRACE: Waiting for frames on %s vsync events\n",
+            hdmi_vsync_mode_name(hdmi_dev_vsync_mode()));
+  }
+  {
+    hdmi_open_stats_t st = hdmi_dev_open_stats();
+    fprintf(stderr,
+            "TRACE: Opened the source in %.1fms and the framebuffers in "
+            "%.1fms, alongside the device in %.1fms\n",
+            (double)source_ns / 1e6, (double)ring_ns / 1e6,
+            (double)dev.ns / 1e6);
+    if (!sim)
+      fprintf(stderr,
+              "TRACE: %s the PL in %.1fms, set up the clocks in %.1fms\n",
+              st.programmed ? "Programmed" : "Skipped programming",
+              (double)st.pl_ns / 1e6, (double)st.clocks_ns / 1e6);
+  }
 
   puts("TRACE: Done with setup!");
 
-  // Keep reading frames until we hit the end of the file
-  size_t fb = 0u;
-  hdmi_coordinate_t last;
-  bool first = true;
-  while (true) {
-
-    // Decode a frame into the current framebuffer. This will switch because
-    // we're double buffering.
-    int res = video_get_frame(vid, hdmi_fb_data(fbs[fb]));
-    if (res == AVERROR_EOF) {
-      fputs("TRACE: Hit EOF on video\n", stderr);
-      break;
-    } else if (res != 0) {
-      fprintf(stderr, "Error: got %d when decoding video\n", res);
+  // Play the video
+  if (racer != NULL) {
+    if (!racer_run(racer)) {
+      fputs("Error: failed to start playback\n", stderr);
+      exit(127);
     }
-    // Remember to flush the framebuffer from the cache before presenting
-    hdmi_fb_flush(alloc_fb, fbs[fb]);
-
-    if (first) {
-      // If this is our first frame, we can just immediately present it. We also
-      // have to start the device, and set the coordinate on which we presented
-      // the frame so the next iteration can use it.
-      hdmi_dev_set_fb(fbs[fb]);
-      hdmi_dev_start();
-      last = hdmi_dev_coordinate();
-
-    } else {
-      // Wait until enough frames have elapsed since the last one before
-      // presenting this frame. The procedure is a bit complicated - we need to
-      // make sure the HDMI Peripheral has in fact switched to the new
-      // framebuffer before we clobber the old one. Specifically, we need to
-      // tell the device about the new framebuffer before `FDIV` frames have
-      // elapsed, then we need to wait for `FDIV` frames to actually elapse
-      // before continuing.
-
-      // We'll use this variable throughout this section to keep track of where
-      // the device is currently
-      hdmi_coordinate_t cur = hdmi_dev_coordinate();
-      int_fast16_t fid_delta = hdmi_fid_delta(cur.fid, last.fid);
-
-      // Check that we actually met the deadline. We need some margin before we
-      // have to present, so we'll make sure we're still before the last line on
-      // the frame before. 31us should be plenty.
-      bool overshoot_frame = fid_delta >= FDIV;
-      bool overshoot_line = fid_delta == FDIV - 1 && cur.row >= 524u;
-      if (overshoot_frame || overshoot_line)
-        fputs("WARN: missed deadline\n", stderr);
-
-      // Wait until we're on the frame just before we have to present. Remember
-      // to update the state variables.
-      while (fid_delta < FDIV - 1) {
-        cur = hdmi_dev_coordinate();
-        fid_delta = hdmi_fid_delta(cur.fid, last.fid);
-      }
-      // Give the peripheral the new framebuffer
-      hdmi_dev_set_fb(fbs[fb]);
-      // The new framebuffer won't start being used until the start of the next
-      // frame, so wait for that
-      while (fid_delta < FDIV) {
-        cur = hdmi_dev_coordinate();
-        fid_delta = hdmi_fid_delta(cur.fid, last.fid);
-      }
-
-      // Remember to update the coordinate for the next loop
-      last = cur;
+    fprintf(stderr,
+            "TRACE: Presented %zu frames, missed %zu deadlines, tore %zu\n",
+            racer->presented, racer->missed, racer->torn);
+    if (racer->presented != 0u)
+      fprintf(stderr, "TRACE: First frame shown %.1fms after startup\n",
+              (double)(racer->first_frame_ns - start_ns) / 1e6);
+    if (racer->presented > 1u) {
+      double raced = (double)(racer->presented - 1u);
+      fprintf(stderr,
+              "TRACE: Frames were fully on screen %.1fms after they started "
+              "decoding on average (max %.1fms)\n",
+              (double)racer->latency_ns_total / raced / 1e6,
+              (double)racer->latency_ns_max / 1e6);
+      fprintf(stderr, "TRACE: The beam came within %" PRId64 " lines of a "
+                      "band being written\n",
+              racer->min_margin_rows);
     }
-
-    // Next
-    fb = (fb + 1u) & 1u;
-    first = false;
+  } else {
+    if (!player_run(player)) {
+      fputs("Error: failed to start playback\n", stderr);
+      exit(127);
+    }
+    fprintf(stderr,
+            "TRACE: Presented %zu frames, missed %zu deadlines, dropped %zu\n",
+            player->presented, player->missed, player->dropped);
+    if (player->presented != 0u)
+      fprintf(stderr, "TRACE: First frame shown %.1fms after startup\n",
+              (double)(player->first_frame_ns - start_ns) / 1e6);
+    fprintf(stderr, "TRACE: Fell at most %zu refreshes (%.1fms) behind\n",
+            player->max_lag, player->max_lag * 1000.0 / HDMI_REFRESH_HZ);
+    if (player->rescheduled != 0u)
+      fprintf(stderr, "TRACE: Waited on the source for %zu live frames\n",
+              player->rescheduled);
+  }
+  // Report how long each stage took
+  telemetry_print(tel, stderr);
+  if (telemetry_path != NULL && !telemetry_write_report(tel, telemetry_path))
+    fputs("Error: failed to write telemetry\n", stderr);
+  // Show how well we slept while waiting for frames
+  {
+    hdmi_wait_stats_t st = hdmi_dev_wait_stats();
+    double sleeps = st.sleeps != 0u ? (double)st.sleeps : 1.0;
+    double waits = st.waits != 0u ? (double)st.waits : 1.0;
+    fprintf(stderr,
+            "TRACE: Slept %zu times waiting for frames, waking %.1fus late "
+            "on average (max %.1fus), overslept %zu times\n",
+            st.sleeps, (double)st.wake_late_ns_total / sleeps / 1000.0,
+            (double)st.wake_late_ns_max / 1000.0, st.overslept);
+    fprintf(stderr, "TRACE: Spun %.1fus per wait on average\n",
+            (double)st.spin_ns_total / waits / 1000.0);
+  }
+  // Show how much partial flushing saved
+  {
+    const hdmi_fb_flush_stats_t *st = &alloc_fb->stats;
+    double flushes = st->flushes != 0u ? (double)st->flushes : 1.0;
+    double per_frame = (double)st->bytes / flushes;
+    fprintf(stderr,
+            "TRACE: Flushed %.0f bytes per frame (%.1f%% of a framebuffer) "
+            "in %.2f ioctls\n",
+            per_frame, 100.0 * per_frame / (640.0 * 480.0 * 4.0),
+            (double)st->ioctls / flushes);
+  }
+  // Show how reading the stream went
+  if (raw != NULL) {
+    double frames = raw->frames != 0u ? (double)raw->frames : 1.0;
+    fprintf(stderr,
+            "TRACE: Read %zu raw frames, %" PRIu64 " bytes, in %.2f reads "
+            "per frame, through a %zu byte pipe\n",
+            raw->frames, raw->bytes, (double)raw->reads / frames,
+            raw->pipe_size);
+  }
+  // Show how the client kept up
+  if (share != NULL)
+    fprintf(stderr,
+            "TRACE: Leased %zu framebuffers to the client, which submitted "
+            "%zu, with %zu rejected\n",
+            share->leased, share->submitted, share->rejected);
+  // Show how switching between items went
+  if (list != NULL) {
+    playlist_stats_t st = playlist_stats(list);
+    fprintf(stderr,
+            "TRACE: Started %zu items, skipped %zu, reused the decoder %zu "
+            "times, waited %.1fms for the next item at most\n",
+            st.started, st.skipped, st.decoder_reuses,
+            (double)st.wait_ns_max / 1e6);
+  }
+  // Show that decoding didn't allocate frame buffers. Any fallbacks mean the
+  // pool was too small or the stream's format changed. For playlists, this is
+  // only the last item.
+  video_t *last = list != NULL ? playlist_video(list) : vid;
+  if (last != NULL) {
+    frame_pool_stats_t pool = frame_pool_stats(last->pool);
+    fprintf(stderr,
+            "TRACE: Frame pool had %zu buffers, peak %zu in use, %zu "
+            "fallback allocations\n",
+            pool.buffers, pool.peak_in_use, pool.fallbacks);
+  }
+  // Show whether the demuxer ever waited for the storage
+  if (last != NULL && last->reader != NULL) {
+    reader_stats_t st = reader_stats(last->reader);
+    double reads = st.reads != 0u ? (double)st.reads : 1.0;
+    double stalls = st.stalls != 0u ? (double)st.stalls : 1.0;
+    fprintf(stderr,
+            "TRACE: Read %" PRIu64 " bytes in %zu reads, stalling %zu times "
+            "for %.1fus on average (max %.1fus), with %zu seeks\n",
+            st.bytes, st.reads, st.stalls,
+            (double)st.stall_ns_total / stalls / 1000.0,
+            (double)st.stall_ns_max / 1000.0, st.seeks);
+    if (last->reader->mode == READER_THREAD)
+      fprintf(stderr,
+              "TRACE: Read-ahead buffer held %.0f bytes on average (min "
+              "%zu)\n",
+              (double)st.buffered_total / reads,
+              st.reads != 0u ? st.buffered_min : (size_t)0u);
   }
 
   // At least cleanup on the happy path
   puts("TRACE: Cleaning up...");
   hdmi_dev_stop();
   hdmi_dev_close();
-  hdmi_fb_free(alloc_fb, fbs[0u]);
-  hdmi_fb_free(alloc_fb, fbs[1u]);
-  hdmi_fb_allocator_close(alloc_fb);
+  player_close(player);
+  share_close(share);
+  raw_close(raw);
+  racer_close(racer);
   video_close(vid);
+  playlist_close(list);
+  pack_close(pack);
+  hdmi_fb_allocator_close(alloc_fb);
+  telemetry_close(tel);
   puts("TRACE: Cleaned up!");
   return 0;
 }
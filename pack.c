@@ -0,0 +1,371 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "pack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+
+//! \brief Top bit of a run header, set for repeated runs
+static const uint32_t RLE_REPEAT = UINT32_C(0x80000000);
+//! \brief Shortest run of identical pixels worth encoding as a repeat
+//! \details Shorter ones take up as much space as literals
+static const size_t RLE_MIN_REPEAT = 3u;
+
+//! \brief Round `x` up to a multiple of `PACK_ALIGN`
+static inline uint64_t align_up(uint64_t x) {
+  return (x + PACK_ALIGN - 1u) & ~(uint64_t)(PACK_ALIGN - 1u);
+}
+
+//! \brief Read exactly `size` bytes at `offset`
+//! \return Whether that worked
+static bool read_at(int fd, void *dst, size_t size, uint64_t offset) {
+  size_t done = 0u;
+  while (done < size) {
+    ssize_t res = pread(fd, (uint8_t *)dst + done, size - done,
+                        (off_t)(offset + done));
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    done += (size_t)res;
+  }
+  return true;
+}
+
+pack_t *pack_open(const char *filename) {
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  pack_t *ret = calloc(1u, sizeof(pack_t));
+  if (ret == NULL)
+    return NULL;
+  ret->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (ret->fd == -1)
+    goto failure;
+  struct stat st;
+  if (fstat(ret->fd, &st) != 0 || (uint64_t)st.st_size < PACK_ALIGN)
+    goto failure;
+  // The file is never mapped whole, so its size doesn't have to fit in a
+  // `size_t`. Only one frame's worth does.
+  ret->size = (uint64_t)st.st_size;
+
+  // Check the header
+  pack_header_t *h = &ret->header;
+  if (!read_at(ret->fd, h, sizeof(pack_header_t), 0u))
+    goto failure;
+  if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0)
+    goto failure;
+  if (h->version != PACK_VERSION || h->width != 640u || h->height != 480u)
+    goto failure;
+  // The index has to be inside the file. Be careful about overflow, since the
+  // counts come from the file.
+  uint64_t index_bytes = (uint64_t)h->frame_count * sizeof(pack_entry_t);
+  if (h->index_offset % sizeof(uint64_t) != 0u ||
+      h->index_offset > ret->size ||
+      index_bytes > ret->size - h->index_offset || index_bytes > SIZE_MAX)
+    goto failure;
+  if (h->frame_count != 0u) {
+    ret->index = malloc((size_t)index_bytes);
+    if (ret->index == NULL ||
+        !read_at(ret->fd, ret->index, (size_t)index_bytes, h->index_offset))
+      goto failure;
+  }
+
+  // Check every frame, so reading them doesn't have to. No frame is bigger
+  // than a raw one, so each one can always be mapped.
+  for (size_t i = 0u; i < h->frame_count; i++) {
+    const pack_entry_t *e = &ret->index[i];
+    if (e->offset % PACK_ALIGN != 0u || e->offset > ret->size ||
+        e->size > ret->size - e->offset || e->size % 4u != 0u ||
+        e->size > PACK_FRAME_BYTES)
+      goto failure;
+    if (e->encoding == PACK_ENCODING_RAW) {
+      if (e->size != PACK_FRAME_BYTES)
+        goto failure;
+    } else if (e->encoding != PACK_ENCODING_RLE) {
+      goto failure;
+    }
+  }
+
+  return ret;
+
+failure:
+  pack_close(ret);
+  return NULL;
+}
+
+void pack_close(pack_t *pack) {
+  // Edge case handling
+  if (pack == NULL)
+    return;
+  if (pack->fd != -1)
+    close(pack->fd);
+  free(pack->index);
+  free(pack);
+}
+
+//! \brief Decode a run-length encoded frame
+//!
+//! \param[in] src The encoded data
+//! \param[in] words The length of `src` in words
+//! \param[out] dst Where to write the frame
+//! \return Whether the data was valid, and decoded to exactly one frame
+static bool rle_decode(const uint32_t *src, size_t words, uint32_t *dst) {
+  size_t in = 0u;
+  size_t out = 0u;
+  while (in < words) {
+    uint32_t header = src[in++];
+    size_t count = header & ~RLE_REPEAT;
+    if (count == 0u || count > PACK_FRAME_PIXELS - out)
+      return false;
+    if ((header & RLE_REPEAT) != 0u) {
+      if (in == words)
+        return false;
+      uint32_t pixel = src[in++];
+      for (size_t i = 0u; i < count; i++)
+        dst[out + i] = pixel;
+    } else {
+      if (count > words - in)
+        return false;
+      memcpy(dst + out, src + in, count * sizeof(uint32_t));
+      in += count;
+    }
+    out += count;
+  }
+  return out == PACK_FRAME_PIXELS;
+}
+
+int pack_get_frame(pack_t *pack, uint32_t *framebuffer) {
+  return pack_get_frame_diff(pack, framebuffer, NULL);
+}
+
+int pack_get_frame_diff(pack_t *pack, uint32_t *framebuffer,
+                        hdmi_fb_dirty_t *dirty) {
+  // Edge case handling
+  if (pack == NULL || framebuffer == NULL)
+    return AVERROR(EINVAL);
+  const size_t count = pack->header.frame_count;
+  if (pack->next >= count && pack->loop)
+    pack->next = 0u;
+  if (pack->next >= count)
+    return AVERROR_EOF;
+
+  // Map just this frame. Its offset is aligned for that, unless pages are
+  // bigger than `PACK_ALIGN`, in which case we start a bit before it. The
+  // pages are faulted in all at once, instead of one at a time as we copy.
+  uint64_t start = telemetry_now_ns();
+  const pack_entry_t *e = &pack->index[pack->next++];
+  const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  const uint64_t base = e->offset & ~(page - 1u);
+  const size_t lead = (size_t)(e->offset - base);
+  const size_t map_size = lead + e->size;
+  uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                      pack->fd, (off_t)base);
+  if (map == MAP_FAILED)
+    return AVERROR(errno);
+
+  // Ask the kernel to start reading the frame after this one, wrapping around
+  // if we're looping. Frames are read one at a time, and looping packs are
+  // read over and over, so there's no advice to give about the whole file.
+  if (pack->next < count || pack->loop) {
+    const pack_entry_t *n = &pack->index[pack->next < count ? pack->next : 0u];
+    posix_fadvise(pack->fd, (off_t)n->offset, (off_t)n->size,
+                  POSIX_FADV_WILLNEED);
+  }
+
+  // Copy the frame. Everything was bounds-checked in `pack_open`, except for
+  // the contents of compressed frames.
+  int ret = 0;
+  const uint32_t *src = (const uint32_t *)(map + lead);
+  if (e->encoding == PACK_ENCODING_RAW && dirty != NULL) {
+    memset(dirty, 0, sizeof(hdmi_fb_dirty_t));
+    for (size_t row = 0u; row < 480u; row++)
+      hdmi_fb_store_row(dirty, framebuffer, row, src + row * 640u);
+  } else if (e->encoding == PACK_ENCODING_RAW) {
+    memcpy(framebuffer, src, PACK_FRAME_BYTES);
+  } else {
+    if (dirty != NULL)
+      hdmi_fb_dirty_all(dirty);
+    if (!rle_decode(src, e->size / 4u, framebuffer))
+      ret = AVERROR(EINVAL);
+  }
+  munmap(map, map_size);
+  telemetry_record(pack->telemetry, TELEMETRY_CONVERT,
+                   telemetry_now_ns() - start);
+  return ret;
+}
+
+pack_writer_t *pack_writer_open(const char *filename, uint32_t rate_num,
+                                uint32_t rate_den, bool compress) {
+
+  // Allocate space for the return value
+  pack_writer_t *ret = calloc(1u, sizeof(pack_writer_t));
+  if (ret == NULL)
+    return NULL;
+  ret->compress = compress;
+  memcpy(ret->header.magic, PACK_MAGIC, sizeof(ret->header.magic));
+  ret->header.version = PACK_VERSION;
+  ret->header.width = 640u;
+  ret->header.height = 480u;
+  ret->header.rate_num = rate_num;
+  ret->header.rate_den = rate_den;
+  ret->next_offset = PACK_ALIGN;
+
+  // Compressed frames are only kept if they're smaller than raw ones, so we
+  // never need more scratch space than a raw frame
+  if (compress) {
+    ret->scratch = malloc(PACK_FRAME_BYTES);
+    if (ret->scratch == NULL)
+      goto failure;
+  }
+
+  // Open the file, and write a blank header. The real one is only written
+  // once the pack is complete, so an unfinished pack won't have the magic.
+  ret->file = fopen(filename, "wb");
+  if (ret->file == NULL)
+    goto failure;
+  static const uint8_t BLANK[PACK_ALIGN] = {0};
+  if (fwrite(BLANK, sizeof(BLANK), 1u, ret->file) != 1u)
+    goto failure;
+
+  return ret;
+
+failure:
+  if (ret->file != NULL)
+    fclose(ret->file);
+  free(ret->scratch);
+  free(ret);
+  return NULL;
+}
+
+//! \brief Append a literal run to run-length encoded data
+//!
+//! \param[in] src The pixels to copy
+//! \param[in] count The number of pixels in the run, possibly zero
+//! \param[out] dst The encoded data
+//! \param[inout] out The length of `dst` in words
+//! \return Whether the run fit in less space than a raw frame
+static bool rle_literal(const uint32_t *src, size_t count, uint32_t *dst,
+                        size_t *out) {
+  if (count == 0u)
+    return true;
+  if (*out + 1u + count >= PACK_FRAME_PIXELS)
+    return false;
+  dst[(*out)++] = (uint32_t)count;
+  memcpy(dst + *out, src, count * sizeof(uint32_t));
+  *out += count;
+  return true;
+}
+
+//! \brief Run-length encode a frame
+//!
+//! \param[in] src The frame to encode
+//! \param[out] dst Where to write the encoded data, `PACK_FRAME_PIXELS` words
+//! \return The length of the encoded data in words, or zero if it wouldn't be
+//!         smaller than the raw frame
+static size_t rle_encode(const uint32_t *src, uint32_t *dst) {
+  size_t in = 0u;
+  size_t out = 0u;
+  // Start of the literal run that hasn't been written yet
+  size_t literal = 0u;
+
+  while (in < PACK_FRAME_PIXELS) {
+    // Find out how long the run starting here is
+    size_t run = 1u;
+    while (in + run < PACK_FRAME_PIXELS && src[in + run] == src[in])
+      run++;
+    if (run < RLE_MIN_REPEAT) {
+      in += run;
+      continue;
+    }
+    // It's long enough, so write out the literals before it, then the run
+    if (!rle_literal(src + literal, in - literal, dst, &out))
+      return 0u;
+    if (out + 2u >= PACK_FRAME_PIXELS)
+      return 0u;
+    dst[out++] = RLE_REPEAT | (uint32_t)run;
+    dst[out++] = src[in];
+    in += run;
+    literal = in;
+  }
+  if (!rle_literal(src + literal, PACK_FRAME_PIXELS - literal, dst, &out))
+    return 0u;
+  return out;
+}
+
+bool pack_writer_add(pack_writer_t *writer, const uint32_t *frame) {
+  // Edge case handling
+  if (writer == NULL || frame == NULL)
+    return false;
+
+  // Make room in the index
+  if (writer->header.frame_count == writer->index_capacity) {
+    size_t capacity =
+        writer->index_capacity == 0u ? 256u : 2u * writer->index_capacity;
+    pack_entry_t *index =
+        realloc(writer->index, capacity * sizeof(pack_entry_t));
+    if (index == NULL)
+      return false;
+    writer->index = index;
+    writer->index_capacity = capacity;
+  }
+
+  // Figure out what to write
+  pack_entry_t entry = {
+      .offset = writer->next_offset,
+      .size = PACK_FRAME_BYTES,
+      .encoding = PACK_ENCODING_RAW,
+  };
+  const void *data = frame;
+  if (writer->compress) {
+    size_t words = rle_encode(frame, writer->scratch);
+    if (words != 0u) {
+      entry.size = (uint32_t)(words * sizeof(uint32_t));
+      entry.encoding = PACK_ENCODING_RLE;
+      data = writer->scratch;
+    }
+  }
+
+  // Write it at the next page boundary. Seeking past the end leaves a hole,
+  // which reads back as zeros.
+  if (fseeko(writer->file, (off_t)entry.offset, SEEK_SET) != 0)
+    return false;
+  if (fwrite(data, entry.size, 1u, writer->file) != 1u)
+    return false;
+  writer->next_offset = align_up(entry.offset + entry.size);
+  writer->index[writer->header.frame_count++] = entry;
+  return true;
+}
+
+bool pack_writer_close(pack_writer_t *writer) {
+  // Edge case handling
+  if (writer == NULL)
+    return false;
+
+  // Write the index after the last frame, then the header. The index has to be
+  // written first, so the header is only valid once everything else is.
+  writer->header.index_offset = writer->next_offset;
+  size_t count = writer->header.frame_count;
+  bool ok = fseeko(writer->file, (off_t)writer->next_offset, SEEK_SET) == 0;
+  ok = ok && (count == 0u || fwrite(writer->index, sizeof(pack_entry_t),
+                                    count, writer->file) == count);
+  ok = ok && fflush(writer->file) == 0;
+  ok = ok && fseeko(writer->file, 0, SEEK_SET) == 0;
+  ok = ok && fwrite(&writer->header, sizeof(pack_header_t), 1u,
+                    writer->file) == 1u;
+
+  // Release everything, remembering to check whether the close succeeded
+  ok = fclose(writer->file) == 0 && ok;
+  free(writer->index);
+  free(writer->scratch);
+  free(writer);
+  return ok;
+}
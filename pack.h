@@ -0,0 +1,176 @@
+//! \file pack.h
+//! \brief Files of frames that have already been decoded and converted
+//!
+//! Looping content gets decoded and converted again every time it's played. A
+//! frame pack instead stores every frame of a video as BGRA, exactly as it
+//! should appear in a framebuffer. Playing one back just copies each frame into
+//! a framebuffer, which costs almost nothing compared to decoding.
+//!
+//! The file starts with a one-page header, followed by the frames, followed by
+//! an index giving the location of every frame. Frames start on page
+//! boundaries, so they can be mapped or read without touching their
+//! neighbours. Every integer is stored in the machine's native byte order.
+//!
+//! Frames can optionally be compressed with a simple run-length encoding on
+//! whole pixels. It's lossless and fast to decode, and it works well on the
+//! flat regions that are common in signage. A frame is only stored compressed
+//! if that makes it smaller.
+
+#pragma once
+
+#include "hdmi_fb.h"
+#include "telemetry.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//! \brief Magic bytes at the start of every pack
+#define PACK_MAGIC "HDMIPACK"
+//! \brief Version of the format this module reads and writes
+#define PACK_VERSION 1u
+//! \brief Alignment of each frame in the file, in bytes
+#define PACK_ALIGN 4096u
+
+//! \brief Number of pixels in a frame
+#define PACK_FRAME_PIXELS (640u * 480u)
+//! \brief Size of an uncompressed frame in bytes
+#define PACK_FRAME_BYTES (PACK_FRAME_PIXELS * 4u)
+
+//! \brief How a frame is stored in the file
+typedef enum pack_encoding_t {
+  //! \brief The frame's pixels, as is
+  PACK_ENCODING_RAW = 0,
+  //! \brief Run-length encoded pixels
+  //!
+  //! The data is a sequence of runs. Each one starts with a word whose top bit
+  //! says what kind of run it is, and whose other bits give its length in
+  //! pixels. If the top bit is set, the run is one pixel repeated, and that
+  //! pixel follows. Otherwise, the run is that many literal pixels.
+  PACK_ENCODING_RLE = 1,
+} pack_encoding_t;
+
+//! \brief Header at the start of the file
+//! \details This is padded out to `PACK_ALIGN` bytes on disk
+typedef struct pack_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frame_count;
+  //! \brief Frame rate of the source video, or zero if it's unknown
+  //! @{
+  uint32_t rate_num;
+  uint32_t rate_den;
+  //! @}
+  //! \brief Offset of the index in the file
+  uint64_t index_offset;
+} pack_header_t;
+
+//! \brief Where a single frame is in the file
+typedef struct pack_entry_t {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t encoding;
+} pack_entry_t;
+
+//! \brief An open pack
+//!
+//! The pack is read through `pack_get_frame`, which returns each frame in turn
+//! like `video_get_frame` does. Only the header and the index are kept in
+//! memory. Each frame is mapped on its own while it's read, so a pack can be
+//! far bigger than the address space, as long loops on a 32-bit system are.
+typedef struct pack_t {
+  int fd;
+  //! \brief Size of the file in bytes
+  uint64_t size;
+  //! \brief Copies of the header and the index, read when the pack is opened
+  //! @{
+  pack_header_t header;
+  pack_entry_t *index;
+  //! @}
+  //! \brief Index of the frame `pack_get_frame` will return next
+  size_t next;
+  //! \brief Whether to go back to the first frame after the last one
+  bool loop;
+  //! \brief Where to record how long copying each frame took, or `NULL`
+  //! \details This is recorded as conversion time. It's not owned by the pack.
+  telemetry_t *telemetry;
+} pack_t;
+
+//! \brief Open a pack for reading
+//!
+//! The header and the index are validated here, so later reads don't have to
+//! check that the frames are inside the file.
+//!
+//! \param[in] filename The pack to open
+//! \return A handle to the pack, or `NULL` on failure
+pack_t *pack_open(const char *filename);
+//! \brief Inverse of `pack_open`
+//! \details It is legal to close a `NULL` pack
+void pack_close(pack_t *pack);
+
+//! \brief Read the next frame from the pack
+//!
+//! The frame is copied or decompressed into `framebuffer`, which must hold
+//! `PACK_FRAME_PIXELS` pixels.
+//!
+//! If `loop` is set, the first frame follows the last one, and `AVERROR_EOF` is
+//! never returned.
+//!
+//! \return Zero on success, `AVERROR_EOF` after the last frame, or
+//!         `AVERROR(EINVAL)` if the arguments or the frame's data are invalid
+int pack_get_frame(pack_t *pack, uint32_t *framebuffer);
+//! \brief Read the next frame from the pack, only writing what changed
+//!
+//! This is like `pack_get_frame`, but uncompressed frames are compared with
+//! what `framebuffer` already holds, and only the tiles that differ are
+//! written. Compressed frames are decoded straight into the framebuffer, so
+//! every tile is marked dirty for them.
+//!
+//! \param[out] dirty Set to the tiles that were written
+int pack_get_frame_diff(pack_t *pack, uint32_t *framebuffer,
+                        hdmi_fb_dirty_t *dirty);
+
+//! \brief State for writing a pack
+//!
+//! Frames are written as they're added. The index is kept in memory, and it's
+//! written along with the header by `pack_writer_close`.
+typedef struct pack_writer_t {
+  FILE *file;
+  //! \brief Whether to try compressing frames
+  bool compress;
+  //! \brief The header, filled in as frames are added
+  pack_header_t header;
+  //! \brief Offset in the file where the next frame goes
+  uint64_t next_offset;
+  //! \brief Where each frame went
+  //! @{
+  pack_entry_t *index;
+  size_t index_capacity;
+  //! @}
+  //! \brief Scratch space for compressing a frame
+  uint32_t *scratch;
+} pack_writer_t;
+
+//! \brief Start writing a pack
+//!
+//! \param[in] filename Where to write the pack
+//! \param[in] rate_num,rate_den The frame rate to record, or zeros
+//! \param[in] compress Whether to store frames compressed when it helps
+//! \return A handle to the writer, or `NULL` on failure
+pack_writer_t *pack_writer_open(const char *filename, uint32_t rate_num,
+                                uint32_t rate_den, bool compress);
+//! \brief Append a frame to the pack
+//! \param[in] frame The frame's pixels, `PACK_FRAME_PIXELS` of them
+//! \return Whether the frame was written
+bool pack_writer_add(pack_writer_t *writer, const uint32_t *frame);
+//! \brief Finish the pack and free the writer
+//!
+//! This writes the index and the header. If it fails, the file is left
+//! incomplete and `pack_open` will reject it. It is legal to close a `NULL`
+//! writer, in which case this returns `false`.
+//!
+//! \return Whether the pack was written successfully
+bool pack_writer_close(pack_writer_t *writer);
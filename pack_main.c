@@ -0,0 +1,122 @@
+#include "convert.h"
+#include "pack.h"
+#include "video.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Print the usage and exit
+//! \details Exits with code 1
+__attribute__((noreturn)) void usage(void) {
+  const char *const USAGE =
+      "Usage: hdmi-dev-video-pack [OPTIONS] [VIDEO] [PACK]\n"
+      "Decodes every frame of [VIDEO] and writes them to the frame pack\n"
+      "[PACK], ready to be played with `hdmi-dev-video-player --pack`\n"
+      "\n"
+      "Options:\n"
+      "  -c, --compress Run-length encode frames that get smaller from it.\n"
+      "                 This is lossless, and decoding it is still much\n"
+      "                 cheaper than decoding the video.\n"
+      "\n"
+      "The input video has the same requirements as for the player, and it's\n"
+      "scaled to 640x480 the same way. It must have a single stream. Each\n"
+      "frame takes 1.2MB in the pack without compression.\n";
+  fputs(USAGE, stderr);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  // Check if the user is asking for help
+  if (argc == 2 && strcmp("help", argv[1]) == 0)
+    usage();
+  else if (argc == 2 && strcmp("--help", argv[1]) == 0)
+    usage();
+
+  // Parse options
+  bool compress = false;
+  {
+    static const struct option LONG_OPTS[] = {
+        {"compress", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c", LONG_OPTS, NULL)) != -1) {
+      switch (opt) {
+      case 'c':
+        compress = true;
+        break;
+      default:
+        usage();
+      }
+    }
+    // Only leave the positional arguments
+    argc -= optind - 1;
+    argv += optind - 1;
+  }
+  if (argc != 3) {
+    fputs("Usage: wrong number of arguments\n", stderr);
+    usage();
+  }
+
+  // Open the video with the fastest conversion we have. We don't care about
+  // latency here, so the decoder's defaults are fine.
+  convert_select(CONVERT_IMPL_AUTO);
+  video_t *vid = video_open(argv[1], NULL);
+  if (vid == NULL) {
+    fputs("Usage: failed to open video\n", stderr);
+    usage();
+  }
+
+  // Record the frame rate if the container knows it
+  const AVStream *stream = vid->format_ctx->streams[0u];
+  AVRational rate = stream->avg_frame_rate;
+  if (rate.num <= 0 || rate.den <= 0)
+    rate = stream->r_frame_rate;
+  if (rate.num <= 0 || rate.den <= 0)
+    rate = (AVRational){0, 0};
+
+  pack_writer_t *writer = pack_writer_open(argv[2], (uint32_t)rate.num,
+                                           (uint32_t)rate.den, compress);
+  if (writer == NULL) {
+    fputs("Error: failed to create frame pack\n", stderr);
+    exit(127);
+  }
+
+  // Decode every frame into one buffer, and append each one to the pack
+  uint32_t *frame = malloc(PACK_FRAME_BYTES);
+  if (frame == NULL) {
+    fputs("Error: failed to allocate frame\n", stderr);
+    exit(127);
+  }
+  size_t frames = 0u;
+  size_t skipped = 0u;
+  while (true) {
+    int res = video_get_frame(vid, frame);
+    if (res == AVERROR_EOF)
+      break;
+    if (res != 0) {
+      fprintf(stderr, "Error: got %d when decoding video\n", res);
+      skipped++;
+      continue;
+    }
+    if (!pack_writer_add(writer, frame)) {
+      fputs("Error: failed to write frame\n", stderr);
+      exit(127);
+    }
+    frames++;
+  }
+
+  // Finish up. The pack isn't valid until the writer is closed.
+  free(frame);
+  video_close(vid);
+  if (!pack_writer_close(writer)) {
+    fputs("Error: failed to finish frame pack\n", stderr);
+    exit(127);
+  }
+  fprintf(stderr, "TRACE: Packed %zu frames at %d/%d fps, skipped %zu\n",
+          frames, rate.num, rate.den, skipped);
+  return 0;
+}
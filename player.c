@@ -0,0 +1,418 @@
+#include "player.h"
+
+#include "hdmi_dev.h"
+
+#include <libavutil/avutil.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//! \brief How long to sleep when a queue is empty or full
+//!
+//! Neither thread should spin on the queues - on a two-core system, that takes
+//! time away from the other thread. This is short compared to the 16.7ms frame
+//! period, so the added latency doesn't matter.
+static const long QUEUE_POLL_NS = 500000l;
+
+//! \brief Sleep for `QUEUE_POLL_NS`
+static void queue_backoff(void) {
+  struct timespec req = {.tv_sec = 0, .tv_nsec = QUEUE_POLL_NS};
+  nanosleep(&req, NULL);
+}
+
+//! \brief Longest to wait for a single vsync event, in milliseconds
+//!
+//! If events stop coming for whatever reason, we still notice the device
+//! moving on by checking the coordinate after this long. It's two refreshes.
+static const int VSYNC_TIMEOUT_MS = 2000 / HDMI_REFRESH_HZ;
+
+//! \brief Wait until the device starts frame `fid`
+//!
+//! With `vsync`, this sleeps on the device's vsync events, which are at the
+//! start of each frame. Otherwise, it's just `hdmi_dev_wait`.
+static void wait_frame(const player_t *player, hdmi_fid_t fid) {
+  if (!player->config.vsync) {
+    hdmi_dev_wait(fid, 0u);
+    return;
+  }
+  struct pollfd pfd = {.fd = hdmi_dev_vsync_fd(), .events = POLLIN};
+  hdmi_coordinate_t cur = hdmi_dev_vsync_ack();
+  while (hdmi_fid_delta(fid, cur.fid) > 0) {
+    poll(&pfd, 1, VSYNC_TIMEOUT_MS);
+    cur = hdmi_dev_vsync_ack();
+  }
+}
+
+player_t *player_open(const player_source_t *source,
+                      hdmi_fb_allocator_t *alloc,
+                      const player_config_t *config) {
+
+  // Edge case handling
+  if (source == NULL || source->get_frame == NULL || alloc == NULL ||
+      config == NULL)
+    return NULL;
+  if (config->depth < PLAYER_MIN_DEPTH || config->depth > PLAYER_MAX_DEPTH)
+    return NULL;
+  if (config->fdiv < 0)
+    return NULL;
+
+  // Allocate space for the return value. Everything is initialized to zero or
+  // `NULL`, which is what `player_close` expects.
+  player_t *ret = calloc(1u, sizeof(player_t));
+  if (ret == NULL)
+    return NULL;
+  ret->source = *source;
+  ret->alloc = alloc;
+  ret->config = *config;
+  atomic_init(&ret->decoder_done, false);
+  atomic_init(&ret->stop, false);
+  atomic_init(&ret->catchup, PLAYER_CATCHUP_NONE);
+
+  // Allocate the queues. Each of them has to be able to hold every framebuffer
+  // at once.
+  ret->free = spsc_alloc(config->depth);
+  ret->ready = spsc_alloc(config->depth);
+  if (ret->free == NULL || ret->ready == NULL)
+    goto failure;
+
+  // Allocate the framebuffers, all in one buffer object. They all start out
+  // free.
+  ret->pool = hdmi_fb_pool_allocate(alloc, config->depth);
+  if (ret->pool == NULL)
+    goto failure;
+  for (size_t i = 0u; i < config->depth; i++) {
+    ret->fbs[i] = &ret->pool->fbs[i];
+    spsc_push(ret->free, i);
+  }
+
+  return ret;
+
+failure:
+  player_close(ret);
+  return NULL;
+}
+
+void player_close(player_t *player) {
+  // Edge case handling
+  if (player == NULL)
+    return;
+  // If the decoder is still running, tell it to stop and wait for it. This only
+  // happens if `player_run` bailed early.
+  if (player->decoder_started) {
+    atomic_store(&player->stop, true);
+    pthread_join(player->decoder, NULL);
+    player->decoder_started = false;
+  }
+  // Release everything. The free functions are all tolerant of `NULL`.
+  hdmi_fb_pool_free(player->alloc, player->pool);
+  spsc_free(player->free);
+  spsc_free(player->ready);
+  free(player);
+}
+
+//! \brief Entry point for the decoding thread
+//!
+//! This repeatedly takes a free framebuffer, decodes the next frame into it,
+//! flushes it, and gives it to the presenter. It stops at the end of the video
+//! or when asked to.
+static void *decoder_main(void *arg) {
+  player_t *player = arg;
+  int64_t last_index = -1;
+  player_catchup_t catchup = PLAYER_CATCHUP_NONE;
+  // Whether `idx` is a framebuffer we kept after failing to decode into it
+  bool holding = false;
+  size_t idx = 0u;
+
+  while (!atomic_load(&player->stop)) {
+
+    // Get a framebuffer to decode into, unless we kept one. If there aren't
+    // any, the ring is full and we're ahead of the presenter. Wait for it to
+    // catch up.
+    if (!holding && !spsc_pop(player->free, &idx)) {
+      queue_backoff();
+      continue;
+    }
+    holding = false;
+    hdmi_fb_handle_t *fb = player->fbs[idx];
+
+    // Skip more or less work if the presenter asked us to. The source isn't
+    // thread-safe, so we have to be the ones to tell it.
+    player_catchup_t want = (player_catchup_t)atomic_load(&player->catchup);
+    if (want != catchup && player->source.set_catchup != NULL) {
+      player->source.set_catchup(player->source.ctx, want);
+      catchup = want;
+    }
+
+    // Decode into the framebuffer. If this fails for any reason other than
+    // EOF, skip the frame. We still own the framebuffer, so keep it for the
+    // next one. We can't give it back to the free queue, since the presenter
+    // is that queue's only producer.
+    hdmi_fb_dirty_all(&fb->dirty);
+    player_frame_t frame = {.index = last_index + 1, .time_ns = -1};
+    int res = player->source.get_frame(player->source.ctx, fb, &frame);
+    if (res == AVERROR_EOF) {
+      fputs("TRACE: Hit EOF on video\n", stderr);
+      break;
+    } else if (res != 0) {
+      fprintf(stderr, "Error: got %d when decoding video\n", res);
+      holding = true;
+      continue;
+    }
+    // Remember to flush the framebuffer from the cache before presenting. Only
+    // the parts the source wrote need it.
+    uint64_t flush_start = telemetry_now_ns();
+    hdmi_fb_flush_dirty(player->alloc, fb);
+    telemetry_record(player->config.telemetry, TELEMETRY_FLUSH,
+                     telemetry_now_ns() - flush_start);
+
+    // Hand it off. The ready queue can hold every framebuffer, so this always
+    // succeeds.
+    player->frames[idx] = frame;
+    last_index = frame.index;
+    spsc_push(player->ready, idx);
+  }
+
+  atomic_store(&player->decoder_done, true);
+  return NULL;
+}
+
+//! \brief Get the next decoded framebuffer, waiting if needed
+//! \param[out] idx Where to write the index of the framebuffer
+//! \return Whether there was a frame, or `false` if the decoder is done
+static bool next_ready(player_t *player, size_t *idx) {
+  while (true) {
+    if (spsc_pop(player->ready, idx))
+      return true;
+    // Check for completion only after a failed pop. The decoder pushes its
+    // last frame before it signals that it's done, so if it's done and the
+    // queue is still empty, there won't be any more frames.
+    if (atomic_load(&player->decoder_done))
+      return spsc_pop(player->ready, idx);
+    queue_backoff();
+  }
+}
+
+int64_t player_frame_offset(int fdiv, const player_frame_t *origin,
+                            const player_frame_t *frame, int64_t prev_offset) {
+  // If we were given a divider, that overrides everything
+  if (fdiv != 0)
+    return (frame->index - origin->index) * fdiv;
+  // Otherwise, go by the timestamps if we have them. Round to the nearest
+  // refresh, being careful to round down for negative numbers too.
+  if (frame->time_ns < 0 || origin->time_ns < 0)
+    return prev_offset + 1;
+  const int64_t NS = 1000000000;
+  int64_t scaled =
+      (frame->time_ns - origin->time_ns) * HDMI_REFRESH_HZ + NS / 2;
+  int64_t ret = scaled / NS;
+  if (scaled % NS < 0)
+    ret--;
+  return ret;
+}
+
+bool player_start(player_t *player) {
+  // Edge case handling
+  if (player == NULL)
+    return false;
+  if (player->decoder_started)
+    return true;
+  if (pthread_create(&player->decoder, NULL, decoder_main, player) != 0)
+    return false;
+  player->decoder_started = true;
+  return true;
+}
+
+bool player_run(player_t *player) {
+
+  // Edge case handling
+  if (player == NULL)
+    return false;
+
+  // Start decoding, unless we already have
+  if (!player_start(player))
+    return false;
+
+  // Let the decoder get ahead before we start presenting. We wait until the
+  // ring is full, or until there's nothing more to decode.
+  while (spsc_size(player->ready) < player->config.depth &&
+         !atomic_load(&player->decoder_done))
+    queue_backoff();
+
+  telemetry_t *const tel = player->config.telemetry;
+  player->presented = 0u;
+  player->missed = 0u;
+  player->dropped = 0u;
+  player->max_lag = 0u;
+  player->rescheduled = 0u;
+
+  // Present frames until we run out. We have to keep track of which
+  // framebuffer is on screen, since we can only recycle it once the device has
+  // moved on to the next one. We also have to remember when the first frame
+  // was shown, since every other frame is scheduled relative to it.
+  size_t shown = 0u;
+  hdmi_fid_t origin_fid = 0u;
+  player_frame_t origin = {0};
+  int64_t prev_offset = 0;
+  bool first = true;
+  size_t idx;
+  while (next_ready(player, &idx)) {
+
+    if (first) {
+      // If this is our first frame, we can just immediately present it. We also
+      // have to start the device, and remember which frame we presented on so
+      // the rest can be scheduled.
+      hdmi_dev_set_fb(player->fbs[idx]);
+      hdmi_dev_start();
+      player->first_frame_ns = telemetry_now_ns();
+      origin_fid = hdmi_dev_coordinate().fid;
+      origin = player->frames[idx];
+      prev_offset = 0;
+
+    } else {
+      // Figure out which refresh this frame is due on. The frame ids wrap, but
+      // we only ever compare against ones that are close. Also remember how
+      // many refreshes this frame is meant to last, at least roughly.
+      int64_t offset = player_frame_offset(
+          player->config.fdiv, &origin, &player->frames[idx], prev_offset);
+      int64_t interval = offset - prev_offset < 1 ? 1 : offset - prev_offset;
+      prev_offset = offset;
+      hdmi_fid_t due = hdmi_fid_add(origin_fid, (int_fast16_t)(offset & 0xfff));
+
+      // We'll use this variable throughout this section to keep track of where
+      // the device is currently
+      hdmi_coordinate_t cur = hdmi_dev_coordinate();
+      int_fast16_t to_due = hdmi_fid_delta(due, cur.fid);
+
+      // Check that we're going to meet the deadline. We need to present before
+      // the refresh the frame is due on, so we need some margin before the end
+      // of the one before it. We'll make sure we're still before its last line.
+      // 31us should be plenty. If we're late, count by how many refreshes.
+      size_t late = 0u;
+      if (to_due <= 0)
+        late = (size_t)(1 - to_due);
+      else if (to_due == 1 && cur.row >= HDMI_FRAME_ROWS - 1u)
+        late = 1u;
+
+      // A live source can only fall behind, so a late live frame isn't missed.
+      // Move the schedule back so it's due on the first refresh we can still
+      // make, and schedule the frames after it from there.
+      if (late != 0u && player->frames[idx].live) {
+        int_fast16_t shift = (int_fast16_t)(1 - to_due);
+        if (cur.row >= HDMI_FRAME_ROWS - 1u)
+          shift++;
+        origin_fid = hdmi_fid_add(origin_fid, shift);
+        due = hdmi_fid_add(due, shift);
+        to_due += shift;
+        late = 0u;
+        player->rescheduled++;
+      }
+      if (late > player->max_lag)
+        player->max_lag = late;
+
+      // Ask the source to skip work if we're whole frames behind, and to stop
+      // once we're back on time. In between, leave it alone so it doesn't
+      // flip back and forth.
+      size_t late_frames = late / (size_t)interval;
+      if (late == 0u)
+        atomic_store(&player->catchup, PLAYER_CATCHUP_NONE);
+      else if (late_frames >= PLAYER_NONKEY_LAG)
+        atomic_store(&player->catchup, PLAYER_CATCHUP_NONKEY);
+      else if (late_frames >= 1u &&
+               atomic_load(&player->catchup) == PLAYER_CATCHUP_NONE)
+        atomic_store(&player->catchup, PLAYER_CATCHUP_NONREF);
+
+      // If the next frame would be shown no later than this one, there's no
+      // point in showing this one at all. Only drop it if the next one is
+      // actually ready though, or we'd never show anything while the source is
+      // too slow.
+      hdmi_fid_t show = late != 0u ? hdmi_fid_add(cur.fid, 1) : due;
+      bool drop = false;
+      size_t next;
+      if (spsc_peek(player->ready, &next)) {
+        int64_t next_offset = player_frame_offset(
+            player->config.fdiv, &origin, &player->frames[next], offset);
+        hdmi_fid_t next_due =
+            hdmi_fid_add(origin_fid, (int_fast16_t)(next_offset & 0xfff));
+        drop = hdmi_fid_delta(next_due, show) <= 0;
+      }
+      if (drop) {
+        player->dropped++;
+        telemetry_record(tel, TELEMETRY_SLACK, 0u);
+        spsc_push(player->free, idx);
+        telemetry_poll(tel, stderr);
+        continue;
+      }
+
+      uint64_t wait_ns = 0u;
+      uint64_t present_ns = 0u;
+      if (late != 0u) {
+        // We missed the deadline, but this is still the best frame to show.
+        // Present it on the very next refresh. The device may have moved on
+        // since we last looked, so check which frame it's on only after
+        // presenting. The one after that is the first sure to use the new
+        // framebuffer. Complain only once that's done, since printing takes
+        // time we don't have.
+        player->missed++;
+        telemetry_record(tel, TELEMETRY_SLACK, 0u);
+        uint64_t present_start = telemetry_now_ns();
+        hdmi_dev_set_fb(player->fbs[idx]);
+        hdmi_fid_t presented_fid = hdmi_dev_coordinate().fid;
+        present_ns += telemetry_now_ns() - present_start;
+        uint64_t wait_start = telemetry_now_ns();
+        wait_frame(player, hdmi_fid_add(presented_fid, 1));
+        wait_ns += telemetry_now_ns() - wait_start;
+        fputs("WARN: missed deadline\n", stderr);
+
+      } else {
+        // Record how many lines we had to spare
+        int_fast32_t rows = HDMI_FRAME_ROWS;
+        int_fast32_t slack =
+            (to_due - 1) * rows + (rows - 1) - (int_fast32_t)cur.row;
+        telemetry_record(tel, TELEMETRY_SLACK, (uint64_t)slack);
+
+        // We need to make sure the HDMI Peripheral has in fact switched to the
+        // new framebuffer before we recycle the old one. Specifically, we need
+        // to tell the device about the new framebuffer during the refresh
+        // before the one it's due on, then wait for the one it's due on to
+        // actually start before continuing. Both waits sleep for most of the
+        // time, so the decoder gets the CPU.
+        uint64_t wait_start = telemetry_now_ns();
+        wait_frame(player, hdmi_fid_add(due, -1));
+        wait_ns += telemetry_now_ns() - wait_start;
+        // Give the peripheral the new framebuffer
+        uint64_t present_start = telemetry_now_ns();
+        hdmi_dev_set_fb(player->fbs[idx]);
+        present_ns += telemetry_now_ns() - present_start;
+        // The new framebuffer won't start being used until the start of the
+        // next frame, so wait for that
+        wait_start = telemetry_now_ns();
+        wait_frame(player, due);
+        wait_ns += telemetry_now_ns() - wait_start;
+      }
+
+      // The device is now reading from the new framebuffer, so the old one can
+      // be decoded into again. The free queue can hold every framebuffer, so
+      // this always succeeds.
+      uint64_t present_start = telemetry_now_ns();
+      spsc_push(player->free, shown);
+      present_ns += telemetry_now_ns() - present_start;
+      telemetry_record(tel, TELEMETRY_WAIT, wait_ns);
+      telemetry_record(tel, TELEMETRY_PRESENT, present_ns);
+    }
+
+    // Print a summary if someone asked for one
+    telemetry_poll(tel, stderr);
+
+    // Next
+    player->presented++;
+    shown = idx;
+    first = false;
+  }
+
+  // The decoder is done, so reap it
+  pthread_join(player->decoder, NULL);
+  player->decoder_started = false;
+  return true;
+}
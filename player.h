@@ -0,0 +1,231 @@
+//! \file player.h
+//! \brief Play a video on the HDMI Peripheral
+//!
+//! Playback is split across two threads. A decoding thread fills a ring of
+//! framebuffers ahead of time, and the presenting thread (the caller of
+//! `player_run`) hands them to the device on schedule. The two are connected by
+//! a pair of lock-free queues: one carrying decoded framebuffers to the
+//! presenter, and one carrying framebuffers the device is done with back to the
+//! decoder. That way, an occasional expensive frame is absorbed by the frames
+//! already waiting in the ring instead of causing a missed deadline.
+
+#pragma once
+
+#include "hdmi_fb.h"
+#include "spsc.h"
+#include "telemetry.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Minimum number of framebuffers in the ring
+//!
+//! We need one for the frame being displayed, and one for the frame that will
+//! be displayed next.
+#define PLAYER_MIN_DEPTH 2u
+//! \brief Maximum number of framebuffers in the ring
+#define PLAYER_MAX_DEPTH 64u
+
+//! \brief How much work a source should skip to catch up
+//!
+//! When frames are late, the presenter asks the source to produce them faster
+//! by skipping some. It goes back to `PLAYER_CATCHUP_NONE` once frames are on
+//! time again.
+typedef enum player_catchup_t {
+  //! \brief Produce every frame
+  PLAYER_CATCHUP_NONE,
+  //! \brief Skip frames that no other frame depends on
+  PLAYER_CATCHUP_NONREF,
+  //! \brief Skip everything but keyframes
+  PLAYER_CATCHUP_NONKEY,
+} player_catchup_t;
+
+//! \brief How many frames behind we have to be to only decode keyframes
+#define PLAYER_NONKEY_LAG 30
+
+//! \brief When a frame should be shown, as reported by its source
+typedef struct player_frame_t {
+  //! \brief Number of the frame, counting from the start of the content
+  int64_t index;
+  //! \brief Presentation time relative to the start of the content, in
+  //!        nanoseconds, or -1 if it's unknown
+  int64_t time_ns;
+  //! \brief Whether the frame comes from a live source with no clock of its
+  //!        own, which can't get ahead and can only fall behind
+  //! \details A live frame that's late moves the schedule back instead of
+  //!          counting as missed
+  bool live;
+} player_frame_t;
+
+//! \brief Figure out how many refreshes after the first frame a frame is due
+//!
+//! This is the schedule `player_run` keeps, as described there.
+//!
+//! \param[in] fdiv The frame-rate divider, or zero to go by timestamps
+//! \param[in] origin The first frame that was shown
+//! \param[in] frame The frame to schedule
+//! \param[in] prev_offset What this returned for the frame before
+int64_t player_frame_offset(int fdiv, const player_frame_t *origin,
+                            const player_frame_t *frame, int64_t prev_offset);
+
+//! \brief Where the player gets frames from
+//!
+//! The decoding thread calls `get_frame` with `ctx` to fill each framebuffer.
+//! It follows the same convention as `video_get_frame`: it returns zero on
+//! success, `AVERROR_EOF` once there are no more frames, and any other error if
+//! just that frame failed.
+//!
+//! Every tile of the framebuffer is marked dirty before the call. Sources that
+//! know which tiles they changed can narrow that down, and then only those
+//! tiles are flushed.
+//!
+//! The source also describes the frame in `frame`. It's initialized to follow
+//! on from the last frame with an unknown time, so sources that can't skip
+//! frames and don't know timestamps don't have to touch it. A source that
+//! skips frames to catch up should report the gap, and a live source should
+//! mark its frames as such.
+//!
+//! If `set_catchup` isn't `NULL`, it's called from the decoding thread
+//! whenever the presenter wants the source to skip more or less work.
+typedef struct player_source_t {
+  int (*get_frame)(void *ctx, hdmi_fb_handle_t *fb, player_frame_t *frame);
+  void (*set_catchup)(void *ctx, player_catchup_t catchup);
+  void *ctx;
+} player_source_t;
+
+//! \brief Parameters for playback
+typedef struct player_config_t {
+  //! \brief Number of framebuffers to allocate for the ring
+  //! \details Must be in [`PLAYER_MIN_DEPTH`, `PLAYER_MAX_DEPTH`]
+  size_t depth;
+  //! \brief Frame-rate divider applied to the device's 60Hz refresh rate
+  //!
+  //! If this is zero, frames are scheduled by their timestamps instead. Frames
+  //! without one are shown one refresh after the frame before them.
+  int fdiv;
+  //! \brief Whether to sleep on vsync events while waiting for frames
+  //!
+  //! If this is set, `hdmi_dev_vsync_open` must have been called for row
+  //! zero. The presenter then sleeps in `poll` until each frame starts,
+  //! instead of using `hdmi_dev_wait`.
+  bool vsync;
+  //! \brief Where to record flushing and presentation times, or `NULL`
+  //!
+  //! The presenter also prints a summary from here whenever one is requested
+  //! with `telemetry_request_dump`. This must outlive the player.
+  telemetry_t *telemetry;
+} player_config_t;
+
+//! \brief State shared between the decoding and presenting threads
+//!
+//! The framebuffers are referred to by their index in `fbs`. Initially, all of
+//! them are in the `free` queue. The decoder pops from `free`, decodes into the
+//! framebuffer, and pushes it onto `ready`. The presenter pops from `ready`,
+//! displays it, and pushes the framebuffer it replaced back onto `free`.
+typedef struct player_t {
+  //! \brief Where frames come from, and how to flush them
+  //! \details These are not owned by the player
+  //! @{
+  player_source_t source;
+  hdmi_fb_allocator_t *alloc;
+  //! @}
+
+  //! \brief Configuration this player was opened with
+  player_config_t config;
+
+  //! \brief The ring of framebuffers
+  //! \details These all point into `pool`
+  //! @{
+  hdmi_fb_pool_t *pool;
+  hdmi_fb_handle_t *fbs[PLAYER_MAX_DEPTH];
+  spsc_t *free;
+  spsc_t *ready;
+  //! @}
+  //! \brief The frame in each framebuffer, as reported by the source
+  //! \details The queues order accesses to these
+  player_frame_t frames[PLAYER_MAX_DEPTH];
+
+  //! \brief The decoding thread
+  pthread_t decoder;
+  //! \brief Whether `decoder` was started and needs to be joined
+  bool decoder_started;
+  //! \brief Set by the decoder after it pushes its last frame
+  atomic_bool decoder_done;
+  //! \brief Set by the presenter to ask the decoder to stop early
+  atomic_bool stop;
+  //! \brief Set by the presenter to a `player_catchup_t` for the source
+  atomic_int catchup;
+
+  //! \brief Statistics from the last call to `player_run`
+  //! @{
+  size_t presented;
+  //! \brief Frames presented late, but still presented
+  size_t missed;
+  //! \brief Frames discarded because a later one was due
+  size_t dropped;
+  //! \brief Furthest behind schedule a frame ever was, in refreshes
+  size_t max_lag;
+  //! \brief Live frames that were late, and moved the schedule back
+  size_t rescheduled;
+  //! \brief When the first frame was shown, as from `telemetry_now_ns`
+  uint64_t first_frame_ns;
+  //! @}
+} player_t;
+
+//! \brief Create a player
+//!
+//! This allocates the framebuffers for the ring, all from one pool, and the
+//! queues connecting the two threads. The source's context and the allocator
+//! must outlive the player.
+//!
+//! \return A pointer to the player on the heap, or `NULL` on failure
+player_t *player_open(const player_source_t *source,
+                      hdmi_fb_allocator_t *alloc,
+                      const player_config_t *config);
+//! \brief Inverse of `player_open`
+//!
+//! The framebuffers are freed, so the HDMI Peripheral must not be reading from
+//! them anymore. It is legal to close a `NULL` player.
+void player_close(player_t *player);
+
+//! \brief Start decoding into the ring, without presenting anything
+//!
+//! This starts the decoding thread early, so the first frames can be decoded
+//! while the rest of the program is still starting up. The device doesn't
+//! have to be open yet. Calling it again does nothing.
+//!
+//! \return Whether the decoding thread is running
+bool player_start(player_t *player);
+
+//! \brief Play the video until it ends
+//!
+//! This starts the decoding thread if `player_start` hasn't, waits for it to
+//! fill the ring, then starts the HDMI Peripheral and presents frames from the
+//! calling thread. The device must already be open. It is left running on the
+//! last frame when this function returns.
+//!
+//! Each frame is due on the refresh nearest its timestamp, counting from when
+//! the first frame was shown. With 24fps content, that gives the usual
+//! alternating cadence of two and three refreshes per frame, and variable
+//! frame rates just work. If `fdiv` is set, frames are instead due `fdiv`
+//! refreshes per frame number after the first one. A frame that stays on
+//! screen for several refreshes costs nothing extra - the presenter sleeps
+//! until the next one is due.
+//!
+//! Either way, a frame's deadline doesn't depend on when the previous frame
+//! was actually shown. That way, a late frame doesn't push back every frame
+//! after it. A frame that's late is shown as soon as possible. If it's so late
+//! that the next frame would be shown just as early, and that frame is ready,
+//! it's dropped instead. While frames are late, the source is asked to skip
+//! work until it catches up.
+//!
+//! Live frames are the exception. Their source can't catch up, so a late live
+//! frame is shown as soon as possible, and the frames after it are scheduled
+//! relative to it instead. Otherwise, a source slower than its schedule would
+//! fall further behind with every frame.
+//!
+//! \return Whether playback ran to the end of the video
+bool player_run(player_t *player);
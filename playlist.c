@@ -0,0 +1,297 @@
+#include "playlist.h"
+
+#include "hdmi_dev.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Interval to assume for a frame when nothing says otherwise
+//! \details This is one refresh of the device
+static const int64_t DEFAULT_INTERVAL_NS = 1000000000 / HDMI_REFRESH_HZ;
+
+//! \brief Read the list of files from a playlist
+//! \return Whether the file could be read and listed at least one item
+static bool load(playlist_t *playlist, const char *filename) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+    return false;
+  size_t capacity = 0u;
+  char *line = NULL;
+  size_t line_size = 0u;
+  bool ok = true;
+  while (ok && getline(&line, &line_size, file) != -1) {
+    // Trim whitespace from both ends, and skip comments and blank lines
+    char *begin = line;
+    while (isspace((unsigned char)*begin))
+      begin++;
+    char *end = begin + strlen(begin);
+    while (end > begin && isspace((unsigned char)end[-1]))
+      end--;
+    *end = '\0';
+    if (*begin == '\0' || *begin == '#')
+      continue;
+    // Add it to the list
+    if (playlist->count == capacity) {
+      size_t grown = capacity != 0u ? 2u * capacity : 16u;
+      char **files = realloc(playlist->files, grown * sizeof(char *));
+      ok = files != NULL;
+      if (!ok)
+        break;
+      playlist->files = files;
+      capacity = grown;
+    }
+    ok = (playlist->files[playlist->count] = strdup(begin)) != NULL;
+    if (ok)
+      playlist->count++;
+  }
+  free(line);
+  fclose(file);
+  return ok && playlist->count != 0u;
+}
+
+//! \brief Open the first item that can be played, starting at `next_item`
+//!
+//! The video is reused if one is given, and closed if it can't be. Items that
+//! can't be opened, or that don't have a single frame, are skipped. Every
+//! item is tried at most once.
+//!
+//! \param[inout] video The video to reuse, or `NULL`. It's replaced with the
+//!                     one opened, or `NULL` if it had to be closed.
+//! \param[inout] item The item to start at. It's replaced with the one after
+//!                    the one opened.
+//! \param[inout] stats Where to count items skipped and decoders reused
+//! \return Whether an item was opened
+static bool prepare(const playlist_t *playlist, video_t **video, size_t *item,
+                    playlist_stats_t *stats) {
+  for (size_t tried = 0u; tried < playlist->count; tried++) {
+    if (*item == playlist->count && !playlist->loop)
+      return false;
+    if (*item == playlist->count)
+      *item = 0u;
+    const char *file = playlist->files[(*item)++];
+
+    // Reuse the video if we have one. If that fails, it's no good anymore.
+    if (*video != NULL) {
+      size_t reuses = (*video)->decoder_reuses;
+      if (video_reopen(*video, file)) {
+        stats->decoder_reuses += (*video)->decoder_reuses - reuses;
+      } else {
+        video_close(*video);
+        *video = NULL;
+      }
+    } else {
+      *video = video_open(file, &playlist->config);
+    }
+    if (*video != NULL && video_preroll(*video, PLAYLIST_PREROLL) == 0 &&
+        (*video)->held_count != 0u)
+      return true;
+    fprintf(stderr, "Error: failed to play %s, skipping it\n", file);
+    stats->skipped++;
+  }
+  return false;
+}
+
+//! \brief Entry point for the background thread
+//!
+//! Whenever the state is `PLAYLIST_PREPARING`, this prepares the video that
+//! isn't playing for the next item, then marks it ready. The lock isn't held
+//! while preparing, but nothing else touches that video meanwhile.
+static void *playlist_main(void *arg) {
+  playlist_t *pl = arg;
+  pthread_mutex_lock(&pl->lock);
+  while (!pl->stop) {
+    if (pl->state != PLAYLIST_PREPARING) {
+      pthread_cond_wait(&pl->cond, &pl->lock);
+      continue;
+    }
+    size_t spare = 1u - pl->playing;
+    video_t *video = pl->videos[spare];
+    size_t item = pl->next_item;
+    playlist_stats_t stats = {0};
+    pthread_mutex_unlock(&pl->lock);
+    bool ok = prepare(pl, &video, &item, &stats);
+    pthread_mutex_lock(&pl->lock);
+    pl->videos[spare] = video;
+    pl->next_item = item;
+    pl->stats.skipped += stats.skipped;
+    pl->stats.decoder_reuses += stats.decoder_reuses;
+    pl->state = ok ? PLAYLIST_READY : PLAYLIST_DONE;
+    pthread_cond_broadcast(&pl->cond);
+  }
+  pthread_mutex_unlock(&pl->lock);
+  return NULL;
+}
+
+playlist_t *playlist_open(const char *filename, const video_config_t *config) {
+
+  // Edge case handling
+  static const video_config_t DEFAULT_CONFIG = {0};
+  if (config == NULL)
+    config = &DEFAULT_CONFIG;
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state. Only the playlist loops, not the items in it.
+  playlist_t *ret = calloc(1u, sizeof(playlist_t));
+  if (ret == NULL)
+    return NULL;
+  ret->config = *config;
+  ret->config.loop = false;
+  ret->loop = config->loop;
+  ret->discard = AVDISCARD_DEFAULT;
+  ret->frame_index = -1;
+  ret->frame_time_ns = -1;
+  ret->frame_interval_ns = -1;
+  ret->state = PLAYLIST_PREPARING;
+
+  // Read the list, and open the first item we can
+  if (!load(ret, filename))
+    goto failure;
+  if (!prepare(ret, &ret->videos[0], &ret->next_item, &ret->stats))
+    goto failure;
+  ret->stats.started = 1u;
+
+  // Start preparing the next item
+  if (pthread_mutex_init(&ret->lock, NULL) != 0)
+    goto failure;
+  if (pthread_cond_init(&ret->cond, NULL) != 0) {
+    pthread_mutex_destroy(&ret->lock);
+    goto failure;
+  }
+  if (pthread_create(&ret->thread, NULL, playlist_main, ret) != 0) {
+    pthread_cond_destroy(&ret->cond);
+    pthread_mutex_destroy(&ret->lock);
+    goto failure;
+  }
+  ret->thread_started = true;
+  return ret;
+
+failure:
+  playlist_close(ret);
+  return NULL;
+}
+
+void playlist_close(playlist_t *playlist) {
+  // Edge case handling
+  if (playlist == NULL)
+    return;
+  // Stop the background thread first, since it might be using a video
+  if (playlist->thread_started) {
+    pthread_mutex_lock(&playlist->lock);
+    playlist->stop = true;
+    pthread_cond_broadcast(&playlist->cond);
+    pthread_mutex_unlock(&playlist->lock);
+    pthread_join(playlist->thread, NULL);
+    pthread_cond_destroy(&playlist->cond);
+    pthread_mutex_destroy(&playlist->lock);
+  }
+  video_close(playlist->videos[0]);
+  video_close(playlist->videos[1]);
+  for (size_t i = 0u; i < playlist->count; i++)
+    free(playlist->files[i]);
+  free(playlist->files);
+  free(playlist);
+}
+
+video_t *playlist_video(playlist_t *playlist) {
+  return playlist != NULL ? playlist->videos[playlist->playing] : NULL;
+}
+
+//! \brief Switch to the next item, waiting for it to be prepared if it isn't
+//! \return Whether there was a next item
+static bool advance(playlist_t *pl) {
+  uint64_t start = telemetry_now_ns();
+  pthread_mutex_lock(&pl->lock);
+  while (pl->state == PLAYLIST_PREPARING)
+    pthread_cond_wait(&pl->cond, &pl->lock);
+  if (pl->state == PLAYLIST_DONE) {
+    pthread_mutex_unlock(&pl->lock);
+    return false;
+  }
+  uint64_t wait_ns = telemetry_now_ns() - start;
+  pl->stats.wait_ns_total += wait_ns;
+  if (wait_ns > pl->stats.wait_ns_max)
+    pl->stats.wait_ns_max = wait_ns;
+  pl->stats.started++;
+
+  // Swap the videos, and have the old one prepared for the item after
+  pl->playing = 1u - pl->playing;
+  pl->state = PLAYLIST_PREPARING;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->lock);
+
+  // Carry the numbering and timing on from the end of the last item. The
+  // first frame was decoded ahead, so we know where the new item starts.
+  video_t *video = pl->videos[pl->playing];
+  const video_held_t *first = &video->held[video->held_next];
+  pl->index_offset = pl->frame_index + 1 - first->index;
+  if (pl->frame_time_ns >= 0 && first->time_ns >= 0) {
+    int64_t interval = pl->frame_interval_ns >= 0 ? pl->frame_interval_ns
+                                                  : DEFAULT_INTERVAL_NS;
+    pl->time_offset_ns = pl->frame_time_ns + interval - first->time_ns;
+  }
+  pl->frame_interval_ns = -1;
+  video_set_discard(video, pl->discard);
+  return true;
+}
+
+//! \brief Read one frame, with `video_get_frame_fb` if `fb` isn't `NULL`
+//! \details Otherwise, this uses `video_get_frame_diff`
+static int get_frame(playlist_t *playlist, uint32_t *framebuffer,
+                     hdmi_fb_dirty_t *dirty, hdmi_fb_handle_t *fb, bool diff) {
+  // Edge case handling
+  if (playlist == NULL)
+    return AVERROR(EINVAL);
+
+  while (true) {
+    video_t *video = playlist->videos[playlist->playing];
+    int res = fb != NULL ? video_get_frame_fb(video, fb, diff)
+                         : video_get_frame_diff(video, framebuffer, dirty);
+    if (res == AVERROR_EOF && advance(playlist))
+      continue;
+    if (res != 0)
+      return res;
+
+    // Number and time the frame as part of the whole playlist. Remember how
+    // long it lasts, in case it's the last one in its item.
+    playlist->frame_index = video->frame_index + playlist->index_offset;
+    int64_t prev_time_ns = playlist->frame_time_ns;
+    playlist->frame_time_ns = video->frame_time_ns >= 0
+                                  ? video->frame_time_ns +
+                                        playlist->time_offset_ns
+                                  : -1;
+    if (prev_time_ns >= 0 && playlist->frame_time_ns > prev_time_ns)
+      playlist->frame_interval_ns = playlist->frame_time_ns - prev_time_ns;
+    return 0;
+  }
+}
+
+int playlist_get_frame(playlist_t *playlist, uint32_t *framebuffer,
+                       hdmi_fb_dirty_t *dirty) {
+  return get_frame(playlist, framebuffer, dirty, NULL, false);
+}
+
+int playlist_get_frame_fb(playlist_t *playlist, hdmi_fb_handle_t *fb,
+                          bool diff) {
+  if (fb == NULL)
+    return AVERROR(EINVAL);
+  return get_frame(playlist, NULL, NULL, fb, diff);
+}
+
+void playlist_set_discard(playlist_t *playlist, enum AVDiscard discard) {
+  if (playlist == NULL)
+    return;
+  playlist->discard = discard;
+  video_set_discard(playlist->videos[playlist->playing], discard);
+}
+
+playlist_stats_t playlist_stats(playlist_t *playlist) {
+  playlist_stats_t ret = {0};
+  if (playlist == NULL)
+    return ret;
+  pthread_mutex_lock(&playlist->lock);
+  ret = playlist->stats;
+  pthread_mutex_unlock(&playlist->lock);
+  return ret;
+}
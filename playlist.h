@@ -0,0 +1,143 @@
+//! \file playlist.h
+//! \brief Play a list of videos back to back, without gaps
+//!
+//! A playlist keeps two videos open. One is playing, and the other is prepared
+//! on a background thread: switched over to the next item with `video_reopen`,
+//! and its first few frames decoded with `video_preroll`. When the playing
+//! video ends, the two swap. The next item's first frames are already decoded,
+//! so it only has to be converted like any other frame, and the player's ring
+//! never runs dry.
+//!
+//! Frames are numbered and timed as if the items were one long video. Each
+//! item's timestamps carry on from the end of the item before, so the player
+//! shows the first frame of an item on the refresh after the last frame of the
+//! previous one ends. The player keeps running throughout, and so does the
+//! device.
+
+#pragma once
+
+#include "video.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Number of frames of the next item to decode ahead
+//! \details This covers the first frame and the decoder's startup delay
+#define PLAYLIST_PREROLL 3u
+
+//! \brief What the background thread is doing
+typedef enum playlist_state_t {
+  //! \brief Preparing the next item
+  PLAYLIST_PREPARING,
+  //! \brief The next item is ready to play
+  PLAYLIST_READY,
+  //! \brief There are no more items that can be played
+  PLAYLIST_DONE,
+} playlist_state_t;
+
+//! \brief Counters describing how playback went
+typedef struct playlist_stats_t {
+  //! \brief Number of items started, and number that couldn't be played
+  //! @{
+  size_t started;
+  size_t skipped;
+  //! @}
+  //! \brief Number of times an item reused the decoder from two items before
+  size_t decoder_reuses;
+  //! \brief Time the decoding thread waited for the next item to be ready
+  //! \details This is zero if every item was prepared in time
+  //! @{
+  uint64_t wait_ns_total;
+  uint64_t wait_ns_max;
+  //! @}
+} playlist_stats_t;
+
+//! \brief A list of videos, and the state of playing through them
+//!
+//! Everything from `lock` on is protected by it. The other fields are only
+//! used by the thread calling `playlist_get_frame`.
+typedef struct playlist_t {
+  //! \brief Paths to every item
+  //! @{
+  char **files;
+  size_t count;
+  //! @}
+  //! \brief Whether to go back to the first item after the last one
+  bool loop;
+  //! \brief What each video is opened with
+  video_config_t config;
+  //! \brief What the decoder may skip, applied to every item
+  enum AVDiscard discard;
+
+  //! \brief Number and time of the last frame returned, across all items
+  //! \details These are like `frame_index` and `frame_time_ns` in `video_t`
+  //! @{
+  int64_t frame_index;
+  int64_t frame_time_ns;
+  //! @}
+  //! \brief Added to each frame's number and time in the current item
+  //! @{
+  int64_t index_offset;
+  int64_t time_offset_ns;
+  //! @}
+  //! \brief How long the last frame returned lasts, or -1 if it's unknown
+  int64_t frame_interval_ns;
+
+  //! \brief The background thread
+  pthread_t thread;
+  bool thread_started;
+  pthread_mutex_t lock;
+  //! \brief Signalled whenever `state` or `stop` changes
+  pthread_cond_t cond;
+  playlist_state_t state;
+  bool stop;
+  //! \brief The two videos, and which one is playing
+  //! \details The other one is `NULL` until it's first prepared
+  //! @{
+  video_t *videos[2];
+  size_t playing;
+  //! @}
+  //! \brief Next item the background thread will try to prepare
+  size_t next_item;
+  playlist_stats_t stats;
+} playlist_t;
+
+//! \brief Open a playlist, and start playing its first item
+//!
+//! The playlist is a text file listing one video per line. Blank lines and
+//! lines starting with `#` are ignored. The first item that can be opened is
+//! opened here, and the background thread starts preparing the one after it.
+//!
+//! \param[in] filename The playlist to read
+//! \param[in] config Options for every video. If `loop` is set, the playlist
+//!                   loops instead of each video.
+//! \return A handle to the playlist, or `NULL` on failure
+playlist_t *playlist_open(const char *filename, const video_config_t *config);
+//! \brief Inverse of `playlist_open`
+//! \details It is legal to close a `NULL` playlist
+void playlist_close(playlist_t *playlist);
+
+//! \brief The video that's playing
+//! \details This changes as the playlist moves on, so don't hold onto it
+video_t *playlist_video(playlist_t *playlist);
+
+//! \brief Read one frame, moving on to the next item at the end of each one
+//!
+//! This is like `video_get_frame_diff`. It only returns `AVERROR_EOF` after
+//! the last frame of the last item, and never if the playlist loops. After
+//! each frame, `frame_index` and `frame_time_ns` describe it.
+int playlist_get_frame(playlist_t *playlist, uint32_t *framebuffer,
+                       hdmi_fb_dirty_t *dirty);
+//! \brief Read one frame into a framebuffer
+//! \details This is like `playlist_get_frame`, but with `video_get_frame_fb`
+int playlist_get_frame_fb(playlist_t *playlist, hdmi_fb_handle_t *fb,
+                          bool diff);
+
+//! \brief Set which frames the decoder may skip, for this and later items
+//! \details This must be called from the thread that calls `get_frame`
+void playlist_set_discard(playlist_t *playlist, enum AVDiscard discard);
+
+//! \brief Get a snapshot of the playlist's counters
+playlist_stats_t playlist_stats(playlist_t *playlist);
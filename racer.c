@@ -0,0 +1,228 @@
+#include "racer.h"
+
+#include "hdmi_dev.h"
+
+#include <libavutil/avutil.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//! \brief Number of lines the device shows, out of `HDMI_FRAME_ROWS`
+static const uint_fast16_t VISIBLE_ROWS =
+    HDMI_FB_TILE_ROWS * HDMI_FB_TILE_HEIGHT;
+
+//! \brief How many lines the beam has to scan from `cur` to reach row `row` of
+//!        frame `fid`
+//! \return The distance, which is negative if the beam has already passed it
+static int64_t rows_until(hdmi_coordinate_t cur, hdmi_fid_t fid,
+                          uint_fast16_t row) {
+  return (int64_t)hdmi_fid_delta(fid, cur.fid) * HDMI_FRAME_ROWS +
+         (int64_t)row - (int64_t)cur.row;
+}
+
+//! \brief How long the beam takes to scan from `cur` to the given coordinate
+//! \return The time in nanoseconds, or zero if it's already there
+static uint64_t ns_until(hdmi_coordinate_t cur, hdmi_fid_t fid,
+                         uint_fast16_t row) {
+  int64_t pixels = rows_until(cur, fid, row) * HDMI_FRAME_COLS - cur.col;
+  if (pixels <= 0)
+    return 0u;
+  return (uint64_t)pixels * 1000000000u / HDMI_PIXEL_CLOCK_HZ;
+}
+
+racer_t *racer_open(const racer_source_t *source, hdmi_fb_allocator_t *alloc,
+                    const racer_config_t *config) {
+
+  // Edge case handling
+  if (source == NULL || source->decode == NULL || source->convert == NULL ||
+      alloc == NULL || config == NULL)
+    return NULL;
+  if (config->fdiv < 0 || config->margin_rows >= VISIBLE_ROWS)
+    return NULL;
+
+  // Allocate space for the return value, and the framebuffer
+  racer_t *ret = calloc(1u, sizeof(racer_t));
+  if (ret == NULL)
+    return NULL;
+  ret->source = *source;
+  ret->alloc = alloc;
+  ret->config = *config;
+  if (ret->config.margin_rows == 0u)
+    ret->config.margin_rows = RACER_DEFAULT_MARGIN_ROWS;
+  ret->fb = hdmi_fb_allocate(alloc);
+  if (ret->fb == NULL)
+    goto failure;
+  return ret;
+
+failure:
+  racer_close(ret);
+  return NULL;
+}
+
+void racer_close(racer_t *racer) {
+  // Edge case handling
+  if (racer == NULL)
+    return;
+  hdmi_fb_free(racer->alloc, racer->fb);
+  free(racer);
+}
+
+//! \brief Decode the next frame, skipping any that fail
+//! \return Zero on success, or `AVERROR_EOF` at the end of the video
+static int next_frame(racer_t *racer, player_frame_t *frame) {
+  while (true) {
+    int res = racer->source.decode(racer->source.ctx, frame);
+    if (res == 0 || res == AVERROR_EOF)
+      return res;
+    fprintf(stderr, "Error: got %d when decoding video\n", res);
+  }
+}
+
+//! \brief Write and flush the decoded frame, racing the beam to refresh `due`
+//!
+//! Each band is written once the beam has scanned past it on the refresh
+//! before `due`, and the beam is checked once it's flushed. This records the
+//! frame's statistics, counting from `start_ns`, and adding `wait_ns` already
+//! spent waiting for the frame.
+static void race_frame(racer_t *racer, hdmi_fid_t due, uint64_t start_ns,
+                       uint64_t wait_ns) {
+  hdmi_fb_handle_t *fb = racer->fb;
+  const int64_t margin = (int64_t)racer->config.margin_rows;
+  const hdmi_fid_t before = hdmi_fid_add(due, -1);
+  int64_t min_margin = INT64_MAX;
+  uint64_t convert_ns = 0u;
+  uint64_t flush_ns = 0u;
+
+  hdmi_fb_dirty_all(&fb->dirty);
+  for (size_t tb = 0u; tb < HDMI_FB_TILE_ROWS; tb += RACER_BAND_TILE_ROWS) {
+    size_t te = tb + RACER_BAND_TILE_ROWS;
+    if (te > HDMI_FB_TILE_ROWS)
+      te = HDMI_FB_TILE_ROWS;
+    uint_fast16_t top = (uint_fast16_t)(tb * HDMI_FB_TILE_HEIGHT);
+    uint_fast16_t bottom = (uint_fast16_t)(te * HDMI_FB_TILE_HEIGHT);
+
+    // Stay behind the beam until it's done with this band for the last time
+    uint64_t t0 = telemetry_now_ns();
+    hdmi_dev_wait(before, bottom);
+    uint64_t t1 = telemetry_now_ns();
+    racer->source.convert(racer->source.ctx, fb, tb, te);
+    uint64_t t2 = telemetry_now_ns();
+    hdmi_fb_flush_band(racer->alloc, fb, tb, te);
+    uint64_t t3 = telemetry_now_ns();
+    wait_ns += t1 - t0;
+    convert_ns += t2 - t1;
+    flush_ns += t3 - t2;
+
+    // Check that we stayed ahead of the beam for the refresh it's due on
+    int64_t left = rows_until(hdmi_dev_coordinate(), due, top);
+    if (left < min_margin)
+      min_margin = left;
+  }
+  // Every band is synced already, so this only counts the frame
+  hdmi_fb_flush_dirty(racer->alloc, fb);
+
+  // The frame is fully on screen once the beam gets to the end of it
+  uint64_t end_ns = telemetry_now_ns();
+  uint64_t latency_ns =
+      end_ns - start_ns + ns_until(hdmi_dev_coordinate(), due, VISIBLE_ROWS);
+  racer->latency_ns_total += latency_ns;
+  if (latency_ns > racer->latency_ns_max)
+    racer->latency_ns_max = latency_ns;
+  if (min_margin < racer->min_margin_rows)
+    racer->min_margin_rows = min_margin;
+  if (min_margin < margin) {
+    fputs("WARN: beam caught up with a band\n", stderr);
+    racer->torn++;
+  }
+
+  telemetry_t *const tel = racer->config.telemetry;
+  telemetry_record(tel, TELEMETRY_WAIT, wait_ns);
+  telemetry_record(tel, TELEMETRY_CONVERT, convert_ns);
+  telemetry_record(tel, TELEMETRY_FLUSH, flush_ns);
+  telemetry_record(tel, TELEMETRY_SLACK,
+                   min_margin > 0 ? (uint64_t)min_margin : 0u);
+}
+
+bool racer_run(racer_t *racer) {
+
+  // Edge case handling
+  if (racer == NULL)
+    return false;
+  racer->presented = 0u;
+  racer->missed = 0u;
+  racer->torn = 0u;
+  racer->min_margin_rows = INT64_MAX;
+  racer->latency_ns_total = 0u;
+  racer->latency_ns_max = 0u;
+
+  // Write the first frame in full, and start the device on it. There's no
+  // beam to race yet. Every other frame is scheduled relative to this one.
+  player_frame_t origin = {.index = 0, .time_ns = -1};
+  int res = next_frame(racer, &origin);
+  if (res == AVERROR_EOF)
+    return true;
+  hdmi_fb_dirty_all(&racer->fb->dirty);
+  racer->source.convert(racer->source.ctx, racer->fb, 0u, HDMI_FB_TILE_ROWS);
+  hdmi_fb_flush(racer->alloc, racer->fb);
+  hdmi_dev_set_fb(racer->fb);
+  hdmi_dev_start();
+  racer->first_frame_ns = telemetry_now_ns();
+  const hdmi_fid_t origin_fid = hdmi_dev_coordinate().fid;
+  racer->presented++;
+
+  // Race every frame after it. Remember when the last frame was due, and how
+  // many refreshes the last two lasted, to guess when the next one is due.
+  // That's by the schedule, not when they were shown, so we catch up after
+  // falling behind.
+  int64_t prev_offset = 0;
+  int64_t last_index = origin.index;
+  hdmi_fid_t prev_due = origin_fid;
+  int64_t interval = racer->config.fdiv != 0 ? racer->config.fdiv : 1;
+  int64_t expected = interval;
+  while (true) {
+
+    // Don't decode the next frame any sooner than we have to, so it's as
+    // fresh as it can be when it's shown. Starting a refresh before it's
+    // likely due leaves that long to decode it and write the first band.
+    // Guessing short only costs latency, but guessing long would miss.
+    uint64_t wait_start = telemetry_now_ns();
+    hdmi_dev_wait(hdmi_fid_add(prev_due, (int_fast16_t)(expected - 1)), 0u);
+    uint64_t start_ns = telemetry_now_ns();
+    player_frame_t frame = {.index = last_index + 1, .time_ns = -1};
+    if (next_frame(racer, &frame) == AVERROR_EOF)
+      break;
+    last_index = frame.index;
+
+    // Figure out which refresh this frame is due on
+    int64_t offset = player_frame_offset(racer->config.fdiv, &origin, &frame,
+                                         prev_offset);
+    int64_t lasted = offset - prev_offset < 1 ? 1 : offset - prev_offset;
+    expected = lasted < interval ? lasted : interval;
+    interval = lasted;
+    prev_offset = offset;
+    hdmi_fid_t due = hdmi_fid_add(origin_fid, (int_fast16_t)(offset & 0xfff));
+    prev_due = due;
+
+    // The soonest we can race is the next refresh, as long as there's time to
+    // write the first band before the beam gets to it. If the frame was due
+    // before that, show it then instead.
+    hdmi_coordinate_t cur = hdmi_dev_coordinate();
+    hdmi_fid_t soonest = hdmi_fid_add(cur.fid, 1);
+    if (rows_until(cur, soonest, 0u) <=
+        (int64_t)(racer->config.margin_rows +
+                  RACER_BAND_TILE_ROWS * HDMI_FB_TILE_HEIGHT))
+      soonest = hdmi_fid_add(soonest, 1);
+    if (hdmi_fid_delta(due, soonest) < 0) {
+      fputs("WARN: missed deadline\n", stderr);
+      racer->missed++;
+      due = soonest;
+    }
+
+    race_frame(racer, due, start_ns, start_ns - wait_start);
+    racer->presented++;
+
+    // Print a summary if someone asked for one
+    telemetry_poll(racer->config.telemetry, stderr);
+  }
+  return true;
+}
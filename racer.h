@@ -0,0 +1,129 @@
+//! \file racer.h
+//! \brief Play a video by racing the beam, with a single framebuffer
+//!
+//! The player double-buffers. Every frame is written in full to a spare
+//! framebuffer, and the device only switches to it on the next refresh. That
+//! costs at least a frame of latency, and a framebuffer for every frame in
+//! flight. The racer instead writes every frame into the one framebuffer the
+//! device is always scanning out, a band of lines at a time. Each band is
+//! written after the beam has scanned it on the refresh before the frame's,
+//! and flushed before the beam gets back to it, so every refresh still shows
+//! exactly one frame. A frame is on screen during the refresh right after it's
+//! decoded, without waiting behind any others.
+//!
+//! Everything happens on the calling thread, so there's nothing to absorb an
+//! expensive frame. This suits interactive use, where latency matters more
+//! than throughput.
+
+#pragma once
+
+#include "hdmi_fb.h"
+#include "player.h"
+#include "telemetry.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Height of the bands frames are written in, in rows of tiles
+//! \details This is 32 lines, or about 1ms of scanning
+#define RACER_BAND_TILE_ROWS 2u
+//! \brief Default number of lines to keep between a band and the beam
+//!
+//! The device fetches pixels a little before it serializes them, and the
+//! coordinate is only read between bands, so a band has to be flushed some
+//! time before the beam reaches it. This is about half a millisecond.
+#define RACER_DEFAULT_MARGIN_ROWS 16u
+
+//! \brief Where the racer gets frames from
+//!
+//! A frame is decoded with `decode`, which follows the same conventions as
+//! `player_source_t`'s `get_frame`, but without writing anything. Then
+//! `convert` is called for each band in turn, from the top, to write tile rows
+//! [`tile_begin`, `tile_end`) of the frame into `fb`. Every tile of the band is
+//! marked dirty before the call. Sources that know which tiles they changed
+//! can narrow that down, and then only those tiles are flushed.
+typedef struct racer_source_t {
+  int (*decode)(void *ctx, player_frame_t *frame);
+  void (*convert)(void *ctx, hdmi_fb_handle_t *fb, size_t tile_begin,
+                  size_t tile_end);
+  void *ctx;
+} racer_source_t;
+
+//! \brief Parameters for racing the beam
+typedef struct racer_config_t {
+  //! \brief Frame-rate divider applied to the device's 60Hz refresh rate
+  //! \details This works like `player_config_t`'s
+  int fdiv;
+  //! \brief Lines to keep between the beam and a band when it's flushed
+  //! \details Zero means `RACER_DEFAULT_MARGIN_ROWS`
+  size_t margin_rows;
+  //! \brief Where to record conversion, flushing, and waiting, or `NULL`
+  //! \details This must outlive the racer
+  telemetry_t *telemetry;
+} racer_config_t;
+
+//! \brief State for racing the beam
+typedef struct racer_t {
+  //! \brief Where frames come from, and how to flush them
+  //! \details These are not owned by the racer
+  //! @{
+  racer_source_t source;
+  hdmi_fb_allocator_t *alloc;
+  //! @}
+
+  //! \brief Configuration this racer was opened with
+  racer_config_t config;
+  //! \brief The one framebuffer, which the device always scans out
+  hdmi_fb_handle_t *fb;
+
+  //! \brief Statistics from the last call to `racer_run`
+  //! @{
+  size_t presented;
+  //! \brief Frames that couldn't be shown on the refresh they were due on
+  size_t missed;
+  //! \brief Frames where the beam caught up with a band being written
+  //! \details Part of the band was shown from the frame before on one refresh
+  size_t torn;
+  //! \brief Fewest lines the beam was from a band when it was flushed
+  //! \details This is negative if the beam had already reached the band
+  int64_t min_margin_rows;
+  //! \brief Time from when each frame started decoding to when it was fully
+  //!        on screen, in nanoseconds
+  //! @{
+  uint64_t latency_ns_total;
+  uint64_t latency_ns_max;
+  //! @}
+  //! \brief When the first frame was shown, as from `telemetry_now_ns`
+  uint64_t first_frame_ns;
+  //! @}
+} racer_t;
+
+//! \brief Create a racer
+//!
+//! This allocates the one framebuffer. The source's context and the allocator
+//! must outlive the racer.
+//!
+//! \return A pointer to the racer on the heap, or `NULL` on failure
+racer_t *racer_open(const racer_source_t *source, hdmi_fb_allocator_t *alloc,
+                    const racer_config_t *config);
+//! \brief Inverse of `racer_open`
+//!
+//! The framebuffer is freed, so the HDMI Peripheral must not be reading from
+//! it anymore. It is legal to close a `NULL` racer.
+void racer_close(racer_t *racer);
+
+//! \brief Play the video until it ends
+//!
+//! The first frame is written in full and the device is started on it. After
+//! that, each frame is decoded, then written into the framebuffer band by
+//! band. Before each band, this waits for the beam to have passed it on the
+//! refresh before the one the frame is due on, and after flushing it, checks
+//! how far the beam is from reaching it again. Frames are due on the same
+//! schedule as with `player_run`. A frame that's decoded too late for its
+//! refresh is shown on the next one that can still be raced. The device must
+//! already be open. It is left running on the last frame when this function
+//! returns.
+//!
+//! \return Whether playback ran to the end of the video
+bool racer_run(racer_t *racer);
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "raw.h"
+
+#include <libavutil/avutil.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//! \brief Dimensions of every frame
+//! @{
+#define RAW_WIDTH 640u
+#define RAW_HEIGHT 480u
+//! @}
+
+//! \brief Everything a worker needs to convert its part of a YUV frame
+typedef struct raw_job_t {
+  const convert_matrix_t *matrix;
+  const uint8_t *planes[3];
+  int strides[3];
+  uint32_t *framebuffer;
+} raw_job_t;
+
+const char *raw_format_name(raw_format_t format) {
+  switch (format) {
+  case RAW_FORMAT_BGRA:
+    return "bgra";
+  case RAW_FORMAT_YUV420P:
+    return "yuv420p";
+  }
+  return "unknown";
+}
+
+raw_t *raw_open(const char *path, raw_format_t format,
+                size_t convert_threads) {
+
+  // Edge case handling
+  if (path == NULL)
+    return NULL;
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  raw_t *ret = calloc(1u, sizeof(raw_t));
+  if (ret == NULL)
+    return NULL;
+  ret->fd = -1;
+  ret->format = format;
+  ret->frame_size = format == RAW_FORMAT_BGRA
+                        ? RAW_WIDTH * RAW_HEIGHT * 4u
+                        : RAW_WIDTH * RAW_HEIGHT * 3u / 2u;
+
+  // YUV frames need somewhere to land, and threads to convert them
+  if (format == RAW_FORMAT_YUV420P) {
+    ret->planes = malloc(ret->frame_size);
+    if (ret->planes == NULL)
+      goto failure;
+    ret->matrix = convert_matrix(CONVERT_BT601, false);
+    ret->workers = workers_open(convert_threads);
+    if (ret->workers == NULL)
+      goto failure;
+  }
+
+  // Open the input
+  if (strcmp(path, "-") == 0) {
+    ret->fd = STDIN_FILENO;
+  } else {
+    ret->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ret->fd == -1)
+      goto failure;
+    ret->owns_fd = true;
+  }
+
+  // Try to make the pipe big enough for the writer to get a whole frame in.
+  // Pipes are capped at `/proc/sys/fs/pipe-max-size`, so settle for as much
+  // as we can get. That just costs more reads.
+  struct stat st;
+  if (fstat(ret->fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    int size = fcntl(ret->fd, F_GETPIPE_SZ);
+    for (int want = (int)ret->frame_size; size > 0 && want > size; want /= 2)
+      if (fcntl(ret->fd, F_SETPIPE_SZ, want) != -1) {
+        size = fcntl(ret->fd, F_GETPIPE_SZ);
+        break;
+      }
+    ret->pipe_size = size > 0 ? (size_t)size : 0u;
+  }
+  return ret;
+
+failure:
+  raw_close(ret);
+  return NULL;
+}
+
+void raw_close(raw_t *raw) {
+  // Edge case handling
+  if (raw == NULL)
+    return;
+  if (raw->owns_fd)
+    close(raw->fd);
+  workers_close(raw->workers);
+  free(raw->planes);
+  free(raw);
+}
+
+//! \brief Read until `size` bytes are in `dst`, or the stream ends
+//! \return How many bytes were read, or -1 with `errno` set on error
+static ssize_t read_full(raw_t *raw, uint8_t *dst, size_t size) {
+  size_t done = 0u;
+  while (done < size) {
+    ssize_t res = read(raw->fd, dst + done, size - done);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res == -1)
+      return -1;
+    raw->reads++;
+    if (res == 0)
+      break;
+    done += (size_t)res;
+  }
+  raw->bytes += done;
+  return (ssize_t)done;
+}
+
+//! \brief Convert this worker's share of the rows, keeping pairs together
+static void convert_part(void *arg, size_t index, size_t count) {
+  const raw_job_t *job = arg;
+  const size_t pairs = RAW_HEIGHT / 2u;
+  size_t begin = pairs * index / count * 2u;
+  size_t end = pairs * (index + 1u) / count * 2u;
+  convert_yuv420p(job->matrix, job->planes, job->strides, job->framebuffer,
+                  RAW_WIDTH, RAW_WIDTH, begin, end);
+}
+
+int raw_get_frame(raw_t *raw, hdmi_fb_handle_t *fb) {
+
+  // Edge case handling
+  if (raw == NULL || fb == NULL)
+    return AVERROR(EINVAL);
+
+  // BGRA goes straight into the framebuffer. Anything else has to be
+  // converted first.
+  uint32_t *framebuffer = hdmi_fb_data(fb);
+  uint8_t *dst = raw->planes != NULL ? raw->planes : (uint8_t *)framebuffer;
+  uint64_t read_start = telemetry_now_ns();
+  ssize_t res = read_full(raw, dst, raw->frame_size);
+  if (res == -1)
+    return AVERROR(errno);
+  telemetry_record(raw->telemetry, TELEMETRY_DEMUX,
+                   telemetry_now_ns() - read_start);
+  // A partial frame can only mean the writer went away partway through
+  if ((size_t)res != raw->frame_size)
+    return AVERROR_EOF;
+
+  if (raw->planes != NULL) {
+    const size_t luma = RAW_WIDTH * RAW_HEIGHT;
+    const raw_job_t job = {
+        .matrix = &raw->matrix,
+        .planes = {raw->planes, raw->planes + luma,
+                   raw->planes + luma + luma / 4u},
+        .strides = {RAW_WIDTH, RAW_WIDTH / 2u, RAW_WIDTH / 2u},
+        .framebuffer = framebuffer,
+    };
+    uint64_t convert_start = telemetry_now_ns();
+    workers_run(raw->workers, convert_part, (void *)&job);
+    telemetry_record(raw->telemetry, TELEMETRY_CONVERT,
+                     telemetry_now_ns() - convert_start);
+  }
+  raw->frames++;
+  return 0;
+}
@@ -0,0 +1,94 @@
+//! \file raw.h
+//! \brief Play raw frames streamed through a pipe
+//!
+//! Live content from another process would otherwise have to be encoded and
+//! muxed, just to be demuxed and decoded again. Instead, the other process can
+//! write uncompressed frames to our standard input or to a named pipe, back to
+//! back, with no header or framing.
+//!
+//! Frames must already be 640x480. BGRA frames are in exactly the format of a
+//! framebuffer, so they're read from the pipe straight into the framebuffer,
+//! with no buffer in between. YUV420P frames are read into one buffer of
+//! planes, and converted from there straight into the framebuffer.
+//!
+//! Nothing is read until the player has a framebuffer free, so a full ring
+//! stops us reading, and a full pipe then blocks the writer. The pipe is grown
+//! to hold about a frame if the system allows it, so the writer can write a
+//! whole frame without waiting for us, but can't get far ahead of what's on
+//! screen.
+
+#pragma once
+
+#include "convert.h"
+#include "hdmi_fb.h"
+#include "telemetry.h"
+#include "workers.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Layout of the frames in the stream
+typedef enum raw_format_t {
+  //! \brief One word per pixel, as in `hdmi_fb_handle_t`
+  RAW_FORMAT_BGRA,
+  //! \brief Full-size luma, then quarter-size U and V, one byte per sample
+  //! \details This is treated as BT.601 with limited range
+  RAW_FORMAT_YUV420P,
+} raw_format_t;
+
+//! \brief A stream of raw frames
+typedef struct raw_t {
+  //! \brief Where frames are read from
+  int fd;
+  //! \brief Whether `fd` was opened by us, rather than being standard input
+  bool owns_fd;
+  raw_format_t format;
+  //! \brief Size of each frame in the stream, in bytes
+  size_t frame_size;
+  //! \brief Frames are read into here before conversion
+  //! \details This is `NULL` for BGRA, which is read straight into the
+  //!          framebuffer
+  uint8_t *planes;
+  //! \brief How to convert YUV frames, and the threads to do it with
+  //! @{
+  convert_matrix_t matrix;
+  workers_t *workers;
+  //! @}
+  //! \brief Where to record reading and conversion times, or `NULL`
+  telemetry_t *telemetry;
+
+  //! \brief Statistics
+  //! @{
+  size_t frames;
+  uint64_t bytes;
+  //! \brief Number of `read` calls, which is one per frame at best
+  size_t reads;
+  //! \brief Capacity of the pipe, or zero if the input isn't one
+  size_t pipe_size;
+  //! @}
+} raw_t;
+
+//! \brief Get the name of a format, as accepted on the command line
+const char *raw_format_name(raw_format_t format);
+
+//! \brief Open a stream of raw frames
+//!
+//! A `path` of `-` reads from standard input. Opening a named pipe blocks until
+//! something opens it for writing.
+//!
+//! \param[in] convert_threads How many threads to convert YUV frames with, as
+//!                            for `workers_open`
+//! \return A pointer to the stream on the heap, or `NULL` on failure
+raw_t *raw_open(const char *path, raw_format_t format,
+                size_t convert_threads);
+//! \brief Inverse of `raw_open`
+//! \details It is legal to close a `NULL` stream
+void raw_close(raw_t *raw);
+
+//! \brief Read the next frame into a framebuffer
+//!
+//! This follows the same convention as `video_get_frame`. The stream ending,
+//! even partway through a frame, is `AVERROR_EOF`. Every tile of the
+//! framebuffer is written.
+int raw_get_frame(raw_t *raw, hdmi_fb_handle_t *fb);
@@ -0,0 +1,346 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "reader.h"
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+
+//! \brief Most the I/O thread reads at once, in bytes
+//!
+//! Smaller reads let the demuxer start on data sooner after a seek, and larger
+//! ones cost fewer system calls. This is a good size for SD cards.
+static const size_t CHUNK_SIZE = 256u * 1024u;
+
+//! \brief Shortest copy out of the mapping that counts as a stall, in ns
+//!
+//! We can't see page faults directly, only how long the copy took. Copying a
+//! read's worth of pages that are already in memory takes a few microseconds,
+//! even if they still have to be mapped, while reading from an SD card takes
+//! hundreds.
+static const uint64_t MMAP_STALL_NS = 100000u;
+
+//! \brief Entry point for the I/O thread
+//!
+//! This keeps the ring buffer as full as it can, reading from where the last
+//! read ended. After a seek, it starts again from the new position.
+static void *reader_main(void *arg) {
+  reader_t *r = arg;
+  pthread_mutex_lock(&r->lock);
+  while (!r->stop) {
+
+    // Wait until there's space to fill and something to fill it with
+    if (r->count == r->readahead || r->fill_pos >= r->size || r->error) {
+      pthread_cond_wait(&r->not_full, &r->lock);
+      continue;
+    }
+
+    // Read into the free space after the buffered data, without wrapping. We
+    // drop the lock while reading, so the demuxer can keep copying out. It
+    // never touches the free space, so that's safe.
+    size_t tail = (r->head + r->count) % r->readahead;
+    size_t len = r->readahead - r->count;
+    if (len > r->readahead - tail)
+      len = r->readahead - tail;
+    if (len > CHUNK_SIZE)
+      len = CHUNK_SIZE;
+    if ((uint64_t)len > r->size - r->fill_pos)
+      len = (size_t)(r->size - r->fill_pos);
+    uint64_t offset = r->fill_pos;
+    uint64_t generation = r->generation;
+    pthread_mutex_unlock(&r->lock);
+    ssize_t n = pread(r->fd, r->ring + tail, len, (off_t)offset);
+    pthread_mutex_lock(&r->lock);
+
+    // If the demuxer seeked while we were reading, what we read is useless
+    if (generation != r->generation)
+      continue;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      r->error = true;
+    } else {
+      r->count += (size_t)n;
+      r->fill_pos += (uint64_t)n;
+    }
+    pthread_cond_signal(&r->not_empty);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+reader_t *reader_open(const char *filename, reader_mode_t mode,
+                      size_t readahead) {
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  reader_t *ret = calloc(1u, sizeof(reader_t));
+  if (ret == NULL)
+    return NULL;
+  ret->mode = mode;
+  ret->fd = -1;
+  ret->map = MAP_FAILED;
+  ret->readahead = readahead != 0u ? readahead : READER_DEFAULT_READAHEAD;
+  ret->stats.buffered_min = SIZE_MAX;
+
+  // Open the file, and find out how big it is
+  ret->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (ret->fd == -1)
+    goto failure;
+  struct stat st;
+  if (fstat(ret->fd, &st) != 0)
+    goto failure;
+  ret->size = (uint64_t)st.st_size;
+
+  // Files too big to map all at once, which can happen on 32-bit systems, are
+  // read on a thread instead
+  if (mode == READER_MMAP && (uint64_t)(size_t)ret->size != ret->size)
+    mode = ret->mode = READER_THREAD;
+
+  if (mode == READER_MMAP) {
+    // Map the whole file. Empty files can't be mapped, but they're not
+    // videos either.
+    if (ret->size == 0u)
+      goto failure;
+    ret->map = mmap(NULL, (size_t)ret->size, PROT_READ, MAP_SHARED, ret->fd, 0);
+    if (ret->map == MAP_FAILED)
+      goto failure;
+    madvise((void *)ret->map, (size_t)ret->size, MADV_SEQUENTIAL);
+    return ret;
+  }
+
+  // Otherwise, set up the ring buffer and start reading into it
+  ret->ring = malloc(ret->readahead);
+  if (ret->ring == NULL)
+    goto failure;
+  if (pthread_mutex_init(&ret->lock, NULL) != 0)
+    goto failure_with_fd;
+  if (pthread_cond_init(&ret->not_empty, NULL) != 0) {
+    pthread_mutex_destroy(&ret->lock);
+    goto failure_with_fd;
+  }
+  if (pthread_cond_init(&ret->not_full, NULL) != 0) {
+    pthread_cond_destroy(&ret->not_empty);
+    pthread_mutex_destroy(&ret->lock);
+    goto failure_with_fd;
+  }
+  if (pthread_create(&ret->thread, NULL, reader_main, ret) != 0) {
+    pthread_cond_destroy(&ret->not_full);
+    pthread_cond_destroy(&ret->not_empty);
+    pthread_mutex_destroy(&ret->lock);
+    goto failure_with_fd;
+  }
+  ret->thread_started = true;
+  return ret;
+
+  // The synchronization primitives aren't set up here, so `reader_close`
+  // can't be used
+failure_with_fd:
+  free(ret->ring);
+  close(ret->fd);
+  free(ret);
+  return NULL;
+
+failure:
+  reader_close(ret);
+  return NULL;
+}
+
+void reader_close(reader_t *reader) {
+  // Edge case handling
+  if (reader == NULL)
+    return;
+  // Stop the I/O thread first, since it uses everything else
+  if (reader->thread_started) {
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = true;
+    pthread_cond_signal(&reader->not_full);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->not_full);
+    pthread_cond_destroy(&reader->not_empty);
+    pthread_mutex_destroy(&reader->lock);
+  }
+  if (reader->map != MAP_FAILED)
+    munmap((void *)reader->map, (size_t)reader->size);
+  if (reader->fd != -1)
+    close(reader->fd);
+  free(reader->ring);
+  free(reader);
+}
+
+//! \brief Record how long one read waited for the storage
+static void record_stall(reader_t *r, uint64_t ns) {
+  r->stats.stalls++;
+  r->stats.stall_ns_total += ns;
+  if (ns > r->stats.stall_ns_max)
+    r->stats.stall_ns_max = ns;
+}
+
+//! \brief Read from the mapping, asking the kernel to read ahead of us
+static int read_mmap(reader_t *r, uint8_t *buf, size_t n) {
+  if (r->pos >= r->size)
+    return AVERROR_EOF;
+  if ((uint64_t)n > r->size - r->pos)
+    n = (size_t)(r->size - r->pos);
+
+  // Keep the kernel a whole read-ahead window in front of us. Only ask again
+  // once we're halfway through what we asked for, so we don't make a system
+  // call on every read.
+  if (r->advised < r->size && r->advised < r->pos + r->readahead / 2u) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t begin = r->pos & ~(page - 1u);
+    uint64_t end = r->pos + r->readahead;
+    if (end > r->size)
+      end = r->size;
+    madvise((void *)(r->map + begin), (size_t)(end - begin), MADV_WILLNEED);
+    r->advised = end;
+  }
+
+  // Any page faults happen during the copy, so that's what we time. Only
+  // copies slow enough to have waited for the storage count.
+  uint64_t start = telemetry_now_ns();
+  memcpy(buf, r->map + r->pos, n);
+  uint64_t ns = telemetry_now_ns() - start;
+  if (ns >= MMAP_STALL_NS)
+    record_stall(r, ns);
+  r->pos += n;
+  r->stats.reads++;
+  r->stats.bytes += n;
+  return (int)n;
+}
+
+//! \brief Read from the ring buffer, waiting for the I/O thread if it's empty
+static int read_thread(reader_t *r, uint8_t *buf, size_t n) {
+  pthread_mutex_lock(&r->lock);
+
+  // Note how far ahead the I/O thread was
+  if (r->count < r->stats.buffered_min)
+    r->stats.buffered_min = r->count;
+  r->stats.buffered_total += r->count;
+
+  // If there's nothing buffered, we have to wait for the storage
+  if (r->count == 0u && r->pos < r->size && !r->error) {
+    uint64_t start = telemetry_now_ns();
+    while (r->count == 0u && !r->error)
+      pthread_cond_wait(&r->not_empty, &r->lock);
+    record_stall(r, telemetry_now_ns() - start);
+  }
+  if (r->count == 0u) {
+    int ret = r->pos >= r->size ? AVERROR_EOF : AVERROR(EIO);
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+  }
+
+  // Copy out what we can, which may wrap around the end of the ring
+  if (n > r->count)
+    n = r->count;
+  size_t first = r->readahead - r->head;
+  if (first > n)
+    first = n;
+  memcpy(buf, r->ring + r->head, first);
+  memcpy(buf + first, r->ring, n - first);
+  r->head = (r->head + n) % r->readahead;
+  r->count -= n;
+  r->pos += n;
+  r->stats.reads++;
+  r->stats.bytes += n;
+  pthread_cond_signal(&r->not_full);
+  pthread_mutex_unlock(&r->lock);
+  return (int)n;
+}
+
+int reader_read(void *opaque, uint8_t *buf, int buf_size) {
+  reader_t *r = opaque;
+  if (buf_size <= 0)
+    return AVERROR(EINVAL);
+  if (r->mode == READER_MMAP)
+    return read_mmap(r, buf, (size_t)buf_size);
+  return read_thread(r, buf, (size_t)buf_size);
+}
+
+int64_t reader_seek(void *opaque, int64_t offset, int whence) {
+  reader_t *r = opaque;
+
+  // LibAV asks for the size this way
+  if ((whence & AVSEEK_SIZE) != 0)
+    return (int64_t)r->size;
+
+  // Work out where we're going
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+  case SEEK_SET:
+    target = offset;
+    break;
+  case SEEK_CUR:
+    target = (int64_t)r->pos + offset;
+    break;
+  case SEEK_END:
+    target = (int64_t)r->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if (target < 0)
+    return AVERROR(EINVAL);
+  uint64_t t = (uint64_t)target;
+
+  if (r->mode == READER_MMAP) {
+    r->pos = t;
+    r->advised = t;
+    r->stats.seeks++;
+    return target;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (t >= r->pos && t - r->pos <= r->count) {
+    // Short seeks forward stay inside what we've buffered, so just skip over
+    // the bytes in between. This is common when demuxing.
+    size_t skip = (size_t)(t - r->pos);
+    r->head = (r->head + skip) % r->readahead;
+    r->count -= skip;
+  } else {
+    // Otherwise, throw everything away and start reading from the target
+    r->stats.seeks++;
+    r->head = 0u;
+    r->count = 0u;
+    r->fill_pos = t;
+    r->generation++;
+    r->error = false;
+  }
+  r->pos = t;
+  pthread_cond_signal(&r->not_full);
+  pthread_mutex_unlock(&r->lock);
+  return target;
+}
+
+reader_stats_t reader_stats(reader_t *reader) {
+  reader_stats_t ret = {0};
+  if (reader == NULL)
+    return ret;
+  if (reader->mode == READER_MMAP)
+    return reader->stats;
+  pthread_mutex_lock(&reader->lock);
+  ret = reader->stats;
+  pthread_mutex_unlock(&reader->lock);
+  return ret;
+}
+
+const char *reader_mode_name(reader_mode_t mode) {
+  switch (mode) {
+  case READER_MMAP:
+    return "mmap";
+  default:
+    return "thread";
+  }
+}
@@ -0,0 +1,129 @@
+//! \file reader.h
+//! \brief Input for the demuxer that keeps I/O off the presentation path
+//!
+//! By default, LibAV reads the input file with blocking reads as it demuxes.
+//! Any latency from the storage then shows up directly in the time to get a
+//! frame, and a slow SD card can make frames miss their deadlines. This module
+//! provides the read and seek callbacks for a custom `AVIOContext` instead,
+//! with two ways of getting ahead of the demuxer.
+//!
+//! The first maps the whole file, and asks the kernel to read ahead of the
+//! current position. The second has a dedicated thread read the file into a
+//! bounded ring buffer, so the demuxer only ever copies out of memory unless
+//! the buffer runs dry.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief How the file is read
+typedef enum reader_mode_t {
+  //! \brief Map the file, and have the kernel read ahead
+  READER_MMAP,
+  //! \brief Read ahead into a ring buffer on a separate thread
+  READER_THREAD,
+} reader_mode_t;
+
+//! \brief Default amount to read ahead, in bytes
+#define READER_DEFAULT_READAHEAD (8u * 1024u * 1024u)
+
+//! \brief Counters for how well reading ahead kept up
+typedef struct reader_stats_t {
+  //! \brief Number of reads from the demuxer, and bytes returned by them
+  //! @{
+  size_t reads;
+  uint64_t bytes;
+  //! @}
+  //! \brief Number of reads that had to wait for the storage
+  //! \details With `READER_MMAP`, we can't tell directly, so reads whose copy
+  //!          took long enough to have faulted on the storage count
+  size_t stalls;
+  //! \brief Time spent waiting for the storage, in nanoseconds
+  //! \details With `READER_MMAP`, this is the whole copy for the reads that
+  //!          count as stalls
+  //! @{
+  uint64_t stall_ns_total;
+  uint64_t stall_ns_max;
+  //! @}
+  //! \brief Bytes buffered ahead of the demuxer when it read
+  //! \details These are only tracked with `READER_THREAD`
+  //! @{
+  uint64_t buffered_total;
+  size_t buffered_min;
+  //! @}
+  //! \brief Number of seeks that threw away what was read ahead
+  size_t seeks;
+} reader_stats_t;
+
+//! \brief An open file, being read ahead of the demuxer
+//!
+//! With `READER_THREAD`, the ring buffer holds `count` bytes starting at
+//! `head`, and those correspond to the file starting at `pos`. The I/O thread
+//! appends to it from `fill_pos`. Everything past `fd` is protected by `lock`.
+typedef struct reader_t {
+  reader_mode_t mode;
+  int fd;
+  //! \brief Size of the file in bytes
+  uint64_t size;
+  //! \brief How far to read ahead in bytes
+  size_t readahead;
+
+  //! \brief The mapping of the whole file, for `READER_MMAP`
+  const uint8_t *map;
+  //! \brief How far the kernel has been asked to read, for `READER_MMAP`
+  uint64_t advised;
+
+  //! \brief The ring buffer and I/O thread, for `READER_THREAD`
+  //! @{
+  uint8_t *ring;
+  pthread_t thread;
+  bool thread_started;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  size_t head;
+  size_t count;
+  uint64_t fill_pos;
+  //! \brief Incremented on every seek, so reads from before it are discarded
+  uint64_t generation;
+  bool error;
+  bool stop;
+  //! @}
+
+  //! \brief Position of the next byte the demuxer will read
+  uint64_t pos;
+  reader_stats_t stats;
+} reader_t;
+
+//! \brief Open a file for reading ahead
+//!
+//! \param[in] filename The file to open
+//! \param[in] mode How to read it. Files too big to map fall back to
+//!                 `READER_THREAD`, and the reader's `mode` says so.
+//! \param[in] readahead How many bytes to read ahead, or zero for the default
+//! \return A handle to the file, or `NULL` on failure
+reader_t *reader_open(const char *filename, reader_mode_t mode,
+                      size_t readahead);
+//! \brief Inverse of `reader_open`
+//! \details It is legal to close a `NULL` reader
+void reader_close(reader_t *reader);
+
+//! \brief Callbacks for `avio_alloc_context`, with the reader as the opaque
+//!
+//! `reader_read` follows the LibAV convention of returning the number of bytes
+//! read, or `AVERROR_EOF` at the end of the file. `reader_seek` also handles
+//! `AVSEEK_SIZE`.
+//!
+//! @{
+int reader_read(void *opaque, uint8_t *buf, int buf_size);
+int64_t reader_seek(void *opaque, int64_t offset, int whence);
+//! @}
+
+//! \brief Get a snapshot of the reader's counters
+reader_stats_t reader_stats(reader_t *reader);
+
+//! \brief Human-readable name of a mode, as accepted on the command line
+const char *reader_mode_name(reader_mode_t mode);
@@ -0,0 +1,264 @@
+#include "scale.h"
+
+#include <string.h>
+
+#include <libavutil/avutil.h>
+
+//! \brief Widest chroma row we can scale, in samples
+#define MAX_CHROMA_WIDTH (SCALE_MAX_WIDTH / 2u)
+
+bool scale_supported(int format) {
+  switch (format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+  case AV_PIX_FMT_YUV422P:
+  case AV_PIX_FMT_NV12:
+  case AV_PIX_FMT_RGB24:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool scale_full_range(int format) { return format == AV_PIX_FMT_YUVJ420P; }
+
+bool scale_layout_init(scale_layout_t *layout, const AVFrame *frame) {
+
+  // Edge case handling
+  if (!scale_supported(frame->format))
+    return false;
+  if (frame->width <= 0 || frame->height <= 0 ||
+      (size_t)frame->width > SCALE_MAX_WIDTH || frame->height > UINT16_MAX)
+    return false;
+  size_t w = (size_t)frame->width;
+  size_t h = (size_t)frame->height;
+  layout->src_width = frame->width;
+  layout->src_height = frame->height;
+  layout->format = frame->format;
+  layout->sample_aspect_ratio = frame->sample_aspect_ratio;
+
+  // Work out the display aspect ratio. Pixels are square unless the frame says
+  // otherwise.
+  AVRational sar = frame->sample_aspect_ratio;
+  if (sar.num <= 0 || sar.den <= 0)
+    sar = (AVRational){1, 1};
+  uint64_t dar_num = (uint64_t)w * (uint64_t)sar.num;
+  uint64_t dar_den = (uint64_t)h * (uint64_t)sar.den;
+
+  // Fit the picture to whichever side of the framebuffer it hits first, and
+  // round the other side to the nearest even number
+  if (dar_num * 480u >= dar_den * 640u) {
+    layout->width = 640u;
+    layout->height = (size_t)((640u * dar_den + dar_num) / (2u * dar_num)) * 2u;
+  } else {
+    layout->height = 480u;
+    layout->width = (size_t)((480u * dar_num + dar_den) / (2u * dar_den)) * 2u;
+  }
+  if (layout->width < 2u)
+    layout->width = 2u;
+  if (layout->height < 2u)
+    layout->height = 2u;
+  layout->x = (640u - layout->width) / 2u & ~(size_t)1u;
+  layout->y = (480u - layout->height) / 2u & ~(size_t)1u;
+
+  // Pick the fastest way to get there
+  if (w == layout->width && h == layout->height)
+    layout->path = SCALE_PATH_DIRECT;
+  else if (w == 2u * layout->width && h == 2u * layout->height)
+    layout->path = SCALE_PATH_HALF;
+  else
+    layout->path = SCALE_PATH_GENERIC;
+
+  // Sample each source pixel nearest the center of each output pixel
+  for (size_t i = 0u; i < layout->width; i++)
+    layout->x_map[i] = (uint16_t)((2u * i + 1u) * w / (2u * layout->width));
+  for (size_t i = 0u; i < layout->height; i++)
+    layout->y_map[i] = (uint16_t)((2u * i + 1u) * h / (2u * layout->height));
+  return true;
+}
+
+bool scale_layout_matches(const scale_layout_t *layout, const AVFrame *frame) {
+  return layout->src_width == frame->width &&
+         layout->src_height == frame->height &&
+         layout->format == frame->format &&
+         layout->sample_aspect_ratio.num == frame->sample_aspect_ratio.num &&
+         layout->sample_aspect_ratio.den == frame->sample_aspect_ratio.den;
+}
+
+const char *scale_path_name(scale_path_t path) {
+  switch (path) {
+  case SCALE_PATH_DIRECT:
+    return "direct";
+  case SCALE_PATH_HALF:
+    return "half";
+  default:
+    return "generic";
+  }
+}
+
+//! \brief Get a row of chroma as if the frame were YUV420P
+//!
+//! YUV420P rows are returned as they are. YUV422P has twice as many rows, so
+//! each pair of them is averaged. NV12 has its chroma interleaved, so it's
+//! split apart.
+//!
+//! \param[in] k Which row of 4:2:0 chroma to get
+//! \param[out] u_buf,v_buf Scratch space, `MAX_CHROMA_WIDTH` samples each
+//! \param[out] u,v Where the row ended up
+static void chroma_row(const AVFrame *frame, size_t k, uint8_t *u_buf,
+                       uint8_t *v_buf, const uint8_t **u, const uint8_t **v) {
+  size_t cw = ((size_t)frame->width + 1u) / 2u;
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV422P: {
+    size_t k0 = 2u * k;
+    size_t k1 = k0 + 1u < (size_t)frame->height ? k0 + 1u : k0;
+    for (size_t p = 1u; p <= 2u; p++) {
+      const uint8_t *r0 = frame->data[p] + k0 * (size_t)frame->linesize[p];
+      const uint8_t *r1 = frame->data[p] + k1 * (size_t)frame->linesize[p];
+      uint8_t *out = p == 1u ? u_buf : v_buf;
+      for (size_t i = 0u; i < cw; i++)
+        out[i] = (uint8_t)((r0[i] + r1[i] + 1u) >> 1);
+    }
+    *u = u_buf;
+    *v = v_buf;
+    return;
+  }
+  case AV_PIX_FMT_NV12: {
+    const uint8_t *uv = frame->data[1] + k * (size_t)frame->linesize[1];
+    for (size_t i = 0u; i < cw; i++) {
+      u_buf[i] = uv[2u * i];
+      v_buf[i] = uv[2u * i + 1u];
+    }
+    *u = u_buf;
+    *v = v_buf;
+    return;
+  }
+  default:
+    *u = frame->data[1] + k * (size_t)frame->linesize[1];
+    *v = frame->data[2] + k * (size_t)frame->linesize[2];
+    return;
+  }
+}
+
+//! \brief Get a row of luma
+static inline const uint8_t *luma_row(const AVFrame *frame, size_t row) {
+  return frame->data[0] + row * (size_t)frame->linesize[0];
+}
+
+//! \brief Convert a pair of rows of a YUV frame
+//! \param[in] dr Row in the rectangle, which is even
+static void scale_rows_yuv(const scale_layout_t *layout,
+                           const convert_matrix_t *m, const AVFrame *frame,
+                           size_t dr, uint32_t *d0, uint32_t *d1) {
+  uint8_t u_buf[2][MAX_CHROMA_WIDTH];
+  uint8_t v_buf[2][MAX_CHROMA_WIDTH];
+  const uint8_t *u[2];
+  const uint8_t *v[2];
+  size_t w = layout->width;
+  size_t last = (size_t)frame->height - 1u;
+
+  switch (layout->path) {
+  case SCALE_PATH_DIRECT: {
+    // Nothing to scale, so we can go straight to the kernel
+    size_t r1 = dr + 1u <= last ? dr + 1u : dr;
+    chroma_row(frame, dr / 2u, u_buf[0], v_buf[0], &u[0], &v[0]);
+    convert_row_pair(m, luma_row(frame, dr), luma_row(frame, r1), u[0], v[0],
+                     d0, d1, w);
+    return;
+  }
+
+  case SCALE_PATH_HALF: {
+    // Average each 2x2 block of luma, and the 2x2 block of chroma that covers
+    // each pair of output pixels. That's four rows of luma and two of chroma.
+    uint8_t y_out[2][640u];
+    uint8_t u_out[320u];
+    uint8_t v_out[320u];
+    for (size_t i = 0u; i < 2u; i++) {
+      const uint8_t *a = luma_row(frame, 2u * (dr + i));
+      const uint8_t *b = luma_row(frame, 2u * (dr + i) + 1u);
+      for (size_t x = 0u; x < w; x++)
+        y_out[i][x] = (uint8_t)((a[2u * x] + a[2u * x + 1u] + b[2u * x] +
+                                 b[2u * x + 1u] + 2u) >> 2);
+      chroma_row(frame, dr + i, u_buf[i], v_buf[i], &u[i], &v[i]);
+    }
+    for (size_t x = 0u; x < w / 2u; x++) {
+      u_out[x] = (uint8_t)((u[0][2u * x] + u[0][2u * x + 1u] + u[1][2u * x] +
+                            u[1][2u * x + 1u] + 2u) >> 2);
+      v_out[x] = (uint8_t)((v[0][2u * x] + v[0][2u * x + 1u] + v[1][2u * x] +
+                            v[1][2u * x + 1u] + 2u) >> 2);
+    }
+    convert_row_pair(m, y_out[0], y_out[1], u_out, v_out, d0, d1, w);
+    return;
+  }
+
+  default: {
+    // Pick out the nearest samples. Both rows share the chroma of the first.
+    uint8_t y_out[2][640u];
+    uint8_t u_out[320u];
+    uint8_t v_out[320u];
+    size_t sy0 = layout->y_map[dr];
+    for (size_t i = 0u; i < 2u; i++) {
+      const uint8_t *src = luma_row(frame, layout->y_map[dr + i]);
+      for (size_t x = 0u; x < w; x++)
+        y_out[i][x] = src[layout->x_map[x]];
+    }
+    chroma_row(frame, sy0 / 2u, u_buf[0], v_buf[0], &u[0], &v[0]);
+    for (size_t x = 0u; x < w / 2u; x++) {
+      u_out[x] = u[0][layout->x_map[2u * x] / 2u];
+      v_out[x] = v[0][layout->x_map[2u * x] / 2u];
+    }
+    convert_row_pair(m, y_out[0], y_out[1], u_out, v_out, d0, d1, w);
+    return;
+  }
+  }
+}
+
+//! \brief Pack one pixel into the framebuffer's format
+static inline uint32_t pack_rgb(uint32_t r, uint32_t g, uint32_t b) {
+  return 0xff000000u | (r << 16) | (g << 8) | b;
+}
+
+//! \brief Convert one row of an RGB24 frame
+//! \param[in] dr Row in the rectangle
+static void scale_row_rgb(const scale_layout_t *layout, const AVFrame *frame,
+                          size_t dr, uint32_t *d) {
+  size_t w = layout->width;
+  switch (layout->path) {
+  case SCALE_PATH_DIRECT: {
+    const uint8_t *p = luma_row(frame, dr);
+    for (size_t x = 0u; x < w; x++, p += 3)
+      d[x] = pack_rgb(p[0], p[1], p[2]);
+    return;
+  }
+  case SCALE_PATH_HALF: {
+    const uint8_t *a = luma_row(frame, 2u * dr);
+    const uint8_t *b = luma_row(frame, 2u * dr + 1u);
+    for (size_t x = 0u; x < w; x++, a += 6, b += 6) {
+      uint32_t c[3];
+      for (size_t i = 0u; i < 3u; i++)
+        c[i] = (a[i] + a[i + 3u] + b[i] + b[i + 3u] + 2u) >> 2;
+      d[x] = pack_rgb(c[0], c[1], c[2]);
+    }
+    return;
+  }
+  default: {
+    const uint8_t *src = luma_row(frame, layout->y_map[dr]);
+    for (size_t x = 0u; x < w; x++) {
+      const uint8_t *p = src + 3u * layout->x_map[x];
+      d[x] = pack_rgb(p[0], p[1], p[2]);
+    }
+    return;
+  }
+  }
+}
+
+void scale_rows(const scale_layout_t *layout, const convert_matrix_t *m,
+                const AVFrame *frame, size_t row, uint32_t *d0, uint32_t *d1) {
+  size_t dr = row - layout->y;
+  if (frame->format == AV_PIX_FMT_RGB24) {
+    scale_row_rgb(layout, frame, dr, d0);
+    scale_row_rgb(layout, frame, dr + 1u, d1);
+  } else {
+    scale_rows_yuv(layout, m, frame, dr, d0, d1);
+  }
+}
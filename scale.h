@@ -0,0 +1,103 @@
+//! \file scale.h
+//! \brief Fit decoded frames of any size and format into the framebuffer
+//!
+//! Frames are converted straight into the 640x480 BGRA framebuffer, scaled in
+//! the same pass. The picture keeps its display aspect ratio, so it's centered
+//! with black bars above and below, or to either side, when the shapes don't
+//! match.
+//!
+//! The planar and semi-planar YUV formats are all handled as YUV420P. Each row
+//! of chroma is first brought into that layout, then the rows are passed to the
+//! selected `convert` kernel. RGB24 is just repacked.
+//!
+//! How the picture is scaled depends on how its size relates to the size it's
+//! shown at. Frames that are already the right size are converted directly.
+//! Frames that are exactly twice the size, like 1280x960 or 1280x720, are
+//! averaged down over 2x2 blocks before conversion. Everything else goes
+//! through a generic nearest-neighbour scaler, using tables computed once per
+//! layout.
+
+#pragma once
+
+#include "convert.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+//! \brief Widest frame we can scale, in pixels
+//! \details This bounds the scratch space each row needs
+#define SCALE_MAX_WIDTH 4096u
+
+//! \brief How a frame is scaled into its rectangle
+typedef enum scale_path_t {
+  //! \brief The frame is already the right size
+  SCALE_PATH_DIRECT,
+  //! \brief The frame is twice the size in both directions
+  SCALE_PATH_HALF,
+  //! \brief Any other size, with nearest-neighbour sampling
+  SCALE_PATH_GENERIC,
+} scale_path_t;
+
+//! \brief Where and how a frame goes into the framebuffer
+//!
+//! This only depends on the frame's size, format, and aspect ratio, so it's
+//! computed once and reused until one of those changes.
+typedef struct scale_layout_t {
+  //! \brief What the layout was computed for
+  //! @{
+  int src_width;
+  int src_height;
+  int format;
+  AVRational sample_aspect_ratio;
+  //! @}
+  //! \brief Rectangle the picture is shown in, in framebuffer pixels
+  //! \details All of these are even
+  //! @{
+  size_t x;
+  size_t y;
+  size_t width;
+  size_t height;
+  //! @}
+  //! \brief How the picture is scaled into the rectangle
+  scale_path_t path;
+  //! \brief Source column and row for each column and row of the rectangle
+  //! \details These are only used by `SCALE_PATH_GENERIC`
+  //! @{
+  uint16_t x_map[640u];
+  uint16_t y_map[480u];
+  //! @}
+} scale_layout_t;
+
+//! \brief Whether frames of a pixel format can be converted
+bool scale_supported(int format);
+
+//! \brief Whether the format's samples always span the full range
+//! \details These are the JPEG formats, regardless of how they're tagged
+bool scale_full_range(int format);
+
+//! \brief Compute the layout for a frame
+//! \return Whether the frame can be converted at all
+bool scale_layout_init(scale_layout_t *layout, const AVFrame *frame);
+
+//! \brief Whether a layout was computed for frames like this one
+bool scale_layout_matches(const scale_layout_t *layout, const AVFrame *frame);
+
+//! \brief Human-readable name of a scaling path
+const char *scale_path_name(scale_path_t path);
+
+//! \brief Convert the pair of framebuffer rows starting at `row`
+//!
+//! Only the part of the rows inside the layout's rectangle is written, and the
+//! bars to either side are left alone. `row` must be even, and both rows must
+//! be inside the rectangle.
+//!
+//! \param[in] m The conversion matrix to use, ignored for RGB formats
+//! \param[in] frame The frame to convert
+//! \param[in] row The first framebuffer row to produce
+//! \param[out] d0,d1 Where the rectangle starts in each output row. Each must
+//!                   hold `layout->width` pixels.
+void scale_rows(const scale_layout_t *layout, const convert_matrix_t *m,
+                const AVFrame *frame, size_t row, uint32_t *d0, uint32_t *d1);
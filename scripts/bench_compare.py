@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+# Script to compare two runs of the benchmarks
+#
+# Each argument is the output of `make bench-run` saved to a file, typically
+# from two different commits. Results are matched up by the benchmark's name
+# and its parameters, which is everything on a `BENCH` line before the
+# statistics. For each result in both runs, this prints the mean time per
+# iteration before and after, and the change. Changes smaller than the spread
+# of either run are marked as noise.
+
+import sys
+
+# Keys that are measurements rather than parameters
+STAT_KEYS = {"n", "fps", "ns_mean", "ns_stddev", "ns_min", "ns_max"}
+
+
+def parse(path):
+    """Read the results from a file, keyed by name and parameters"""
+    results = {}
+    with open(path) as f:
+        for line in f:
+            words = line.split()
+            if len(words) < 2 or words[0] != "BENCH":
+                continue
+            params = []
+            stats = {}
+            for word in words[2:]:
+                key, _, value = word.partition("=")
+                if key in STAT_KEYS:
+                    stats[key] = float(value)
+                else:
+                    params.append(word)
+            results[(words[1], " ".join(params))] = stats
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: bench_compare.py [BEFORE] [AFTER]", file=sys.stderr)
+        sys.exit(1)
+    before = parse(sys.argv[1])
+    after = parse(sys.argv[2])
+
+    for key in before:
+        if key not in after:
+            continue
+        b = before[key]
+        a = after[key]
+        change = (a["ns_mean"] - b["ns_mean"]) / b["ns_mean"] * 100.0 \
+            if b["ns_mean"] > 0.0 else 0.0
+        noise = abs(a["ns_mean"] - b["ns_mean"]) <= \
+            max(a["ns_stddev"], b["ns_stddev"])
+        print("{} {}: {:.0f}ns -> {:.0f}ns ({:+.1f}%){}".format(
+            key[0], key[1], b["ns_mean"], a["ns_mean"], change,
+            " (noise)" if noise else ""))
+
+    for key in before.keys() - after.keys():
+        print("{} {}: only in {}".format(key[0], key[1], sys.argv[1]))
+    for key in after.keys() - before.keys():
+        print("{} {}: only in {}".format(key[0], key[1], sys.argv[2]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "share.h"
+
+#include "hdmi_dev.h"
+
+#include <libavutil/avutil.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+share_t *share_open(const char *path) {
+
+  // Edge case handling
+  if (path == NULL)
+    return NULL;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return NULL;
+  strcpy(addr.sun_path, path);
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  share_t *ret = calloc(1u, sizeof(share_t));
+  if (ret == NULL)
+    return NULL;
+  ret->listen_fd = -1;
+  ret->client_fd = -1;
+
+  // Bind the socket, replacing any socket left there. Anything else is left
+  // alone, and binding fails.
+  ret->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ret->listen_fd == -1)
+    goto failure;
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if (bind(ret->listen_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+    goto failure;
+  strcpy(ret->path, path);
+  if (listen(ret->listen_fd, 1) == -1)
+    goto failure;
+  return ret;
+
+failure:
+  share_close(ret);
+  return NULL;
+}
+
+void share_close(share_t *share) {
+  // Edge case handling
+  if (share == NULL)
+    return;
+  if (share->client_fd != -1)
+    close(share->client_fd);
+  if (share->listen_fd != -1)
+    close(share->listen_fd);
+  if (share->path[0] != '\0')
+    unlink(share->path);
+  free(share);
+}
+
+bool share_accept(share_t *share, hdmi_fb_allocator_t *alloc,
+                  hdmi_fb_pool_t *pool) {
+
+  // Edge case handling
+  if (share == NULL || alloc == NULL || pool == NULL)
+    return false;
+  if (share->client_fd != -1)
+    return true;
+
+  // Export the pool before waiting, so there's nothing left to fail once the
+  // client is here
+  int buf_fd = hdmi_fb_pool_export(alloc, pool);
+  if (buf_fd == -1)
+    return false;
+  do
+    share->client_fd = accept4(share->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  while (share->client_fd == -1 && errno == EINTR);
+  if (share->client_fd == -1) {
+    close(buf_fd);
+    return false;
+  }
+
+  // Send the hello with the buffer object attached
+  share_hello_t hello = {
+      .type = SHARE_MSG_HELLO,
+      .magic = SHARE_MAGIC,
+      .version = SHARE_VERSION,
+      .count = (uint32_t)pool->count,
+      .size = pool->size,
+      .stride = pool->stride,
+      .width = 640u,
+      .height = 480u,
+      .pitch = 640u * 4u,
+      .refresh_hz = HDMI_REFRESH_HZ,
+  };
+  struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1u,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &buf_fd, sizeof(int));
+  ssize_t res = sendmsg(share->client_fd, &msg, MSG_NOSIGNAL);
+  // The client has its own reference now, if it worked
+  close(buf_fd);
+  if (res != (ssize_t)sizeof(hello)) {
+    close(share->client_fd);
+    share->client_fd = -1;
+    return false;
+  }
+
+  share->alloc = alloc;
+  share->pool = pool;
+  return true;
+}
+
+int share_get_frame(share_t *share, hdmi_fb_handle_t *fb,
+                    player_frame_t *frame) {
+
+  // Edge case handling
+  if (share == NULL || share->pool == NULL || fb == NULL || frame == NULL)
+    return AVERROR(EINVAL);
+  if (share->client_fd == -1)
+    return AVERROR_EOF;
+  if (fb < share->pool->fbs || fb >= share->pool->fbs + share->pool->count)
+    return AVERROR(EINVAL);
+  const uint32_t index = (uint32_t)(fb - share->pool->fbs);
+
+  // Lend the framebuffer out. If the client hung up, that's the end.
+  const share_lease_t lease = {
+      .type = SHARE_MSG_LEASE,
+      .index = index,
+      .offset = fb->offset,
+  };
+  if (send(share->client_fd, &lease, sizeof(lease), MSG_NOSIGNAL) !=
+      (ssize_t)sizeof(lease))
+    return AVERROR_EOF;
+  share->leased++;
+
+  // Wait for it back. A zero-length read means the client hung up.
+  share_submit_t submit;
+  ssize_t res;
+  do
+    res = recv(share->client_fd, &submit, sizeof(submit), 0);
+  while (res == -1 && errno == EINTR);
+  if (res <= 0)
+    return AVERROR_EOF;
+  if (res != (ssize_t)sizeof(submit) || submit.type != SHARE_MSG_SUBMIT ||
+      submit.index != index) {
+    share->rejected++;
+    return AVERROR(EPROTO);
+  }
+  share->submitted++;
+
+  // Only the tiles the client says it wrote need flushing. Bits past the last
+  // column don't name a tile, and would have us flush past the framebuffer.
+  if ((submit.flags & SHARE_SUBMIT_DIRTY) != 0u) {
+    const uint32_t cols = (UINT32_C(1) << HDMI_FB_TILE_COLS) - 1u;
+    for (size_t r = 0u; r < HDMI_FB_TILE_ROWS; r++)
+      fb->dirty.rows[r] = submit.dirty[r] & cols;
+  }
+
+  // Time the frame by how many refreshes it is after the first one. Frame
+  // ids wrap, so add up the differences between consecutive ones instead.
+  // Frames without one are live, and are shown as soon as they can be if
+  // they're late.
+  if ((submit.flags & SHARE_SUBMIT_FID) == 0u) {
+    share->refreshes++;
+    share->last_fid = (uint16_t)hdmi_fid_add(share->last_fid, 1);
+    frame->live = true;
+  } else {
+    if (share->started)
+      share->refreshes += hdmi_fid_delta(submit.fid, share->last_fid);
+    share->last_fid = submit.fid;
+  }
+  share->started = true;
+  frame->time_ns = share->refreshes * 1000000000 / HDMI_REFRESH_HZ;
+  return 0;
+}
+
+share_client_t *share_client_open(const char *path) {
+
+  // Edge case handling
+  if (path == NULL)
+    return NULL;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return NULL;
+  strcpy(addr.sun_path, path);
+
+  // Allocate space for the return value, and initialize everything to a known
+  // state
+  share_client_t *ret = calloc(1u, sizeof(share_client_t));
+  if (ret == NULL)
+    return NULL;
+  ret->data = MAP_FAILED;
+  int buf_fd = -1;
+
+  // Connect
+  ret->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ret->fd == -1)
+    goto failure;
+  if (connect(ret->fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+    goto failure;
+
+  // Get the hello, and the buffer object with it
+  struct iovec iov = {
+      .iov_base = &ret->hello,
+      .iov_len = sizeof(ret->hello),
+  };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1u,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t res = recvmsg(ret->fd, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = res > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&buf_fd, CMSG_DATA(cmsg), sizeof(int));
+  if (res != (ssize_t)sizeof(ret->hello) || buf_fd == -1)
+    goto failure;
+  if (ret->hello.type != SHARE_MSG_HELLO || ret->hello.magic != SHARE_MAGIC ||
+      ret->hello.version != SHARE_VERSION)
+    goto failure;
+
+  // Map the framebuffers. The mapping keeps the buffer object alive, so we
+  // don't need the descriptor after this.
+  ret->data = mmap(NULL, ret->hello.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   buf_fd, 0);
+  close(buf_fd);
+  buf_fd = -1;
+  if (ret->data == MAP_FAILED)
+    goto failure;
+  return ret;
+
+failure:
+  if (buf_fd != -1)
+    close(buf_fd);
+  share_client_close(ret);
+  return NULL;
+}
+
+void share_client_close(share_client_t *client) {
+  // Edge case handling
+  if (client == NULL)
+    return;
+  if (client->data != MAP_FAILED)
+    munmap(client->data, client->hello.size);
+  if (client->fd != -1)
+    close(client->fd);
+  free(client);
+}
+
+uint32_t *share_client_lease(share_client_t *client, uint32_t *index) {
+
+  // Edge case handling
+  if (client == NULL || index == NULL)
+    return NULL;
+
+  share_lease_t lease;
+  ssize_t res;
+  do
+    res = recv(client->fd, &lease, sizeof(lease), 0);
+  while (res == -1 && errno == EINTR);
+  if (res != (ssize_t)sizeof(lease) || lease.type != SHARE_MSG_LEASE)
+    return NULL;
+  if (lease.index >= client->hello.count ||
+      lease.offset + client->hello.pitch * client->hello.height >
+          client->hello.size)
+    return NULL;
+  *index = lease.index;
+  return (uint32_t *)(client->data + lease.offset);
+}
+
+bool share_client_submit(share_client_t *client, uint32_t index, uint16_t fid,
+                         uint16_t flags, const hdmi_fb_dirty_t *dirty) {
+
+  // Edge case handling
+  if (client == NULL)
+    return false;
+  if ((flags & SHARE_SUBMIT_DIRTY) != 0u && dirty == NULL)
+    return false;
+
+  share_submit_t submit = {
+      .type = SHARE_MSG_SUBMIT,
+      .index = index,
+      .fid = fid,
+      .flags = flags,
+  };
+  if (dirty != NULL)
+    memcpy(submit.dirty, dirty->rows, sizeof(submit.dirty));
+  return send(client->fd, &submit, sizeof(submit), MSG_NOSIGNAL) ==
+         (ssize_t)sizeof(submit);
+}
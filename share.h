@@ -0,0 +1,203 @@
+//! \file share.h
+//! \brief Let other processes draw straight into the player's framebuffers
+//!
+//! Anything that wants to show content other than a video would otherwise
+//! have to write it somewhere, and have us copy it into a framebuffer. This
+//! module instead exports the player's ring of framebuffers to a client over
+//! a Unix socket, so the client draws directly into the memory the device
+//! scans out.
+//!
+//! The server listens on a `SOCK_SEQPACKET` socket, and takes one client. On
+//! connecting, the client is sent a `share_hello_t`, with the ring's buffer
+//! object attached as a file descriptor. That's a dma-buf on the real device,
+//! or a memory file when simulated, and the client maps it with `MAP_SHARED`.
+//! After that, each time the player needs a frame, the server leases the
+//! client a framebuffer with a `share_lease_t`. The client draws into it and
+//! hands it back with a `share_submit_t`, saying which refresh to show it on
+//! and optionally which tiles it touched. The server flushes those from the
+//! cache and queues the framebuffer, without reading or copying any pixels.
+//!
+//! Only one framebuffer is leased at a time, and the next lease only comes
+//! once the ring has room, so the ring paces the client. Every message is a
+//! single packet, with integers in the machine's native byte order. The
+//! client hangs up to end playback.
+
+#pragma once
+
+#include "hdmi_fb.h"
+#include "player.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! \brief Magic number at the start of `share_hello_t`
+#define SHARE_MAGIC 0x48534844u
+//! \brief Version of the protocol this module speaks
+#define SHARE_VERSION 1u
+
+//! \brief What a packet is, which is always its first word
+typedef enum share_msg_type_t {
+  SHARE_MSG_HELLO = 1,
+  SHARE_MSG_LEASE = 2,
+  SHARE_MSG_SUBMIT = 3,
+} share_msg_type_t;
+
+//! \brief Sent by the server once a client connects
+//!
+//! The packet carries the buffer object's file descriptor as `SCM_RIGHTS`.
+//! Framebuffers are `width` by `height` words, in the same format as
+//! `hdmi_fb_handle_t`, with rows `pitch` bytes apart.
+typedef struct share_hello_t {
+  uint32_t type;
+  uint32_t magic;
+  uint32_t version;
+  //! \brief Number of framebuffers in the buffer object
+  uint32_t count;
+  //! \brief Size of the buffer object to map, in bytes
+  uint64_t size;
+  //! \brief Distance between the starts of consecutive framebuffers in bytes
+  uint64_t stride;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pitch;
+  //! \brief Refresh rate of the device, in Hz
+  uint32_t refresh_hz;
+} share_hello_t;
+
+//! \brief Sent by the server to lend the client a framebuffer
+//!
+//! The framebuffer holds whatever it held the last time it was submitted.
+//! The first time it's leased, what it holds is unspecified. It isn't on
+//! screen, and won't be until it's submitted.
+typedef struct share_lease_t {
+  uint32_t type;
+  //! \brief Which framebuffer, counting from the start of the buffer object
+  uint32_t index;
+  //! \brief Where it starts in the buffer object, in bytes
+  uint64_t offset;
+} share_lease_t;
+
+//! \brief Flags for `share_submit_t`
+//! @{
+//! \brief `fid` says when to show the frame
+#define SHARE_SUBMIT_FID 1u
+//! \brief `dirty` says which tiles were written
+#define SHARE_SUBMIT_DIRTY 2u
+//! @}
+
+//! \brief Sent by the client to hand back the framebuffer it was leased
+//!
+//! Frames are shown on the refresh with frame id `fid`, in the 12-bit space of
+//! `hdmi_fid_t`. The first frame is shown as soon as the ring is full, and
+//! defines where the client's frame ids are on the device. Every frame after
+//! that is shown as many refreshes after the first one as its `fid` is after
+//! the first frame's, so ids should increase by less than half their range
+//! between frames. Without `SHARE_SUBMIT_FID`, the frame is shown one refresh
+//! after the one before it, or on the next refresh if that's already passed.
+//! Frames after a late one are then shown relative to it.
+//!
+//! Without `SHARE_SUBMIT_DIRTY`, the whole framebuffer is flushed. With it,
+//! only the tiles set in `dirty`, laid out as in `hdmi_fb_dirty_t`, are. Bits
+//! past the last column of tiles are ignored.
+typedef struct share_submit_t {
+  uint32_t type;
+  //! \brief The index from the lease
+  uint32_t index;
+  uint16_t fid;
+  uint16_t flags;
+  uint32_t dirty[HDMI_FB_TILE_ROWS];
+} share_submit_t;
+
+//! \brief A server for one client
+typedef struct share_t {
+  //! \brief The listening socket, and the client's once it connects
+  //! @{
+  int listen_fd;
+  int client_fd;
+  //! @}
+  //! \brief Where the listening socket is bound
+  char path[108];
+
+  //! \brief The ring being shared, and how to export it
+  //! \details These are not owned by the server
+  //! @{
+  hdmi_fb_allocator_t *alloc;
+  hdmi_fb_pool_t *pool;
+  //! @}
+
+  //! \brief Frame id of the last frame submitted with one
+  uint16_t last_fid;
+  //! \brief Refreshes from the first frame to the last one, by their ids
+  int64_t refreshes;
+  //! \brief Whether any frame has been submitted yet
+  bool started;
+
+  //! \brief Statistics
+  //! @{
+  size_t leased;
+  size_t submitted;
+  //! \brief Packets from the client that didn't make sense
+  size_t rejected;
+  //! @}
+} share_t;
+
+//! \brief Listen for a client on a Unix socket
+//!
+//! Any socket already at `path` is removed first, since it's probably left
+//! over from an earlier run. Other kinds of files are left alone.
+//!
+//! \return A pointer to the server on the heap, or `NULL` on failure
+share_t *share_open(const char *path);
+//! \brief Inverse of `share_open`
+//!
+//! This hangs up on the client, and removes the socket. It is legal to close a
+//! `NULL` server.
+void share_close(share_t *share);
+
+//! \brief Wait for a client, and share a ring of framebuffers with it
+//!
+//! This blocks until a client connects, then sends it the hello with the
+//! pool's buffer object attached. Both parameters must outlive the server.
+//!
+//! \return Whether a client is connected
+bool share_accept(share_t *share, hdmi_fb_allocator_t *alloc,
+                  hdmi_fb_pool_t *pool);
+
+//! \brief Get the next frame from the client
+//!
+//! This leases `fb` to the client and waits for it to be submitted. The dirty
+//! tiles and the frame's time are filled in from the submission. It follows
+//! the conventions of `player_source_t`'s `get_frame`. The client hanging up
+//! is the end of the frames, and a bad submission fails just that frame.
+//!
+//! \param[in] fb The framebuffer to fill, which must be in the shared pool
+int share_get_frame(share_t *share, hdmi_fb_handle_t *fb,
+                    player_frame_t *frame);
+
+//! \brief A client's connection to a server
+typedef struct share_client_t {
+  int fd;
+  //! \brief What the server said when we connected
+  share_hello_t hello;
+  //! \brief The mapping of the server's framebuffers
+  uint8_t *data;
+} share_client_t;
+
+//! \brief Connect to a server, and map its framebuffers
+//! \return A pointer to the client on the heap, or `NULL` on failure
+share_client_t *share_client_open(const char *path);
+//! \brief Inverse of `share_client_open`
+//! \details It is legal to close a `NULL` client.
+void share_client_close(share_client_t *client);
+
+//! \brief Wait for the server to lease us a framebuffer
+//! \param[out] index Which framebuffer it is, to pass to `share_client_submit`
+//! \return A pointer to its pixels, or `NULL` if the server hung up
+uint32_t *share_client_lease(share_client_t *client, uint32_t *index);
+//! \brief Hand a leased framebuffer back to be shown
+//! \param[in] flags Any of the `SHARE_SUBMIT_` flags
+//! \param[in] dirty The tiles written, if `SHARE_SUBMIT_DIRTY` is set
+//! \return Whether the submission was sent
+bool share_client_submit(share_client_t *client, uint32_t index, uint16_t fid,
+                         uint16_t flags, const hdmi_fb_dirty_t *dirty);
@@ -0,0 +1,116 @@
+//! \file share_demo.c
+//! \brief Draw into the player's framebuffers from another process
+//!
+//! This is a client for `hdmi-dev-video-player --serve`, and an example of
+//! the protocol in share.h. It draws a box bouncing over a gradient. Each
+//! framebuffer gets the gradient the first time it's leased. After that, only
+//! the box is moved, so only the tiles it covered and now covers are written
+//! and flushed.
+
+#include "share.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \brief Size of the box, in pixels
+#define BOX_SIZE 64u
+//! \brief Colour of the box
+#define BOX_COLOR 0x00ffffffu
+
+//! \brief Where the box was last drawn in a framebuffer
+typedef struct box_t {
+  bool drawn;
+  uint32_t x;
+  uint32_t y;
+} box_t;
+
+//! \brief The background at a pixel
+static uint32_t background(uint32_t x, uint32_t y) {
+  uint32_t r = x * 255u / 639u;
+  uint32_t g = y * 255u / 479u;
+  return r << 16 | g << 8 | 0x40u;
+}
+
+//! \brief Fill a rectangle, either with the box or with the background
+//! \details The rectangle's tiles are marked in `dirty`
+static void fill(uint32_t *data, hdmi_fb_dirty_t *dirty, uint32_t bx,
+                 uint32_t by, bool box) {
+  for (uint32_t y = by; y < by + BOX_SIZE; y++) {
+    for (uint32_t x = bx; x < bx + BOX_SIZE; x++)
+      data[y * 640u + x] = box ? BOX_COLOR : background(x, y);
+    for (uint32_t t = bx / HDMI_FB_TILE_WIDTH;
+         t <= (bx + BOX_SIZE - 1u) / HDMI_FB_TILE_WIDTH; t++)
+      dirty->rows[y / HDMI_FB_TILE_HEIGHT] |= UINT32_C(1) << t;
+  }
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 2 || argc > 4) {
+    fputs("Usage: hdmi-dev-share-demo [SOCKET] [FRAMES] [FDIV]\n"
+          "Connects to `hdmi-dev-video-player --serve [SOCKET]`, and draws\n"
+          "[FRAMES] frames straight into its framebuffers, one every [FDIV]\n"
+          "refreshes. The defaults are 600 frames, and every refresh.\n",
+          stderr);
+    return 1;
+  }
+  long frames = argc > 2 ? atol(argv[2]) : 600;
+  int fdiv = argc > 3 ? atoi(argv[3]) : 1;
+  if (frames <= 0 || fdiv <= 0 || fdiv >= 2048) {
+    fputs("Usage: invalid parameters\n", stderr);
+    return 1;
+  }
+
+  share_client_t *client = share_client_open(argv[1]);
+  if (client == NULL) {
+    fprintf(stderr, "Error: failed to connect to %s\n", argv[1]);
+    return 127;
+  }
+  fprintf(stderr, "TRACE: Sharing %u framebuffers with the player\n",
+          client->hello.count);
+  box_t *boxes = calloc(client->hello.count, sizeof(box_t));
+  if (boxes == NULL) {
+    share_client_close(client);
+    return 127;
+  }
+
+  // The box bounces off the edges
+  const uint32_t span_x = 640u - BOX_SIZE;
+  const uint32_t span_y = 480u - BOX_SIZE;
+  long n = 0;
+  for (; n < frames; n++) {
+    uint32_t index;
+    uint32_t *data = share_client_lease(client, &index);
+    if (data == NULL)
+      break;
+    uint32_t bx = (uint32_t)(n * 8) % (2u * span_x);
+    uint32_t by = (uint32_t)(n * 5) % (2u * span_y);
+    bx = bx < span_x ? bx : 2u * span_x - bx;
+    by = by < span_y ? by : 2u * span_y - by;
+
+    // Paint over where the box was in this framebuffer, or everything if
+    // it's new to us, then draw the box where it is now
+    hdmi_fb_dirty_t dirty = {0};
+    box_t *old = &boxes[index];
+    if (old->drawn) {
+      fill(data, &dirty, old->x, old->y, false);
+    } else {
+      for (uint32_t y = 0u; y < 480u; y++)
+        for (uint32_t x = 0u; x < 640u; x++)
+          data[y * 640u + x] = background(x, y);
+      hdmi_fb_dirty_all(&dirty);
+    }
+    fill(data, &dirty, bx, by, true);
+    *old = (box_t){.drawn = true, .x = bx, .y = by};
+
+    if (!share_client_submit(client, index, (uint16_t)((n * fdiv) & 0xfff),
+                             SHARE_SUBMIT_FID | SHARE_SUBMIT_DIRTY, &dirty))
+      break;
+  }
+
+  fprintf(stderr, "TRACE: Drew %ld frames\n", n);
+  free(boxes);
+  share_client_close(client);
+  return n == frames ? 0 : 127;
+}
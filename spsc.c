@@ -0,0 +1,79 @@
+#include "spsc.h"
+
+#include <stdlib.h>
+
+spsc_t *spsc_alloc(size_t capacity) {
+
+  // Round the capacity up to a power of two so we can mask instead of using
+  // modulo. Zero-capacity queues are useless, so reject them.
+  if (capacity == 0u)
+    return NULL;
+  size_t rounded = 1u;
+  while (rounded < capacity)
+    rounded <<= 1;
+
+  // Allocate space for the return value. It has over-aligned members, so we
+  // can't just use `calloc`.
+  spsc_t *ret = aligned_alloc(_Alignof(spsc_t), sizeof(spsc_t));
+  if (ret == NULL)
+    return NULL;
+  atomic_init(&ret->head, 0u);
+  atomic_init(&ret->tail, 0u);
+  ret->capacity = rounded;
+
+  // Allocate the backing storage
+  ret->slots = calloc(rounded, sizeof(size_t));
+  if (ret->slots == NULL) {
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+void spsc_free(spsc_t *q) {
+  if (q == NULL)
+    return;
+  free(q->slots);
+  free(q);
+}
+
+bool spsc_push(spsc_t *q, size_t value) {
+  // We own the tail, so we can read it relaxed. The head has to be acquired so
+  // we know the consumer is done reading the slot we're about to overwrite.
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == q->capacity)
+    return false;
+  // Write the data, then publish it
+  q->slots[tail & (q->capacity - 1u)] = value;
+  atomic_store_explicit(&q->tail, tail + 1u, memory_order_release);
+  return true;
+}
+
+bool spsc_pop(spsc_t *q, size_t *value) {
+  // Mirror image of `spsc_push`
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (tail == head)
+    return false;
+  *value = q->slots[head & (q->capacity - 1u)];
+  atomic_store_explicit(&q->head, head + 1u, memory_order_release);
+  return true;
+}
+
+bool spsc_peek(spsc_t *q, size_t *value) {
+  // Same as `spsc_pop`, but without giving the slot back
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (tail == head)
+    return false;
+  *value = q->slots[head & (q->capacity - 1u)];
+  return true;
+}
+
+size_t spsc_size(spsc_t *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  return tail - head;
+}
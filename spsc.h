@@ -0,0 +1,71 @@
+//! \file spsc.h
+//! \brief Lock-free single-producer single-consumer queue
+//!
+//! This queue carries indices between exactly two threads: one that only ever
+//! pushes, and one that only ever pops. With that restriction, no locks are
+//! needed - each side only writes its own cursor and reads the other's. We use
+//! it to hand framebuffers between the decoding and presenting threads.
+//!
+//! None of these methods block. If the queue is full or empty, they fail and
+//! the caller decides how to wait.
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//! \brief A bounded queue of `size_t`s
+//!
+//! The cursors are free-running, and they are only reduced modulo the capacity
+//! when indexing into `slots`. This is why the capacity must be a power of two.
+//! They are kept on separate cache lines so the two threads don't fight over
+//! the same line when they update them.
+typedef struct spsc_t {
+  //! \brief Index of the next element to pop
+  //! \details Only written by the consumer
+  _Alignas(64) atomic_size_t head;
+  //! \brief Index of the next element to push
+  //! \details Only written by the producer
+  _Alignas(64) atomic_size_t tail;
+
+  //! \brief Number of elements in `slots`, always a power of two
+  _Alignas(64) size_t capacity;
+  //! \brief Backing storage for the queue
+  size_t *slots;
+} spsc_t;
+
+//! \brief Create an empty queue
+//!
+//! The capacity is rounded up to the next power of two, so the queue may be
+//! able to hold more elements than requested.
+//!
+//! \param[in] capacity The minimum number of elements the queue should hold
+//! \return A pointer to the queue on the heap, or `NULL` on failure
+spsc_t *spsc_alloc(size_t capacity);
+//! \brief Inverse of `spsc_alloc`
+//! \details It is legal to free a `NULL` queue
+void spsc_free(spsc_t *q);
+
+//! \brief Append an element to the queue
+//! \details Must only be called from the producer thread
+//! \return Whether there was space for the element
+bool spsc_push(spsc_t *q, size_t value);
+//! \brief Remove the oldest element from the queue
+//! \details Must only be called from the consumer thread
+//! \param[out] value Where to write the element, if there was one
+//! \return Whether there was an element to remove
+bool spsc_pop(spsc_t *q, size_t *value);
+//! \brief Look at the oldest element without removing it
+//! \details Must only be called from the consumer thread
+//! \param[out] value Where to write the element, if there was one
+//! \return Whether there was an element
+bool spsc_peek(spsc_t *q, size_t *value);
+
+//! \brief Number of elements currently in the queue
+//!
+//! This can be called from either thread. The value may be stale by the time
+//! it's returned, but it's accurate for the calling side in the sense that the
+//! producer will never see fewer free slots than there are, and the consumer
+//! will never see fewer elements than there are.
+size_t spsc_size(spsc_t *q);
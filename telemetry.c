@@ -0,0 +1,216 @@
+#include "telemetry.h"
+
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! \brief Set by `telemetry_request_dump`, and cleared by `telemetry_poll`
+static volatile sig_atomic_t dump_requested = 0;
+
+telemetry_t *telemetry_open(void) {
+  telemetry_t *ret = calloc(1u, sizeof(telemetry_t));
+  if (ret == NULL)
+    return NULL;
+  for (size_t s = 0u; s < TELEMETRY_STAGES; s++) {
+    telemetry_hist_t *h = &ret->hists[s];
+    atomic_init(&h->count, 0u);
+    atomic_init(&h->sum, 0u);
+    atomic_init(&h->min, UINT64_MAX);
+    atomic_init(&h->max, 0u);
+    for (size_t b = 0u; b < TELEMETRY_BUCKETS; b++)
+      atomic_init(&h->buckets[b], 0u);
+  }
+  return ret;
+}
+
+void telemetry_close(telemetry_t *tel) { free(tel); }
+
+uint64_t telemetry_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+//! \brief Which bucket a value goes in
+static size_t bucket_of(uint64_t value) {
+  if (value < 16u)
+    return (size_t)value;
+  size_t e = 63u - (size_t)__builtin_clzll(value);
+  size_t sub = (size_t)(value >> (e - 2u)) & 3u;
+  return 16u + (e - 4u) * 4u + sub;
+}
+
+//! \brief Largest value that goes in a bucket
+static uint64_t bucket_upper(size_t bucket) {
+  if (bucket < 16u)
+    return bucket;
+  size_t e = (bucket - 16u) / 4u + 4u;
+  uint64_t sub = (bucket - 16u) % 4u;
+  uint64_t lower = (UINT64_C(4) + sub) << (e - 2u);
+  return lower + (UINT64_C(1) << (e - 2u)) - 1u;
+}
+
+void telemetry_record(telemetry_t *tel, telemetry_stage_t stage,
+                      uint64_t value) {
+  if (tel == NULL || stage >= TELEMETRY_STAGES)
+    return;
+  telemetry_hist_t *h = &tel->hists[stage];
+  atomic_fetch_add_explicit(&h->buckets[bucket_of(value)], 1u,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1u, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+  // There's no atomic min or max, so retry until we either win or see that
+  // someone else recorded something more extreme
+  uint_fast64_t cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+  while (value < cur && !atomic_compare_exchange_weak_explicit(
+                            &h->min, &cur, value, memory_order_relaxed,
+                            memory_order_relaxed)) {
+  }
+  cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (value > cur && !atomic_compare_exchange_weak_explicit(
+                            &h->max, &cur, value, memory_order_relaxed,
+                            memory_order_relaxed)) {
+  }
+}
+
+telemetry_summary_t telemetry_summary(const telemetry_t *tel,
+                                      telemetry_stage_t stage) {
+  telemetry_summary_t ret = {0};
+  if (tel == NULL || stage >= TELEMETRY_STAGES)
+    return ret;
+  const telemetry_hist_t *h = &tel->hists[stage];
+
+  // Take a snapshot of the buckets, and count from that so the percentiles
+  // are consistent with each other
+  uint64_t buckets[TELEMETRY_BUCKETS];
+  uint64_t count = 0u;
+  for (size_t b = 0u; b < TELEMETRY_BUCKETS; b++) {
+    buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+    count += buckets[b];
+  }
+  if (count == 0u)
+    return ret;
+  ret.count = count;
+  ret.mean = (double)atomic_load_explicit(&h->sum, memory_order_relaxed) /
+             (double)count;
+  ret.min = atomic_load_explicit(&h->min, memory_order_relaxed);
+  ret.max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+  // Walk the buckets to find each percentile. Report the top of the bucket,
+  // but never more than the maximum we actually saw.
+  const double QS[3] = {0.50, 0.90, 0.99};
+  uint64_t *const OUTS[3] = {&ret.p50, &ret.p90, &ret.p99};
+  for (size_t q = 0u; q < 3u; q++) {
+    uint64_t rank = (uint64_t)ceil(QS[q] * (double)count);
+    if (rank == 0u)
+      rank = 1u;
+    uint64_t seen = 0u;
+    size_t b = 0u;
+    while (b < TELEMETRY_BUCKETS - 1u && seen + buckets[b] < rank)
+      seen += buckets[b++];
+    uint64_t v = bucket_upper(b);
+    *OUTS[q] = v < ret.max ? v : ret.max;
+  }
+  return ret;
+}
+
+const char *telemetry_stage_name(telemetry_stage_t stage) {
+  static const char *const NAMES[TELEMETRY_STAGES] = {
+      [TELEMETRY_DEMUX] = "demux",     [TELEMETRY_DECODE] = "decode",
+      [TELEMETRY_CONVERT] = "convert", [TELEMETRY_FLUSH] = "flush",
+      [TELEMETRY_WAIT] = "wait",       [TELEMETRY_PRESENT] = "present",
+      [TELEMETRY_SLACK] = "slack",
+  };
+  return stage < TELEMETRY_STAGES ? NAMES[stage] : "unknown";
+}
+
+const char *telemetry_stage_unit(telemetry_stage_t stage) {
+  return stage == TELEMETRY_SLACK ? "lines" : "ns";
+}
+
+void telemetry_print(const telemetry_t *tel, FILE *out) {
+  if (tel == NULL)
+    return;
+  fprintf(out, "%-8s %-5s %8s %10s %10s %10s %10s %10s %10s\n", "stage",
+          "unit", "count", "mean", "min", "p50", "p90", "p99", "max");
+  for (telemetry_stage_t s = 0; s < TELEMETRY_STAGES; s++) {
+    telemetry_summary_t sum = telemetry_summary(tel, s);
+    fprintf(out,
+            "%-8s %-5s %8llu %10.0f %10llu %10llu %10llu %10llu %10llu\n",
+            telemetry_stage_name(s), telemetry_stage_unit(s),
+            (unsigned long long)sum.count, sum.mean,
+            (unsigned long long)sum.min, (unsigned long long)sum.p50,
+            (unsigned long long)sum.p90, (unsigned long long)sum.p99,
+            (unsigned long long)sum.max);
+  }
+}
+
+//! \brief Write the report as CSV, one row per stage
+static void write_csv(const telemetry_t *tel, FILE *out) {
+  fputs("stage,unit,count,mean,min,p50,p90,p99,max\n", out);
+  for (telemetry_stage_t s = 0; s < TELEMETRY_STAGES; s++) {
+    telemetry_summary_t sum = telemetry_summary(tel, s);
+    fprintf(out, "%s,%s,%llu,%.1f,%llu,%llu,%llu,%llu,%llu\n",
+            telemetry_stage_name(s), telemetry_stage_unit(s),
+            (unsigned long long)sum.count, sum.mean,
+            (unsigned long long)sum.min, (unsigned long long)sum.p50,
+            (unsigned long long)sum.p90, (unsigned long long)sum.p99,
+            (unsigned long long)sum.max);
+  }
+}
+
+//! \brief Write the report as JSON, including the buckets
+//! \details Buckets are written as pairs of their upper bound and count
+static void write_json(const telemetry_t *tel, FILE *out) {
+  fputs("{\n  \"stages\": {\n", out);
+  for (telemetry_stage_t s = 0; s < TELEMETRY_STAGES; s++) {
+    telemetry_summary_t sum = telemetry_summary(tel, s);
+    fprintf(out,
+            "    \"%s\": {\"unit\": \"%s\", \"count\": %llu, "
+            "\"mean\": %.1f, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"max\": %llu, \"buckets\": [",
+            telemetry_stage_name(s), telemetry_stage_unit(s),
+            (unsigned long long)sum.count, sum.mean,
+            (unsigned long long)sum.min, (unsigned long long)sum.p50,
+            (unsigned long long)sum.p90, (unsigned long long)sum.p99,
+            (unsigned long long)sum.max);
+    bool first = true;
+    for (size_t b = 0u; b < TELEMETRY_BUCKETS; b++) {
+      uint64_t n =
+          atomic_load_explicit(&tel->hists[s].buckets[b], memory_order_relaxed);
+      if (n == 0u)
+        continue;
+      fprintf(out, "%s[%llu, %llu]", first ? "" : ", ",
+              (unsigned long long)bucket_upper(b), (unsigned long long)n);
+      first = false;
+    }
+    fprintf(out, "]}%s\n", s + 1 < TELEMETRY_STAGES ? "," : "");
+  }
+  fputs("  }\n}\n", out);
+}
+
+bool telemetry_write_report(const telemetry_t *tel, const char *filename) {
+  if (tel == NULL || filename == NULL)
+    return false;
+  FILE *out = fopen(filename, "w");
+  if (out == NULL)
+    return false;
+  size_t len = strlen(filename);
+  if (len >= 4u && strcmp(filename + len - 4u, ".csv") == 0)
+    write_csv(tel, out);
+  else
+    write_json(tel, out);
+  bool ok = !ferror(out);
+  return fclose(out) == 0 && ok;
+}
+
+void telemetry_request_dump(void) { dump_requested = 1; }
+
+void telemetry_poll(const telemetry_t *tel, FILE *out) {
+  if (tel == NULL || !dump_requested)
+    return;
+  dump_requested = 0;
+  telemetry_print(tel, out);
+}
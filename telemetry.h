@@ -0,0 +1,117 @@
+//! \file telemetry.h
+//! \brief Per-stage timing of the playback pipeline
+//!
+//! Every frame is timed as it goes through each stage of the pipeline, and the
+//! times are recorded into one histogram per stage. The histograms have a fixed
+//! number of buckets, and recording into them is just a few relaxed atomic
+//! operations, so they can be updated from any thread without locks or
+//! allocation.
+//!
+//! Buckets are log-linear: values below 16 get a bucket each, and every power
+//! of two above that is split into four buckets. Percentiles computed from them
+//! are accurate to within 25%.
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//! \brief Number of buckets in each histogram
+#define TELEMETRY_BUCKETS 256u
+
+//! \brief The quantities we record
+typedef enum telemetry_stage_t {
+  //! \brief Reading packets from the container, or raw frames from a pipe,
+  //!        in nanoseconds
+  TELEMETRY_DEMUX,
+  //! \brief Sending packets to and receiving frames from the decoder
+  TELEMETRY_DECODE,
+  //! \brief Colorspace conversion, or copying from a pack
+  TELEMETRY_CONVERT,
+  //! \brief Flushing the framebuffer from the cache
+  TELEMETRY_FLUSH,
+  //! \brief Waiting for the device to reach the presentation point
+  TELEMETRY_WAIT,
+  //! \brief Handing the framebuffer to the device and recycling the old one
+  TELEMETRY_PRESENT,
+  //! \brief Scan lines left before the deadline when a frame was ready
+  //! \details Frames that missed their deadline are recorded as zero
+  TELEMETRY_SLACK,
+  //! \brief Number of stages
+  TELEMETRY_STAGES,
+} telemetry_stage_t;
+
+//! \brief A histogram that can be updated concurrently
+typedef struct telemetry_hist_t {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+  atomic_uint_fast64_t min;
+  atomic_uint_fast64_t max;
+  atomic_uint_fast64_t buckets[TELEMETRY_BUCKETS];
+} telemetry_hist_t;
+
+//! \brief Histograms for every stage of the pipeline
+typedef struct telemetry_t {
+  telemetry_hist_t hists[TELEMETRY_STAGES];
+} telemetry_t;
+
+//! \brief Summary statistics computed from a histogram
+typedef struct telemetry_summary_t {
+  uint64_t count;
+  double mean;
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t max;
+} telemetry_summary_t;
+
+//! \brief Create an empty set of histograms
+//! \return A pointer to the histograms on the heap, or `NULL` on failure
+telemetry_t *telemetry_open(void);
+//! \brief Inverse of `telemetry_open`
+//! \details It is legal to close a `NULL` pointer
+void telemetry_close(telemetry_t *tel);
+
+//! \brief Current time on the monotonic clock, in nanoseconds
+uint64_t telemetry_now_ns(void);
+
+//! \brief Record one value for a stage
+//! \details This is a no-op if `tel` is `NULL`
+void telemetry_record(telemetry_t *tel, telemetry_stage_t stage,
+                      uint64_t value);
+
+//! \brief Compute summary statistics for a stage
+//! \details The histogram may be updated concurrently, in which case the
+//!          result is approximate
+telemetry_summary_t telemetry_summary(const telemetry_t *tel,
+                                      telemetry_stage_t stage);
+
+//! \brief Name of a stage, as used in reports
+const char *telemetry_stage_name(telemetry_stage_t stage);
+//! \brief Unit of a stage's values, as used in reports
+const char *telemetry_stage_unit(telemetry_stage_t stage);
+
+//! \brief Print a human-readable summary of every stage
+void telemetry_print(const telemetry_t *tel, FILE *out);
+
+//! \brief Write a machine-readable report to a file
+//!
+//! The report is CSV if the filename ends in `.csv`, with one row per stage.
+//! Otherwise, it's JSON, and it also includes the non-empty buckets of every
+//! histogram.
+//!
+//! \return Whether the report was written
+bool telemetry_write_report(const telemetry_t *tel, const char *filename);
+
+//! \brief Ask for a summary to be printed
+//!
+//! This is safe to call from a signal handler. The summary is printed by the
+//! next call to `telemetry_poll`.
+void telemetry_request_dump(void);
+//! \brief Print a summary if one was requested
+//! \details This is a no-op if `tel` is `NULL`
+void telemetry_poll(const telemetry_t *tel, FILE *out);
@@ -1,70 +1,428 @@
 #include "video.h"
 
+#include "convert.h"
+#include "scale.h"
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-video_t *video_open(const char *filename) {
+//! \brief Everything a worker needs to convert its part of a frame
+typedef struct convert_job_t {
+  convert_matrix_t matrix;
+  const AVFrame *frame;
+  const scale_layout_t *layout;
+  uint32_t *framebuffer;
+  //! \brief Where to record which tiles changed, or `NULL` to not compare
+  hdmi_fb_dirty_t *dirty;
+  //! \brief Whether the bars around the picture have to be cleared
+  bool clear_bars;
+  //! \brief Where to flush each band as soon as it's converted, or `NULL`
+  hdmi_fb_allocator_t *alloc;
+  //! \brief The framebuffer being written, if bands are flushed
+  hdmi_fb_handle_t *fb;
+  //! \brief Which rows of tiles to convert
+  //! @{
+  size_t tile_begin;
+  size_t tile_end;
+  //! @}
+} convert_job_t;
 
-  // Allocate space for the return value
-  video_t *ret = calloc(1u, sizeof(video_t));
-  if (ret == NULL)
-    return NULL;
-  // Initialize everything to a known state
-  ret->format_ctx = NULL;
-  ret->codec_ctx = NULL;
-  ret->packet = NULL;
-  ret->frame = NULL;
+//! \brief Height of the bands that are flushed as they're converted
+//! \details This is in rows of tiles, so 32 lines
+#define FLUSH_BAND_TILE_ROWS 2u
+
+//! \brief Color of the bars around the picture
+static const uint32_t BAR_COLOR = 0xff000000u;
+
+//! \brief Fill columns [`begin`, `end`) of a pair of rows with `BAR_COLOR`
+static inline void fill_bars(uint32_t *d0, uint32_t *d1, size_t begin,
+                             size_t end) {
+  for (size_t x = begin; x < end; x++)
+    d0[x] = d1[x] = BAR_COLOR;
+}
+
+//! \brief Convert rows of a frame straight into the framebuffer
+static void convert_rows(const convert_job_t *job, size_t row_begin,
+                         size_t row_end) {
+  const scale_layout_t *l = job->layout;
+  for (size_t row = row_begin; row < row_end; row += 2u) {
+    uint32_t *d0 = job->framebuffer + row * 640u;
+    uint32_t *d1 = d0 + 640u;
+    bool inside = row >= l->y && row < l->y + l->height;
+    // Only touch the bars if we have to
+    if (job->clear_bars && !inside) {
+      fill_bars(d0, d1, 0u, 640u);
+    } else if (job->clear_bars) {
+      fill_bars(d0, d1, 0u, l->x);
+      fill_bars(d0, d1, l->x + l->width, 640u);
+    }
+    if (inside)
+      scale_rows(l, &job->matrix, job->frame, row, d0 + l->x, d1 + l->x);
+  }
+}
+
+//! \brief Convert rows of a frame, only writing the tiles that changed
+//!
+//! Each pair of rows is converted into a small buffer on the stack, then
+//! compared with what the framebuffer already holds. Both rows must be in the
+//! same row of tiles, which is always the case since tiles have an even height.
+//! Rows that are entirely bars are skipped unless they have to be cleared.
+static void convert_rows_diff(const convert_job_t *job, size_t row_begin,
+                              size_t row_end) {
+  const scale_layout_t *l = job->layout;
+  uint32_t scratch[2u * 640u];
+  for (size_t i = 0u; i < 2u * 640u; i++)
+    scratch[i] = BAR_COLOR;
+  for (size_t row = row_begin; row < row_end; row += 2u) {
+    bool inside = row >= l->y && row < l->y + l->height;
+    if (!inside && !job->clear_bars)
+      continue;
+    // The bars in the scratch buffer are never overwritten, so rows of bars
+    // can use it as it is
+    if (inside)
+      scale_rows(l, &job->matrix, job->frame, row, scratch + l->x,
+                 scratch + 640u + l->x);
+    else
+      fill_bars(scratch, scratch + 640u, l->x, l->x + l->width);
+    hdmi_fb_store_row(job->dirty, job->framebuffer, row, scratch);
+    hdmi_fb_store_row(job->dirty, job->framebuffer, row + 1u, scratch + 640u);
+  }
+}
+
+//! \brief Convert the rows in tile rows [`tile_begin`, `tile_end`)
+static void convert_tile_rows(const convert_job_t *job, size_t tile_begin,
+                              size_t tile_end) {
+  size_t row_begin = HDMI_FB_TILE_HEIGHT * tile_begin;
+  size_t row_end = HDMI_FB_TILE_HEIGHT * tile_end;
+  if (job->dirty == NULL) {
+    convert_rows(job, row_begin, row_end);
+    return;
+  }
+  // Start with a clean slate for our rows of tiles
+  for (size_t tr = tile_begin; tr < tile_end; tr++)
+    job->dirty->rows[tr] = 0u;
+  convert_rows_diff(job, row_begin, row_end);
+}
+
+//! \brief Convert one band of a frame
+//!
+//! The rows of tiles the job covers are split into `count` bands of roughly
+//! equal height, and this converts the `index`-th one. Band boundaries are
+//! kept on the boundaries between rows of tiles, so each band starts on a new
+//! row of chroma, and so no two threads touch the same word of the dirty
+//! bitmap. Since every row is converted independently, the result doesn't
+//! depend on how the frame was split.
+//!
+//! If bands are flushed as they're converted, the rows are instead split into
+//! bands of `FLUSH_BAND_TILE_ROWS`, dealt out to the workers in turn from the
+//! top. Each is flushed as soon as it's converted, while the other workers are
+//! still converting theirs, so the flush mostly overlaps with conversion
+//! instead of following it.
+static void convert_band(void *arg, size_t index, size_t count) {
+  const convert_job_t *job = arg;
+  size_t begin = job->tile_begin;
+  size_t end = job->tile_end;
+  if (job->fb == NULL) {
+    convert_tile_rows(job, begin + (end - begin) * index / count,
+                      begin + (end - begin) * (index + 1u) / count);
+    return;
+  }
+  for (size_t tb = begin + index * FLUSH_BAND_TILE_ROWS; tb < end;
+       tb += count * FLUSH_BAND_TILE_ROWS) {
+    size_t te = tb + FLUSH_BAND_TILE_ROWS;
+    if (te > end)
+      te = end;
+    convert_tile_rows(job, tb, te);
+    hdmi_fb_flush_band(job->alloc, job->fb, tb, te);
+  }
+}
+
+//! \brief Timestamp of the start of a stream, in its time base
+static int64_t stream_start(const AVStream *stream) {
+  return stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+}
+
+//! \brief Order timestamps for `qsort`
+static int compare_ts(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+//! \brief Take ownership of a list of keyframe timestamps as the index
+//!
+//! The timestamps are in the stream's time base. They're converted to
+//! nanoseconds from the start of the stream in place, and sorted.
+static void set_index(video_t *video, int64_t *keyframes, size_t count) {
+  const AVStream *stream = video->format_ctx->streams[0u];
+  const AVRational NS = {1, 1000000000};
+  int64_t start = stream_start(stream);
+  for (size_t i = 0u; i < count; i++)
+    keyframes[i] = av_rescale_q(keyframes[i] - start, stream->time_base, NS);
+  qsort(keyframes, count, sizeof(int64_t), compare_ts);
+  free(video->keyframes_ns);
+  video->keyframes_ns = keyframes;
+  video->keyframe_count = count;
+  video->indexed = count != 0u;
+}
+
+//! \brief Take the keyframes from the demuxer's index, if it has one
+//! \return Whether that worked, which it does even without an index
+static bool index_from_demuxer(video_t *video) {
+  AVStream *stream = video->format_ctx->streams[0u];
+  int entries = avformat_index_get_entries_count(stream);
+  if (entries <= 0)
+    return true;
+  int64_t *keyframes = malloc((size_t)entries * sizeof(int64_t));
+  if (keyframes == NULL)
+    return false;
+  size_t count = 0u;
+  for (int i = 0; i < entries; i++) {
+    const AVIndexEntry *e = avformat_index_get_entry(stream, i);
+    if (e != NULL && (e->flags & AVINDEX_KEYFRAME) != 0)
+      keyframes[count++] = e->timestamp;
+  }
+  // An index with no keyframes is as good as none
+  if (count == 0u) {
+    free(keyframes);
+    return true;
+  }
+  set_index(video, keyframes, count);
+  return true;
+}
+
+//! \brief Size of the buffer the demuxer reads into through a custom context
+static const int IO_BUFFER_SIZE = 64 * 1024;
+
+//! \brief Give the decoder a buffer from our pool
+//! \details The context's opaque field points to the video
+static int get_buffer2(AVCodecContext *ctx, AVFrame *frame, int flags) {
+  const video_t *video = ctx->opaque;
+  return frame_pool_get_buffer(video->pool, ctx, frame, flags);
+}
+
+//! \brief Open the input file, and check that it's something we can play
+//!
+//! This sets up everything to do with the container, and resets everything we
+//! track about the stream. The decoder isn't touched.
+static bool open_input(video_t *video, const char *filename) {
+  const video_config_t *config = &video->config;
+  video->frame_index = -1;
+  video->frame_time_ns = -1;
+  video->loops = 0u;
+  video->loop_offset = 0;
+  video->loop_end = INT64_MIN;
+  video->loop_read = false;
+
+  // If we're reading ahead of the demuxer, set up the context it reads
+  // through. LibAV won't touch the file itself in that case.
+  if (config->io != VIDEO_IO_LIBAV) {
+    reader_mode_t mode =
+        config->io == VIDEO_IO_MMAP ? READER_MMAP : READER_THREAD;
+    video->reader = reader_open(filename, mode, config->readahead);
+    if (video->reader == NULL)
+      return false;
+    uint8_t *buffer = av_malloc((size_t)IO_BUFFER_SIZE);
+    if (buffer == NULL)
+      return false;
+    video->io = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, video->reader,
+                                   reader_read, NULL, reader_seek);
+    if (video->io == NULL) {
+      av_free(buffer);
+      return false;
+    }
+    video->format_ctx = avformat_alloc_context();
+    if (video->format_ctx == NULL)
+      return false;
+    video->format_ctx->pb = video->io;
+    video->format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
 
   // Open the input file, failing if we can't. This will allocate the context
-  // for the container on success, placing the result in `ret->format_ctx`.
-  if (avformat_open_input(&ret->format_ctx, filename, NULL, NULL) != 0)
-    goto failure;
+  // for the container on success, placing the result in `format_ctx`. LibAV
+  // frees the context if this fails.
+  if (avformat_open_input(&video->format_ctx, filename, NULL, NULL) != 0)
+    return false;
 
   // We should only have one stream. If we get a container with more than one,
   // just fail so we don't have to find the right one.
-  if (ret->format_ctx->nb_streams != 1u)
-    goto failure;
+  if (video->format_ctx->nb_streams != 1u)
+    return false;
 
   // Pull out the stream for easy access. Note that this aliases into the format
   // context. It will be freed when the format context is freed.
-  AVStream *stream = ret->format_ctx->streams[0u];
+  AVStream *stream = video->format_ctx->streams[0u];
 
   // Validate that the stream is what we expect
   const AVCodecParameters *stream_codecpar = stream->codecpar;
-  // The singular stream should be a video stream, ...
+  // The singular stream should be a video stream. Frames of any size are
+  // scaled to fit, so that's all we check.
   if (stream_codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
-    goto failure;
-  // ... which is 640x480.
-  if (stream_codecpar->width != 640 || stream_codecpar->height != 480)
-    goto failure;
+    return false;
   // We can't validate the framerate since it might be unknown. Ditto with the
-  // format.
+  // format. Remember it if it's there, since we use it to number frames.
+  video->frame_rate = stream->avg_frame_rate;
+  if (video->frame_rate.num <= 0 || video->frame_rate.den <= 0)
+    video->frame_rate = stream->r_frame_rate;
+  if (video->frame_rate.num <= 0 || video->frame_rate.den <= 0)
+    video->frame_rate = (AVRational){0, 1};
+  // If the container lists its keyframes, remember them for seeking
+  return index_from_demuxer(video);
+}
+
+//! \brief Inverse of `open_input`
+//! \details This is tolerant to a partially-opened input
+static void close_input(video_t *video) {
+  // The format is guaranteed to either be `NULL` or open because we allocated
+  // in `avformat_open_input`, or allocated just before it.
+  avformat_close_input(&video->format_ctx);
+  // With custom I/O, the context and its buffer are ours to free, and only
+  // after the format is closed. LibAV may have replaced the buffer.
+  if (video->io != NULL)
+    av_freep(&video->io->buffer);
+  avio_context_free(&video->io);
+  reader_close(video->reader);
+  video->reader = NULL;
+  free(video->keyframes_ns);
+  video->keyframes_ns = NULL;
+  video->keyframe_count = 0u;
+  video->indexed = false;
+}
+
+//! \brief Create and open a decoder for the input's stream
+//! \details The frame pool is created too, unless there already is one
+static bool open_decoder(video_t *video) {
+  const video_config_t *config = &video->config;
+  const AVCodecParameters *stream_codecpar =
+      video->format_ctx->streams[0u]->codecpar;
 
   // Find the codec we're supposed to use, and create the context for it based
-  // on the parameters requested by the video.
+  // on the parameters requested by the video. Remember the parameters, so we
+  // can tell if the next input can use the same decoder.
   const AVCodec *codec = avcodec_find_decoder(stream_codecpar->codec_id);
   if (codec == NULL)
+    return false;
+  video->codec_ctx = avcodec_alloc_context3(codec);
+  if (video->codec_ctx == NULL)
+    return false;
+  if (avcodec_parameters_to_context(video->codec_ctx, stream_codecpar) < 0)
+    return false;
+  if (avcodec_parameters_copy(video->codecpar, stream_codecpar) < 0)
+    return false;
+
+  // Configure threading before opening the codec, since it's fixed after that.
+  // For the automatic mode, we leave LibAV's defaults alone.
+  switch (config->decode_threading) {
+  case VIDEO_THREADING_AUTO:
+    video->codec_ctx->thread_count = (int)config->decode_threads;
+    break;
+  case VIDEO_THREADING_NONE:
+    video->codec_ctx->thread_count = 1;
+    break;
+  case VIDEO_THREADING_SLICE:
+    video->codec_ctx->thread_count = (int)config->decode_threads;
+    video->codec_ctx->thread_type = FF_THREAD_SLICE;
+    break;
+  case VIDEO_THREADING_FRAME:
+    video->codec_ctx->thread_count = (int)config->decode_threads;
+    video->codec_ctx->thread_type = FF_THREAD_FRAME;
+    break;
+  }
+  // Have the decoder use our preallocated buffers, if it supports that
+  if ((codec->capabilities & AV_CODEC_CAP_DR1) != 0) {
+    size_t pool_frames = config->pool_frames != 0u ? config->pool_frames
+                                                   : VIDEO_DEFAULT_POOL_FRAMES;
+    if (video->pool == NULL)
+      video->pool = frame_pool_open(pool_frames);
+    if (video->pool == NULL)
+      return false;
+    video->codec_ctx->opaque = video;
+    video->codec_ctx->get_buffer2 = get_buffer2;
+  }
+
+  if (avcodec_open2(video->codec_ctx, codec, NULL) != 0)
+    return false;
+
+  // Now that the codec is open, we can see how much delay it adds. Frame
+  // threading holds back one frame for every thread but the first, and
+  // reordering holds back however many frames the stream says it needs.
+  video->decode_delay = (size_t)video->codec_ctx->has_b_frames;
+  if ((video->codec_ctx->active_thread_type & FF_THREAD_FRAME) != 0 &&
+      video->codec_ctx->thread_count > 1)
+    video->decode_delay += (size_t)video->codec_ctx->thread_count - 1u;
+  return true;
+}
+
+//! \brief Whether a decoder opened with `a` can decode a stream with `b`
+//!
+//! The codec, the frame size and format, and any global headers all have to
+//! be the same. Everything else is carried in the stream.
+static bool same_params(const AVCodecParameters *a,
+                        const AVCodecParameters *b) {
+  return a->codec_id == b->codec_id && a->width == b->width &&
+         a->height == b->height && a->format == b->format &&
+         a->extradata_size == b->extradata_size &&
+         (a->extradata_size == 0 ||
+          memcmp(a->extradata, b->extradata, (size_t)a->extradata_size) == 0);
+}
+
+//! \brief Unreference every frame `video_preroll` held back
+static void drop_held(video_t *video) {
+  for (size_t i = video->held_next; i < video->held_count; i++)
+    av_frame_unref(video->held[i].frame);
+  video->held_next = 0u;
+  video->held_count = 0u;
+}
+
+video_t *video_open(const char *filename, const video_config_t *config) {
+
+  // Use the defaults if we weren't given a configuration
+  static const video_config_t DEFAULT_CONFIG = {0};
+  if (config == NULL)
+    config = &DEFAULT_CONFIG;
+
+  // Allocate space for the return value
+  video_t *ret = calloc(1u, sizeof(video_t));
+  if (ret == NULL)
+    return NULL;
+  // Initialize everything to a known state
+  ret->format_ctx = NULL;
+  ret->codec_ctx = NULL;
+  ret->codecpar = NULL;
+  ret->packet = NULL;
+  ret->frame = NULL;
+  ret->workers = NULL;
+  ret->pool = NULL;
+  ret->reader = NULL;
+  ret->io = NULL;
+  ret->keyframes_ns = NULL;
+  ret->config = *config;
+  ret->telemetry = config->telemetry;
+  ret->loop = config->loop;
+
+  // Open the file, then a decoder for it
+  ret->codecpar = avcodec_parameters_alloc();
+  if (ret->codecpar == NULL)
     goto failure;
-  ret->codec_ctx = avcodec_alloc_context3(codec);
-  if (ret->codec_ctx == NULL)
-    goto failure;
-  if (avcodec_parameters_to_context(ret->codec_ctx, stream_codecpar) < 0)
+  if (!open_input(ret, filename))
     goto failure;
-  if (avcodec_open2(ret->codec_ctx, codec, NULL) != 0)
+  if (!open_decoder(ret))
     goto failure;
 
-  // Finally, allocate the packet and the frame we'll use for decoding
+  // Allocate the packet and the frames we'll use for decoding
   ret->packet = av_packet_alloc();
   ret->frame = av_frame_alloc();
   if (ret->packet == NULL || ret->frame == NULL)
     goto failure;
+  for (size_t i = 0u; i < VIDEO_MAX_PREROLL; i++)
+    if ((ret->held[i].frame = av_frame_alloc()) == NULL)
+      goto failure;
 
-  // Now, we need to handle the software scaling side of things. Just allocate
-  // and initialize the context. We'll use the point scaling method, since it's
-  // probably the least computationally expensive.
-  ret->sws_ctx = sws_getContext(640, 480, AV_PIX_FMT_YUV420P, 640, 480,
-                                AV_PIX_FMT_BGRA, SWS_POINT, NULL, NULL, NULL);
-  if (ret->sws_ctx == NULL)
+  // Start the threads we'll use for colorspace conversion. We do this once
+  // here so we don't pay for thread creation on every frame.
+  ret->workers = workers_open(config->convert_threads);
+  if (ret->workers == NULL)
     goto failure;
 
   // We've setup everything we need to, so return
@@ -76,26 +434,220 @@ failure:
   return NULL;
 }
 
+bool video_reopen(video_t *video, const char *filename) {
+  // Edge case handling
+  if (video == NULL || video->codecpar == NULL)
+    return false;
+
+  // Switch inputs. Any frames we were holding were from the old one.
+  drop_held(video);
+  close_input(video);
+  if (!open_input(video, filename))
+    return false;
+  // Something else may have drawn over the bars since we last did
+  video->layout_valid = false;
+  video->cleared_count = 0u;
+
+  // Keep the decoder if it can handle the new stream. It only has to forget
+  // what it was doing, which also takes it out of draining mode.
+  const AVCodecParameters *par = video->format_ctx->streams[0u]->codecpar;
+  if (video->codec_ctx != NULL && same_params(video->codecpar, par)) {
+    avcodec_flush_buffers(video->codec_ctx);
+    video->decoder_reuses++;
+    return true;
+  }
+  // Otherwise, start over. Frames of a different size would all miss the pool,
+  // so that's replaced too. Frames still using the old one keep it alive.
+  avcodec_free_context(&video->codec_ctx);
+  frame_pool_close(video->pool);
+  video->pool = NULL;
+  return open_decoder(video);
+}
+
+//! \brief Read the next packet, starting over at the end if we're looping
+//!
+//! Packets from later loops have their timestamps moved past the end of the
+//! loop before, so they keep increasing.
+static int read_packet(video_t *video) {
+  AVFormatContext *ctx = video->format_ctx;
+  const AVStream *stream = ctx->streams[0u];
+  AVPacket *pkt = video->packet;
+  int res = av_read_frame(ctx, pkt);
+
+  // At the end, go back to the start. Only do it if something was read since
+  // the last time, or an empty stream would loop forever.
+  if (res == AVERROR_EOF && video->loop && video->loop_read) {
+    int64_t start = stream_start(stream);
+    if (av_seek_frame(ctx, 0, start, AVSEEK_FLAG_BACKWARD) >= 0) {
+      if (video->loop_end != INT64_MIN)
+        video->loop_offset += video->loop_end - start;
+      video->loops++;
+      video->loop_end = INT64_MIN;
+      video->loop_read = false;
+      res = av_read_frame(ctx, pkt);
+    }
+  }
+  if (res != 0)
+    return res;
+
+  // Remember where this loop ends. Packets without a duration are assumed to
+  // last a frame.
+  if (pkt->pts != AV_NOPTS_VALUE) {
+    int64_t duration = pkt->duration;
+    if (duration <= 0 && video->frame_rate.num > 0)
+      duration =
+          av_rescale_q(1, av_inv_q(video->frame_rate), stream->time_base);
+    if (pkt->pts + duration > video->loop_end)
+      video->loop_end = pkt->pts + duration;
+  }
+  video->loop_read = true;
+  if (pkt->pts != AV_NOPTS_VALUE)
+    pkt->pts += video->loop_offset;
+  if (pkt->dts != AV_NOPTS_VALUE)
+    pkt->dts += video->loop_offset;
+  return 0;
+}
+
+bool video_build_index(video_t *video) {
+  // Edge case handling
+  if (video == NULL)
+    return false;
+  if (video->indexed)
+    return true;
+
+  // Read every packet from the start, noting the keyframes. The packet is
+  // normally empty between frames, so we can borrow it.
+  AVFormatContext *ctx = video->format_ctx;
+  if (av_seek_frame(ctx, 0, stream_start(ctx->streams[0u]),
+                    AVSEEK_FLAG_BACKWARD) < 0)
+    return false;
+  size_t capacity = 64u;
+  size_t count = 0u;
+  int64_t *keyframes = malloc(capacity * sizeof(int64_t));
+  if (keyframes == NULL)
+    return false;
+  int res;
+  while ((res = av_read_frame(ctx, video->packet)) == 0) {
+    const AVPacket *pkt = video->packet;
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    av_packet_unref(video->packet);
+    if (!key || ts == AV_NOPTS_VALUE)
+      continue;
+    if (count == capacity) {
+      int64_t *grown = realloc(keyframes, 2u * capacity * sizeof(int64_t));
+      if (grown == NULL)
+        goto failure;
+      keyframes = grown;
+      capacity *= 2u;
+    }
+    keyframes[count++] = ts;
+  }
+  if (res != AVERROR_EOF || count == 0u)
+    goto failure;
+  set_index(video, keyframes, count);
+  return true;
+
+failure:
+  free(keyframes);
+  return false;
+}
+
+int video_seek(video_t *video, int64_t time_ns) {
+  // Edge case handling
+  if (video == NULL)
+    return AVERROR(EINVAL);
+
+  // Find the last keyframe at or before the target. If we don't know where
+  // the keyframes are, the demuxer still lands on one, just not one we know.
+  video_build_index(video);
+  int64_t target = time_ns;
+  if (video->keyframe_count != 0u) {
+    size_t lo = 0u;
+    size_t hi = video->keyframe_count;
+    while (hi - lo > 1u) {
+      size_t mid = lo + (hi - lo) / 2u;
+      if (video->keyframes_ns[mid] <= time_ns)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    target = video->keyframes_ns[lo];
+  }
+
+  // Go there, and throw away whatever the decoder was working on
+  drop_held(video);
+  const AVStream *stream = video->format_ctx->streams[0u];
+  const AVRational NS = {1, 1000000000};
+  int64_t ts = av_rescale_q(target, NS, stream->time_base) +
+               stream_start(stream);
+  int res = av_seek_frame(video->format_ctx, 0, ts, AVSEEK_FLAG_BACKWARD);
+  if (res < 0)
+    return res;
+  avcodec_flush_buffers(video->codec_ctx);
+  return 0;
+}
+
+void video_set_discard(video_t *video, enum AVDiscard discard) {
+  if (video == NULL)
+    return;
+  video->codec_ctx->skip_frame = discard;
+}
+
+const char *video_io_name(video_io_t io) {
+  switch (io) {
+  case VIDEO_IO_MMAP:
+    return "mmap";
+  case VIDEO_IO_THREAD:
+    return "thread";
+  default:
+    return "libav";
+  }
+}
+
+const char *video_threading_name(video_threading_t threading) {
+  switch (threading) {
+  case VIDEO_THREADING_NONE:
+    return "none";
+  case VIDEO_THREADING_SLICE:
+    return "slice";
+  case VIDEO_THREADING_FRAME:
+    return "frame";
+  default:
+    return "auto";
+  }
+}
+
 void video_close(video_t *video) {
   // Edge case handling
   if (video == NULL)
     return;
   // Release all the resources. This is tolerant to having `NULL` values in
-  // these fields. Also note that the format is guaranteed to either be `NULL`
-  // or open because we allocated in `avformat_open_input`.
-  sws_freeContext(video->sws_ctx);
+  // these fields.
+  workers_close(video->workers);
+  drop_held(video);
+  for (size_t i = 0u; i < VIDEO_MAX_PREROLL; i++)
+    av_frame_free(&video->held[i].frame);
   av_packet_free(&video->packet);
   av_frame_free(&video->frame);
   avcodec_free_context(&video->codec_ctx);
-  avformat_close_input(&video->format_ctx);
+  avcodec_parameters_free(&video->codecpar);
+  close_input(video);
+  // Close the pool last, after everything that might reference it. Even if
+  // something still does, the pool will stay alive until it's released.
+  frame_pool_close(video->pool);
   free(video);
 }
 
-int video_get_frame(video_t *video, uint32_t *framebuffer) {
+//! \brief Decode the next frame into `video->frame`, and number and time it
+//! \return Zero on success, or the error from LibAV
+static int decode_frame(video_t *video) {
 
-  // Edge cases
-  if (video == NULL || framebuffer == NULL)
-    return AVERROR(EINVAL);
+  // Time spent in each stage for this frame. Getting one frame can take
+  // several packets, so these accumulate until we have it.
+  uint64_t demux_ns = 0u;
+  uint64_t decode_ns = 0u;
+  uint64_t t0 = telemetry_now_ns();
 
 retry_receive_frame:
   // Try to get a frame from the codec
@@ -104,7 +656,22 @@ retry_receive_frame:
   if (rx_frame_res == AVERROR(EAGAIN)) {
     // Pull a packet from the container. The stream index will always be zero
     // since we only have the one stream.
-    int rx_packet_res = av_read_frame(video->format_ctx, video->packet);
+    uint64_t t1 = telemetry_now_ns();
+    decode_ns += t1 - t0;
+    int rx_packet_res = read_packet(video);
+    t0 = telemetry_now_ns();
+    demux_ns += t0 - t1;
+    // When we run out of packets and aren't looping, the decoder may still be
+    // holding frames back, either for reordering or because of frame
+    // threading. Enter draining mode to get them out. After that, the decoder
+    // will report EOF itself instead of asking for more data, so we only get
+    // here once.
+    if (rx_packet_res == AVERROR_EOF) {
+      int drain_res = avcodec_send_packet(video->codec_ctx, NULL);
+      if (drain_res != 0)
+        return drain_res;
+      goto retry_receive_frame;
+    }
     if (rx_packet_res != 0)
       return rx_packet_res;
     // Forward that packet to the codec. After this, we no longer need the
@@ -119,28 +686,194 @@ retry_receive_frame:
   // On the other hand, if there was a legitimate error, just fail out
   if (rx_frame_res != 0)
     return rx_frame_res;
+  decode_ns += telemetry_now_ns() - t0;
 
-  // We expect frames to have YUV420P format. If that's not the case, fail.
-  if (video->frame->format != AV_PIX_FMT_YUV420P)
-    goto failure_with_frame;
-
-  // Convert to RGB from YUV
+  // Number and time the frame. Going by the timestamp accounts for frames the
+  // decoder skipped, and for variable frame rates. Without one, or without a
+  // frame rate, we can only count.
   {
-    // We can't allocate an AVFrame for the output, so we have to stub the
-    // `data` and `linesize` fields
-    uint8_t *const dst[] = {(void *)framebuffer};
-    const int dstStride[] = {640 * 4};
-    // Convert colorspaces
-    sws_scale(video->sws_ctx, (void *)video->frame->data,
-              video->frame->linesize, 0, 480, dst, dstStride);
+    const AVStream *stream = video->format_ctx->streams[0u];
+    const AVRational NS = {1, 1000000000};
+    int64_t pts = video->frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE && stream->start_time != AV_NOPTS_VALUE)
+      pts -= stream->start_time;
+    if (pts != AV_NOPTS_VALUE && video->frame_rate.num > 0)
+      video->frame_index =
+          av_rescale_q(pts, stream->time_base, av_inv_q(video->frame_rate));
+    else
+      video->frame_index++;
+    if (pts != AV_NOPTS_VALUE)
+      video->frame_time_ns = av_rescale_q(pts, stream->time_base, NS);
+    else if (video->frame_rate.num > 0)
+      video->frame_time_ns = av_rescale_q(
+          video->frame_index, av_inv_q(video->frame_rate), NS);
+    else
+      video->frame_time_ns = -1;
   }
+  telemetry_record(video->telemetry, TELEMETRY_DEMUX, demux_ns);
+  telemetry_record(video->telemetry, TELEMETRY_DECODE, decode_ns);
+  return 0;
+}
 
-  // Free resources and return success
+int video_preroll(video_t *video, size_t count) {
+  // Edge case handling
+  if (video == NULL)
+    return AVERROR(EINVAL);
+  if (count > VIDEO_MAX_PREROLL)
+    count = VIDEO_MAX_PREROLL;
+
+  // Decode frames and set them aside. Hitting the end is fine, as long as
+  // there's something to show.
+  while (video->held_count < count) {
+    int res = decode_frame(video);
+    if (res == AVERROR_EOF && video->held_count != 0u)
+      return 0;
+    if (res != 0)
+      return res;
+    video_held_t *h = &video->held[video->held_count++];
+    av_frame_move_ref(h->frame, video->frame);
+    h->index = video->frame_index;
+    h->time_ns = video->frame_time_ns;
+  }
+  return 0;
+}
+
+int video_decode(video_t *video) {
+
+  // Edge cases
+  if (video == NULL)
+    return AVERROR(EINVAL);
+  // Let go of the last frame, if it's still around
   av_frame_unref(video->frame);
+
+  // Frames set aside by `video_preroll` come first. Otherwise, decode one.
+  if (video->held_next < video->held_count) {
+    video_held_t *h = &video->held[video->held_next++];
+    av_frame_move_ref(video->frame, h->frame);
+    video->frame_index = h->index;
+    video->frame_time_ns = h->time_ns;
+    if (video->held_next == video->held_count) {
+      video->held_next = 0u;
+      video->held_count = 0u;
+    }
+  } else {
+    int res = decode_frame(video);
+    if (res != 0)
+      return res;
+  }
+
+  // Work out where the frame goes in the framebuffer, unless we already know.
+  // If it changed, every framebuffer needs its bars redrawn. If we can't lay
+  // the frame out, there's no point in keeping it.
+  if (!video->layout_valid ||
+      !scale_layout_matches(&video->layout, video->frame)) {
+    video->layout_valid = scale_layout_init(&video->layout, video->frame);
+    video->cleared_count = 0u;
+    if (!video->layout_valid) {
+      av_frame_unref(video->frame);
+      return AVERROR(EINVAL);
+    }
+  }
   return 0;
+}
 
-  // If we failed after successfully obtaining a frame, remember to free it
-failure_with_frame:
+//! \brief Convert tile rows [`tile_begin`, `tile_end`) of the decoded frame
+//!
+//! Bands are flushed through `alloc` as they're converted if `fb` is given, in
+//! which case `framebuffer` must be its data.
+static void convert_frame(video_t *video, uint32_t *framebuffer,
+                          hdmi_fb_dirty_t *dirty, hdmi_fb_allocator_t *alloc,
+                          hdmi_fb_handle_t *fb, size_t tile_begin,
+                          size_t tile_end) {
+
+  // The bars only have to be drawn once per framebuffer. Remember which ones
+  // have them, once a whole frame has been converted into them. If we run out
+  // of room to, just draw them every time.
+  bool clear_bars = true;
+  for (size_t i = 0u; i < video->cleared_count; i++)
+    if (video->cleared[i] == framebuffer)
+      clear_bars = false;
+  if (clear_bars && tile_end == HDMI_FB_TILE_ROWS &&
+      video->cleared_count < VIDEO_MAX_FRAMEBUFFERS)
+    video->cleared[video->cleared_count++] = framebuffer;
+
+  // Figure out which matrix to use. Everything that isn't explicitly BT.709
+  // is treated as BT.601, since that's what untagged SD content usually is.
+  convert_colorspace_t space = video->frame->colorspace == AVCOL_SPC_BT709
+                                   ? CONVERT_BT709
+                                   : CONVERT_BT601;
+  bool full_range = video->frame->color_range == AVCOL_RANGE_JPEG ||
+                    scale_full_range(video->frame->format);
+  // Convert colorspaces, splitting the work across all the workers
+  convert_job_t job = {
+      .matrix = convert_matrix(space, full_range),
+      .frame = video->frame,
+      .layout = &video->layout,
+      .framebuffer = framebuffer,
+      .dirty = dirty,
+      .clear_bars = clear_bars,
+      .alloc = alloc,
+      .fb = fb,
+      .tile_begin = tile_begin,
+      .tile_end = tile_end,
+  };
+  workers_run(video->workers, convert_band, &job);
+}
+
+void video_convert(video_t *video, uint32_t *framebuffer,
+                   hdmi_fb_dirty_t *dirty, size_t tile_begin,
+                   size_t tile_end) {
+  // Edge cases
+  if (video == NULL || framebuffer == NULL || video->frame->data[0] == NULL)
+    return;
+  if (tile_end > HDMI_FB_TILE_ROWS)
+    tile_end = HDMI_FB_TILE_ROWS;
+  if (tile_begin >= tile_end)
+    return;
+  convert_frame(video, framebuffer, dirty, NULL, NULL, tile_begin, tile_end);
+}
+
+//! \brief Read one frame from the video into `framebuffer`
+//!
+//! This does the work of every `video_get_frame` variant. Bands are flushed
+//! through `alloc` as they're converted if `fb` is given, in which case
+//! `framebuffer` must be its data.
+static int get_frame(video_t *video, uint32_t *framebuffer,
+                     hdmi_fb_dirty_t *dirty, hdmi_fb_allocator_t *alloc,
+                     hdmi_fb_handle_t *fb) {
+
+  // Edge cases
+  if (video == NULL || framebuffer == NULL)
+    return AVERROR(EINVAL);
+
+  int res = video_decode(video);
+  if (res != 0)
+    return res;
+
+  // If bands are flushed as they go, this times flushing them too
+  uint64_t convert_start = telemetry_now_ns();
+  convert_frame(video, framebuffer, dirty, alloc, fb, 0u, HDMI_FB_TILE_ROWS);
+  uint64_t convert_ns = telemetry_now_ns() - convert_start;
+  telemetry_record(video->telemetry, TELEMETRY_CONVERT, convert_ns);
+
+  // Free resources and return success
   av_frame_unref(video->frame);
-  return AVERROR(EINVAL);
+  return 0;
+}
+
+int video_get_frame(video_t *video, uint32_t *framebuffer) {
+  return get_frame(video, framebuffer, NULL, NULL, NULL);
+}
+
+int video_get_frame_diff(video_t *video, uint32_t *framebuffer,
+                         hdmi_fb_dirty_t *dirty) {
+  return get_frame(video, framebuffer, dirty, NULL, NULL);
+}
+
+int video_get_frame_fb(video_t *video, hdmi_fb_handle_t *fb, bool diff) {
+  if (video == NULL || fb == NULL)
+    return AVERROR(EINVAL);
+  hdmi_fb_allocator_t *alloc = video->config.flush_alloc;
+  return get_frame(video, hdmi_fb_data(fb), diff ? &fb->dirty : NULL, alloc,
+                   alloc != NULL ? fb : NULL);
 }
@@ -2,16 +2,96 @@
 //! \brief Functions to read video data from files
 //!
 //! This module only interacts with very particular videos. The videos cannot
-//! have any audio associated with them. They also have to be 640x480 and the
-//! pixel format has to be YUV420P.
+//! have any audio associated with them. They can be any size, and they're
+//! scaled to fit the 640x480 framebuffer, but the pixel format has to be one
+//! `scale_supported` accepts.
 
 #pragma once
 
+#include "frame_pool.h"
+#include "hdmi_fb.h"
+#include "reader.h"
+#include "scale.h"
+#include "telemetry.h"
+#include "workers.h"
+
 #include <stdint.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
+
+//! \brief Number of framebuffers we remember drawing the bars into
+//! \details This should be at least as deep as the player's ring
+#define VIDEO_MAX_FRAMEBUFFERS 64u
+
+//! \brief Most frames `video_preroll` can set aside
+#define VIDEO_MAX_PREROLL 8u
+
+//! \brief A decoded frame set aside by `video_preroll`
+typedef struct video_held_t {
+  AVFrame *frame;
+  int64_t index;
+  int64_t time_ns;
+} video_held_t;
+
+//! \brief How LibAV should use threads to decode
+typedef enum video_threading_t {
+  //! \brief Let LibAV choose, which is usually frame threading
+  VIDEO_THREADING_AUTO,
+  //! \brief Decode on the calling thread only
+  VIDEO_THREADING_NONE,
+  //! \brief Split each frame into slices, and decode those in parallel
+  VIDEO_THREADING_SLICE,
+  //! \brief Decode multiple frames in parallel, at the cost of latency
+  VIDEO_THREADING_FRAME,
+} video_threading_t;
+
+//! \brief How the input file is read while demuxing
+typedef enum video_io_t {
+  //! \brief Let LibAV read the file with blocking reads
+  VIDEO_IO_LIBAV,
+  //! \brief Map the file, and have the kernel read ahead with `READER_MMAP`
+  VIDEO_IO_MMAP,
+  //! \brief Read ahead on a separate thread with `READER_THREAD`
+  VIDEO_IO_THREAD,
+} video_io_t;
+
+//! \brief Options for opening a video
+//! \details Zero-initializing this structure gives the defaults
+typedef struct video_config_t {
+  //! \brief Number of threads to do colorspace conversion on
+  //! \details This includes the decoding thread. Zero means one per CPU.
+  size_t convert_threads;
+  //! \brief Threading mode for the decoder
+  video_threading_t decode_threading;
+  //! \brief Number of threads for the decoder
+  //! \details Zero lets LibAV choose, which is usually one per CPU
+  size_t decode_threads;
+  //! \brief Number of buffers to preallocate for decoded frames
+  //!
+  //! This has to cover the decoder's reference frames, the frames it holds back
+  //! for reordering and threading, and the one we're converting. Zero means
+  //! `VIDEO_DEFAULT_POOL_FRAMES`.
+  size_t pool_frames;
+  //! \brief How to read the input file
+  video_io_t io;
+  //! \brief How many bytes to read ahead of the demuxer
+  //! \details This is ignored for `VIDEO_IO_LIBAV`. Zero means the default.
+  size_t readahead;
+  //! \brief Where to record demuxing, decoding, and conversion times
+  //! \details This is optional, and it must outlive the video
+  telemetry_t *telemetry;
+  //! \brief Whether to play the video over and over
+  //! \details See `video_get_frame`
+  bool loop;
+  //! \brief Where to flush framebuffers as they're converted, or `NULL`
+  //! \details See `video_get_frame_fb`. It must outlive the video.
+  hdmi_fb_allocator_t *flush_alloc;
+} video_config_t;
+
+//! \brief Default number of buffers to preallocate for decoded frames
+//! \details This is enough for H.264's maximum of 16 reference frames
+#define VIDEO_DEFAULT_POOL_FRAMES 24u
 
 //! \brief Persistent data we need to decode videos
 //!
@@ -22,9 +102,9 @@
 //! The `packet` and `frame` fields should normally hold no data. They are
 //! allocated when reading a frame and unreferenced after that.
 //!
-//! Additionally, this structure holds the context needed for software scaling.
-//! We don't do any scaling, but we do colorspace conversion. This does not need
-//! its own frame since the framebuffer is allocated for us.
+//! Colorspace conversion and scaling are done by the `scale` module, which
+//! writes directly into the framebuffer. The frame is split into horizontal
+//! bands, and each band is converted by a different thread in `workers`.
 typedef struct video_t {
 
   //! \brief Decoding context
@@ -35,35 +115,254 @@ typedef struct video_t {
   AVFrame *frame;
   //! @}
 
-  //! \brief Software scaling context
+  //! \brief What the video was opened with
+  video_config_t config;
+  //! \brief Parameters the decoder was opened for
+  //! \details `video_reopen` keeps the decoder if the new stream matches
+  AVCodecParameters *codecpar;
+  //! \brief Number of times `video_reopen` kept the decoder
+  size_t decoder_reuses;
+
+  //! \brief Frames decoded ahead by `video_preroll`, not yet returned
+  //! \details Those in [`held_next`, `held_count`) hold data
+  //! @{
+  video_held_t held[VIDEO_MAX_PREROLL];
+  size_t held_next;
+  size_t held_count;
+  //! @}
+
+  //! \brief Where the demuxer reads the file from
+  //! \details These are `NULL` if LibAV reads the file itself
   //! @{
-  struct SwsContext *sws_ctx;
+  reader_t *reader;
+  AVIOContext *io;
   //! @}
+
+  //! \brief Threads to do colorspace conversion on
+  workers_t *workers;
+
+  //! \brief Buffers the decoder writes frames into
+  //! \details This is `NULL` if the codec can't use custom buffers
+  frame_pool_t *pool;
+
+  //! \brief How many frames the decoder holds back before outputting one
+  //!
+  //! This is the latency added by frame threading and by frame reordering. It
+  //! is only known after the codec is opened.
+  size_t decode_delay;
+
+  //! \brief Where to record how long each stage took, or `NULL`
+  //! \details This is not owned by the video
+  telemetry_t *telemetry;
+
+  //! \brief Frame rate of the stream, or zero if the container doesn't say
+  AVRational frame_rate;
+  //! \brief Number of the last frame returned by `video_get_frame`
+  //!
+  //! This counts frames from the start of the stream, including any the
+  //! decoder discarded, so it can skip ahead. It's computed from the frame's
+  //! timestamp if there is one. Otherwise, it's one more than the last one.
+  int64_t frame_index;
+  //! \brief When the last frame returned should be shown, in nanoseconds
+  //!
+  //! This is relative to the start of the stream. It comes from the frame's
+  //! timestamp if there is one, and from its number and the frame rate
+  //! otherwise. It's -1 if neither is known.
+  int64_t frame_time_ns;
+
+  //! \brief Where frames go in the framebuffer
+  //! \details This is only valid if `layout_valid` is set
+  scale_layout_t layout;
+  bool layout_valid;
+  //! \brief Framebuffers that already have the bars around the picture
+  //! \details This is reset whenever the layout changes
+  //! @{
+  const uint32_t *cleared[VIDEO_MAX_FRAMEBUFFERS];
+  size_t cleared_count;
+  //! @}
+
+  //! \brief Times of every keyframe, relative to the start of the stream
+  //!
+  //! These are in nanoseconds, in increasing order. They're taken from the
+  //! demuxer's own index when the container has one. Otherwise, they're only
+  //! found when `video_build_index` is first called.
+  //! @{
+  int64_t *keyframes_ns;
+  size_t keyframe_count;
+  bool indexed;
+  //! @}
+
+  //! \brief Whether to start over at the end of the stream
+  bool loop;
+  //! \brief Number of times the stream has started over
+  size_t loops;
+  //! \brief Added to the timestamps of every packet, in the stream's time base
+  //! \details This makes timestamps keep increasing across loops
+  int64_t loop_offset;
+  //! \brief Latest end of any packet read since the last loop
+  //! \details This is in the stream's time base, without `loop_offset`
+  int64_t loop_end;
+  //! \brief Whether any packet was read since the last loop
+  bool loop_read;
 } video_t;
 
+//! \brief Human-readable name of a threading mode
+const char *video_threading_name(video_threading_t threading);
+//! \brief Human-readable name of an I/O mode
+const char *video_io_name(video_io_t io);
+
 //! \brief Open a video file
 //!
 //! As mentioned above, we only handle very particular files. The videos have to
-//! have just one stream, they must be 640x480, and they must have a pixel
-//! format of YUV420P. We can't validate the the pixel format here, so you might
-//! have `video_get_frame` fail if that constraint is violated. We also can't
-//! find the frame rate.
+//! have just one stream, and they must have a pixel format we can convert. We
+//! can't validate the the pixel format here, so you might have
+//! `video_get_frame` fail if that constraint is violated. We also can't find
+//! the frame rate.
 //!
 //! \param[in] filename The file we should try to open as a video
+//! \param[in] config Options for decoding, or `NULL` for the defaults
 //! \return A handle to the video, or `NULL` on failure
-video_t *video_open(const char *filename);
+video_t *video_open(const char *filename, const video_config_t *config);
 //! \brief Inverse of `video_open`
 //! \details Video handles must be freed to prevent resource leaks
 void video_close(video_t *video);
 
+//! \brief Switch to another file, keeping as much as possible
+//!
+//! The old file is closed and the new one opened, with the configuration the
+//! video was opened with. If its stream has the same codec, frame size, pixel
+//! format, and global headers, the decoder is kept, just flushed. That saves
+//! starting its threads again. The conversion threads are always kept.
+//!
+//! Nothing about the old file carries over. Frame numbers and times start
+//! over, and the bars are redrawn in every framebuffer.
+//!
+//! \return Whether the new file could be opened. If not, the video can only be
+//!         closed.
+bool video_reopen(video_t *video, const char *filename);
+
+//! \brief Decode frames ahead of time
+//!
+//! Up to `count` frames, and at most `VIDEO_MAX_PREROLL`, are decoded and set
+//! aside. `video_get_frame` returns them before decoding any more, so the
+//! first few frames are cheap even though the decoder's pipeline was empty.
+//!
+//! \return Zero on success, which includes the video having fewer frames, or an
+//!         error
+int video_preroll(video_t *video, size_t count);
+
 //! \brief Read one frame from the video
 //!
-//! If one of the arguments is `NULL`, or if the video data is not YUV420P, this
-//! function returns `AVERROR(EINVAL)`. Otherwise, this function forwards the
-//! error returned by LibAV. Importantly, this means that `AVERROR_EOF` is
-//! returned on end-of-file.
+//! The frame is converted to BGRA using the matrix for the colorspace and range
+//! it's tagged with. Untagged frames are assumed to be limited-range BT.601.
+//! It's scaled to fit the framebuffer, keeping its aspect ratio, and the rest
+//! of the framebuffer is black. The black bars are only drawn the first time a
+//! framebuffer is used, or after the layout changes, so the caller mustn't
+//! write to the bars.
+//!
+//! If one of the arguments is `NULL`, or if the video data isn't in a format
+//! we can convert, this function returns `AVERROR(EINVAL)`. Otherwise, this
+//! function forwards the error returned by LibAV. Importantly, this means that
+//! `AVERROR_EOF` is returned on end-of-file, once every frame the decoder was
+//! holding back has been returned.
+//!
+//! If the video was opened with `loop`, end-of-file is never returned. Instead,
+//! the demuxer goes back to the start and keeps feeding the decoder, without
+//! draining or flushing it. The first frames of the next loop are decoded
+//! while the decoder still holds the last ones of this loop, so the wrap costs
+//! no more than any other keyframe. Timestamps carry on from the end of the
+//! last loop, so `frame_index` and `frame_time_ns` keep increasing.
 //!
 //! \param[in] video The video to read a frame from
 //! \param[out] framebuffer Where to write the pixel data for the frame
 //! \return Zero on success, or an error
 int video_get_frame(video_t *video, uint32_t *framebuffer);
+//! \brief Read one frame from the video, only writing what changed
+//!
+//! This is like `video_get_frame`, but each converted tile is first compared
+//! with what `framebuffer` already holds. Only the tiles that differ are
+//! written, and `dirty` is set to exactly those tiles. This suits mostly static
+//! content, since only the dirty tiles then have to be flushed.
+//!
+//! \param[in] video The video to read a frame from
+//! \param[inout] framebuffer Where to write the pixel data for the frame
+//! \param[out] dirty Where to record which tiles changed, or `NULL` to write
+//!                   every tile without comparing
+//! \return Zero on success, or an error
+int video_get_frame_diff(video_t *video, uint32_t *framebuffer,
+                         hdmi_fb_dirty_t *dirty);
+//! \brief Read one frame from the video into a framebuffer
+//!
+//! This is `video_get_frame_diff` on `fb`'s data and dirty tiles, or
+//! `video_get_frame` if `diff` is false. If the video was opened with a
+//! `flush_alloc`, the frame is also flushed from the cache in bands of 32
+//! lines as it's converted, with each band flushed as soon as it's written.
+//! That way, most of the flush happens while the rest of the frame is still
+//! being converted on other threads, instead of all of it afterwards.
+//!
+//! The framebuffer still has to be passed to `hdmi_fb_flush_dirty` before
+//! it's shown, but by then there's usually nothing left to sync.
+//!
+//! \param[in] video The video to read a frame from
+//! \param[inout] fb The framebuffer to write the frame to
+//! \param[in] diff Whether to only write the tiles that changed
+//! \return Zero on success, or an error
+int video_get_frame_fb(video_t *video, hdmi_fb_handle_t *fb, bool diff);
+
+//! \brief Decode the next frame, without converting it yet
+//!
+//! This splits `video_get_frame` in two, for callers that convert the frame a
+//! few rows at a time with `video_convert`. The frame is kept until the next
+//! call to this or anything else that decodes, and `frame_index` and
+//! `frame_time_ns` describe it.
+//!
+//! \return Zero on success, or an error
+int video_decode(video_t *video);
+//! \brief Convert some rows of the frame from the last `video_decode`
+//!
+//! Only tile rows [`tile_begin`, `tile_end`) are written, split across the
+//! conversion threads as usual. As with `video_get_frame_diff`, `dirty` can be
+//! given to only write the tiles that changed, and only its bits for those
+//! rows are touched. The bars around the picture are drawn into `framebuffer`
+//! until a whole frame has been converted into it, so the rows of each frame
+//! should all be converted eventually. The time this takes isn't recorded in
+//! the telemetry - that's up to the caller.
+//!
+//! This does nothing if there's no decoded frame.
+void video_convert(video_t *video, uint32_t *framebuffer,
+                   hdmi_fb_dirty_t *dirty, size_t tile_begin,
+                   size_t tile_end);
+
+//! \brief Find every keyframe in the video, unless we already know them
+//!
+//! Containers with an index, like MP4 and Matroska, have their keyframes
+//! listed when the video is opened. For the rest, this reads every packet in
+//! the file without decoding, which takes time. After that, the video has to
+//! be seeked before frames are read again.
+//!
+//! \return Whether the index could be built
+bool video_build_index(video_t *video);
+
+//! \brief Move to the keyframe at or before a time
+//!
+//! The next frame `video_get_frame` returns is the keyframe at or before
+//! `time_ns`, or the first keyframe if there's none before. The time is
+//! relative to the start of the stream, like `frame_time_ns` in the first
+//! loop. The decoder is flushed, so frames it was holding back are lost.
+//!
+//! If the video is looping, frames after the seek are still numbered and timed
+//! as part of the current loop, so their timestamps jump.
+//!
+//! This builds the keyframe index if it isn't built yet.
+//!
+//! \return Zero on success, or an error
+int video_seek(video_t *video, int64_t time_ns);
+
+//! \brief Set which frames the decoder may skip
+//!
+//! This sets the codec's `skip_frame` option. Skipping non-reference frames, or
+//! everything but keyframes, lets the decoder catch up when it falls behind.
+//! Skipped frames are never returned, and `frame_index` jumps over them.
+//!
+//! This must be called from the thread that calls `video_get_frame`.
+void video_set_discard(video_t *video, enum AVDiscard discard);
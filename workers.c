@@ -0,0 +1,144 @@
+#include "workers.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+//! \brief Argument passed to each worker thread
+//!
+//! The workers need to know which pool they're in and which index they are.
+//! These are allocated by `workers_open`, and each thread frees its own once it
+//! has read it.
+typedef struct worker_arg_t {
+  workers_t *workers;
+  size_t index;
+} worker_arg_t;
+
+//! \brief Entry point for each worker thread
+static void *worker_main(void *raw_arg) {
+  // Copy out our arguments and free them, since nobody else will
+  worker_arg_t arg = *(worker_arg_t *)raw_arg;
+  free(raw_arg);
+  workers_t *w = arg.workers;
+
+  size_t seen = 0u;
+  while (true) {
+
+    // Wait for a new job, or to be told to exit
+    pthread_mutex_lock(&w->lock);
+    while (w->generation == seen && !w->exit)
+      pthread_cond_wait(&w->go, &w->lock);
+    if (w->exit) {
+      pthread_mutex_unlock(&w->lock);
+      return NULL;
+    }
+    seen = w->generation;
+    workers_fn_t fn = w->fn;
+    void *fn_arg = w->arg;
+    size_t count = w->count;
+    pthread_mutex_unlock(&w->lock);
+
+    // Do our part
+    fn(fn_arg, arg.index, count);
+
+    // Report that we're done. The last one out wakes up the caller.
+    pthread_mutex_lock(&w->lock);
+    if (--w->pending == 0u)
+      pthread_cond_signal(&w->done);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+workers_t *workers_open(size_t count) {
+
+  // Figure out how many threads we want
+  if (count == 0u) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    count = cpus > 0 ? (size_t)cpus : 1u;
+  }
+  if (count > WORKERS_MAX)
+    count = WORKERS_MAX;
+
+  // Allocate space for the return value
+  workers_t *ret = calloc(1u, sizeof(workers_t));
+  if (ret == NULL)
+    return NULL;
+  // The caller always participates
+  ret->count = 1u;
+  if (pthread_mutex_init(&ret->lock, NULL) != 0) {
+    free(ret);
+    return NULL;
+  }
+  pthread_cond_init(&ret->go, NULL);
+  pthread_cond_init(&ret->done, NULL);
+
+  // Start the threads. Each one bumps `count` as it joins. We don't have to
+  // take the lock since none of them are running a job yet.
+  for (size_t i = 1u; i < count; i++) {
+    worker_arg_t *arg = malloc(sizeof(worker_arg_t));
+    if (arg == NULL)
+      goto failure;
+    arg->workers = ret;
+    arg->index = i;
+    if (pthread_create(&ret->threads[i - 1u], NULL, worker_main, arg) != 0) {
+      free(arg);
+      goto failure;
+    }
+    ret->started++;
+    ret->count++;
+  }
+
+  return ret;
+
+failure:
+  workers_close(ret);
+  return NULL;
+}
+
+void workers_close(workers_t *workers) {
+  // Edge case handling
+  if (workers == NULL)
+    return;
+  // Tell all the threads to exit, then wait for them
+  pthread_mutex_lock(&workers->lock);
+  workers->exit = true;
+  pthread_cond_broadcast(&workers->go);
+  pthread_mutex_unlock(&workers->lock);
+  for (size_t i = 0u; i < workers->started; i++)
+    pthread_join(workers->threads[i], NULL);
+  // Release the rest of our resources
+  pthread_cond_destroy(&workers->go);
+  pthread_cond_destroy(&workers->done);
+  pthread_mutex_destroy(&workers->lock);
+  free(workers);
+}
+
+void workers_run(workers_t *workers, workers_fn_t fn, void *arg) {
+
+  // Without a pool, or with a pool of one, just do the work here
+  if (workers == NULL || workers->count == 1u) {
+    fn(arg, 0u, 1u);
+    return;
+  }
+
+  // Post the job
+  pthread_mutex_lock(&workers->lock);
+  workers->fn = fn;
+  workers->arg = arg;
+  workers->pending = workers->started;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->go);
+  pthread_mutex_unlock(&workers->lock);
+
+  // Do our share
+  fn(arg, 0u, workers->count);
+
+  // Wait for everyone else
+  pthread_mutex_lock(&workers->lock);
+  while (workers->pending != 0u)
+    pthread_cond_wait(&workers->done, &workers->lock);
+  pthread_mutex_unlock(&workers->lock);
+}
+
+size_t workers_count(const workers_t *workers) {
+  return workers == NULL ? 1u : workers->count;
+}
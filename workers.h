@@ -0,0 +1,77 @@
+//! \file workers.h
+//! \brief Persistent pool of threads for splitting work across cores
+//!
+//! The threads are created once and then sleep until they're given a job. Each
+//! call to `workers_run` hands the same function to every thread, including the
+//! caller, and returns once all of them have finished. It's effectively a
+//! barrier at the start and end of every job.
+//!
+//! Only one thread may call `workers_run` on a given pool at a time.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//! \brief Maximum number of threads in a pool, including the caller
+#define WORKERS_MAX 32u
+
+//! \brief A job for the pool
+//!
+//! Every thread calls the function with the same argument. The `index` tells
+//! each thread which part of the work to do, and it ranges over [0, `count`).
+//! Index zero is always run on the thread that called `workers_run`.
+typedef void (*workers_fn_t)(void *arg, size_t index, size_t count);
+
+//! \brief State of a pool of worker threads
+typedef struct workers_t {
+  //! \brief Number of threads that participate in each job
+  //! \details This includes the caller, so it's one more than `started`
+  size_t count;
+  //! \brief The threads we've started
+  //! @{
+  pthread_t threads[WORKERS_MAX - 1u];
+  size_t started;
+  //! @}
+
+  //! \brief Synchronization between the caller and the workers
+  //! @{
+  pthread_mutex_t lock;
+  pthread_cond_t go;
+  pthread_cond_t done;
+  //! @}
+
+  //! \brief The current job, protected by `lock`
+  //! @{
+  workers_fn_t fn;
+  void *arg;
+  //! \brief Incremented every time a new job is posted
+  size_t generation;
+  //! \brief Number of workers still running the current job
+  size_t pending;
+  //! \brief Set to tell the workers to exit
+  bool exit;
+  //! @}
+} workers_t;
+
+//! \brief Create a pool of worker threads
+//!
+//! \param[in] count The number of threads that should do each job, including
+//!                  the caller. Zero means one per online CPU. It is clamped to
+//!                  `WORKERS_MAX`.
+//! \return A pointer to the pool on the heap, or `NULL` on failure
+workers_t *workers_open(size_t count);
+//! \brief Inverse of `workers_open`
+//! \details It is legal to close a `NULL` pool
+void workers_close(workers_t *workers);
+
+//! \brief Run a job on every thread in the pool and wait for it to finish
+//!
+//! If `workers` is `NULL`, the job is run on the calling thread alone, with a
+//! `count` of one.
+void workers_run(workers_t *workers, workers_fn_t fn, void *arg);
+
+//! \brief Number of threads that participate in each job
+//! \details This is one for a `NULL` pool
+size_t workers_count(const workers_t *workers);